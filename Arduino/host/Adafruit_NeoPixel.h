@@ -0,0 +1,80 @@
+/*
+
+ Copyright (c) by Emil Valkov,
+ All rights reserved.
+
+ License: http://www.opensource.org/licenses/bsd-license.php
+
+ Host stub of the Adafruit NeoPixel library: the pixels are kept in memory,
+ and show() takes the time the strip needs on the wire.
+*/
+
+#ifndef __Adafruit_NeoPixel__
+#define __Adafruit_NeoPixel__
+
+#include "Arduino.h"
+#include "ArduinoSim.h"
+#include <vector>
+
+#define NEO_RGB ((0 << 6) | (0 << 4) | (1 << 2) | (2))
+#define NEO_GRB ((1 << 6) | (1 << 4) | (0 << 2) | (2))
+#define NEO_KHZ800 0x0000
+#define NEO_KHZ400 0x0100
+
+// 24 bits at 800kHz, then the latch
+#define kNeoPixelMicros 30
+#define kNeoLatchMicros 50
+
+class Adafruit_NeoPixel {
+public:
+	Adafruit_NeoPixel(uint16_t n, uint8_t pin = 6, uint16_t /* type */ = NEO_GRB + NEO_KHZ800) : fPixels(n, 0) {
+		fPin = pin;
+		fBrightness = 0;
+		fShows = 0;
+	}
+
+	void begin() {pinMode(fPin, OUTPUT);}
+
+	void show() {
+		fShows++;
+		ArduinoSim::Advance(fPixels.size() * kNeoPixelMicros + kNeoLatchMicros);
+	}
+
+	void setPin(uint8_t pin) {fPin = pin;}
+
+	void setPixelColor(uint16_t n, uint8_t r, uint8_t g, uint8_t b) {
+		setPixelColor(n, Color(r, g, b));
+	}
+
+	void setPixelColor(uint16_t n, uint32_t c) {
+		if (n < fPixels.size()) fPixels[n] = c;
+	}
+
+	uint32_t getPixelColor(uint16_t n) const {
+		return (n < fPixels.size()) ? fPixels[n] : 0;
+	}
+
+	void clear() {
+		for (size_t ii = 0 ; ii < fPixels.size() ; ii++) fPixels[ii] = 0;
+	}
+
+	// Kept, the colors aren't scaled
+	void setBrightness(uint8_t brightness) {fBrightness = brightness;}
+	uint8_t getBrightness() const {return fBrightness;}
+
+	uint16_t numPixels() const {return (uint16_t)fPixels.size();}
+
+	static uint32_t Color(uint8_t r, uint8_t g, uint8_t b) {
+		return ((uint32_t)r << 16) | ((uint32_t)g << 8) | b;
+	}
+
+	unsigned long GetShowCount() const {return fShows;}
+
+private:
+	std::vector<uint32_t> fPixels;
+	uint8_t fPin;
+	uint8_t fBrightness;
+	unsigned long fShows;
+};
+
+#endif
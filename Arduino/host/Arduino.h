@@ -0,0 +1,94 @@
+/*
+
+ Copyright (c) by Emil Valkov,
+ All rights reserved.
+
+ License: http://www.opensource.org/licenses/bsd-license.php
+
+ Host build of the Arduino core API, so the libraries compile unchanged on
+ Linux. Time is virtual and the pins are simulated, see ArduinoSim.h.
+*/
+
+#ifndef __Arduino__
+#define __Arduino__
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <avr/io.h>
+#include <avr/interrupt.h>
+
+typedef bool boolean;
+typedef uint8_t byte;
+typedef unsigned int word;
+
+#define HIGH 0x1
+#define LOW  0x0
+
+#define INPUT 0x0
+#define OUTPUT 0x1
+#define INPUT_PULLUP 0x2
+
+// Uno numbering, analogRead also takes the channel number
+#define A0 14
+#define A1 15
+#define A2 16
+#define A3 17
+#define A4 18
+#define A5 19
+#define A6 20
+#define A7 21
+
+#ifndef F_CPU
+#define F_CPU 16000000L
+#endif
+#define clockCyclesPerMicrosecond() (F_CPU / 1000000L)
+
+#define interrupts() sei()
+#define noInterrupts() cli()
+
+#define PI 3.1415926535897932384626433832795
+#define constrain(amt, low, high) ((amt) < (low) ? (low) : ((amt) > (high) ? (high) : (amt)))
+
+unsigned long micros();
+unsigned long millis();
+void delay(unsigned long ms);
+void delayMicroseconds(unsigned int us);
+
+void pinMode(uint8_t pin, uint8_t mode);
+void digitalWrite(uint8_t pin, uint8_t value);
+int digitalRead(uint8_t pin);
+int analogRead(uint8_t pin);
+void analogWrite(uint8_t pin, int value);
+unsigned long pulseIn(uint8_t pin, uint8_t state, unsigned long timeout = 1000000L);
+
+long random(long howbig);
+long random(long howsmall, long howbig);
+void randomSeed(unsigned long seed);
+
+class HardwareSerial {
+public:
+	void begin(unsigned long /* baud */) {}
+	void end() {}
+	int available();
+	int peek();
+	int read();
+	void flush() {}
+	size_t write(uint8_t cc);
+
+	size_t print(const char * str);
+	size_t print(char cc);
+	size_t print(int value) {return print((long)value);}
+	size_t print(unsigned int value) {return print((unsigned long)value);}
+	size_t print(long value);
+	size_t print(unsigned long value);
+	size_t print(double value, int digits = 2);
+
+	size_t println() {return print("\r\n");}
+	template <typename T> size_t println(T value) {return print(value) + println();}
+};
+
+extern HardwareSerial Serial;
+
+#endif
@@ -0,0 +1,379 @@
+/*
+
+ Copyright (c) by Emil Valkov,
+ All rights reserved.
+
+ License: http://www.opensource.org/licenses/bsd-license.php
+
+ Host Arduino core on the simulated board, see ArduinoSim.h
+*/
+
+#include "Arduino.h"
+#include "ArduinoSim.h"
+#include "SimAvr.h"
+#include <stdio.h>
+
+#define kSimMaxListeners 4
+
+struct SimState {
+	uint64_t cycles;				// 16 per microsecond
+	unsigned long analogReadMicros;
+	unsigned long digitalIOMicros;
+	unsigned long microsResolution;
+	unsigned long randomContext;
+	unsigned long interruptMicros;
+
+	unsigned long interrupts;
+	uint64_t interruptCycles;
+
+	int analog[kSimAnalogCount];
+	SimAnalogModel analogModel[kSimAnalogCount];
+	void * analogUser[kSimAnalogCount];
+	unsigned long analogReads[kSimAnalogCount];
+
+	uint8_t mode[kSimPinCount];
+	uint8_t input[kSimPinCount];
+	int output[kSimPinCount];		// analogWrite scale
+	unsigned long writes[kSimPinCount];
+	SimPinListener listeners[kSimMaxListeners];
+	void * listenerUsers[kSimMaxListeners];
+
+	unsigned long pulse[kSimPinCount];
+	SimPulseModel pulseModel[kSimPinCount];
+	void * pulseUser[kSimPinCount];
+
+	int servo[kSimPinCount];
+
+	char serialInput[256];
+	size_t serialLength;
+	size_t serialPos;
+	bool serialEcho;
+	unsigned long serialWritten;
+};
+
+static constexpr SimState SimDefaults() {
+	SimState state = {};
+	state.analogReadMicros = kSimAnalogReadMicros;
+	state.digitalIOMicros = kSimDigitalIOMicros;
+	state.microsResolution = kSimMicrosResolution;
+	state.randomContext = 1;
+	state.interruptMicros = kSimInterruptMicros;
+	return state;
+}
+
+// Statically initialized, the constructors of global objects may already use it
+static SimState gSim = SimDefaults();
+
+static struct SimAvrInit {
+	SimAvrInit() {SimAvrReset();}
+} gSimAvrInit;
+
+HardwareSerial Serial;
+
+static bool ValidPin(uint8_t pin) {
+	return pin < kSimPinCount;
+}
+
+static int AnalogChannel(uint8_t pin) {
+	if (pin >= A0) pin -= A0;
+	return (pin < kSimAnalogCount) ? pin : -1;
+}
+
+static void NotifyWrite(uint8_t pin, int value, bool analog) {
+	gSim.writes[pin]++;
+	for (int ii = 0 ; ii < kSimMaxListeners ; ii++) {
+		if (gSim.listeners[ii]) gSim.listeners[ii](pin, value, analog, ArduinoSim::GetMicros(), gSim.listenerUsers[ii]);
+	}
+}
+
+// Pending interrupts, with their entry and exit time
+static void RunInterrupts() {
+	SimVector vector;
+	while ((SREG & _BV(SREG_I)) && (vector = SimAvrTakeInterrupt()) != NULL) {
+		uint64_t start = gSim.cycles;
+		SREG &= ~_BV(SREG_I);
+		vector();
+		ArduinoSim::Advance(gSim.interruptMicros);
+		SREG |= _BV(SREG_I);
+		gSim.interrupts++;
+		gSim.interruptCycles += gSim.cycles - start;
+	}
+}
+
+void ArduinoSim::Reset() {
+	gSim = SimDefaults();
+	SimAvrReset();
+}
+
+unsigned long ArduinoSim::GetMicros() {return (unsigned long)(gSim.cycles / kSimCyclesPerMicro);}
+
+// Runs the peripherals up to each of their events, and the interrupts they raise
+void ArduinoSim::Advance(unsigned long micros) {
+	uint64_t target = gSim.cycles + (uint64_t)micros * kSimCyclesPerMicro;
+
+	for (;;) {
+		SimAvrSync(gSim.cycles);
+		RunInterrupts();
+		uint64_t next = SimAvrNextEvent(gSim.cycles);
+		if (next > target) break;
+		gSim.cycles = next;
+		SimAvrRunEvents(next);
+	}
+	// Interrupts may have run past it
+	if (gSim.cycles < target) gSim.cycles = target;
+	SimAvrSync(gSim.cycles);
+}
+
+void ArduinoSim::SetAnalogReadMicros(unsigned long micros) {gSim.analogReadMicros = micros;}
+void ArduinoSim::SetDigitalIOMicros(unsigned long micros) {gSim.digitalIOMicros = micros;}
+void ArduinoSim::SetMicrosResolution(unsigned long micros) {gSim.microsResolution = micros ? micros : 1;}
+void ArduinoSim::SetInterruptMicros(unsigned long micros) {gSim.interruptMicros = micros;}
+
+unsigned long ArduinoSim::GetInterruptCount() {return gSim.interrupts;}
+unsigned long ArduinoSim::GetInterruptMicros() {return (unsigned long)(gSim.interruptCycles / kSimCyclesPerMicro);}
+
+void ArduinoSim::SetAnalog(uint8_t channel, int value) {
+	int ch = AnalogChannel(channel);
+	if (ch >= 0) gSim.analog[ch] = value;
+}
+
+void ArduinoSim::SetAnalogModel(uint8_t channel, SimAnalogModel model, void * user) {
+	int ch = AnalogChannel(channel);
+	if (ch >= 0) {
+		gSim.analogModel[ch] = model;
+		gSim.analogUser[ch] = user;
+	}
+}
+
+unsigned long ArduinoSim::GetAnalogReads(uint8_t channel) {
+	int ch = AnalogChannel(channel);
+	return (ch >= 0) ? gSim.analogReads[ch] : 0;
+}
+
+void ArduinoSim::SetDigital(uint8_t pin, int value) {
+	if (ValidPin(pin)) gSim.input[pin] = value ? HIGH : LOW;
+}
+
+int ArduinoSim::GetDigital(uint8_t pin) {
+	return (ValidPin(pin) && gSim.output[pin] != 0) ? HIGH : LOW;
+}
+
+int ArduinoSim::GetPwm(uint8_t pin) {
+	return ValidPin(pin) ? gSim.output[pin] : 0;
+}
+
+int ArduinoSim::GetPinMode(uint8_t pin) {
+	return ValidPin(pin) ? gSim.mode[pin] : INPUT;
+}
+
+unsigned long ArduinoSim::GetPinWrites(uint8_t pin) {
+	return ValidPin(pin) ? gSim.writes[pin] : 0;
+}
+
+bool ArduinoSim::AddPinListener(SimPinListener listener, void * user) {
+	for (int ii = 0 ; ii < kSimMaxListeners ; ii++) {
+		if (gSim.listeners[ii] == listener && gSim.listenerUsers[ii] == user) return true;
+	}
+	for (int ii = 0 ; ii < kSimMaxListeners ; ii++) {
+		if (gSim.listeners[ii] == NULL) {
+			gSim.listeners[ii] = listener;
+			gSim.listenerUsers[ii] = user;
+			return true;
+		}
+	}
+	return false;
+}
+
+void ArduinoSim::RemovePinListener(SimPinListener listener, void * user) {
+	for (int ii = 0 ; ii < kSimMaxListeners ; ii++) {
+		if (gSim.listeners[ii] == listener && gSim.listenerUsers[ii] == user) gSim.listeners[ii] = NULL;
+	}
+}
+
+void ArduinoSim::SetPulse(uint8_t pin, unsigned long micros) {
+	if (ValidPin(pin)) gSim.pulse[pin] = micros;
+}
+
+void ArduinoSim::SetPulseModel(uint8_t pin, SimPulseModel model, void * user) {
+	if (ValidPin(pin)) {
+		gSim.pulseModel[pin] = model;
+		gSim.pulseUser[pin] = user;
+	}
+}
+
+int ArduinoSim::GetServoMicros(uint8_t pin) {
+	return ValidPin(pin) ? gSim.servo[pin] : 0;
+}
+
+void ArduinoSim::SetServoMicros(uint8_t pin, int micros) {
+	if (ValidPin(pin)) gSim.servo[pin] = micros;
+}
+
+void ArduinoSim::SetSerialInput(const char * text) {
+	gSim.serialLength = strlen(text);
+	if (gSim.serialLength > sizeof(gSim.serialInput)) gSim.serialLength = sizeof(gSim.serialInput);
+	memcpy(gSim.serialInput, text, gSim.serialLength);
+	gSim.serialPos = 0;
+}
+
+void ArduinoSim::SetSerialEcho(bool echo) {gSim.serialEcho = echo;}
+unsigned long ArduinoSim::GetSerialBytesWritten() {return gSim.serialWritten;}
+
+// Arduino core
+
+unsigned long micros() {
+	unsigned long now = ArduinoSim::GetMicros();
+	return now - now % gSim.microsResolution;
+}
+
+unsigned long millis() {
+	return ArduinoSim::GetMicros() / 1000;
+}
+
+void delay(unsigned long ms) {
+	ArduinoSim::Advance(ms * 1000);
+}
+
+void delayMicroseconds(unsigned int us) {
+	ArduinoSim::Advance(us);
+}
+
+void pinMode(uint8_t pin, uint8_t mode) {
+	if (!ValidPin(pin)) return;
+	gSim.mode[pin] = mode;
+	if (mode == INPUT_PULLUP) gSim.input[pin] = HIGH;
+}
+
+void digitalWrite(uint8_t pin, uint8_t value) {
+	if (!ValidPin(pin)) return;
+	ArduinoSim::Advance(gSim.digitalIOMicros);
+	gSim.output[pin] = value ? 255 : 0;
+	NotifyWrite(pin, value ? HIGH : LOW, false);
+}
+
+int digitalRead(uint8_t pin) {
+	if (!ValidPin(pin)) return LOW;
+	ArduinoSim::Advance(gSim.digitalIOMicros);
+	return (gSim.mode[pin] == OUTPUT) ? ArduinoSim::GetDigital(pin) : gSim.input[pin];
+}
+
+int SimAnalogValue(uint8_t channel, unsigned long micros) {
+	gSim.analogReads[channel]++;
+	int value = gSim.analogModel[channel] ? gSim.analogModel[channel](channel, micros, gSim.analogUser[channel]) : gSim.analog[channel];
+	return constrain(value, 0, 1023);
+}
+
+// Doesn't go through the ADC registers, it can't disturb code using them
+int analogRead(uint8_t pin) {
+	int ch = AnalogChannel(pin);
+	if (ch < 0) return 0;
+
+	// The conversion is sampled at its start
+	unsigned long start = ArduinoSim::GetMicros();
+	ArduinoSim::Advance(gSim.analogReadMicros);
+	return SimAnalogValue(ch, start);
+}
+
+void analogWrite(uint8_t pin, int value) {
+	if (!ValidPin(pin)) return;
+	ArduinoSim::Advance(gSim.digitalIOMicros);
+	gSim.mode[pin] = OUTPUT;
+	gSim.output[pin] = constrain(value, 0, 255);
+	NotifyWrite(pin, gSim.output[pin], true);
+}
+
+unsigned long pulseIn(uint8_t pin, uint8_t state, unsigned long timeout) {
+	if (!ValidPin(pin)) return 0;
+
+	unsigned long length = gSim.pulseModel[pin] ? gSim.pulseModel[pin](pin, state, ArduinoSim::GetMicros(), gSim.pulseUser[pin]) : gSim.pulse[pin];
+	if (length == 0 || length > timeout) {
+		ArduinoSim::Advance(timeout);
+		return 0;
+	}
+	ArduinoSim::Advance(length);
+	return length;
+}
+
+// avr-libc random(), so sketches see the same sequence as on the board
+static long NextRandom() {
+	long x = gSim.randomContext ? gSim.randomContext : 123459876L;
+	long hi = x / 127773L;
+	long lo = x % 127773L;
+	x = 16807L * lo - 2836L * hi;
+	if (x < 0) x += 0x7fffffffL;
+	gSim.randomContext = x;
+	return x;
+}
+
+long random(long howbig) {
+	if (howbig == 0) return 0;
+	return NextRandom() % howbig;
+}
+
+long random(long howsmall, long howbig) {
+	if (howsmall >= howbig) return howsmall;
+	return random(howbig - howsmall) + howsmall;
+}
+
+void randomSeed(unsigned long seed) {
+	if (seed != 0) gSim.randomContext = seed;
+}
+
+// Serial
+
+int HardwareSerial::available() {
+	return (int)(gSim.serialLength - gSim.serialPos);
+}
+
+int HardwareSerial::peek() {
+	return available() ? (unsigned char)gSim.serialInput[gSim.serialPos] : -1;
+}
+
+int HardwareSerial::read() {
+	return available() ? (unsigned char)gSim.serialInput[gSim.serialPos++] : -1;
+}
+
+size_t HardwareSerial::write(uint8_t cc) {
+	gSim.serialWritten++;
+	if (gSim.serialEcho) putchar(cc);
+	return 1;
+}
+
+size_t HardwareSerial::print(const char * str) {
+	size_t count = 0;
+	while (*str) count += write((uint8_t)*str++);
+	return count;
+}
+
+size_t HardwareSerial::print(char cc) {
+	return write((uint8_t)cc);
+}
+
+size_t HardwareSerial::print(long value) {
+	char text[24];
+	snprintf(text, sizeof(text), "%ld", value);
+	return print(text);
+}
+
+size_t HardwareSerial::print(unsigned long value) {
+	char text[24];
+	snprintf(text, sizeof(text), "%lu", value);
+	return print(text);
+}
+
+size_t HardwareSerial::print(double value, int digits) {
+	char text[48];
+	snprintf(text, sizeof(text), "%.*f", digits, value);
+	return print(text);
+}
+
+// Interrupt flag
+
+void sei(void) {
+	SREG |= _BV(SREG_I);
+	RunInterrupts();
+}
+
+void cli(void) {
+	SREG &= ~_BV(SREG_I);
+}
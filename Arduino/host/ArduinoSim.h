@@ -0,0 +1,95 @@
+/*
+
+ Copyright (c) by Emil Valkov,
+ All rights reserved.
+
+ License: http://www.opensource.org/licenses/bsd-license.php
+
+ Simulated board behind the host Arduino.h. The clock is virtual: it only
+ moves when the code waits (delay, pulseIn), when a HAL call takes time on
+ the real board (analogRead, digitalWrite), or when the test advances it.
+ The default call times are those of a 16MHz AVR, so a loop sees about the
+ same number of samples as on the board.
+
+ Timer1 and the ADC are simulated at the register level, see avr/io.h and
+ SimAvr.cpp, and the ISR() the code defines run when they are due, in the
+ middle of whatever the main code is waiting for, as on the board.
+
+ Inputs come from scripts: a fixed value or a model function per ADC
+ channel, digital pin and pulseIn pin. Outputs are kept per pin, and a
+ listener sees every write, for plant models reacting to the pins.
+*/
+
+#ifndef __ArduinoSim__
+#define __ArduinoSim__
+
+#include "Arduino.h"
+
+#define kSimPinCount 70			// Mega
+#define kSimAnalogCount 16
+
+#define kSimAnalogReadMicros 112	// 13 ADC clocks at 125kHz, and the call
+#define kSimDigitalIOMicros 4
+#define kSimMicrosResolution 4		// micros() counts in steps of 4 at 16MHz
+#define kSimInterruptMicros 3		// Entry and exit of an ISR saving the registers
+
+/// Reading of ADC channel at the given time
+typedef int (*SimAnalogModel)(uint8_t channel, unsigned long micros, void * user);
+/// Length of the pulse pulseIn sees on pin starting at the given time, 0 for none
+typedef unsigned long (*SimPulseModel)(uint8_t pin, uint8_t state, unsigned long micros, void * user);
+/// Called after each digitalWrite and analogWrite
+typedef void (*SimPinListener)(uint8_t pin, int value, bool analog, unsigned long micros, void * user);
+
+class ArduinoSim {
+public:
+	/// Back to time 0, inputs low, outputs, models and registers cleared, default call times
+	static void Reset();
+
+	static unsigned long GetMicros();
+	static void Advance(unsigned long micros);
+
+	/// Time taken by analogRead, and by digitalWrite, digitalRead and analogWrite
+	static void SetAnalogReadMicros(unsigned long micros);
+	static void SetDigitalIOMicros(unsigned long micros);
+	/// Step of micros(), 1 for exact times
+	static void SetMicrosResolution(unsigned long micros);
+	/// Time taken by an interrupt on top of its code
+	static void SetInterruptMicros(unsigned long micros);
+
+	/// Interrupts run, and the time spent in them
+	static unsigned long GetInterruptCount();
+	static unsigned long GetInterruptMicros();
+
+	/// Fixed reading of an ADC channel, 0..1023. Takes the channel or its pin, A0 etc
+	static void SetAnalog(uint8_t channel, int value);
+	/// Reading from model instead, NULL for the fixed value
+	static void SetAnalogModel(uint8_t channel, SimAnalogModel model, void * user);
+	static unsigned long GetAnalogReads(uint8_t channel);
+
+	/// Level digitalRead returns on an input pin
+	static void SetDigital(uint8_t pin, int value);
+	/// Last digitalWrite, or HIGH when the last analogWrite was not 0
+	static int GetDigital(uint8_t pin);
+	/// Last analogWrite, 0 or 255 after a digitalWrite
+	static int GetPwm(uint8_t pin);
+	static int GetPinMode(uint8_t pin);
+	static unsigned long GetPinWrites(uint8_t pin);
+	/// Up to 4 listeners, returns false when full
+	static bool AddPinListener(SimPinListener listener, void * user);
+	static void RemovePinListener(SimPinListener listener, void * user);
+
+	/// Pulse length pulseIn returns on pin, 0 to time out
+	static void SetPulse(uint8_t pin, unsigned long micros);
+	static void SetPulseModel(uint8_t pin, SimPulseModel model, void * user);
+
+	/// Pulse width of the servo attached to pin, 0 if none
+	static int GetServoMicros(uint8_t pin);
+	static void SetServoMicros(uint8_t pin, int micros);
+
+	/// Bytes Serial.read returns, copied. Output is dropped unless echoed to stdout
+	static void SetSerialInput(const char * text);
+	static void SetSerialEcho(bool echo);
+	static unsigned long GetSerialBytesWritten();
+};
+
+#endif
@@ -0,0 +1,756 @@
+/*
+
+ Copyright (c) by Emil Valkov,
+ All rights reserved.
+
+ License: http://www.opensource.org/licenses/bsd-license.php
+
+ Host benchmark of the Arduino libraries. Runs each library against the
+ simulated board for a few seconds of virtual time, measures the host time
+ of each call, checks the library did its job, and prints the results as one
+ JSON object on stdout. Exits with 1 when a check fails or a call is slower
+ than its limit, to catch regressions in CI.
+
+*/
+
+#include <Arduino.h>
+#include <Servo.h>
+#include <Adafruit_NeoPixel.h>
+#include <BackEmfMotor.h>
+#include <BackEmfScheduler.h>
+#include <BackEmfMotorGroup.h>
+#include <InterpolatedServo.h>
+#include <UltraSound1.h>
+#include <SharpIRSensor.h>
+#include <CommandStream.h>
+#include <NeoPixo.h>
+#include "ArduinoSim.h"
+#include "SimMotor.h"
+
+#include <stdio.h>
+#include <time.h>
+#include <unistd.h>
+#include <vector>
+#include <algorithm>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define kTimeUnit "cycles"
+#else
+#define kTimeUnit "ns"
+#endif
+
+#define kMaxLimits 16
+
+struct BenchOptions {
+	double seconds;				/// Virtual time per library
+	unsigned long loopMicros;	/// Virtual time of the rest of loop(), between calls
+	unsigned long analogReadMicros;
+	const char * only;			/// Run this library only, NULL for all
+	const char * limitNames[kMaxLimits];
+	double limits[kMaxLimits];	/// Largest mean time per call, in kTimeUnit
+	int limitCount;
+};
+
+// Time of each call, in cycles where the CPU has a counter, in ns otherwise
+class Timing {
+public:
+	Timing() {fWallNs = 0;}
+
+	static uint64_t Now() {
+#if defined(__x86_64__) || defined(__i386__)
+		return __rdtsc();
+#else
+		return NowNs();
+#endif
+	}
+
+	static uint64_t NowNs() {
+		struct timespec t;
+		clock_gettime(CLOCK_MONOTONIC, &t);
+		return (uint64_t)t.tv_sec * 1000000000ULL + t.tv_nsec;
+	}
+
+	void Start() {
+		fSamples.clear();
+		fWallNs = NowNs();
+	}
+
+	void Add(uint64_t start) {fSamples.push_back((uint32_t)(Now() - start));}
+	void Stop() {fWallNs = NowNs() - fWallNs;}
+
+	// Median time of an empty call, part of every sample
+	static uint32_t GetOverhead() {
+		Timing timing;
+		timing.Start();
+		for (int ii = 0 ; ii < 1000 ; ii++) timing.Add(Now());
+		return timing.GetPercentile(50);
+	}
+
+	size_t GetCount() const {return fSamples.size();}
+
+	double GetMean() const {
+		double total = 0;
+		for (size_t ii = 0 ; ii < fSamples.size() ; ii++) total += fSamples[ii];
+		return fSamples.empty() ? 0 : total / fSamples.size();
+	}
+
+	uint32_t GetPercentile(double percent) {
+		if (fSamples.empty()) return 0;
+		size_t nth = (size_t)(percent / 100 * (fSamples.size() - 1));
+		std::nth_element(fSamples.begin(), fSamples.begin() + nth, fSamples.end());
+		return fSamples[nth];
+	}
+
+	// Includes the simulator and the timing itself
+	double GetWallNsPerCall() const {return fSamples.empty() ? 0 : (double)fWallNs / fSamples.size();}
+
+private:
+	std::vector<uint32_t> fSamples;
+	uint64_t fWallNs;
+};
+
+static int gChecksFailed = 0;
+static int gLimitsExceeded = 0;
+
+static void Check(bool ok, const char * library, const char * what) {
+	if (!ok) {
+		fprintf(stderr, "%s: check failed, %s\n", library, what);
+		gChecksFailed++;
+	}
+}
+
+/**
+ * Print the timing of a library, open its JSON object for the extra fields
+ *
+ * @param options Benchmark options, with the limits
+ * @param library Library name
+ * @param timing Timing of the calls
+ */
+static void PrintTiming(const BenchOptions & options, const char * library, Timing & timing) {
+	double mean = timing.GetMean();
+
+	for (int ii = 0 ; ii < options.limitCount ; ii++) {
+		if (strcmp(options.limitNames[ii], library) == 0 && mean > options.limits[ii]) {
+			fprintf(stderr, "%s: %.1f %s per call, over the limit of %.1f\n", library, mean, kTimeUnit, options.limits[ii]);
+			gLimitsExceeded++;
+		}
+	}
+
+	printf(",\n  \"%s\": {\n", library);
+	printf("    \"calls\": %zu,\n", timing.GetCount());
+	printf("    \"mean\": %.1f,\n", mean);
+	printf("    \"p50\": %u,\n", timing.GetPercentile(50));
+	printf("    \"p99\": %u,\n", timing.GetPercentile(99));
+	printf("    \"max\": %u,\n", timing.GetPercentile(100));
+	printf("    \"ns_per_call\": %.1f", timing.GetWallNsPerCall());
+}
+
+static bool Selected(const BenchOptions & options, const char * library) {
+	return options.only == NULL || strcmp(options.only, library) == 0;
+}
+
+static unsigned long VirtualEnd(const BenchOptions & options) {
+	return ArduinoSim::GetMicros() + (unsigned long)(options.seconds * 1000000);
+}
+
+// Libraries keep their objects in globals, as in the sketches
+
+BackEmfMotor gMotor;
+SimMotor gPlant;
+
+static void BenchBackEmfMotor(const BenchOptions & options) {
+	const int target = 256;
+	Timing timing;
+	unsigned long cycles = 0;
+
+	gPlant.Initialize(2, 3, 4, 11, 1);
+	gPlant.SetNoise(8);
+	gMotor.Initialize(2, 3, 4, 11, 1);
+	gMotor.SetTargetSpeed(target);
+	gMotor.SetCommand(BackEmfMotor::kStart);
+	gMotor.Commit();
+
+	unsigned long start = ArduinoSim::GetMicros();
+	unsigned long end = VirtualEnd(options);
+	timing.Start();
+	while (ArduinoSim::GetMicros() < end) {
+		uint64_t t0 = Timing::Now();
+		bool updated = gMotor.Service();
+		timing.Add(t0);
+		if (updated) cycles++;
+		ArduinoSim::Advance(options.loopMicros);
+	}
+	timing.Stop();
+
+	unsigned long elapsed = ArduinoSim::GetMicros() - start;
+	unsigned long reads = ArduinoSim::GetAnalogReads(1);
+	int speed = gMotor.GetSpeed();
+
+	PrintTiming(options, "BackEmfMotor", timing);
+	printf(",\n    \"virtual_ms\": %lu,\n", elapsed / 1000);
+	printf("    \"pwm_cycles\": %lu,\n", cycles);
+	printf("    \"samples_per_cycle\": %.1f,\n", cycles ? (double)reads / cycles : 0.0);
+	printf("    \"target\": %d,\n", target);
+	printf("    \"speed\": %d,\n", speed);
+	printf("    \"pwm_micros\": %d\n  }", gMotor.GetPwmMicros());
+
+	// 10ms PWM cycles, late by up to a few loop passes each
+	unsigned long slack = 3 * (options.loopMicros + options.analogReadMicros);
+	Check(cycles >= elapsed / (10000 + slack) && cycles <= elapsed / 10000, "BackEmfMotor", "PWM cycles of 10ms");
+	Check(speed > target - target / 4 && speed < target + target / 4, "BackEmfMotor", "speed near the target");
+}
+
+// Two motors beside a loop blocked in the sonar, as in a robot sketch
+
+BackEmfMotor gPolledWheels[2];
+BackEmfMotor gWheels[2];
+SimMotor gWheelPlants[2];
+BackEmfScheduler gScheduler;
+UltraSound1 gWheelSonar;
+static std::vector<unsigned long> gEdges;
+
+// Start of each PWM pulse of the first wheel
+static void EdgeListener(uint8_t pin, int value, bool /* analog */, unsigned long micros, void * /* user */) {
+	if (pin == 2 && value == HIGH) gEdges.push_back(micros);
+}
+
+struct EdgeStats {
+	unsigned long count;
+	unsigned long minPeriod;
+	unsigned long maxPeriod;
+};
+
+static EdgeStats GetEdgeStats() {
+	EdgeStats stats = {0, 0, 0};
+	// The first cycles start the motor
+	for (size_t ii = 3 ; ii < gEdges.size() ; ii++) {
+		unsigned long period = gEdges[ii] - gEdges[ii - 1];
+		if (stats.count == 0 || period < stats.minPeriod) stats.minPeriod = period;
+		if (stats.count == 0 || period > stats.maxPeriod) stats.maxPeriod = period;
+		stats.count++;
+	}
+	return stats;
+}
+
+static void StartWheels(BackEmfMotor * wheels, SimMotor * plants, int target) {
+	const uint8_t pins[2][5] = {{2, 3, 4, 5, 0}, {8, 9, 10, 11, 1}};
+	for (int ii = 0 ; ii < 2 ; ii++) {
+		plants[ii].Initialize(pins[ii][0], pins[ii][1], pins[ii][2], pins[ii][3], pins[ii][4]);
+		plants[ii].SetNoise(8);
+		wheels[ii].Initialize(pins[ii][0], pins[ii][1], pins[ii][2], pins[ii][3], pins[ii][4]);
+		wheels[ii].SetTargetSpeed(target);
+		wheels[ii].SetCommand(BackEmfMotor::kStart);
+	}
+	ArduinoSim::SetPulse(7, 100 * 58);
+	gWheelSonar.Initialize(7);
+	gEdges.clear();
+	ArduinoSim::AddPinListener(EdgeListener, NULL);
+}
+
+static void BenchBackEmfScheduler(const BenchOptions & options) {
+	const int target = 256;
+	Timing timing;
+
+	// Polled from the loop, late by the whole sonar wait
+	StartWheels(gPolledWheels, gWheelPlants, target);
+	for (int ii = 0 ; ii < 2 ; ii++) gPolledWheels[ii].Commit();
+	unsigned long end = VirtualEnd(options);
+	while (ArduinoSim::GetMicros() < end) {
+		gWheelSonar.SafeWaitMeasureMicroseconds();
+		for (int ii = 0 ; ii < 2 ; ii++) gPolledWheels[ii].Service();
+		ArduinoSim::Advance(options.loopMicros);
+	}
+	EdgeStats polled = GetEdgeStats();
+	double polledSamples = gEdges.empty() ? 0 : (double)ArduinoSim::GetAnalogReads(0) / gEdges.size();
+	ArduinoSim::RemovePinListener(EdgeListener, NULL);
+
+	// Same loop with the cycles in the timer interrupts
+	ArduinoSim::Reset();
+	ArduinoSim::SetAnalogReadMicros(options.analogReadMicros);
+	StartWheels(gWheels, gWheelPlants, target);
+	for (int ii = 0 ; ii < 2 ; ii++) gScheduler.Add(gWheels[ii]);
+	gScheduler.Begin();
+	for (int ii = 0 ; ii < 2 ; ii++) gScheduler.Commit(gWheels[ii]);
+
+	unsigned long start = ArduinoSim::GetMicros();
+	end = VirtualEnd(options);
+	timing.Start();
+	while (ArduinoSim::GetMicros() < end) {
+		uint64_t t0 = Timing::Now();
+		gWheelSonar.SafeWaitMeasureMicroseconds();
+		timing.Add(t0);
+		ArduinoSim::Advance(options.loopMicros);
+	}
+	timing.Stop();
+	gScheduler.End();
+	ArduinoSim::RemovePinListener(EdgeListener, NULL);
+
+	unsigned long elapsed = ArduinoSim::GetMicros() - start;
+	EdgeStats timed = GetEdgeStats();
+	unsigned long cycles = gScheduler.GetCycles(gWheels[0]);
+	double samples = cycles ? (double)ArduinoSim::GetAnalogReads(0) / cycles : 0;
+	int speeds[2] = {gScheduler.GetSpeed(gWheels[0]), gScheduler.GetSpeed(gWheels[1])};
+
+	PrintTiming(options, "BackEmfScheduler", timing);
+	printf(",\n    \"virtual_ms\": %lu,\n", elapsed / 1000);
+	printf("    \"polled_period_min\": %lu,\n", polled.minPeriod);
+	printf("    \"polled_period_max\": %lu,\n", polled.maxPeriod);
+	printf("    \"period_min\": %lu,\n", timed.minPeriod);
+	printf("    \"period_max\": %lu,\n", timed.maxPeriod);
+	printf("    \"pwm_cycles\": %lu,\n", cycles);
+	printf("    \"polled_samples_per_cycle\": %.1f,\n", polledSamples);
+	printf("    \"samples_per_cycle\": %.1f,\n", samples);
+	printf("    \"interrupts\": %lu,\n", ArduinoSim::GetInterruptCount());
+	printf("    \"interrupt_load\": %.3f,\n", elapsed ? (double)ArduinoSim::GetInterruptMicros() / elapsed : 0.0);
+	printf("    \"target\": %d,\n", target);
+	printf("    \"speeds\": [%d, %d]\n  }", speeds[0], speeds[1]);
+
+	// 10010us cycles, each edge late by an interrupt entry and the bridge writes at most
+	const unsigned long jitter = 20;
+	Check(timed.count > 0 && timed.minPeriod >= 10010 - jitter && timed.maxPeriod <= 10010 + jitter, "BackEmfScheduler", "PWM cycles of 10ms under a blocking loop");
+	Check(cycles >= elapsed / (10010 + jitter) - 1, "BackEmfScheduler", "one speed per PWM cycle");
+	Check(samples > 10 * polledSamples, "BackEmfScheduler", "10 times the samples of analogRead");
+	for (int ii = 0 ; ii < 2 ; ii++) {
+		Check(speeds[ii] > target - target / 4 && speeds[ii] < target + target / 4, "BackEmfScheduler", "speed near the target");
+	}
+}
+
+// The same two motors, each in its own cycle, then in a group
+
+BackEmfMotor gPairWheels[2];
+BackEmfScheduler gPairScheduler;
+BackEmfMotorGroup gGroup;
+
+struct PairStats {
+	unsigned long driveOverlap;		/// Loop passes with both motors drawing current
+	unsigned long measureOverlap;	/// With both motors measuring
+	unsigned long passes;
+};
+
+static void SamplePair(PairStats & stats, const BackEmfMotor & motor0, const BackEmfMotor & motor1) {
+	if (gWheelPlants[0].IsConnected() && gWheelPlants[1].IsConnected()) stats.driveOverlap++;
+	if (motor0.IsMeasuring() && motor1.IsMeasuring()) stats.measureOverlap++;
+	stats.passes++;
+}
+
+static void InitializePlants() {
+	const uint8_t pins[2][5] = {{2, 3, 4, 5, 0}, {8, 9, 10, 11, 1}};
+	for (int ii = 0 ; ii < 2 ; ii++) {
+		gWheelPlants[ii].Initialize(pins[ii][0], pins[ii][1], pins[ii][2], pins[ii][3], pins[ii][4]);
+		gWheelPlants[ii].SetNoise(8);
+	}
+}
+
+static void PrintPair(const char * name, const PairStats & stats, double samples, int speed0, int speed1) {
+	printf("    \"%s\": {\"drive_overlap\": %.3f, \"measure_overlap\": %.3f, \"samples_per_cycle\": %.1f, \"speeds\": [%d, %d]}",
+		name, (double)stats.driveOverlap / stats.passes, (double)stats.measureOverlap / stats.passes, samples, speed0, speed1);
+}
+
+static void BenchBackEmfMotorGroup(const BenchOptions & options) {
+	const int target = 256;
+	Timing timing;
+	PairStats pair = {0, 0, 0};
+	PairStats group = {0, 0, 0};
+
+	// Each motor in its own cycle, started together
+	InitializePlants();
+	gPairWheels[0].Initialize(2, 3, 4, 5, 0);
+	gPairWheels[1].Initialize(8, 9, 10, 11, 1);
+	for (int ii = 0 ; ii < 2 ; ii++) {
+		gPairScheduler.Add(gPairWheels[ii]);
+		gPairWheels[ii].SetTargetSpeed(target);
+		gPairWheels[ii].SetCommand(BackEmfMotor::kStart);
+	}
+	gPairScheduler.Begin();
+	for (int ii = 0 ; ii < 2 ; ii++) gPairScheduler.Commit(gPairWheels[ii]);
+	unsigned long end = VirtualEnd(options);
+	while (ArduinoSim::GetMicros() < end) {
+		ArduinoSim::Advance(options.loopMicros);
+		SamplePair(pair, gPairWheels[0], gPairWheels[1]);
+	}
+	gPairScheduler.End();
+	unsigned long cycles = gPairScheduler.GetCycles(gPairWheels[0]);
+	double pairSamples = cycles ? (double)ArduinoSim::GetAnalogReads(0) / cycles : 0;
+	int pairSpeeds[2] = {gPairWheels[0].GetSpeed(), gPairWheels[1].GetSpeed()};
+
+	// In the group, offset by half a cycle
+	ArduinoSim::Reset();
+	ArduinoSim::SetAnalogReadMicros(options.analogReadMicros);
+	InitializePlants();
+	gGroup.AddMotor(2, 3, 4, 5, 0);
+	gGroup.AddMotor(8, 9, 10, 11, 1);
+	gGroup.Begin();
+	gGroup.SetTargetSpeed(target, target);
+	gGroup.Start();
+
+	unsigned long start = ArduinoSim::GetMicros();
+	end = VirtualEnd(options);
+	timing.Start();
+	while (ArduinoSim::GetMicros() < end) {
+		uint64_t t0 = Timing::Now();
+		gGroup.SetTargetSpeed(target, target);
+		timing.Add(t0);
+		ArduinoSim::Advance(options.loopMicros);
+		SamplePair(group, gGroup.GetMotor(0), gGroup.GetMotor(1));
+	}
+	timing.Stop();
+	gGroup.End();
+
+	unsigned long elapsed = ArduinoSim::GetMicros() - start;
+	cycles = gGroup.GetCycles(0);
+	double groupSamples = cycles ? (double)ArduinoSim::GetAnalogReads(0) / cycles : 0;
+	int groupSpeeds[2] = {gGroup.GetSpeed(0), gGroup.GetSpeed(1)};
+
+	PrintTiming(options, "BackEmfMotorGroup", timing);
+	printf(",\n    \"virtual_ms\": %lu,\n", elapsed / 1000);
+	printf("    \"pwm_cycles\": %lu,\n", cycles);
+	printf("    \"target\": %d,\n", target);
+	PrintPair("separate", pair, pairSamples, pairSpeeds[0], pairSpeeds[1]);
+	printf(",\n");
+	PrintPair("group", group, groupSamples, groupSpeeds[0], groupSpeeds[1]);
+	printf("\n  }");
+
+	Check(cycles >= elapsed / 10010 - 2, "BackEmfMotorGroup", "PWM cycles of 10ms");
+	Check(group.measureOverlap * 100 < group.passes, "BackEmfMotorGroup", "one motor measuring at a time");
+	Check(group.driveOverlap < pair.driveOverlap / 2, "BackEmfMotorGroup", "less drive overlap than separate cycles");
+	Check(groupSamples > pairSamples, "BackEmfMotorGroup", "more samples than separate cycles");
+	for (int ii = 0 ; ii < 2 ; ii++) {
+		Check(groupSpeeds[ii] > target - target / 4 && groupSpeeds[ii] < target + target / 4, "BackEmfMotorGroup", "speed near the target");
+	}
+}
+
+// Step response of the speed PID on the motor plant, scored by its settling time
+
+BackEmfMotor gPidMotor;
+
+struct StepResult {
+	unsigned long settlingMicros;	/// To stay within 5% of the new target, 0 if it never does
+	int overshoot;					/// Percent of the step
+};
+
+// Runs at the target for the given time, the speed of each cycle in samples
+static void RunPid(const BenchOptions & options, Timing & timing, unsigned long micros, std::vector<std::pair<unsigned long, int> > * samples) {
+	unsigned long end = ArduinoSim::GetMicros() + micros;
+	while (ArduinoSim::GetMicros() < end) {
+		uint64_t t0 = Timing::Now();
+		bool updated = gPidMotor.Service();
+		timing.Add(t0);
+		if (updated && samples) samples->push_back(std::make_pair(ArduinoSim::GetMicros(), gPidMotor.GetSpeed()));
+		ArduinoSim::Advance(options.loopMicros);
+	}
+}
+
+static StepResult StepPid(const BenchOptions & options, Timing & timing, int from, int to) {
+	std::vector<std::pair<unsigned long, int> > samples;
+	StepResult result = {0, 0};
+
+	gPidMotor.SetTargetSpeed(from);
+	RunPid(options, timing, 1000000, NULL);
+	unsigned long start = ArduinoSim::GetMicros();
+	gPidMotor.SetTargetSpeed(to);
+	RunPid(options, timing, 1500000, &samples);
+
+	int band = to / 20;
+	int peak = from;
+	unsigned long lastOutside = start;
+	for (size_t ii = 0 ; ii < samples.size() ; ii++) {
+		int speed = samples[ii].second;
+		if (speed > peak) peak = speed;
+		if (speed < to - band || speed > to + band) lastOutside = samples[ii].first;
+	}
+	if (!samples.empty() && lastOutside < samples.back().first) result.settlingMicros = lastOutside - start;
+	result.overshoot = (peak > to) ? (peak - to) * 100 / (to - from) : 0;
+	return result;
+}
+
+static void PrintStep(const char * name, const StepResult & result, BackEmfPid & pid) {
+	printf("    \"%s\": {\"settling_ms\": %lu, \"overshoot_percent\": %d, \"gains\": [%d, %d, %d, %d]}",
+		name, result.settlingMicros / 1000, result.overshoot,
+		pid.GetFeedForward(), pid.GetProportional(), pid.GetIntegral(), pid.GetDerivative());
+}
+
+static void BenchBackEmfPid(const BenchOptions & options) {
+	const int from = 128;
+	const int to = 384;
+	const int relay = 600;
+	Timing timing;
+
+	gPlant.Initialize(2, 3, 4, 11, 1);
+	gPlant.SetNoise(8);
+	gPidMotor.Initialize(2, 3, 4, 11, 1);
+	gPidMotor.SetCommand(BackEmfMotor::kStart);
+	gPidMotor.Commit();
+
+	timing.Start();
+	// Default gains, integral only
+	StepResult initial = StepPid(options, timing, from, to);
+	BackEmfPid initialPid = gPidMotor.GetPid();
+
+	// Relay auto-tune in the middle of the range
+	gPidMotor.SetTargetSpeed((from + to) / 2);
+	RunPid(options, timing, 1000000, NULL);
+	unsigned long tuneStart = ArduinoSim::GetMicros();
+	gPidMotor.GetPid().StartAutoTune(relay);
+	while (gPidMotor.GetPid().IsAutoTuning()) {
+		RunPid(options, timing, 10000, NULL);
+	}
+	unsigned long tuneMicros = ArduinoSim::GetMicros() - tuneStart;
+
+	StepResult tuned = StepPid(options, timing, from, to);
+	timing.Stop();
+
+	PrintTiming(options, "BackEmfPid", timing);
+	printf(",\n    \"step\": [%d, %d],\n", from, to);
+	printf("    \"tune_ms\": %lu,\n", tuneMicros / 1000);
+	PrintStep("initial", initial, initialPid);
+	printf(",\n");
+	PrintStep("tuned", tuned, gPidMotor.GetPid());
+	printf("\n  }");
+
+	Check(gPidMotor.GetPid().IsTuned(), "BackEmfPid", "relay auto-tune");
+	Check(tuned.settlingMicros > 0 && (initial.settlingMicros == 0 || tuned.settlingMicros < initial.settlingMicros), "BackEmfPid", "tuned PID settles faster");
+	Check(tuned.overshoot <= 10, "BackEmfPid", "tuned PID overshoot");
+}
+
+SpeedLimitedServo gServo;
+
+static void BenchSpeedLimitedServo(const BenchOptions & options) {
+	const int speed = 60;		// Degrees per second
+	const int pin = 9;
+	Timing timing;
+	unsigned long sweeps = 0;
+	unsigned long firstSweepMicros = 0;
+
+	gServo.Initialize(pin, 10, 100, speed, 0);
+	gServo.SetValue(90);
+
+	unsigned long start = ArduinoSim::GetMicros();
+	unsigned long end = VirtualEnd(options);
+	timing.Start();
+	while (ArduinoSim::GetMicros() < end) {
+		uint64_t t0 = Timing::Now();
+		gServo.Service();
+		timing.Add(t0);
+
+		if (gServo.IsIdle()) {
+			if (sweeps++ == 0) firstSweepMicros = ArduinoSim::GetMicros() - start;
+			gServo.SetValue(90 - gServo.GetTargetValue());
+		}
+		ArduinoSim::Advance(options.loopMicros);
+	}
+	timing.Stop();
+
+	PrintTiming(options, "SpeedLimitedServo", timing);
+	printf(",\n    \"sweeps\": %lu,\n", sweeps);
+	printf("    \"first_sweep_ms\": %lu,\n", firstSweepMicros / 1000);
+	printf("    \"servo_micros\": %d\n  }", ArduinoSim::GetServoMicros(pin));
+
+	// 90 degrees at 60 degrees per second
+	unsigned long expected = 90 * 1000000UL / speed;
+	if (options.seconds * 1000000 > expected * 105 / 100) {
+		Check(firstSweepMicros > expected * 95 / 100 && firstSweepMicros < expected * 105 / 100, "SpeedLimitedServo", "sweep time from the speed");
+	}
+}
+
+UltraSound1 gSonar;
+
+static void BenchUltraSound1(const BenchOptions & options) {
+	const int pin = 7;
+	const int distanceCM = 100;
+	Timing timing;
+	unsigned long measures = 0;
+
+	ArduinoSim::SetPulse(pin, distanceCM * 58);
+	gSonar.Initialize(pin);
+	int cm = gSonar.MesaureCM();
+
+	unsigned long end = VirtualEnd(options);
+	timing.Start();
+	while (ArduinoSim::GetMicros() < end) {
+		unsigned long before = ArduinoSim::GetPinWrites(pin);
+		uint64_t t0 = Timing::Now();
+		gSonar.SafeSkipMeasureMicroseconds();
+		timing.Add(t0);
+		if (ArduinoSim::GetPinWrites(pin) != before) measures++;
+		ArduinoSim::Advance(options.loopMicros);
+	}
+	timing.Stop();
+
+	PrintTiming(options, "UltraSound1", timing);
+	printf(",\n    \"measures\": %lu,\n", measures);
+	printf("    \"cm\": %d\n  }", cm);
+
+	Check(cm == distanceCM, "UltraSound1", "distance from the echo");
+	Check(measures <= (unsigned long)(options.seconds * 1000 / kMinMeasureInterval) + 1, "UltraSound1", "measures spaced by kMinMeasureInterval");
+}
+
+SharpIRSensor gIR;
+
+// Triangle from 20 to 620 and back, every second
+static int IRModel(uint8_t /* channel */, unsigned long micros, void * /* user */) {
+	long phase = (micros / 1000) % 1000;
+	return 20 + (phase < 500 ? phase : 1000 - phase) * 600 / 500;
+}
+
+static void BenchSharpIRSensor(const BenchOptions & options) {
+	const int pin = A2;
+	Timing timing;
+	unsigned long infinite = 0;
+
+	ArduinoSim::SetAnalogModel(pin, IRModel, NULL);
+	gIR.Initialize(pin);
+
+	unsigned long end = VirtualEnd(options);
+	timing.Start();
+	while (ArduinoSim::GetMicros() < end) {
+		uint64_t t0 = Timing::Now();
+		int distance = gIR.GetDistance();
+		timing.Add(t0);
+		if (distance == kIRInfinityThreshold) infinite++;
+		ArduinoSim::Advance(options.loopMicros);
+	}
+	timing.Stop();
+
+	PrintTiming(options, "SharpIRSensor", timing);
+	printf(",\n    \"infinite\": %lu\n  }", infinite);
+
+	Check(infinite > 0 && infinite < timing.GetCount(), "SharpIRSensor", "readings under the threshold are infinite");
+}
+
+CommandStream gCommand;
+
+static void BenchCommandStream(const BenchOptions & options) {
+	const char * text = "250s12m7x";
+	Timing timing;
+
+	for (const char * cc = text ; *cc ; cc++) gCommand.HandleChar(*cc);
+	bool parsed = gCommand.HasCommand() && gCommand.GetCommand() == 'x' && gCommand.GetValue() == 7;
+
+	// One character per call, a serial line at 115200 bauds
+	unsigned long end = VirtualEnd(options);
+	timing.Start();
+	for (size_t ii = 0 ; ArduinoSim::GetMicros() < end ; ii++) {
+		char cc = text[ii % 9];
+		uint64_t t0 = Timing::Now();
+		gCommand.HandleChar(cc);
+		timing.Add(t0);
+		ArduinoSim::Advance(87);
+	}
+	timing.Stop();
+
+	PrintTiming(options, "CommandStream", timing);
+	printf("\n  }");
+
+	Check(parsed, "CommandStream", "value then command");
+}
+
+#define kPixelCount 60
+Adafruit_NeoPixel gStrip(kPixelCount, 6);
+uint32_t gColors[3] = {0xff0000, 0x00ff00, 0x0000ff};
+NeoPixo gPixo(gStrip, gColors, 3);
+
+static void BenchNeoPixo(const BenchOptions & options) {
+	Timing timing;
+
+	gStrip.begin();
+	unsigned long shows = gStrip.GetShowCount();
+
+	unsigned long end = VirtualEnd(options);
+	timing.Start();
+	while (ArduinoSim::GetMicros() < end) {
+		uint64_t t0 = Timing::Now();
+		gPixo.Rainbow(1, 1);
+		timing.Add(t0);
+		ArduinoSim::Advance(options.loopMicros);
+	}
+	timing.Stop();
+	shows = gStrip.GetShowCount() - shows;
+
+	PrintTiming(options, "NeoPixo", timing);
+	printf(",\n    \"shows\": %lu,\n", shows);
+	printf("    \"show_micros\": %d\n  }", kPixelCount * kNeoPixelMicros + kNeoLatchMicros);
+
+	Check(shows == timing.GetCount(), "NeoPixo", "one show per frame");
+	Check(gStrip.getPixelColor(0) != 0, "NeoPixo", "pixels set");
+}
+
+static void usage(const char * name)
+{
+	fprintf(stderr, "Usage: %s [options]\n", name);
+	fprintf(stderr, "-s seconds: Virtual time per library, default 2\n");
+	fprintf(stderr, "-t us: Virtual time of the rest of the loop between calls, at least 1, default 20\n");
+	fprintf(stderr, "-a us: Time of an analogRead, default %d\n", kSimAnalogReadMicros);
+	fprintf(stderr, "-l library: Run this library only\n");
+	fprintf(stderr, "-L library=limit,...: Largest mean time per call in %s, exit with 1 above\n", kTimeUnit);
+	exit(2);
+}
+
+static void ParseLimits(BenchOptions & options, char * arg) {
+	for (char * item = strtok(arg, ",") ; item && options.limitCount < kMaxLimits ; item = strtok(NULL, ",")) {
+		char * value = strchr(item, '=');
+		if (!value) continue;
+		*value++ = 0;
+		options.limitNames[options.limitCount] = item;
+		options.limits[options.limitCount] = atof(value);
+		options.limitCount++;
+	}
+}
+
+int main(int argc, char * argv[]) {
+	BenchOptions options;
+	int opt;
+
+	memset(&options, 0, sizeof(options));
+	options.seconds = 2;
+	options.loopMicros = 20;
+	options.analogReadMicros = kSimAnalogReadMicros;
+
+	while ((opt = getopt(argc, argv, "s:t:a:l:L:")) != -1)
+	{
+		switch (opt)
+		{
+			case 's': options.seconds = atof(optarg); break;
+			case 't':
+				// Some calls take no virtual time, the loop must
+				options.loopMicros = atol(optarg);
+				if (options.loopMicros < 1) options.loopMicros = 1;
+				break;
+			case 'a': options.analogReadMicros = atol(optarg); break;
+			case 'l': options.only = optarg; break;
+			case 'L': ParseLimits(options, optarg); break;
+			default:
+				usage(argv[0]);
+		}
+	}
+
+	printf("{\n  \"unit\": \"%s\",\n", kTimeUnit);
+	printf("  \"timer_overhead\": %u", Timing::GetOverhead());
+
+	struct {
+		const char * name;
+		void (*run)(const BenchOptions & options);
+	} benches[] = {
+		{"BackEmfMotor", BenchBackEmfMotor},
+		{"BackEmfScheduler", BenchBackEmfScheduler},
+		{"BackEmfMotorGroup", BenchBackEmfMotorGroup},
+		{"BackEmfPid", BenchBackEmfPid},
+		{"SpeedLimitedServo", BenchSpeedLimitedServo},
+		{"UltraSound1", BenchUltraSound1},
+		{"SharpIRSensor", BenchSharpIRSensor},
+		{"CommandStream", BenchCommandStream},
+		{"NeoPixo", BenchNeoPixo},
+	};
+
+	for (size_t ii = 0 ; ii < sizeof(benches) / sizeof(benches[0]) ; ii++) {
+		if (!Selected(options, benches[ii].name)) continue;
+		// Reset clears the call times too
+		ArduinoSim::Reset();
+		ArduinoSim::SetAnalogReadMicros(options.analogReadMicros);
+		benches[ii].run(options);
+	}
+
+	printf(",\n  \"checks_failed\": %d,\n", gChecksFailed);
+	printf("  \"limits_exceeded\": %d\n}\n", gLimitsExceeded);
+
+	return (gChecksFailed || gLimitsExceeded) ? 1 : 0;
+}
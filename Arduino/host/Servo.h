@@ -0,0 +1,72 @@
+/*
+
+ Copyright (c) by Emil Valkov,
+ All rights reserved.
+
+ License: http://www.opensource.org/licenses/bsd-license.php
+
+ Host stub of the Servo library. The pulse width of each attached pin is
+ kept by the simulator, see ArduinoSim::GetServoMicros.
+*/
+
+#ifndef __Servo__
+#define __Servo__
+
+#include "Arduino.h"
+#include "ArduinoSim.h"
+
+#define MIN_PULSE_WIDTH 544
+#define MAX_PULSE_WIDTH 2400
+#define DEFAULT_PULSE_WIDTH 1500
+
+class Servo {
+public:
+	Servo() {
+		fPin = -1;
+		fMin = MIN_PULSE_WIDTH;
+		fMax = MAX_PULSE_WIDTH;
+		fMicros = DEFAULT_PULSE_WIDTH;
+	}
+
+	uint8_t attach(int pin) {return attach(pin, MIN_PULSE_WIDTH, MAX_PULSE_WIDTH);}
+
+	uint8_t attach(int pin, int minMicros, int maxMicros) {
+		fPin = pin;
+		fMin = minMicros;
+		fMax = maxMicros;
+		pinMode(pin, OUTPUT);
+		ArduinoSim::SetServoMicros(pin, fMicros);
+		return 0;
+	}
+
+	void detach() {
+		if (fPin >= 0) ArduinoSim::SetServoMicros(fPin, 0);
+		fPin = -1;
+	}
+
+	// Like the real one, values below the minimum pulse width are angles
+	void write(int value) {
+		if (value < MIN_PULSE_WIDTH) {
+			value = constrain(value, 0, 180);
+			value = fMin + (long)value * (fMax - fMin) / 180;
+		}
+		writeMicroseconds(value);
+	}
+
+	void writeMicroseconds(int value) {
+		fMicros = constrain(value, fMin, fMax);
+		if (fPin >= 0) ArduinoSim::SetServoMicros(fPin, fMicros);
+	}
+
+	int read() {return (int)(((long)(fMicros - fMin) * 180 + (fMax - fMin) / 2) / (fMax - fMin));}
+	int readMicroseconds() {return fMicros;}
+	bool attached() {return fPin >= 0;}
+
+private:
+	int fPin;
+	int fMin;
+	int fMax;
+	int fMicros;
+};
+
+#endif
@@ -0,0 +1,265 @@
+/*
+
+ Copyright (c) by Emil Valkov,
+ All rights reserved.
+
+ License: http://www.opensource.org/licenses/bsd-license.php
+
+ Simulated ATmega328P peripherals, see SimAvr.h
+
+ Timer1 runs in normal or CTC mode from the prescaler in TCCR1B, and sets
+ OCF1A, OCF1B and TOV1. The ADC converts single shots or free running, in 13
+ ADC clocks, 25 for the first one after ADEN. The channel is taken when a
+ conversion starts, so in free running mode an ADMUX write in the ADC
+ interrupt applies to the conversion after the one already started, as on
+ the AVR. Flags written as one are cleared.
+*/
+
+#include "SimAvr.h"
+
+extern "C" {
+
+volatile uint8_t SREG;
+
+volatile uint8_t TCCR1A;
+volatile uint8_t TCCR1B;
+volatile uint16_t TCNT1;
+volatile uint16_t OCR1A;
+volatile uint16_t OCR1B;
+volatile uint8_t TIMSK1;
+volatile uint8_t TIFR1;
+
+volatile uint8_t ADMUX;
+volatile uint8_t ADCSRA;
+volatile uint8_t ADCSRB;
+volatile uint16_t ADC;
+
+// Defined by the code with ISR(), if at all
+void TIMER1_COMPA_vect(void) __attribute__((weak));
+void TIMER1_COMPB_vect(void) __attribute__((weak));
+void TIMER1_OVF_vect(void) __attribute__((weak));
+void ADC_vect(void) __attribute__((weak));
+
+}
+
+// What the simulator last saw or stored, a difference is a write from the code
+struct SimTimer {
+	uint64_t baseCycle;		// Start of the tick where the count was baseCount
+	uint16_t baseCount;
+	uint8_t tccr1a;
+	uint8_t tccr1b;
+	uint16_t ocr1a;
+	uint16_t tcnt1;
+	uint8_t tifr1;
+};
+
+struct SimAdc {
+	bool converting;
+	bool first;				// Next conversion is the first after ADEN
+	uint8_t channel;
+	uint64_t start;
+	uint64_t end;
+	uint8_t adcsra;
+};
+
+static SimTimer gTimer;
+static SimAdc gAdc;
+
+static const unsigned int kTimerPrescale[8] = {0, 1, 8, 64, 256, 1024, 0, 0};
+static const unsigned int kAdcPrescale[8] = {2, 2, 4, 8, 16, 32, 64, 128};
+
+void SimAvrReset() {
+	SREG = _BV(SREG_I);
+	TCCR1A = 0;
+	TCCR1B = 0;
+	TCNT1 = 0;
+	OCR1A = 0;
+	OCR1B = 0;
+	TIMSK1 = 0;
+	TIFR1 = 0;
+
+	// The ADC as Arduino's init() leaves it
+	ADMUX = 0;
+	ADCSRA = _BV(ADEN) | _BV(ADPS2) | _BV(ADPS1) | _BV(ADPS0);
+	ADCSRB = 0;
+	ADC = 0;
+
+	memset(&gTimer, 0, sizeof(gTimer));
+	memset(&gAdc, 0, sizeof(gAdc));
+	gAdc.first = true;
+	gAdc.adcsra = ADCSRA;
+}
+
+// Timer1, with the settings it counts with
+
+static unsigned int Prescale() {
+	return kTimerPrescale[gTimer.tccr1b & 7];
+}
+
+static bool IsCTC() {
+	return (gTimer.tccr1b & (_BV(WGM13) | _BV(WGM12))) == _BV(WGM12) && (gTimer.tccr1a & (_BV(WGM11) | _BV(WGM10))) == 0;
+}
+
+static uint32_t Period() {
+	return IsCTC() ? (uint32_t)gTimer.ocr1a + 1 : 65536;
+}
+
+static uint64_t Ticks(uint64_t now) {
+	return (now - gTimer.baseCycle) / Prescale();
+}
+
+static uint16_t Count(uint64_t now) {
+	if (Prescale() == 0) return gTimer.baseCount;
+	return (uint16_t)((gTimer.baseCount + Ticks(now)) % Period());
+}
+
+// First cycle after now where the count becomes value
+static uint64_t NextMatch(uint32_t value, uint64_t now) {
+	uint32_t period = Period();
+	if (Prescale() == 0 || value >= period) return UINT64_MAX;
+
+	uint32_t count = Count(now);
+	uint32_t ticks = (value + period - count) % period;
+	if (ticks == 0) ticks = period;
+	return gTimer.baseCycle + (Ticks(now) + ticks) * Prescale();
+}
+
+static void SyncTimer(uint64_t now) {
+	bool countWritten = (TCNT1 != gTimer.tcnt1);
+	bool modeWritten = (TCCR1A != gTimer.tccr1a) || (TCCR1B != gTimer.tccr1b);
+	bool topWritten = (OCR1A != gTimer.ocr1a) && IsCTC();
+
+	if (countWritten || modeWritten || topWritten) {
+		uint16_t count = countWritten ? TCNT1 : Count(now);
+		// Keep the phase of the prescaler when only the count or top changes
+		if (!modeWritten && Prescale() != 0) {
+			gTimer.baseCycle = now - (now - gTimer.baseCycle) % Prescale();
+		}
+		else {
+			gTimer.baseCycle = now;
+		}
+		gTimer.baseCount = count;
+	}
+	gTimer.tccr1a = TCCR1A;
+	gTimer.tccr1b = TCCR1B;
+	gTimer.ocr1a = OCR1A;
+
+	if (TIFR1 != gTimer.tifr1) {
+		TIFR1 = gTimer.tifr1 & ~TIFR1;
+	}
+	gTimer.tifr1 = TIFR1;
+
+	TCNT1 = Count(now);
+	gTimer.tcnt1 = TCNT1;
+}
+
+static void SetTimerFlags(uint8_t flags) {
+	TIFR1 |= flags;
+	gTimer.tifr1 = TIFR1;
+}
+
+// ADC
+
+static void StartConversion(uint64_t now) {
+	unsigned int clocks = gAdc.first ? 25 : 13;
+	gAdc.converting = true;
+	gAdc.first = false;
+	gAdc.channel = ADMUX & 0x0F;
+	gAdc.start = now;
+	gAdc.end = now + (uint64_t)clocks * kAdcPrescale[ADCSRA & 7];
+}
+
+static bool IsFreeRunning() {
+	return (ADCSRA & _BV(ADATE)) && (ADCSRB & 7) == 0;
+}
+
+static void SyncAdc(uint64_t now) {
+	if (ADCSRA != gAdc.adcsra) {
+		// Writing one clears the flag, zero leaves it. ADSC can't be cleared
+		bool clearFlag = ADCSRA & _BV(ADIF);
+		ADCSRA &= ~_BV(ADIF);
+		if ((gAdc.adcsra & _BV(ADIF)) && !clearFlag) ADCSRA |= _BV(ADIF);
+		if (gAdc.converting) ADCSRA |= _BV(ADSC);
+	}
+	if (!(ADCSRA & _BV(ADEN))) {
+		gAdc.converting = false;
+		gAdc.first = true;
+		ADCSRA &= ~_BV(ADSC);
+	}
+	else if ((ADCSRA & _BV(ADSC)) && !gAdc.converting) {
+		StartConversion(now);
+	}
+	gAdc.adcsra = ADCSRA;
+}
+
+static void CompleteConversion(uint64_t now) {
+	// The sample is held at the start
+	int value = 0;
+	if (gAdc.channel < 8) value = SimAnalogValue(gAdc.channel, (unsigned long)(gAdc.start / kSimCyclesPerMicro));
+	ADC = (ADMUX & _BV(ADLAR)) ? (uint16_t)(value << 6) : (uint16_t)value;
+
+	ADCSRA |= _BV(ADIF);
+	if (IsFreeRunning()) {
+		StartConversion(now);
+	}
+	else {
+		gAdc.converting = false;
+		ADCSRA &= ~_BV(ADSC);
+	}
+	gAdc.adcsra = ADCSRA;
+}
+
+void SimAvrSync(uint64_t now) {
+	SyncTimer(now);
+	SyncAdc(now);
+}
+
+uint64_t SimAvrNextEvent(uint64_t now) {
+	uint64_t next = UINT64_MAX;
+	uint64_t event;
+
+	if ((event = NextMatch(gTimer.ocr1a, now)) < next) next = event;
+	if ((event = NextMatch(OCR1B, now)) < next) next = event;
+	if (!IsCTC() && (event = NextMatch(0, now)) < next) next = event;
+	if (gAdc.converting && gAdc.end > now && gAdc.end < next) next = gAdc.end;
+	return next;
+}
+
+void SimAvrRunEvents(uint64_t now) {
+	uint8_t flags = 0;
+	if (NextMatch(gTimer.ocr1a, now - 1) == now) flags |= _BV(OCF1A);
+	if (NextMatch(OCR1B, now - 1) == now) flags |= _BV(OCF1B);
+	if (!IsCTC() && NextMatch(0, now - 1) == now) flags |= _BV(TOV1);
+	if (flags) SetTimerFlags(flags);
+	TCNT1 = Count(now);
+	gTimer.tcnt1 = TCNT1;
+
+	if (gAdc.converting && gAdc.end == now) CompleteConversion(now);
+}
+
+SimVector SimAvrTakeInterrupt() {
+	static const struct {
+		uint8_t bit;
+		SimVector vector;
+	} timerVectors[] = {
+		{OCF1A, TIMER1_COMPA_vect},
+		{OCF1B, TIMER1_COMPB_vect},
+		{TOV1, TIMER1_OVF_vect},
+	};
+
+	// In vector order, a flag without a vector is dropped
+	for (size_t ii = 0 ; ii < sizeof(timerVectors) / sizeof(timerVectors[0]) ; ii++) {
+		uint8_t bit = _BV(timerVectors[ii].bit);
+		if ((TIFR1 & bit) && (TIMSK1 & bit)) {
+			TIFR1 &= ~bit;
+			gTimer.tifr1 = TIFR1;
+			if (timerVectors[ii].vector) return timerVectors[ii].vector;
+		}
+	}
+	if ((ADCSRA & _BV(ADIF)) && (ADCSRA & _BV(ADIE))) {
+		ADCSRA &= ~_BV(ADIF);
+		gAdc.adcsra = ADCSRA;
+		if (ADC_vect) return ADC_vect;
+	}
+	return NULL;
+}
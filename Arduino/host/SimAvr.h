@@ -0,0 +1,34 @@
+/*
+
+ Copyright (c) by Emil Valkov,
+ All rights reserved.
+
+ License: http://www.opensource.org/licenses/bsd-license.php
+
+ Simulated ATmega328P peripherals, Timer1 and the ADC, driven by the virtual
+ clock of ArduinoSim.cpp. Times are in CPU cycles.
+*/
+
+#ifndef __SimAvr__
+#define __SimAvr__
+
+#include "Arduino.h"
+
+#define kSimCyclesPerMicro (F_CPU / 1000000L)
+
+typedef void (*SimVector)(void);
+
+void SimAvrReset();
+/// Take what the code wrote to the registers, and update the counters to now
+void SimAvrSync(uint64_t now);
+/// Cycle of the next peripheral event after now, UINT64_MAX for none
+uint64_t SimAvrNextEvent(uint64_t now);
+/// Set the flags of the events due at now
+void SimAvrRunEvents(uint64_t now);
+/// Vector of the highest priority pending interrupt, its flag cleared, NULL for none
+SimVector SimAvrTakeInterrupt();
+
+/// Reading of ADC channel at the given time, from ArduinoSim.cpp
+int SimAnalogValue(uint8_t channel, unsigned long micros);
+
+#endif
@@ -0,0 +1,113 @@
+/*
+
+ Copyright (c) by Emil Valkov,
+ All rights reserved.
+
+ License: http://www.opensource.org/licenses/bsd-license.php
+
+ DC motor plant for the simulator, see SimMotor.h
+*/
+
+#include "SimMotor.h"
+
+static SimMotor * gMotors[kSimMaxMotors];
+
+SimMotor::SimMotor() {
+	fFullSpeed = 600;
+	fDrivenTau = 50000;
+	fCoastTau = 500000;
+	fNoise = 0;
+	fNoiseState = 1;
+	fSpeed = 0;
+	fTarget = 0;
+	fConnected = false;
+	fLastMicros = 0;
+	fAnalogPin = 0;
+}
+
+SimMotor::~SimMotor() {
+	for (int ii = 0 ; ii < kSimMaxMotors ; ii++) {
+		if (gMotors[ii] == this) gMotors[ii] = NULL;
+	}
+}
+
+void SimMotor::Initialize(uint8_t pin1, uint8_t enablePin1, uint8_t pin2, uint8_t enablePin2, uint8_t analogPin) {
+	fPins[0] = pin1;
+	fEnablePins[0] = enablePin1;
+	fPins[1] = pin2;
+	fEnablePins[1] = enablePin2;
+	fAnalogPin = analogPin;
+	fLastMicros = ArduinoSim::GetMicros();
+	fSpeed = 0;
+
+	// One listener for every motor
+	for (int ii = 0 ; ii < kSimMaxMotors ; ii++) {
+		if (gMotors[ii] == NULL || gMotors[ii] == this) {
+			gMotors[ii] = this;
+			break;
+		}
+	}
+	ArduinoSim::AddPinListener(PinListener, NULL);
+	ArduinoSim::SetAnalogModel(analogPin, AnalogModel, this);
+	PinChanged();
+}
+
+double SimMotor::GetSpeed() {
+	Update();
+	return fSpeed;
+}
+
+// Exact first order step from the last change
+void SimMotor::Update() {
+	unsigned long now = ArduinoSim::GetMicros();
+	unsigned long tau = fConnected ? fDrivenTau : fCoastTau;
+	if (now != fLastMicros && tau > 0) {
+		fSpeed = fTarget + (fSpeed - fTarget) * exp(-(double)(now - fLastMicros) / tau);
+	}
+	fLastMicros = now;
+}
+
+void SimMotor::PinChanged() {
+	Update();
+
+	int enable0 = ArduinoSim::GetPwm(fEnablePins[0]);
+	int enable1 = ArduinoSim::GetPwm(fEnablePins[1]);
+	fConnected = (enable0 != 0 && enable1 != 0);
+	if (fConnected) {
+		// PWM on an enable pin averages the drive
+		int duty = (enable0 < enable1) ? enable0 : enable1;
+		int drive = ArduinoSim::GetDigital(fPins[0]) - ArduinoSim::GetDigital(fPins[1]);
+		fTarget = (double)drive * fFullSpeed * duty / 255;
+	}
+	else {
+		fTarget = 0;
+	}
+}
+
+int SimMotor::Read() {
+	Update();
+	if (fConnected) {
+		// The terminal is driven
+		return ArduinoSim::GetDigital(fPins[0]) ? 1023 : 0;
+	}
+
+	int value = (int)(fSpeed < 0 ? -fSpeed : fSpeed);
+	if (fNoise > 0) {
+		fNoiseState = fNoiseState * 1103515245 + 12345;
+		value += (int)((fNoiseState >> 16) % (fNoise + 1)) - fNoise / 2;
+	}
+	return value;
+}
+
+void SimMotor::PinListener(uint8_t pin, int /* value */, bool /* analog */, unsigned long /* micros */, void * /* user */) {
+	for (int ii = 0 ; ii < kSimMaxMotors ; ii++) {
+		SimMotor * motor = gMotors[ii];
+		if (motor && (pin == motor->fPins[0] || pin == motor->fPins[1] || pin == motor->fEnablePins[0] || pin == motor->fEnablePins[1])) {
+			motor->PinChanged();
+		}
+	}
+}
+
+int SimMotor::AnalogModel(uint8_t /* channel */, unsigned long /* micros */, void * user) {
+	return ((SimMotor *)user)->Read();
+}
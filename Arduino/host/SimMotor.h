@@ -0,0 +1,67 @@
+/*
+
+ Copyright (c) by Emil Valkov,
+ All rights reserved.
+
+ License: http://www.opensource.org/licenses/bsd-license.php
+
+ DC motor plant for the simulator: follows the pins of its two half
+ H-bridges, and reads back its back-EMF on an ADC channel.
+*/
+
+#ifndef __SimMotor__
+#define __SimMotor__
+
+#include "Arduino.h"
+#include "ArduinoSim.h"
+
+#define kSimMaxMotors 8
+
+class SimMotor {
+public:
+	SimMotor();
+	~SimMotor();
+
+	/// Same pins as BackEmfMotor::Initialize, with the CombinedL298HBridge
+	void Initialize(uint8_t pin1, uint8_t enablePin1, uint8_t pin2, uint8_t enablePin2, uint8_t analogPin);
+
+	/// Back-EMF at full drive, in ADC counts
+	void SetFullSpeed(int counts) {fFullSpeed = counts;}
+	/// Time constants of the speed, driven or braked, and coasting
+	void SetTimeConstants(unsigned long drivenMicros, unsigned long coastMicros) {
+		fDrivenTau = drivenMicros;
+		fCoastTau = coastMicros;
+	}
+	/// Peak to peak noise on the readings, in ADC counts
+	void SetNoise(int counts) {fNoise = counts;}
+
+	/// Signed speed, in ADC counts of back-EMF
+	double GetSpeed();
+	/// Both halves enabled, driven or braked, drawing current
+	bool IsConnected() const {return fConnected;}
+
+private:
+	void Update();
+	void PinChanged();
+	int Read();
+
+	static void PinListener(uint8_t pin, int value, bool analog, unsigned long micros, void * user);
+	static int AnalogModel(uint8_t channel, unsigned long micros, void * user);
+
+	uint8_t fPins[2];
+	uint8_t fEnablePins[2];
+	uint8_t fAnalogPin;
+
+	int fFullSpeed;
+	unsigned long fDrivenTau;
+	unsigned long fCoastTau;
+	int fNoise;
+	unsigned long fNoiseState;
+
+	double fSpeed;
+	double fTarget;			/// Speed the drive tends to
+	bool fConnected;		/// Both halves enabled, driven or braked
+	unsigned long fLastMicros;
+};
+
+#endif
@@ -0,0 +1,16 @@
+/*
+
+ Copyright (c) by Emil Valkov,
+ All rights reserved.
+
+ License: http://www.opensource.org/licenses/bsd-license.php
+
+ Pre 1.0 name of Arduino.h
+*/
+
+#ifndef __WProgram__
+#define __WProgram__
+
+#include "Arduino.h"
+
+#endif
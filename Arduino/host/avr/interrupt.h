@@ -0,0 +1,24 @@
+/*
+
+ Copyright (c) by Emil Valkov,
+ All rights reserved.
+
+ License: http://www.opensource.org/licenses/bsd-license.php
+
+ Host build of the AVR interrupt macros. The simulator calls the vectors the
+ code defines when their flag is set, the interrupt enabled and SREG_I set,
+ with SREG_I cleared meanwhile as on the AVR.
+*/
+
+#ifndef __avr_interrupt__
+#define __avr_interrupt__
+
+#include "avr/io.h"
+
+#define ISR(vector, ...) extern "C" void vector(void); void vector(void)
+
+/// Sets SREG_I, and runs the pending interrupts
+extern "C" void sei(void);
+extern "C" void cli(void);
+
+#endif
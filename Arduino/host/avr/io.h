@@ -0,0 +1,96 @@
+/*
+
+ Copyright (c) by Emil Valkov,
+ All rights reserved.
+
+ License: http://www.opensource.org/licenses/bsd-license.php
+
+ Host build of the ATmega328P registers the libraries use: Timer1 and the
+ ADC. They are plain variables, the simulator follows what the code writes
+ and updates them as the virtual clock goes, see ArduinoSim.h.
+*/
+
+#ifndef __avr_io__
+#define __avr_io__
+
+#include <stdint.h>
+
+#define _BV(bit) (1 << (bit))
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+extern volatile uint8_t SREG;
+
+extern volatile uint8_t TCCR1A;
+extern volatile uint8_t TCCR1B;
+extern volatile uint16_t TCNT1;
+extern volatile uint16_t OCR1A;
+extern volatile uint16_t OCR1B;
+extern volatile uint8_t TIMSK1;
+extern volatile uint8_t TIFR1;
+
+extern volatile uint8_t ADMUX;
+extern volatile uint8_t ADCSRA;
+extern volatile uint8_t ADCSRB;
+extern volatile uint16_t ADC;
+
+#ifdef __cplusplus
+}
+#endif
+
+// Little endian, as on the AVR
+#define ADCL (((volatile uint8_t *)&ADC)[0])
+#define ADCH (((volatile uint8_t *)&ADC)[1])
+
+#define SREG_I 7
+
+#define COM1A1 7
+#define COM1A0 6
+#define COM1B1 5
+#define COM1B0 4
+#define WGM11 1
+#define WGM10 0
+
+#define ICNC1 7
+#define ICES1 6
+#define WGM13 4
+#define WGM12 3
+#define CS12 2
+#define CS11 1
+#define CS10 0
+
+#define ICIE1 5
+#define OCIE1B 2
+#define OCIE1A 1
+#define TOIE1 0
+
+#define ICF1 5
+#define OCF1B 2
+#define OCF1A 1
+#define TOV1 0
+
+#define REFS1 7
+#define REFS0 6
+#define ADLAR 5
+#define MUX3 3
+#define MUX2 2
+#define MUX1 1
+#define MUX0 0
+
+#define ADEN 7
+#define ADSC 6
+#define ADATE 5
+#define ADIF 4
+#define ADIE 3
+#define ADPS2 2
+#define ADPS1 1
+#define ADPS0 0
+
+#define ACME 6
+#define ADTS2 2
+#define ADTS1 1
+#define ADTS0 0
+
+#endif
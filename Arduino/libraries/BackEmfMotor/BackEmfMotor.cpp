@@ -11,11 +11,6 @@
 
 //#define __DEBUG_BackEmfMotor__
 
-#define kPwmCycleMicros 10000
-#define kMeasureDelayMicros 10
-#define kMeasureDurationMicros 100
-#define kMaxPwmMicros (kPwmCycleMicros - kMeasureDelayMicros - kMeasureDurationMicros)
-
 #define ABS(x) ((x<0) ? (-x) : (x))
 
 BackEmfMotor::BackEmfMotor() {
@@ -23,13 +18,15 @@ BackEmfMotor::BackEmfMotor() {
 	fTargetSpeed = 255;
 	fPwmMicros = 0;
 	fLastStateChangeMicros = 0;
+	fMeasureMicros = 0;
+	fMeasuredMicros = 0;
+	fCoastMicros = 0;
 	fState = kStopped;
 	fPosition = 0;
 	fSpeed = 0;
 	fAcceleration = 0;
 	fPrevSpeed = 0;
-	fIntegral = 0;
-	fPrevError = 0;
+	fPid.SetLimit(kMaxPwmMicros);
 }
 
 #ifdef __Use_CombinedL298HBridge__
@@ -61,12 +58,13 @@ bool BackEmfMotor::Service() {
 	case kMeasuring: {
 		fMeasure.Add(analogRead(fAnalogPin));
 
-		if (elapsedMicros > (kPwmCycleMicros - ABS(fPwmMicros))) {
+		if (elapsedMicros > (unsigned long)(kPwmCycleMicros - ABS(fPwmMicros))) {
 			UpdatePwm();
 			Start();
 			return true;
 		}
 	} break;
+	case kCoasting:
 	case kFreed:
 	case kStopped:
 		break;
@@ -74,6 +72,66 @@ bool BackEmfMotor::Service() {
 	return false;
 }
 
+unsigned long BackEmfMotor::Step() {
+	switch (fState) {
+	case kStarted:
+		WaitToMeasure();
+		break;
+	case kWaitToMeasure:
+		StartMeasure();
+		break;
+	case kMeasuring: {
+		// The ADC was busy with another motor, measure a little longer
+		if (fMeasure.GetCount() == 0) {
+			fMeasuredMicros += kMeasureDurationMicros;
+			return kMeasureDurationMicros;
+		}
+		// The rest of the cycle, at the PWM it started with, none if the measure took it all
+		long coastMicros = (long)kPwmCycleMicros - ABS(fPwmMicros) - (long)fMeasuredMicros;
+		UpdatePwm();
+		if (coastMicros > 0) {
+			fCoastMicros = coastMicros;
+			SetState(kCoasting);
+		}
+		else {
+			Start();
+		}
+	} break;
+	case kCoasting:
+		Start();
+		break;
+	case kFreed:
+	case kStopped:
+		break;
+	}
+
+	unsigned long stepMicros = GetStepMicros();
+	if (fState == kMeasuring) {
+		fMeasuredMicros += stepMicros;
+	}
+	return stepMicros;
+}
+
+unsigned long BackEmfMotor::GetStepMicros() const {
+	switch (fState) {
+	case kStarted:
+		return ABS(fPwmMicros);
+	case kWaitToMeasure:
+		return kMeasureDelayMicros;
+	case kMeasuring:
+		if (fMeasureMicros != 0 && fMeasureMicros < (unsigned long)(kPwmCycleMicros - ABS(fPwmMicros))) {
+			return fMeasureMicros;
+		}
+		return kPwmCycleMicros - ABS(fPwmMicros);
+	case kCoasting:
+		return fCoastMicros;
+	case kFreed:
+	case kStopped:
+		break;
+	}
+	return 0;
+}
+
 #ifdef __DEBUG_BackEmfMotor__
 static void DebugPrintVar(char * name, int num) {
 	Serial.print(name);
@@ -94,7 +152,6 @@ static void DebugPrint(char * name, int num, unsigned long value) {
 
 void BackEmfMotor::UpdatePwm() {
 	// Measure what actually happened
-	int averageMeasure = fMeasure.GetAverage();
 	int measure = fMeasure.GetMax();
 
 	if (fPwmMicros < 0) {
@@ -121,24 +178,12 @@ void BackEmfMotor::UpdatePwm() {
 	fAcceleration = fSpeed - fPrevSpeed;
 	fPrevSpeed = fSpeed;
 
-	// PID algorithm.
-	int error = fTargetSpeed - fSpeed;
-
-	fIntegral += error;
-	if (fIntegral > 5000) {
-		fIntegral = 5000;
-	}
-	else if (fIntegral < -5000) {
-		fIntegral = -5000;
-	}
-
-	int derivative = error - fPrevError;
-	fPrevError = error;
-
 	if (fTargetSpeed != kMaxInt) {
-		fPwmMicros += error / 4;
-		//fPwmMicros += fIntegral / 4;
-		//fPwmMicros += derivative / 4;
+		fPwmMicros = fPid.Update(fTargetSpeed, fSpeed);
+	}
+	else {
+		// Fixed PWM, the PID takes over from it
+		fPid.Track(fPwmMicros, fSpeed);
 	}
 
 	if (fPwmMicros < -kMaxPwmMicros) fPwmMicros = -kMaxPwmMicros;
@@ -148,15 +193,11 @@ void BackEmfMotor::UpdatePwm() {
 	DebugPrint("mt", fAnalogPin, fMeasure.GetAccumulator());
 	DebugPrint(" mc", fAnalogPin, fMeasure.GetCount());
 	DebugPrint(" min", fAnalogPin, fMeasure.GetMin());
-	DebugPrint(" avg", fAnalogPin, averageMeasure);
+	DebugPrint(" avg", fAnalogPin, fMeasure.GetAverage());
 	DebugPrint(" max", fAnalogPin, fMeasure.GetMax());
 	DebugPrint(" tgt", fAnalogPin, fTargetSpeed);
-	DebugPrint(" tgt", fAnalogPin, fTargetSpeed);
 	DebugPrint(" pwm", fAnalogPin, fPwmMicros);
-	DebugPrint(" err", fAnalogPin, error);
-	DebugPrint(" int", fAnalogPin, fIntegral);
-	DebugPrint(" der", fAnalogPin, derivative);
-	DebugPrint(" min", fAnalogPin, fMinMeasure);
+	DebugPrint(" tune", fAnalogPin, (int)fPid.IsAutoTuning());
 	DebugPrint(" pos", fAnalogPin, fPosition);
 	DebugPrint(" spd", fAnalogPin, fSpeed);
 	DebugPrint(" acc", fAnalogPin, fAcceleration);
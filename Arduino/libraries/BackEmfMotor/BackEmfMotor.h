@@ -19,7 +19,12 @@
 #include <PololuHBridge.h>
 #endif
 
-#define kMaxInt 32767
+#include "BackEmfPid.h"
+
+#define kPwmCycleMicros 10000
+#define kMeasureDelayMicros 10
+#define kMeasureDurationMicros 100
+#define kMaxPwmMicros (kPwmCycleMicros - kMeasureDelayMicros - kMeasureDurationMicros)
 
 class Measure {
 public:
@@ -40,7 +45,7 @@ public:
 	}
 
 	unsigned long GetAccumulator() const {return fAccumulator;}
-	int GetAverage() const {return fAccumulator / fCount;}
+	int GetAverage() const {return fCount ? fAccumulator / fCount : 0;}
 	int GetMin() const {return fMin;}
 	int GetMax() const {return fMax;}
 	int GetCount() const {return fCount;}
@@ -79,6 +84,9 @@ public:
 	int GetSpeed() const {return fSpeed;}
 	int GetAcceleration() const {return fAcceleration;}
 
+	/// Speed control, for its gains and auto-tune. Between cycles: from the loop with Service, with the interrupts off with a BackEmfScheduler
+	BackEmfPid & GetPid() {return fPid;}
+
 	void Commit() {
 		switch (fCommand) {
 		case kStart:
@@ -98,8 +106,21 @@ public:
 
 	bool Service();
 
+	// Timer driven operation, see BackEmfScheduler. Instead of polling Service,
+	// the scheduler calls Step when the current step of the cycle is over.
+
+	/// Go to the next step of the cycle. Returns its length in microseconds, 0 when stopped or freed
+	unsigned long Step();
+	/// Length of the current step in microseconds, 0 when stopped or freed
+	unsigned long GetStepMicros() const;
+	bool IsMeasuring() const {return fState == kMeasuring;}
+	/// Longest measure of a cycle, the motor coasts for the rest of it. 0, the default, for the whole rest
+	void SetMeasureMicros(unsigned long measureMicros) {fMeasureMicros = measureMicros;}
+	void AddSample(int value) {fMeasure.Add(value);}
+	int GetAnalogPin() const {return fAnalogPin;}
+
 private:
-	enum State {kStopped, kFreed, kStarted, kWaitToMeasure, kMeasuring};
+	enum State {kStopped, kFreed, kStarted, kWaitToMeasure, kMeasuring, kCoasting};
 
 	void SetState(State state) {
 		fState = state;
@@ -134,6 +155,7 @@ private:
 
 	void StartMeasure() {
 		fMeasure.Reset();
+		fMeasuredMicros = 0;
 		SetState(kMeasuring);
 	}
 
@@ -150,14 +172,16 @@ private:
 	Command fCommand;
 	State fState;
 	unsigned long fLastStateChangeMicros;
+	unsigned long fMeasureMicros;
+	unsigned long fMeasuredMicros;	// Steps of the current measure so far, with Step
+	unsigned long fCoastMicros;
 	unsigned long fPosition;
 	int fSpeed;
 	int fAcceleration;
 	int fPrevSpeed;
 
 	int fTargetSpeed;
-	int fIntegral;
-	int fPrevError;
+	BackEmfPid fPid;
 	int fPwmMicros;
 };
 
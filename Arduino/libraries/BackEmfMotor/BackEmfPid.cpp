@@ -0,0 +1,183 @@
+/*
+
+ Copyright (c) by Emil Valkov,
+ All rights reserved.
+
+ License: http://www.opensource.org/licenses/bsd-license.php
+*/
+
+#include "Arduino.h"
+#include "BackEmfPid.h"
+
+// 4 / pi in Q8.8, for the ultimate gain of a relay
+#define kFourOverPi 326
+
+BackEmfPid::BackEmfPid() {
+	fFeedForward = 0;
+	fProportional = 0;
+	fIntegral = kGainOne / 4;
+	fDerivative = 0;
+	fLimit = kMaxInt;
+	fSum = 0;
+	fTracking = true;
+	fPrevSpeed = 0;
+	fOutput = 0;
+	fTuning = false;
+	fTuned = false;
+}
+
+void BackEmfPid::SetGains(int feedForward, int proportional, int integral, int derivative) {
+	fFeedForward = feedForward;
+	fProportional = proportional;
+	fIntegral = integral;
+	fDerivative = derivative;
+}
+
+int BackEmfPid::Clamp(long output) const {
+	if (output > fLimit) return fLimit;
+	if (output < -fLimit) return -fLimit;
+	return output;
+}
+
+static int ClampGain(long gain) {
+	return (gain > kMaxInt) ? kMaxInt : gain;
+}
+
+void BackEmfPid::Track(int output, int speed) {
+	fOutput = output;
+	fPrevSpeed = speed;
+	fTracking = true;
+}
+
+int BackEmfPid::Update(int target, int speed) {
+	if (fTuning) {
+		return UpdateAutoTune(target, speed);
+	}
+
+	long error = (long)target - speed;
+	long feedForward = (long)fFeedForward * target;
+	long proportional = (long)fProportional * error;
+	long derivative = -(long)fDerivative * (speed - fPrevSpeed);
+	fPrevSpeed = speed;
+
+	// The first Update after Track starts from its output
+	if (fTracking) {
+		fSum = (long)fOutput * kGainOne - feedForward - proportional - derivative;
+		fTracking = false;
+	}
+
+	// The back-EMF has no sign, the speed takes the one of the PWM: the PWM
+	// stays on the side of the target, reversing would read as speeding up
+	long high = (target > 0) ? fLimit : 0;
+	long low = (target < 0) ? -fLimit : 0;
+
+	long sum = fSum + (long)fIntegral * error;
+	long output = (feedForward + proportional + sum + derivative) / kGainOne;
+
+	// Conditional integration: not further into a limit
+	if ((output < high || error < 0) && (output > low || error > 0)) {
+		fSum = sum;
+	}
+	else {
+		output = (feedForward + proportional + fSum + derivative) / kGainOne;
+	}
+
+	if (output > high) output = high;
+	else if (output < low) output = low;
+	fOutput = output;
+	return fOutput;
+}
+
+void BackEmfPid::StartAutoTune(int relay) {
+	fTuning = true;
+	fTuned = false;
+	// Around the PWM now, without reversing the motor: its speed would read with the wrong sign
+	int bias = fOutput;
+	if (bias >= 0) {
+		fHighOutput = Clamp((long)bias + relay);
+		fLowOutput = (bias > relay) ? bias - relay : 0;
+	}
+	else {
+		fHighOutput = (-bias > relay) ? bias + relay : 0;
+		fLowOutput = Clamp((long)bias - relay);
+	}
+	fRelayHigh = true;
+	fCycles = 0;
+	fLastRise = -1;
+	fMax = -kMaxInt;
+	fMin = kMaxInt;
+	fOscillations = 0;
+	fPeriodSum = 0;
+	fAmplitudeSum = 0;
+	fBiasSum = 0;
+}
+
+int BackEmfPid::UpdateAutoTune(int target, int speed) {
+	fCycles++;
+	if (speed > fMax) fMax = speed;
+	if (speed < fMin) fMin = speed;
+
+	if (fRelayHigh && speed > target + kAutoTuneHysteresis) {
+		fRelayHigh = false;
+	}
+	else if (!fRelayHigh && speed < target - kAutoTuneHysteresis) {
+		fRelayHigh = true;
+
+		// A whole oscillation from the last rise, the first one settles
+		if (fLastRise >= 0 && fOscillations++ > 0) {
+			fPeriodSum += fCycles - fLastRise;
+			fAmplitudeSum += fMax - fMin;
+		}
+		else {
+			fBiasSum = 0;
+		}
+		fLastRise = fCycles;
+		fMax = speed;
+		fMin = speed;
+
+		if (fOscillations > kAutoTuneOscillations) {
+			FinishAutoTune(target);
+		}
+	}
+
+	if (fCycles > kAutoTuneMaxCycles) {
+		// No oscillation, the relay is too small
+		fTuning = false;
+	}
+
+	if (fTuning) {
+		fOutput = fRelayHigh ? fHighOutput : fLowOutput;
+		fBiasSum += fOutput;
+	}
+	fPrevSpeed = speed;
+	return fOutput;
+}
+
+void BackEmfPid::FinishAutoTune(int target) {
+	fTuning = false;
+
+	// Amplitude half of the peak to peak, per oscillation
+	long amplitude = fAmplitudeSum / (2 * kAutoTuneOscillations);
+	long period = fPeriodSum / kAutoTuneOscillations;
+	if (amplitude <= 0 || period <= 0) {
+		return;
+	}
+
+	// Ultimate gain 4 relay / (pi amplitude), Q8.8
+	long ultimate = (long)kFourOverPi * (fHighOutput - fLowOutput) / 2 / amplitude;
+
+	// Tyreus-Luyben: Kp = Ku / 2.2, Ti = 2.2 Tu, Td = Tu / 6.3. Ziegler-Nichols
+	// overshoots, the motor speeds up much faster than it coasts down
+	fProportional = ClampGain(ultimate * 10 / 22);
+	fIntegral = ClampGain(ultimate * 100 / (484 * period));
+	fDerivative = ClampGain(ultimate * period * 100 / 1386);
+
+	// Mean PWM over the oscillations, the one that holds the target
+	if (target != 0) {
+		fFeedForward = ClampGain(fBiasSum * kGainOne / fPeriodSum / target);
+	}
+
+	fOutput = fBiasSum / fPeriodSum;
+	fTracking = true;
+	fTuned = true;
+}
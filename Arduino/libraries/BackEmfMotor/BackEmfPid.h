@@ -0,0 +1,110 @@
+/*
+
+ Copyright (c) by Emil Valkov,
+ All rights reserved.
+
+ License: http://www.opensource.org/licenses/bsd-license.php
+
+ Speed PID of a BackEmfMotor, once per PWM cycle, in fixed point: the gains
+ are Q8.8, 256 for 1, and the sums are done in longs, with no float on the
+ AVR.
+
+ PWM = feed-forward * target + P * error + integral of I * error - D * change of speed
+
+ The derivative is on the speed, not on the error, so a new target doesn't
+ kick the PWM. The integral only grows while the PWM is not at a limit, or
+ when the error brings it back, so it doesn't wind up while the motor
+ can't follow.
+
+ The PWM never has the opposite sign of the target: the back-EMF has no
+ sign, the speed takes the one of the PWM.
+
+ The relay auto-tune drives the motor with one PWM while it is below the
+ target, and another above, around the PWM when it starts, and times the
+ oscillation of the speed. The ultimate gain and period give the gains,
+ with the Tyreus-Luyben rule, and the mean PWM gives the feed-forward.
+*/
+
+#ifndef __BackEmfPid__
+#define __BackEmfPid__
+
+#include "Arduino.h"
+
+#define kMaxInt 32767
+#define kGainOne 256					// 1 in Q8.8
+
+#define kAutoTuneHysteresis 4			// Speed counts, above the noise of the back-EMF
+#define kAutoTuneOscillations 4			// Measured, after one to settle
+#define kAutoTuneMaxCycles 400
+
+class BackEmfPid {
+public:
+	BackEmfPid();
+
+	/**
+	 * Set the gains, in Q8.8. The defaults, integral 64 and the rest 0, are
+	 * the integral only controller of the first BackEmfMotor
+	 *
+	 * @param feedForward PWM micros per count of target speed
+	 * @param proportional PWM micros per count of error
+	 * @param integral PWM micros per count of error, added each cycle
+	 * @param derivative PWM micros per count of speed change in a cycle
+	 */
+	void SetGains(int feedForward, int proportional, int integral, int derivative);
+	int GetFeedForward() const {return fFeedForward;}
+	int GetProportional() const {return fProportional;}
+	int GetIntegral() const {return fIntegral;}
+	int GetDerivative() const {return fDerivative;}
+
+	/// Limits of the PWM, the output stays within -limit..limit
+	void SetLimit(int limit) {fLimit = limit;}
+
+	/// Carry on from this PWM with the next Update, without a jump
+	void Track(int output, int speed);
+
+	/// New PWM for the speed measured in the last cycle
+	int Update(int target, int speed);
+
+	/**
+	 * Start a relay auto-tune at the target of the next Updates, from the
+	 * current PWM, which should hold the motor near the target
+	 *
+	 * @param relay PWM micros added and taken off, to swing the speed well above the noise
+	 */
+	void StartAutoTune(int relay);
+	bool IsAutoTuning() const {return fTuning;}
+	/// The last auto-tune set the gains, false when it found no oscillation and kept them
+	bool IsTuned() const {return fTuned;}
+
+private:
+	int Clamp(long output) const;
+	int UpdateAutoTune(int target, int speed);
+	void FinishAutoTune(int target);
+
+	int fFeedForward;
+	int fProportional;
+	int fIntegral;
+	int fDerivative;
+	int fLimit;
+
+	long fSum;					/// Integral term, Q8.8 micros
+	bool fTracking;				/// Set fSum from fOutput on the next Update
+	int fPrevSpeed;
+	int fOutput;
+
+	bool fTuning;
+	bool fTuned;
+	bool fRelayHigh;
+	int fHighOutput;			/// PWM of the relay, below and above the target
+	int fLowOutput;
+	int fCycles;				/// Since the start of the auto-tune
+	int fLastRise;				/// Cycle of the last switch to high, -1 for none yet
+	int fMax;					/// Speed extremes since the last switch to high
+	int fMin;
+	int fOscillations;
+	long fPeriodSum;			/// Cycles
+	long fAmplitudeSum;			/// Speed counts, peak to peak
+	long fBiasSum;
+};
+
+#endif
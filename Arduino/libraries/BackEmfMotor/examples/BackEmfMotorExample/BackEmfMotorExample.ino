@@ -66,6 +66,10 @@ void loop() {
     case '3':
       StartPwmMicros(-6000);
       break;
+    case 't':
+      // Relay auto-tune, at the target speed it runs at
+      gMotor.GetPid().StartAutoTune(600);
+      break;
     }
 
     gMotor.Commit();
@@ -0,0 +1,132 @@
+/*
+
+ Copyright (c) by Emil Valkov,
+ All rights reserved.
+
+ License: http://www.opensource.org/licenses/bsd-license.php
+*/
+
+#include "Arduino.h"
+#include "BackEmfAdc.h"
+
+// ADCSRA is written whole: a read-modify-write would write back a pending
+// ADIF as one, and clear it
+#define kAdcIdle (_BV(ADEN) | kBackEmfAdcPrescaler)
+
+BackEmfAdc * BackEmfAdc::gActive = NULL;
+
+ISR(ADC_vect) {
+	BackEmfAdc::Interrupt();
+}
+
+BackEmfAdc::BackEmfAdc() {
+	fCount = 0;
+	fConverting = -1;
+	fLast = -1;
+	fSamples = 0;
+}
+
+bool BackEmfAdc::Add(BackEmfMotor & motor) {
+	if (fCount >= kMaxAdcMotors) {
+		return false;
+	}
+	fMotors[fCount++] = &motor;
+	return true;
+}
+
+void BackEmfAdc::Begin() {
+	uint8_t oldSREG = SREG;
+	cli();
+
+	gActive = this;
+	fConverting = -1;
+	fLast = fCount - 1;
+	ADCSRA = kAdcIdle | _BV(ADIF);
+	Start();
+
+	SREG = oldSREG;
+}
+
+void BackEmfAdc::End() {
+	uint8_t oldSREG = SREG;
+	cli();
+
+	// A conversion in progress ends before analogRead starts its own
+	ADCSRA = _BV(ADEN) | _BV(ADIF) | kAnalogReadPrescaler;
+	fConverting = -1;
+	gActive = NULL;
+
+	SREG = oldSREG;
+}
+
+void BackEmfAdc::Start() {
+	if (gActive != this || fConverting >= 0) {
+		return;
+	}
+
+	int8_t first = NextMeasuring(fLast);
+	if (first >= 0) {
+		StartConversion(first);
+	}
+}
+
+unsigned long BackEmfAdc::GetSamples() const {
+	uint8_t oldSREG = SREG;
+	cli();
+	unsigned long samples = fSamples;
+	SREG = oldSREG;
+	return samples;
+}
+
+// First measuring motor after the given one, in turn, -1 for none
+int8_t BackEmfAdc::NextMeasuring(int8_t after) const {
+	for (uint8_t nn = 1 ; nn <= fCount ; nn++) {
+		int8_t ii = (after + nn) % fCount;
+		if (fMotors[ii]->IsMeasuring()) {
+			return ii;
+		}
+	}
+	return -1;
+}
+
+// AVcc reference, channel numbered as in analogRead. A8 to A15 of a Mega
+// are selected by MUX5, as in analogRead
+void BackEmfAdc::StartConversion(int8_t index) {
+	int pin = fMotors[index]->GetAnalogPin();
+#ifdef A0
+	if (pin >= A0) pin -= A0;
+#endif
+#if defined(ADCSRB) && defined(MUX5)
+	ADCSRB = (ADCSRB & ~_BV(MUX5)) | (((pin >> 3) & 0x01) << MUX5);
+#endif
+	ADMUX = _BV(REFS0) | (pin & 0x07);
+	ADCSRA = kAdcIdle | _BV(ADIE) | _BV(ADSC) | _BV(ADIF);
+	fConverting = index;
+	fLast = index;
+}
+
+void BackEmfAdc::Interrupt() {
+	BackEmfAdc * adc = gActive;
+	if (adc == NULL) {
+		return;
+	}
+
+	int value = ADC;
+	int8_t owner = adc->fConverting;
+
+	// The next conversion first, it runs while this one is added
+	int8_t next = adc->NextMeasuring(owner);
+	if (next >= 0) {
+		adc->StartConversion(next);
+	}
+	else {
+		ADCSRA = kAdcIdle;
+		adc->fConverting = -1;
+	}
+
+	// Late for a measure that ended, dropped
+	if (owner >= 0 && adc->fMotors[owner]->IsMeasuring()) {
+		adc->fMotors[owner]->AddSample(value);
+		adc->fSamples++;
+	}
+}
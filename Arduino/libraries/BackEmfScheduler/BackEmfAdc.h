@@ -0,0 +1,65 @@
+/*
+
+ Copyright (c) by Emil Valkov,
+ All rights reserved.
+
+ License: http://www.opensource.org/licenses/bsd-license.php
+
+ Samples the back-EMF of BackEmfMotors in the ADC interrupt, and adds each
+ result to the Measure of its motor. Each conversion starts the next one,
+ on the next measuring motor in turn, and the ADC stops when none measures.
+
+ The ADC is not left free running: it latches the channel when a
+ conversion starts, and a late interrupt, behind the bridge switching of
+ another motor, would give the result to the wrong motor.
+
+ At a 1MHz ADC clock a conversion takes 13us instead of the 104us of
+ analogRead, for about 8 bits of accuracy, plenty for a back-EMF. The
+ interrupt comes every 15us or so while a motor measures.
+
+ Takes the ADC: no analogRead while a motor measures, End gives it back.
+*/
+
+#ifndef __BackEmfAdc__
+#define __BackEmfAdc__
+
+#include "Arduino.h"
+#include <BackEmfMotor.h>
+
+#define kMaxAdcMotors 4
+
+#define kBackEmfAdcPrescaler 4		// ADPS bits, F_CPU / 16
+#define kAnalogReadPrescaler 7		// ADPS bits of analogRead, F_CPU / 128
+
+class BackEmfAdc {
+public:
+	BackEmfAdc();
+
+	/// Add a motor, before Begin. Returns false when full
+	bool Add(BackEmfMotor & motor);
+	void Begin();
+	/// Stop the conversions, and set the ADC back for analogRead
+	void End();
+
+	/// Start the conversions if they are stopped, once a motor measures. With the interrupts off
+	void Start();
+
+	/// Results added to the motors
+	unsigned long GetSamples() const;
+
+	static void Interrupt();
+
+private:
+	int8_t NextMeasuring(int8_t after) const;
+	void StartConversion(int8_t index);
+
+	static BackEmfAdc * gActive;
+
+	BackEmfMotor * fMotors[kMaxAdcMotors];
+	uint8_t fCount;
+	int8_t fConverting;		/// Motor of the conversion in progress, -1 when stopped
+	int8_t fLast;			/// Motor of the last conversion, the next one goes to another
+	unsigned long fSamples;
+};
+
+#endif
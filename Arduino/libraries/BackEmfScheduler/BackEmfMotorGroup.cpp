@@ -0,0 +1,112 @@
+/*
+
+ Copyright (c) by Emil Valkov,
+ All rights reserved.
+
+ License: http://www.opensource.org/licenses/bsd-license.php
+*/
+
+#include "Arduino.h"
+#include "BackEmfMotorGroup.h"
+
+BackEmfMotorGroup::BackEmfMotorGroup() {
+	fCount = 0;
+	fStarted = false;
+}
+
+#ifdef __Use_CombinedL298HBridge__
+int BackEmfMotorGroup::AddMotor(int pin1, int enablePin1, int pin2, int enablePin2, int analogPin) {
+#else
+int BackEmfMotorGroup::AddMotor(int pin1, int enablePin1, int pin2, int enablePin2, int pwmPin, int analogPin) {
+#endif
+	if (fCount >= kMaxGroupMotors) {
+		return -1;
+	}
+
+	BackEmfMotor & motor = fMotors[fCount];
+#ifdef __Use_CombinedL298HBridge__
+	motor.Initialize(pin1, enablePin1, pin2, enablePin2, analogPin);
+#else
+	motor.Initialize(pin1, enablePin1, pin2, enablePin2, pwmPin, analogPin);
+#endif
+	if (!fScheduler.Add(motor)) {
+		return -1;
+	}
+	return fCount++;
+}
+
+void BackEmfMotorGroup::Begin() {
+	// A measure each in turn
+	for (uint8_t ii = 0 ; ii < fCount ; ii++) {
+		fMotors[ii].SetMeasureMicros(kPwmCycleMicros / fCount);
+	}
+	fScheduler.Begin();
+}
+
+void BackEmfMotorGroup::End() {
+	fScheduler.End();
+}
+
+void BackEmfMotorGroup::Start() {
+	if (fStarted) {
+		return;
+	}
+	fStarted = true;
+
+	uint8_t oldSREG = SREG;
+	cli();
+	for (uint8_t ii = 0 ; ii < fCount ; ii++) {
+		fMotors[ii].SetCommand(BackEmfMotor::kStart);
+		fScheduler.CommitAfter(fMotors[ii], (unsigned long)ii * kPwmCycleMicros / fCount);
+	}
+	SREG = oldSREG;
+}
+
+void BackEmfMotorGroup::Stop() {
+	CommitAll(BackEmfMotor::kStop);
+}
+
+void BackEmfMotorGroup::Free() {
+	CommitAll(BackEmfMotor::kFree);
+}
+
+void BackEmfMotorGroup::CommitAll(BackEmfMotor::Command command) {
+	fStarted = false;
+
+	uint8_t oldSREG = SREG;
+	cli();
+	for (uint8_t ii = 0 ; ii < fCount ; ii++) {
+		fMotors[ii].SetCommand(command);
+		fScheduler.Commit(fMotors[ii]);
+	}
+	SREG = oldSREG;
+}
+
+void BackEmfMotorGroup::SetTargetSpeeds(const int * speeds) {
+	uint8_t oldSREG = SREG;
+	cli();
+	for (uint8_t ii = 0 ; ii < fCount ; ii++) {
+		fMotors[ii].SetTargetSpeed(speeds[ii]);
+	}
+	SREG = oldSREG;
+}
+
+void BackEmfMotorGroup::SetTargetSpeed(int left, int right) {
+	int speeds[kMaxGroupMotors] = {left, right};
+	for (uint8_t ii = 2 ; ii < fCount ; ii++) {
+		speeds[ii] = fMotors[ii].GetTargetSpeed();
+	}
+	SetTargetSpeeds(speeds);
+}
+
+int BackEmfMotorGroup::GetSpeed(uint8_t index) const {
+	return fScheduler.GetSpeed(fMotors[index]);
+}
+
+unsigned long BackEmfMotorGroup::GetPosition(uint8_t index) const {
+	return fScheduler.GetPosition(fMotors[index]);
+}
+
+unsigned long BackEmfMotorGroup::GetCycles(uint8_t index) const {
+	return fScheduler.GetCycles(fMotors[index]);
+}
@@ -0,0 +1,65 @@
+/*
+
+ Copyright (c) by Emil Valkov,
+ All rights reserved.
+
+ License: http://www.opensource.org/licenses/bsd-license.php
+
+ The motors of a robot, run together by a BackEmfScheduler. Their PWM cycles
+ are offset by a cycle / motor count, and each measures for that long at
+ most, then coasts to the end of its cycle: at the same PWM, as when going
+ straight, only one motor measures at a time, and has the ADC for itself,
+ and the motors never switch on together. In a turn the measures overlap
+ by the difference of the PWMs, and share the ADC.
+
+ Same Timer1 and ADC as BackEmfScheduler.
+*/
+
+#ifndef __BackEmfMotorGroup__
+#define __BackEmfMotorGroup__
+
+#include "Arduino.h"
+#include <BackEmfMotor.h>
+#include "BackEmfScheduler.h"
+
+#define kMaxGroupMotors kMaxScheduledMotors
+
+class BackEmfMotorGroup {
+public:
+	BackEmfMotorGroup();
+
+	/// Add a motor, before Begin. Returns its index, -1 when full
+#ifdef __Use_CombinedL298HBridge__
+	int AddMotor(int pin1, int enablePin1, int pin2, int enablePin2, int analogPin);
+#else
+	int AddMotor(int pin1, int enablePin1, int pin2, int enablePin2, int pwmPin, int analogPin);
+#endif
+	void Begin();
+	void End();
+
+	/// Start all the motors, each a part of a cycle after the one before. Does nothing if started
+	void Start();
+	void Stop();
+	void Free();
+
+	/// New target speeds of all the motors, taken at once
+	void SetTargetSpeeds(const int * speeds);
+	/// Same for a differential drive, motors 0 and 1
+	void SetTargetSpeed(int left, int right);
+
+	int GetSpeed(uint8_t index) const;
+	unsigned long GetPosition(uint8_t index) const;
+	unsigned long GetCycles(uint8_t index) const;
+	uint8_t GetCount() const {return fCount;}
+	const BackEmfMotor & GetMotor(uint8_t index) const {return fMotors[index];}
+
+private:
+	void CommitAll(BackEmfMotor::Command command);
+
+	BackEmfMotor fMotors[kMaxGroupMotors];
+	uint8_t fCount;
+	BackEmfScheduler fScheduler;
+	bool fStarted;
+};
+
+#endif
@@ -0,0 +1,231 @@
+/*
+
+ Copyright (c) by Emil Valkov,
+ All rights reserved.
+
+ License: http://www.opensource.org/licenses/bsd-license.php
+*/
+
+#include "Arduino.h"
+#include "BackEmfScheduler.h"
+
+BackEmfScheduler * BackEmfScheduler::gActive = NULL;
+
+ISR(TIMER1_COMPA_vect) {
+	BackEmfScheduler::MotorInterrupt();
+}
+
+BackEmfScheduler::BackEmfScheduler() {
+	fCount = 0;
+}
+
+bool BackEmfScheduler::Add(BackEmfMotor & motor) {
+	if (fCount >= kMaxScheduledMotors || !fAdc.Add(motor)) {
+		return false;
+	}
+	fMotors[fCount] = &motor;
+	fActive[fCount] = false;
+	fPending[fCount] = false;
+	fCycles[fCount] = 0;
+	fCount++;
+	return true;
+}
+
+void BackEmfScheduler::Begin() {
+	uint8_t oldSREG = SREG;
+	cli();
+
+	gActive = this;
+
+	// Normal mode, free running, the compare is moved ahead for each event
+	TCCR1A = 0;
+	TCCR1B = _BV(CS11);
+	TIMSK1 = 0;
+	TIFR1 = _BV(OCF1A) | _BV(OCF1B) | _BV(TOV1);
+
+	for (uint8_t ii = 0 ; ii < fCount ; ii++) {
+		Schedule(ii, fMotors[ii]->GetStepMicros());
+	}
+	ArmMotorTimer();
+	fAdc.Begin();
+
+	SREG = oldSREG;
+}
+
+void BackEmfScheduler::End() {
+	uint8_t oldSREG = SREG;
+	cli();
+	TIMSK1 &= ~_BV(OCIE1A);
+	fAdc.End();
+	gActive = NULL;
+	SREG = oldSREG;
+}
+
+int BackEmfScheduler::IndexOf(const BackEmfMotor & motor) const {
+	for (uint8_t ii = 0 ; ii < fCount ; ii++) {
+		if (fMotors[ii] == &motor) {
+			return ii;
+		}
+	}
+	return -1;
+}
+
+void BackEmfScheduler::Commit(BackEmfMotor & motor) {
+	int index = IndexOf(motor);
+	if (index < 0) {
+		return;
+	}
+
+	uint8_t oldSREG = SREG;
+	cli();
+	motor.Commit();
+	fPending[index] = false;
+	Schedule(index, motor.GetStepMicros());
+	if (gActive == this) {
+		ArmMotorTimer();
+	}
+	SREG = oldSREG;
+}
+
+bool BackEmfScheduler::CommitAfter(BackEmfMotor & motor, unsigned long micros) {
+	int index = IndexOf(motor);
+	if (index < 0 || micros > kSchedulerMaxMicros) {
+		return false;
+	}
+	if (micros == 0) {
+		Commit(motor);
+		return true;
+	}
+
+	uint8_t oldSREG = SREG;
+	cli();
+	fPending[index] = true;
+	Schedule(index, micros);
+	if (gActive == this) {
+		ArmMotorTimer();
+	}
+	SREG = oldSREG;
+	return true;
+}
+
+void BackEmfScheduler::SetTargetSpeed(BackEmfMotor & motor, int speed) {
+	uint8_t oldSREG = SREG;
+	cli();
+	motor.SetTargetSpeed(speed);
+	SREG = oldSREG;
+}
+
+void BackEmfScheduler::SetPwmMicros(BackEmfMotor & motor, int pwmMicros) {
+	uint8_t oldSREG = SREG;
+	cli();
+	motor.SetPwmMicros(pwmMicros);
+	SREG = oldSREG;
+}
+
+int BackEmfScheduler::GetSpeed(const BackEmfMotor & motor) const {
+	uint8_t oldSREG = SREG;
+	cli();
+	int speed = motor.GetSpeed();
+	SREG = oldSREG;
+	return speed;
+}
+
+unsigned long BackEmfScheduler::GetPosition(const BackEmfMotor & motor) const {
+	uint8_t oldSREG = SREG;
+	cli();
+	unsigned long position = motor.GetPosition();
+	SREG = oldSREG;
+	return position;
+}
+
+unsigned long BackEmfScheduler::GetCycles(const BackEmfMotor & motor) const {
+	int index = IndexOf(motor);
+	if (index < 0) {
+		return 0;
+	}
+
+	uint8_t oldSREG = SREG;
+	cli();
+	unsigned long cycles = fCycles[index];
+	SREG = oldSREG;
+	return cycles;
+}
+
+// Next step of a motor, from now
+void BackEmfScheduler::Schedule(int index, unsigned long micros) {
+	fActive[index] = (micros != 0);
+	fNext[index] = TCNT1 + kSchedulerTicks(micros);
+}
+
+void BackEmfScheduler::RunMotor(int index) {
+	BackEmfMotor * motor = fMotors[index];
+	bool measuring = motor->IsMeasuring();
+	unsigned long micros;
+	if (fPending[index]) {
+		fPending[index] = false;
+		motor->Commit();
+		micros = motor->GetStepMicros();
+	}
+	else {
+		micros = motor->Step();
+	}
+	if (micros == 0) {
+		fActive[index] = false;
+		return;
+	}
+
+	// From the time it was due, not from now, so the cycle doesn't drift
+	fNext[index] += kSchedulerTicks(micros);
+
+	if (measuring && !motor->IsMeasuring()) {
+		fCycles[index]++;
+	}
+	else if (!measuring && motor->IsMeasuring()) {
+		fAdc.Start();
+	}
+}
+
+// Compare A on the earliest step, late by kSchedulerMinLeadTicks at most when it is already due
+void BackEmfScheduler::ArmMotorTimer() {
+	uint16_t now = TCNT1;
+	bool any = false;
+	int16_t earliest = 0;
+
+	for (uint8_t ii = 0 ; ii < fCount ; ii++) {
+		if (!fActive[ii]) {
+			continue;
+		}
+		int16_t delta = fNext[ii] - now;
+		if (!any || delta < earliest) {
+			earliest = delta;
+			any = true;
+		}
+	}
+
+	if (!any) {
+		TIMSK1 &= ~_BV(OCIE1A);
+		return;
+	}
+
+	if (earliest < kSchedulerMinLeadTicks) {
+		earliest = kSchedulerMinLeadTicks;
+	}
+	OCR1A = now + earliest;
+	TIFR1 = _BV(OCF1A);
+	TIMSK1 |= _BV(OCIE1A);
+}
+
+void BackEmfScheduler::MotorInterrupt() {
+	BackEmfScheduler * scheduler = gActive;
+	if (scheduler == NULL) {
+		return;
+	}
+
+	uint16_t now = TCNT1;
+	for (uint8_t ii = 0 ; ii < scheduler->fCount ; ii++) {
+		if (scheduler->fActive[ii] && (int16_t)(scheduler->fNext[ii] - now) <= 0) {
+			scheduler->RunMotor(ii);
+		}
+	}
+	scheduler->ArmMotorTimer();
+}
@@ -0,0 +1,78 @@
+/*
+
+ Copyright (c) by Emil Valkov,
+ All rights reserved.
+
+ License: http://www.opensource.org/licenses/bsd-license.php
+
+ Runs the PWM and measure cycle of BackEmfMotors from the Timer1 compare
+ interrupts, instead of Service() polled in loop(). The edges land within a
+ few microseconds of their time whatever the loop does, even in a 32ms
+ pulseIn, and the loop is free. Compare A switches the bridges, and a
+ BackEmfAdc samples the back-EMF of the measuring motors.
+
+ Takes Timer1 and the ADC: no Servo library on an Uno, no analogWrite on
+ pins 9 and 10, and no analogRead while a motor measures.
+*/
+
+#ifndef __BackEmfScheduler__
+#define __BackEmfScheduler__
+
+#include "Arduino.h"
+#include <BackEmfMotor.h>
+#include "BackEmfAdc.h"
+
+#define kMaxScheduledMotors 4
+
+// Timer1 clock / 8, 2.5 ticks a microsecond at 20MHz: multiply before dividing
+#if F_CPU < 1000000L || F_CPU % 1000000L != 0
+#error "BackEmfScheduler needs F_CPU in whole MHz"
+#endif
+#define kSchedulerTicks(micros) ((micros) * (F_CPU / 1000000L) / 8)
+#define kSchedulerMinLeadTicks 8					// Time to reprogram the compare before it passes
+#define kSchedulerMaxMicros (0x7FFFL * 8 / (F_CPU / 1000000L))	// Longest step, due times are int16_t tick differences: 16383us at 16MHz
+
+class BackEmfScheduler {
+public:
+	BackEmfScheduler();
+
+	/// Add an initialized motor, before Begin. Returns false when full
+	bool Add(BackEmfMotor & motor);
+	/// Take Timer1 and the ADC, and run the cycles of the motors
+	void Begin();
+	/// Give Timer1 back, the motors stay as they are
+	void End();
+
+	// From the main loop instead of the BackEmfMotor methods, with the
+	// interrupts off while the motor is changed
+	void Commit(BackEmfMotor & motor);
+	/// Commit the command micros from now, to offset the cycles of the motors. Returns false, and
+	/// leaves the motor as it is, when micros is over kSchedulerMaxMicros: it would look already due
+	bool CommitAfter(BackEmfMotor & motor, unsigned long micros);
+	void SetTargetSpeed(BackEmfMotor & motor, int speed);
+	void SetPwmMicros(BackEmfMotor & motor, int pwmMicros);
+	int GetSpeed(const BackEmfMotor & motor) const;
+	unsigned long GetPosition(const BackEmfMotor & motor) const;
+	/// PWM cycles completed by the motor, one new speed each
+	unsigned long GetCycles(const BackEmfMotor & motor) const;
+
+	static void MotorInterrupt();
+
+private:
+	int IndexOf(const BackEmfMotor & motor) const;
+	void Schedule(int index, unsigned long micros);
+	void RunMotor(int index);
+	void ArmMotorTimer();
+
+	static BackEmfScheduler * gActive;
+
+	BackEmfMotor * fMotors[kMaxScheduledMotors];
+	uint16_t fNext[kMaxScheduledMotors];		/// Timer1 count of the next step
+	bool fActive[kMaxScheduledMotors];
+	bool fPending[kMaxScheduledMotors];		/// The next step commits the command
+	unsigned long fCycles[kMaxScheduledMotors];
+	uint8_t fCount;
+	BackEmfAdc fAdc;
+};
+
+#endif
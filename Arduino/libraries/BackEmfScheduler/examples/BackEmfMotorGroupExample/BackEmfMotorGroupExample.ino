@@ -0,0 +1,58 @@
+/*
+
+ Copyright (c) by Emil Valkov,
+ All rights reserved.
+
+ License: http://www.opensource.org/licenses/bsd-license.php
+*/
+
+#include <HalfHBridge.h>
+#include <CombinedL298HBridge.h>
+#include <BackEmfMotor.h>
+#include <BackEmfScheduler.h>
+#include <BackEmfMotorGroup.h>
+
+BackEmfMotorGroup gDrive;
+
+void setup() {
+  gDrive.AddMotor(2, 3, 4, 5, 0);
+  gDrive.AddMotor(8, 12, 13, 6, 1);
+  gDrive.Begin();
+
+  Serial.begin(115200);
+}
+
+void loop() {
+  if (Serial.available() > 0) {
+    int cc = Serial.read();
+    switch (cc) {
+    case '8':
+      gDrive.SetTargetSpeed(256, 256);
+      gDrive.Start();
+      break;
+    case '2':
+      gDrive.SetTargetSpeed(-256, -256);
+      gDrive.Start();
+      break;
+    case '4':
+      gDrive.SetTargetSpeed(128, 256);
+      gDrive.Start();
+      break;
+    case '6':
+      gDrive.SetTargetSpeed(256, 128);
+      gDrive.Start();
+      break;
+    case '5':
+      gDrive.Stop();
+      break;
+    case '0':
+      gDrive.Free();
+      break;
+    }
+  }
+
+  Serial.print(gDrive.GetSpeed(0));
+  Serial.print(" ");
+  Serial.println(gDrive.GetSpeed(1));
+  delay(100);
+}
@@ -0,0 +1,52 @@
+/*
+
+ Copyright (c) by Emil Valkov,
+ All rights reserved.
+
+ License: http://www.opensource.org/licenses/bsd-license.php
+*/
+
+#include <HalfHBridge.h>
+#include <CombinedL298HBridge.h>
+#include <BackEmfMotor.h>
+#include <BackEmfScheduler.h>
+#include <UltraSound1.h>
+
+BackEmfMotor gMotor[2];
+BackEmfScheduler gScheduler;
+UltraSound1 gSonar;
+
+static void StartTargetSpeed(int speed) {
+  for (int ii = 0 ; ii < 2 ; ii++) {
+    gScheduler.SetTargetSpeed(gMotor[ii], speed);
+    gMotor[ii].SetCommand(BackEmfMotor::kStart);
+    gScheduler.Commit(gMotor[ii]);
+  }
+}
+
+void setup() {
+  gMotor[0].Initialize(2, 3, 4, 5, 0);
+  gMotor[1].Initialize(8, 12, 13, 6, 1);
+  gSonar.Initialize(7);
+
+  gScheduler.Add(gMotor[0]);
+  gScheduler.Add(gMotor[1]);
+  gScheduler.Begin();
+
+  StartTargetSpeed(256);
+  Serial.begin(115200);
+}
+
+void loop() {
+  // The motors keep their speed while the sonar waits for its echo
+  int cm = gSonar.MesaureCM();
+  if (cm > 0 && cm < 20) {
+    StartTargetSpeed(0);
+  }
+
+  Serial.print(cm);
+  Serial.print(" ");
+  Serial.print(gScheduler.GetSpeed(gMotor[0]));
+  Serial.print(" ");
+  Serial.println(gScheduler.GetSpeed(gMotor[1]));
+}
@@ -0,0 +1,221 @@
+/*
+
+ Copyright (c) by Emil Valkov,
+ All rights reserved.
+
+ License: http://www.opensource.org/licenses/bsd-license.php
+
+ Frame buffer allocator, see RaspiCamArena.h
+
+*/
+
+#include "RaspiCamArena.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <sys/mman.h>
+
+#define ALIGN_UP(x, n) (((x) + (n) - 1) & ~((size_t)(n) - 1))
+
+#define ARENA_PAGE 4096
+#define ARENA_HUGE_PAGE (2 * 1024 * 1024)
+
+// Header in front of each block, padded to RASPICAM_ARENA_ALIGN
+typedef struct
+{
+	size_t size;			/// Whole block, header included
+	int free;
+} ARENA_BLOCK;
+
+#define BLOCK_HEADER RASPICAM_ARENA_ALIGN
+
+static inline ARENA_BLOCK * next_block(ARENA_BLOCK * block)
+{
+	return (ARENA_BLOCK *)((unsigned char *)block + block->size);
+}
+
+size_t raspicam_arena_footprint(size_t size)
+{
+	return ALIGN_UP(size ? size : 1, RASPICAM_ARENA_ALIGN) + BLOCK_HEADER;
+}
+
+int raspicam_arena_init(RASPICAM_ARENA * arena, size_t size, int flags)
+{
+	void * base = MAP_FAILED;
+
+	memset(arena, 0, sizeof(RASPICAM_ARENA));
+	pthread_mutex_init(&arena->lock, NULL);
+	if (size == 0)
+		return 0;
+
+#ifdef MAP_HUGETLB
+	if (flags & RASPICAM_MEMORY_HUGE_PAGES)
+	{
+		size = ALIGN_UP(size, ARENA_HUGE_PAGE);
+		base = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+		if (base != MAP_FAILED)
+			arena->huge_pages = 1;
+		else
+			fprintf(stderr, "%s: No huge pages for %zu bytes, see /proc/sys/vm/nr_hugepages\n", __func__, size);
+	}
+#endif
+	if (base == MAP_FAILED)
+	{
+		size = ALIGN_UP(size, ARENA_PAGE);
+		base = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (base == MAP_FAILED)
+		{
+			fprintf(stderr, "%s: Failed to map %zu bytes\n", __func__, size);
+			pthread_mutex_destroy(&arena->lock);
+			return -1;
+		}
+#ifdef MADV_HUGEPAGE
+		// Transparent huge pages, when the kernel has them
+		if (flags & RASPICAM_MEMORY_HUGE_PAGES)
+			madvise(base, size, MADV_HUGEPAGE);
+#endif
+	}
+
+	// Locked pages are all faulted in now, not at the first frames
+	if (flags & RASPICAM_MEMORY_LOCK)
+	{
+		if (mlock(base, size) == 0)
+			arena->locked = 1;
+		else
+			fprintf(stderr, "%s: Can't lock %zu bytes, see ulimit -l\n", __func__, size);
+	}
+
+	arena->base = (unsigned char *)base;
+	arena->size = size;
+
+	ARENA_BLOCK * block = (ARENA_BLOCK *)arena->base;
+	block->size = size;
+	block->free = 1;
+	return 0;
+}
+
+void raspicam_arena_destroy(RASPICAM_ARENA * arena)
+{
+	if (arena->allocations)
+		fprintf(stderr, "%s: %u buffers still allocated\n", __func__, arena->allocations);
+	if (arena->base)
+	{
+		if (arena->locked)
+			munlock(arena->base, arena->size);
+		munmap(arena->base, arena->size);
+		arena->base = NULL;
+	}
+	pthread_mutex_destroy(&arena->lock);
+}
+
+/**
+ * First free block large enough, split to size
+ *
+ * @param arena The arena, locked
+ * @param size Block size, header included
+ *
+ * @return The block, NULL if none is large enough
+ */
+static ARENA_BLOCK * take_block(RASPICAM_ARENA * arena, size_t size)
+{
+	unsigned char * end = arena->base + arena->size;
+	ARENA_BLOCK * block;
+
+	for (block = (ARENA_BLOCK *)arena->base; (unsigned char *)block < end; block = next_block(block))
+	{
+		if (!block->free || block->size < size)
+			continue;
+
+		// Keep the rest free if it can hold anything
+		if (block->size - size >= BLOCK_HEADER + RASPICAM_ARENA_ALIGN)
+		{
+			ARENA_BLOCK * rest = (ARENA_BLOCK *)((unsigned char *)block + size);
+			rest->size = block->size - size;
+			rest->free = 1;
+			block->size = size;
+		}
+		block->free = 0;
+		return block;
+	}
+	return NULL;
+}
+
+void * raspicam_arena_alloc(RASPICAM_ARENA * arena, size_t size)
+{
+	size_t footprint = raspicam_arena_footprint(size);
+	ARENA_BLOCK * block = NULL;
+
+	if (!arena)
+		return malloc(size);
+
+	pthread_mutex_lock(&arena->lock);
+	if (arena->base)
+	{
+		block = take_block(arena, footprint);
+		if (!block)
+			fprintf(stderr, "%s: %zu bytes don't fit, %zu of %zu in use\n", __func__, size, arena->in_use, arena->size);
+	}
+	else
+	{
+		void * buffer;
+		if (posix_memalign(&buffer, RASPICAM_ARENA_ALIGN, footprint) == 0)
+		{
+			block = (ARENA_BLOCK *)buffer;
+			block->size = footprint;
+			block->free = 0;
+		}
+	}
+	if (block)
+	{
+		arena->in_use += block->size;
+		if (arena->in_use > arena->peak)
+			arena->peak = arena->in_use;
+		arena->allocations++;
+	}
+	pthread_mutex_unlock(&arena->lock);
+
+	return block ? (unsigned char *)block + BLOCK_HEADER : NULL;
+}
+
+void * raspicam_arena_calloc(RASPICAM_ARENA * arena, size_t size)
+{
+	void * buffer = raspicam_arena_alloc(arena, size);
+
+	if (buffer)
+		memset(buffer, 0, size);
+	return buffer;
+}
+
+void raspicam_arena_free(RASPICAM_ARENA * arena, void * buffer)
+{
+	if (!buffer)
+		return;
+	if (!arena)
+	{
+		free(buffer);
+		return;
+	}
+
+	ARENA_BLOCK * block = (ARENA_BLOCK *)((unsigned char *)buffer - BLOCK_HEADER);
+
+	pthread_mutex_lock(&arena->lock);
+	arena->in_use -= block->size;
+	arena->allocations--;
+	if (!arena->base)
+	{
+		pthread_mutex_unlock(&arena->lock);
+		free(block);
+		return;
+	}
+
+	// Merge the free neighbours, the list is short
+	unsigned char * end = arena->base + arena->size;
+	block->free = 1;
+	for (block = (ARENA_BLOCK *)arena->base; (unsigned char *)block < end; block = next_block(block))
+	{
+		while (block->free && (unsigned char *)next_block(block) < end && next_block(block)->free)
+			block->size += next_block(block)->size;
+	}
+	pthread_mutex_unlock(&arena->lock);
+}
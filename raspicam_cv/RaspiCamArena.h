@@ -0,0 +1,65 @@
+#ifndef __RaspiCamArena__
+#define __RaspiCamArena__
+
+#include <stddef.h>
+#include <pthread.h>
+#include "RaspiCamCV.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Frame buffer allocator of a capture. With a size, every buffer comes from
+ * one mapping reserved up front, optionally locked in RAM or backed by huge
+ * pages, and an allocation that doesn't fit fails instead of growing the
+ * process. Without, buffers come from malloc. Either way the bytes in use
+ * and the peak are counted.
+ *
+ * The arena is first fit over blocks in address order, merged when freed.
+ * Buffers are only allocated and freed when the capture is set up, never
+ * per frame, so there are a few dozen blocks at most.
+ */
+
+#define RASPICAM_ARENA_ALIGN 64		/// Cache line, and SIMD loads
+
+typedef struct
+{
+	pthread_mutex_t lock;
+	unsigned char * base;	/// The mapping, NULL for malloc
+	size_t size;
+	int locked;				/// mlock succeeded
+	int huge_pages;			/// Backed by hugetlbfs pages
+
+	size_t in_use;			/// Bytes handed out, headers included
+	size_t peak;
+	unsigned int allocations;
+} RASPICAM_ARENA;
+
+/**
+ * Reserve the arena
+ *
+ * @param arena The arena
+ * @param size Bytes to reserve, 0 to use malloc
+ * @param flags RASPICAM_MEMORY_*
+ *
+ * @return 0 on success
+ */
+int  raspicam_arena_init(RASPICAM_ARENA * arena, size_t size, int flags);
+/// Unmap the arena, every buffer must be freed
+void raspicam_arena_destroy(RASPICAM_ARENA * arena);
+
+/// RASPICAM_ARENA_ALIGN aligned buffer, NULL when it doesn't fit. A NULL arena is malloc.
+void * raspicam_arena_alloc(RASPICAM_ARENA * arena, size_t size);
+/// Same, zeroed
+void * raspicam_arena_calloc(RASPICAM_ARENA * arena, size_t size);
+void raspicam_arena_free(RASPICAM_ARENA * arena, void * buffer);
+
+/// Bytes an allocation of size takes, header included
+size_t raspicam_arena_footprint(size_t size);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,271 @@
+/*
+
+ Copyright (c) by Emil Valkov,
+ All rights reserved.
+
+ License: http://www.opensource.org/licenses/bsd-license.php
+
+ Asynchronous frame consumer: dispatcher thread and worker pool.
+
+*/
+
+#include "RaspiCamAsync.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
+enum
+{
+	JOB_EMPTY = 0,
+	JOB_QUEUED,		/// Waiting for a worker
+	JOB_RUNNING,	/// In the process callback
+	JOB_DONE,		/// Waiting for the frames before it to complete
+	JOB_COMPLETING,	/// In the complete callback
+};
+
+typedef struct
+{
+	int state;		/// JOB_*
+	RASPICAM_RING_SLOT * slot;
+	RASPICAM_FRAME_TIMES times;
+} ASYNC_JOB;
+
+struct _RASPICAM_ASYNC
+{
+	RASPICAM_RING * ring;
+	RASPICAM_ROLLING_HISTOGRAM * latency;
+	RASPICAM_FRAME_CALLBACK process;
+	RASPICAM_FRAME_CALLBACK complete;
+	void * user;
+	int backpressure;		/// RASPICAM_ASYNC_*
+
+	pthread_mutex_t lock;
+	pthread_cond_t work;	/// Signaled when a job is queued
+	pthread_cond_t space;	/// Signaled when a job completes
+
+	// In flight frames, in frame order from head
+	ASYNC_JOB jobs [RASPICAM_RING_MAX_DEPTH];
+	int max_in_flight;
+	int head;
+	int in_flight;
+	int completing;			/// A thread runs the complete callbacks
+
+	atomic_int running;		/// Cleared under the lock, read without it by the dispatcher
+	pthread_t dispatcher;
+	pthread_t * workers;
+	int nthreads;
+};
+
+/**
+ * Complete the finished frames at the head of the queue, in order. Called with the lock held,
+ * which is let go during the complete callback: one thread completes at a time, the others
+ * only mark their frames done, and the dispatcher and workers carry on meanwhile.
+ */
+static void complete_in_order(RASPICAM_ASYNC * async)
+{
+	if (async->completing)
+		return;
+	async->completing = 1;
+
+	while (async->in_flight > 0 && async->jobs[async->head].state == JOB_DONE)
+	{
+		ASYNC_JOB * job = &async->jobs[async->head];
+
+		// The job keeps its place at the head, nothing else touches it until it is released
+		job->state = JOB_COMPLETING;
+		pthread_mutex_unlock(&async->lock);
+
+		if (async->complete)
+			async->complete(async->user, job->slot->image, &job->times);
+
+		// The image stays valid until here
+		raspicam_ring_release(async->ring, job->slot);
+
+		pthread_mutex_lock(&async->lock);
+		job->state = JOB_EMPTY;
+		job->slot = NULL;
+
+		async->head = (async->head + 1) % async->max_in_flight;
+		async->in_flight--;
+		pthread_cond_signal(&async->space);
+	}
+
+	async->completing = 0;
+}
+
+static ASYNC_JOB * next_queued(RASPICAM_ASYNC * async)
+{
+	int i;
+
+	for (i = 0; i < async->in_flight; i++)
+	{
+		ASYNC_JOB * job = &async->jobs[(async->head + i) % async->max_in_flight];
+		if (job->state == JOB_QUEUED)
+			return job;
+	}
+	return NULL;
+}
+
+static void * worker_thread(void * arg)
+{
+	RASPICAM_ASYNC * async = (RASPICAM_ASYNC *)arg;
+
+	pthread_mutex_lock(&async->lock);
+	for (;;)
+	{
+		ASYNC_JOB * job = next_queued(async);
+		if (job)
+		{
+			job->state = JOB_RUNNING;
+			pthread_mutex_unlock(&async->lock);
+
+			async->process(async->user, job->slot->image, &job->times);
+
+			pthread_mutex_lock(&async->lock);
+			job->state = JOB_DONE;
+			complete_in_order(async);
+			continue;
+		}
+
+		// Frames already dispatched are still processed when stopping
+		if (!atomic_load(&async->running))
+			break;
+		pthread_cond_wait(&async->work, &async->lock);
+	}
+	pthread_mutex_unlock(&async->lock);
+	return NULL;
+}
+
+static void * dispatcher_thread(void * arg)
+{
+	RASPICAM_ASYNC * async = (RASPICAM_ASYNC *)arg;
+	RASPICAM_RING * ring = async->ring;
+
+	for (;;)
+	{
+		// Bounded in flight frames: the ring keeps the newer ones, or drops them
+		pthread_mutex_lock(&async->lock);
+		while (atomic_load(&async->running) && async->in_flight >= async->max_in_flight)
+			pthread_cond_wait(&async->space, &async->lock);
+		pthread_mutex_unlock(&async->lock);
+
+		if (!atomic_load(&async->running))
+			break;
+
+		sem_wait(&ring->ready_sem);
+		if (!atomic_load(&async->running))
+			break;
+
+		RASPICAM_RING_SLOT * slot = raspicam_ring_acquire(ring, 0);
+		if (!slot)
+			continue;
+
+		slot->pickup_us = raspicam_now_us();
+		if (async->latency)
+			raspicam_histogram_add(async->latency, slot->pickup_us - slot->callback_us);
+
+		pthread_mutex_lock(&async->lock);
+		ASYNC_JOB * job = &async->jobs[(async->head + async->in_flight) % async->max_in_flight];
+		job->slot = slot;
+		raspicam_ring_slot_times(slot, &job->times);
+		job->state = JOB_QUEUED;
+		async->in_flight++;
+		pthread_cond_signal(&async->work);
+		pthread_mutex_unlock(&async->lock);
+	}
+	return NULL;
+}
+
+RASPICAM_ASYNC * raspicam_async_start(RASPICAM_RING * ring, RASPICAM_ROLLING_HISTOGRAM * latency,
+	RASPICAM_FRAME_CALLBACK process, RASPICAM_FRAME_CALLBACK complete, void * user, int nthreads, int backpressure)
+{
+	RASPICAM_ASYNC * async;
+	int i;
+
+	if (!process || nthreads <= 0)
+		return NULL;
+
+	async = (RASPICAM_ASYNC *)calloc(1, sizeof(RASPICAM_ASYNC));
+	if (!async)
+		return NULL;
+	async->workers = (pthread_t *)calloc(nthreads, sizeof(pthread_t));
+	if (!async->workers)
+	{
+		free(async);
+		return NULL;
+	}
+
+	async->ring = ring;
+	async->latency = latency;
+	async->process = process;
+	async->complete = complete;
+	async->user = user;
+	async->backpressure = backpressure;
+	// Keep a slot free for the producer
+	async->max_in_flight = ring->depth - 1;
+	atomic_init(&async->running, 1);
+
+	pthread_mutex_init(&async->lock, NULL);
+	pthread_cond_init(&async->work, NULL);
+	pthread_cond_init(&async->space, NULL);
+
+	if (backpressure == RASPICAM_ASYNC_BLOCK)
+		raspicam_ring_set_blocking(ring, 1);
+
+	for (i = 0; i < nthreads; i++)
+	{
+		if (pthread_create(&async->workers[i], NULL, worker_thread, async) != 0)
+			break;
+		async->nthreads++;
+	}
+
+	if (async->nthreads < nthreads || pthread_create(&async->dispatcher, NULL, dispatcher_thread, async) != 0)
+	{
+		fprintf(stderr, "%s: Failed to start the threads\n", __func__);
+		pthread_mutex_lock(&async->lock);
+		atomic_store(&async->running, 0);
+		pthread_cond_broadcast(&async->work);
+		pthread_mutex_unlock(&async->lock);
+		for (i = 0; i < async->nthreads; i++)
+			pthread_join(async->workers[i], NULL);
+		raspicam_ring_set_blocking(ring, 0);
+		pthread_cond_destroy(&async->space);
+		pthread_cond_destroy(&async->work);
+		pthread_mutex_destroy(&async->lock);
+		free(async->workers);
+		free(async);
+		return NULL;
+	}
+
+	return async;
+}
+
+void raspicam_async_stop(RASPICAM_ASYNC * async)
+{
+	int i;
+
+	// Let a producer waiting for a slot go, its frames are dropped from now on
+	if (async->backpressure == RASPICAM_ASYNC_BLOCK)
+		raspicam_ring_set_blocking(async->ring, 0);
+
+	pthread_mutex_lock(&async->lock);
+	atomic_store(&async->running, 0);
+	pthread_cond_broadcast(&async->work);
+	pthread_cond_broadcast(&async->space);
+	pthread_mutex_unlock(&async->lock);
+
+	// Wake up the dispatcher if it waits for a frame
+	sem_post(&async->ring->ready_sem);
+	pthread_join(async->dispatcher, NULL);
+
+	for (i = 0; i < async->nthreads; i++)
+		pthread_join(async->workers[i], NULL);
+
+	pthread_cond_destroy(&async->space);
+	pthread_cond_destroy(&async->work);
+	pthread_mutex_destroy(&async->lock);
+	free(async->workers);
+	free(async);
+}
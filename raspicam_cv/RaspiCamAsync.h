@@ -0,0 +1,44 @@
+#ifndef __RaspiCamAsync__
+#define __RaspiCamAsync__
+
+#include "RaspiCamCV.h"
+#include "RaspiCamRing.h"
+#include "RaspiCamStats.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Asynchronous consumer of a frame ring: a dispatcher thread takes frames
+ * from the ring and hands them to a pool of workers. Each frame keeps its
+ * ring slot until its completion, which runs in frame order, so at most
+ * ring depth - 1 frames are in flight.
+ */
+
+typedef struct _RASPICAM_ASYNC RASPICAM_ASYNC;
+
+/**
+ * Start consuming a ring
+ *
+ * @param ring Ring to consume, nothing else may acquire from it until raspicam_async_stop
+ * @param latency Histogram of the pickup latency, NULL for none
+ * @param process Called on a worker for each frame, several at once
+ * @param complete Called for each processed frame, in frame order, one at a time. May be NULL
+ * @param user Passed to the callbacks
+ * @param nthreads Workers
+ * @param backpressure RASPICAM_ASYNC_*
+ *
+ * @return The consumer, NULL if something went wrong
+ */
+RASPICAM_ASYNC * raspicam_async_start(RASPICAM_RING * ring, RASPICAM_ROLLING_HISTOGRAM * latency,
+	RASPICAM_FRAME_CALLBACK process, RASPICAM_FRAME_CALLBACK complete, void * user, int nthreads, int backpressure);
+
+/// Finish the frames in flight and stop the threads
+void raspicam_async_stop(RASPICAM_ASYNC * async);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,660 @@
+/*
+
+ Copyright (c) by Emil Valkov,
+ All rights reserved.
+
+ License: http://www.opensource.org/licenses/bsd-license.php
+
+ Headless capture benchmark. Runs the capture API against a source with a
+ simulated consumer, and prints the results as one JSON object on stdout.
+ The stress mode opens, closes and restarts the capture instead, reports the
+ time per cycle and the resident memory, and fails when they are over their
+ limits. The multi-camera mode measures
+ matched frame sets.
+
+*/
+
+#include <cv.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <semaphore.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/resource.h>
+#include "RaspiCamCV.h"
+
+#define GRAB_POLL_MICROS 200
+
+// Stress mode: resident memory the cycles may add, allocator noise but not a leak
+#define STRESS_DEFAULT_RSS_GROWTH_KB 1024
+
+typedef struct
+{
+	int frames;				/// Frames consumed after the warmup
+	int warmup;				/// Frames consumed before measuring
+	int grab;				/// Use raspiCamCvGrab/raspiCamCvRetrieve instead of raspiCamCvQueryFrame
+	int consumer_us;		/// Simulated processing time per frame
+	int consumer_sleep;		/// Sleep instead of keeping the CPU busy
+	int async_threads;		/// Consume with raspiCamCvStartAsync2 on that many workers, 0 for none
+	int backpressure;		/// RASPICAM_ASYNC_* in asynchronous mode
+	long max_rss_growth_kb;	/// Stress mode: largest resident memory growth, -1 for no limit
+	int max_cycle_us;		/// Stress mode: largest p99 time per open/close and per restart, 0 for no limit
+	sem_t completed;		/// Posted for each frame completed in asynchronous mode
+} BENCH_OPTIONS;
+
+static double now_seconds(clockid_t clock)
+{
+	struct timespec t;
+	clock_gettime(clock, &t);
+	return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+/**
+ * Simulate the processing of a frame
+ *
+ * @param image Frame to touch, so the consumer reads the memory like a real one would
+ * @param options Benchmark options
+ */
+static void consume(IplImage * image, const BENCH_OPTIONS * options)
+{
+	volatile unsigned char sink = 0;
+	int y;
+
+	for (y = 0; y < image->height; y += 16)
+		sink += ((unsigned char *)image->imageData)[y * image->widthStep];
+
+	if (options->consumer_us <= 0)
+		return;
+
+	if (options->consumer_sleep)
+	{
+		usleep(options->consumer_us);
+	}
+	else
+	{
+		double end = now_seconds(CLOCK_MONOTONIC) + options->consumer_us / 1e6;
+		while (now_seconds(CLOCK_MONOTONIC) < end)
+			sink++;
+	}
+}
+
+static void async_process(void * user, IplImage * image, const RASPICAM_FRAME_TIMES * times)
+{
+	consume(image, (const BENCH_OPTIONS *)user);
+}
+
+static void async_complete(void * user, IplImage * image, const RASPICAM_FRAME_TIMES * times)
+{
+	sem_post(&((BENCH_OPTIONS *)user)->completed);
+}
+
+static IplImage * next_frame(RaspiCamCvCapture * capture, const BENCH_OPTIONS * options)
+{
+	if (!options->grab)
+		return raspiCamCvQueryFrame(capture);
+
+	while (!raspiCamCvGrab(capture))
+		usleep(GRAB_POLL_MICROS);
+	return raspiCamCvRetrieve(capture);
+}
+
+static void print_histogram(const char * name, const RASPICAM_HISTOGRAM * histogram)
+{
+	printf("  \"%s\": {\"count\": %u, \"mean\": %.1f, \"min\": %.0f, \"max\": %.0f, \"p50\": %.0f, \"p99\": %.0f},\n",
+		name, histogram->count, histogram->mean, histogram->min, histogram->max, histogram->p50, histogram->p99);
+}
+
+/**
+ * Resident memory of the process in kB, 0 if unknown
+ */
+static long resident_kb(void)
+{
+	long size = 0, resident = 0;
+	FILE * statm = fopen("/proc/self/statm", "r");
+
+	if (!statm)
+		return 0;
+	if (fscanf(statm, "%ld %ld", &size, &resident) != 2)
+		resident = 0;
+	fclose(statm);
+	return resident * (sysconf(_SC_PAGESIZE) / 1024);
+}
+
+static int compare_doubles(const void * a, const void * b)
+{
+	double x = *(const double *)a;
+	double y = *(const double *)b;
+	return x < y ? -1 : x > y;
+}
+
+/**
+ * Summarize cycle times, sorting them
+ */
+static void summarize(double * samples, int count, RASPICAM_HISTOGRAM * histogram)
+{
+	int i;
+
+	memset(histogram, 0, sizeof(RASPICAM_HISTOGRAM));
+	if (count <= 0)
+		return;
+
+	qsort(samples, count, sizeof(double), compare_doubles);
+	for (i = 0; i < count; i++)
+		histogram->mean += samples[i] / count;
+	histogram->count = count;
+	histogram->min = samples[0];
+	histogram->max = samples[count - 1];
+	histogram->p50 = samples[count / 2];
+	histogram->p99 = samples[(count * 99) / 100];
+}
+
+/**
+ * Open a capture, take a frame and close it cycles times, then restart one capture cycles times,
+ * and print the times and memory as JSON
+ *
+ * @param config Capture configuration
+ * @param options Benchmark options, the warmup is in cycles
+ * @param cycles Open/close cycles, and restarts
+ * @param encoder RASPICAM_ENCODER_*, started in each capture
+ * @param source_name For the output
+ * @param encoder_name For the output
+ *
+ * @return EXIT_SUCCESS, or EXIT_FAILURE if a capture failed or a limit of the options was exceeded
+ */
+static int stress(RASPIVID_CONFIG * config, const BENCH_OPTIONS * options, int cycles, int encoder,
+	const char * source_name, const char * encoder_name)
+{
+	double * open_close = (double *)calloc(cycles, sizeof(double));
+	double * restart = (double *)calloc(cycles, sizeof(double));
+	RASPICAM_HISTOGRAM open_close_us, restart_us;
+	RaspiCamCvCapture * capture;
+	long rss_start = 0, rss_open_close;
+	int limits_exceeded = 0;
+	int retval = EXIT_FAILURE;
+	int i;
+
+	if (!open_close || !restart)
+		goto done;
+
+	for (i = -options->warmup; i < cycles; i++)
+	{
+		// Memory after the first captures, allocator pools and libraries are set up by then
+		if (i == 0)
+			rss_start = resident_kb();
+
+		double start = now_seconds(CLOCK_MONOTONIC);
+		capture = raspiCamCvCreateCameraCapture3(0, config, NULL, options->grab);
+		if (!capture)
+		{
+			fprintf(stderr, "Failed to create capture %d\n", i);
+			goto done;
+		}
+		if (encoder != RASPICAM_ENCODER_NONE)
+			raspiCamCvStartEncoder2(capture, encoder, NULL, NULL);
+		consume(next_frame(capture, options), options);
+		raspiCamCvReleaseCapture(&capture);
+		if (i >= 0)
+			open_close[i] = (now_seconds(CLOCK_MONOTONIC) - start) * 1e6;
+	}
+	rss_open_close = resident_kb();
+
+	capture = raspiCamCvCreateCameraCapture3(0, config, NULL, options->grab);
+	if (!capture)
+	{
+		fprintf(stderr, "Failed to create the capture\n");
+		goto done;
+	}
+	if (encoder != RASPICAM_ENCODER_NONE)
+		raspiCamCvStartEncoder2(capture, encoder, NULL, NULL);
+	for (i = 0; i < cycles; i++)
+	{
+		double start = now_seconds(CLOCK_MONOTONIC);
+		if (!raspiCamCvRestart(capture))
+		{
+			fprintf(stderr, "Failed to restart the capture %d\n", i);
+			raspiCamCvReleaseCapture(&capture);
+			goto done;
+		}
+		consume(next_frame(capture, options), options);
+		restart[i] = (now_seconds(CLOCK_MONOTONIC) - start) * 1e6;
+	}
+	raspiCamCvReleaseCapture(&capture);
+	long rss_end = resident_kb();
+
+	summarize(open_close, cycles, &open_close_us);
+	summarize(restart, cycles, &restart_us);
+
+	if (options->max_rss_growth_kb >= 0 && rss_end - rss_start > options->max_rss_growth_kb)
+	{
+		fprintf(stderr, "Resident memory grew by %ld kB, over the limit of %ld kB\n", rss_end - rss_start, options->max_rss_growth_kb);
+		limits_exceeded++;
+	}
+	if (options->max_cycle_us > 0 && open_close_us.p99 > options->max_cycle_us)
+	{
+		fprintf(stderr, "Open/close p99 of %.0f us, over the limit of %d us\n", open_close_us.p99, options->max_cycle_us);
+		limits_exceeded++;
+	}
+	if (options->max_cycle_us > 0 && restart_us.p99 > options->max_cycle_us)
+	{
+		fprintf(stderr, "Restart p99 of %.0f us, over the limit of %d us\n", restart_us.p99, options->max_cycle_us);
+		limits_exceeded++;
+	}
+
+	printf("{\n");
+	printf("  \"source\": \"%s\",\n", source_name);
+	printf("  \"mode\": \"stress\",\n");
+	printf("  \"cycles\": %d,\n", cycles);
+	printf("  \"zero_copy\": %d,\n", config->zero_copy);
+	printf("  \"encoder\": \"%s\",\n", encoder_name);
+	print_histogram("open_close_us", &open_close_us);
+	print_histogram("restart_us", &restart_us);
+	printf("  \"rss_kb_start\": %ld,\n", rss_start);
+	printf("  \"rss_kb_after_open_close\": %ld,\n", rss_open_close);
+	printf("  \"rss_kb_end\": %ld,\n", rss_end);
+	printf("  \"rss_growth_kb\": %ld,\n", rss_end - rss_start);
+	printf("  \"limits_exceeded\": %d\n", limits_exceeded);
+	printf("}\n");
+	retval = limits_exceeded ? EXIT_FAILURE : EXIT_SUCCESS;
+
+done:
+	free(open_close);
+	free(restart);
+	return retval;
+}
+
+/**
+ * Consume frame sets from several cameras, and print the results as JSON
+ *
+ * @param config Capture configuration of every camera
+ * @param options Benchmark options, frames and warmup count sets
+ * @param cameras Number of cameras
+ * @param pin Deliver the frames of camera i on core i
+ * @param skew_us Frame set tolerance, 0 for the default
+ * @param source_name For the output
+ *
+ * @return EXIT_SUCCESS, or EXIT_FAILURE if the cameras failed
+ */
+static int multi_camera(RASPIVID_CONFIG * config, const BENCH_OPTIONS * options, int cameras, int pin, int skew_us,
+	const char * source_name)
+{
+	IplImage ** images = (IplImage **)calloc(cameras, sizeof(IplImage *));
+	int * cpus = (int *)calloc(cameras, sizeof(int));
+	long ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+	RASPICAM_FRAME_SET_STATS start, stats;
+	double wall_start = 0;
+	int i, c;
+
+	if (!images || !cpus)
+		return EXIT_FAILURE;
+	for (c = 0; c < cameras; c++)
+		cpus[c] = pin ? c % ncpus : -1;
+
+	RaspiCamCvMultiCapture * multi = raspiCamCvCreateMultiCapture(cameras, config, cpus, skew_us);
+	if (!multi)
+	{
+		fprintf(stderr, "Failed to open the cameras\n");
+		return EXIT_FAILURE;
+	}
+
+	for (i = 0; i < options->warmup + options->frames; i++)
+	{
+		if (i == options->warmup)
+		{
+			raspiCamCvGetFrameSetStats(multi, &start);
+			wall_start = now_seconds(CLOCK_MONOTONIC);
+		}
+		if (!raspiCamCvQueryFrameSet(multi, images, NULL))
+		{
+			fprintf(stderr, "Failed to match the cameras\n");
+			raspiCamCvReleaseMultiCapture(&multi);
+			return EXIT_FAILURE;
+		}
+		for (c = 0; c < cameras; c++)
+			consume(images[c], options);
+	}
+	double wall = now_seconds(CLOCK_MONOTONIC) - wall_start;
+	raspiCamCvGetFrameSetStats(multi, &stats);
+
+	RaspiCamCvCapture * first = raspiCamCvMultiCaptureCamera(multi, 0);
+	printf("{\n");
+	printf("  \"source\": \"%s\",\n", source_name);
+	printf("  \"mode\": \"multi\",\n");
+	printf("  \"cameras\": %d,\n", cameras);
+	printf("  \"pinned\": %d,\n", pin);
+	printf("  \"width\": %.0f,\n", raspiCamCvGetCaptureProperty(first, RPI_CAP_PROP_FRAME_WIDTH));
+	printf("  \"height\": %.0f,\n", raspiCamCvGetCaptureProperty(first, RPI_CAP_PROP_FRAME_HEIGHT));
+	printf("  \"framerate\": %.0f,\n", raspiCamCvGetCaptureProperty(first, RPI_CAP_PROP_FPS));
+	printf("  \"sets\": %u,\n", stats.sets - start.sets);
+	printf("  \"seconds\": %.3f,\n", wall);
+	printf("  \"sets_per_second\": %.2f,\n", (stats.sets - start.sets) / wall);
+	printf("  \"frames_discarded\": %u,\n", stats.discarded - start.discarded);
+	print_histogram("skew_us", &stats.skew);
+	printf("  \"consumer_us\": %d\n", options->consumer_us);
+	printf("}\n");
+
+	raspiCamCvReleaseMultiCapture(&multi);
+	free(images);
+	free(cpus);
+	return EXIT_SUCCESS;
+}
+
+static void usage(const char * name)
+{
+	fprintf(stderr, "Usage: %s [options]\n", name);
+	fprintf(stderr, "-s source: synthetic (default), file or camera\n");
+	fprintf(stderr, "-a arg: Source argument, pattern or file name\n");
+	fprintf(stderr, "-w width, -h height, -f fps: Capture size and framerate (640x480, 30)\n");
+	fprintf(stderr, "-n frames: Frames to measure (300)\n");
+	fprintf(stderr, "-W frames: Warmup frames, not measured (10)\n");
+	fprintf(stderr, "-m: Monochrome mode\n");
+	fprintf(stderr, "-g: Grab/Retrieve instead of blocking QueryFrame\n");
+	fprintf(stderr, "-z: Zero-copy mode\n");
+	fprintf(stderr, "-c us: Simulated consumer time per frame (0)\n");
+	fprintf(stderr, "-S: Consumer sleeps instead of using the CPU\n");
+	fprintf(stderr, "-r depth: Ring depth\n");
+	fprintf(stderr, "-e: Return every frame instead of the latest\n");
+	fprintf(stderr, "-F format: packed (default), i420 or nv12\n");
+	fprintf(stderr, "-C convert: none (default), bgr or i420\n");
+	fprintf(stderr, "-L layout: padded or packed\n");
+	fprintf(stderr, "-A threads: Asynchronous mode with that many workers\n");
+	fprintf(stderr, "-B: Asynchronous mode blocks the source instead of dropping frames\n");
+	fprintf(stderr, "-E encoder: h264 or mjpeg, next to the raw frames, output to /dev/null\n");
+	fprintf(stderr, "-b bitrate: Encoder bitrate\n");
+	fprintf(stderr, "-R cycles: Stress mode, open/close then restart the capture that many times\n");
+	fprintf(stderr, "-G kB: Stress mode, largest resident memory growth, exit with 1 above, -1 for none (%d)\n", STRESS_DEFAULT_RSS_GROWTH_KB);
+	fprintf(stderr, "-U us: Stress mode, largest p99 time per open/close and per restart, exit with 1 above (none)\n");
+	fprintf(stderr, "-M cameras: Frame sets from several cameras\n");
+	fprintf(stderr, "-P: Deliver the frames of each camera on its own core\n");
+	fprintf(stderr, "-k us: Frame set skew tolerance (half a frame)\n");
+	fprintf(stderr, "-T: Strobe a flash output on every other frame, on the mock GPIO\n");
+	fprintf(stderr, "-O x,y,w,h: Capture a region of interest of the frame\n");
+	fprintf(stderr, "-D threshold: Motion detection, frames without changed blocks are not handed out\n");
+	fprintf(stderr, "-X MB: Frame buffers from an arena of that size, the ring depth is cut to fit\n");
+	fprintf(stderr, "-H flags: Arena backing, lock and/or huge, e.g. lock,huge\n");
+	exit(EXIT_FAILURE);
+}
+
+int main(int argc, char *argv[ ]){
+
+	RASPIVID_CONFIG * config = (RASPIVID_CONFIG*)calloc(1, sizeof(RASPIVID_CONFIG));
+	BENCH_OPTIONS options = { 300, 10, 0, 0, 0, 0, RASPICAM_ASYNC_DROP, STRESS_DEFAULT_RSS_GROWTH_KB, 0 };
+	const char * source_name = "synthetic";
+	const char * format_name = "packed";
+	const char * convert_name = "none";
+	const char * encoder_name = "none";
+	int encoder = RASPICAM_ENCODER_NONE;
+	int stress_cycles = 0;
+	int cameras = 0, pin = 0, skew_us = 0;
+	int strobe = 0;
+	int motion_threshold = 0;
+
+	config->source = RASPICAM_SOURCE_SYNTHETIC;
+
+	int opt;
+
+	while ((opt = getopt(argc, argv, "s:a:w:h:f:n:W:mgzc:Sr:eF:C:L:A:BE:b:R:G:U:M:Pk:TO:D:X:H:")) != -1)
+	{
+		switch (opt)
+		{
+			case 's':
+				source_name = optarg;
+				if (strcmp(optarg, "synthetic") == 0)
+					config->source = RASPICAM_SOURCE_SYNTHETIC;
+				else if (strcmp(optarg, "file") == 0)
+					config->source = RASPICAM_SOURCE_FILE;
+				else if (strcmp(optarg, "camera") == 0)
+					config->source = RASPICAM_SOURCE_CAMERA;
+				else
+					usage(argv[0]);
+				break;
+			case 'a': config->source_arg = optarg; break;
+			case 'w': config->width = atoi(optarg); break;
+			case 'h': config->height = atoi(optarg); break;
+			case 'f': config->framerate = atoi(optarg); break;
+			case 'n': options.frames = atoi(optarg); break;
+			case 'W': options.warmup = atoi(optarg); break;
+			case 'm': config->monochrome = 1; break;
+			case 'g': options.grab = 1; break;
+			case 'z': config->zero_copy = 1; break;
+			case 'c': options.consumer_us = atoi(optarg); break;
+			case 'S': options.consumer_sleep = 1; break;
+			case 'r': config->ring_depth = atoi(optarg); break;
+			case 'e': config->frame_policy = RASPICAM_FRAME_EVERY; break;
+			case 'F':
+				format_name = optarg;
+				if (strcmp(optarg, "i420") == 0)
+					config->format = RASPICAM_FORMAT_I420;
+				else if (strcmp(optarg, "nv12") == 0)
+					config->format = RASPICAM_FORMAT_NV12;
+				else if (strcmp(optarg, "packed") != 0)
+					usage(argv[0]);
+				break;
+			case 'C':
+				convert_name = optarg;
+				if (strcmp(optarg, "bgr") == 0)
+					config->convert = RASPICAM_CONVERT_BGR;
+				else if (strcmp(optarg, "i420") == 0)
+					config->convert = RASPICAM_CONVERT_I420_BGR;
+				else if (strcmp(optarg, "none") != 0)
+					usage(argv[0]);
+				break;
+			case 'L':
+				if (strcmp(optarg, "padded") == 0)
+					config->layout = RASPICAM_LAYOUT_PADDED;
+				else if (strcmp(optarg, "packed") == 0)
+					config->layout = RASPICAM_LAYOUT_PACKED;
+				else
+					usage(argv[0]);
+				break;
+			case 'A': options.async_threads = atoi(optarg); break;
+			case 'B': options.backpressure = RASPICAM_ASYNC_BLOCK; break;
+			case 'E':
+				encoder_name = optarg;
+				if (strcmp(optarg, "h264") == 0)
+					encoder = RASPICAM_ENCODER_H264;
+				else if (strcmp(optarg, "mjpeg") == 0)
+					encoder = RASPICAM_ENCODER_MJPEG;
+				else
+					usage(argv[0]);
+				break;
+			case 'b': config->bitrate = atoi(optarg); break;
+			case 'R': stress_cycles = atoi(optarg); break;
+			case 'G': options.max_rss_growth_kb = atol(optarg); break;
+			case 'U': options.max_cycle_us = atoi(optarg); break;
+			case 'M': cameras = atoi(optarg); break;
+			case 'P': pin = 1; break;
+			case 'k': skew_us = atoi(optarg); break;
+			case 'T': strobe = 1; break;
+			case 'D': motion_threshold = atoi(optarg); break;
+			case 'O':
+				if (sscanf(optarg, "%d,%d,%d,%d", &config->roi_x, &config->roi_y, &config->roi_width, &config->roi_height) != 4)
+				{
+					fprintf(stderr, "Invalid region of interest %s\n", optarg);
+					usage(argv[0]);
+				}
+				break;
+			case 'X': config->max_memory = (long long)(atof(optarg) * 1024 * 1024); break;
+			case 'H':
+				if (strstr(optarg, "lock"))
+					config->memory_flags |= RASPICAM_MEMORY_LOCK;
+				if (strstr(optarg, "huge"))
+					config->memory_flags |= RASPICAM_MEMORY_HUGE_PAGES;
+				break;
+			default:
+				usage(argv[0]);
+		}
+	}
+
+	if (stress_cycles > 0)
+	{
+		int retval = stress(config, &options, stress_cycles, encoder, source_name, encoder_name);
+		free(config);
+		return retval;
+	}
+	if (cameras > 0)
+	{
+		int retval = multi_camera(config, &options, cameras, pin, skew_us, source_name);
+		free(config);
+		return retval;
+	}
+
+	RaspiCamCvCapture * capture = raspiCamCvCreateCameraCapture3(0, config, NULL, options.grab);
+	if (!capture)
+	{
+		fprintf(stderr, "Failed to create the capture\n");
+		return EXIT_FAILURE;
+	}
+
+	if (strobe)
+	{
+		static unsigned char pattern [2] = { 1, 0 };
+
+		raspiCamCvUseMockGpio();
+		raspiCamCvFlashEnable2(capture, 0);
+		raspiCamCvSetFlashPattern2(capture, pattern, 2);
+	}
+
+	if (motion_threshold > 0)
+	{
+		RASPICAM_MOTION_CONFIG motion = { 0 };
+
+		motion.threshold = motion_threshold;
+		if (!raspiCamCvSetMotionDetect(capture, &motion))
+		{
+			fprintf(stderr, "Failed to start motion detection\n");
+			return EXIT_FAILURE;
+		}
+	}
+
+	int encoded_fd = -1;
+	if (encoder != RASPICAM_ENCODER_NONE)
+	{
+		encoded_fd = open("/dev/null", O_WRONLY);
+		if (!raspiCamCvStartEncoder(capture, encoder, encoded_fd))
+		{
+			fprintf(stderr, "Failed to start the encoder\n");
+			return EXIT_FAILURE;
+		}
+	}
+
+	if (options.async_threads > 0)
+	{
+		sem_init(&options.completed, 0, 0);
+		if (!raspiCamCvStartAsync2(capture, async_process, async_complete, &options, options.async_threads, options.backpressure))
+		{
+			fprintf(stderr, "Failed to start the asynchronous mode\n");
+			return EXIT_FAILURE;
+		}
+	}
+
+	int i;
+	for (i = 0; i < options.warmup; i++)
+	{
+		if (options.async_threads > 0)
+			sem_wait(&options.completed);
+		else
+			consume(next_frame(capture, &options), &options);
+	}
+
+	// Measure from here
+	RASPICAM_CAPTURE_STATS start, stats;
+	raspiCamCvResetCaptureStats(capture);
+	raspiCamCvGetCaptureStats(capture, &start);
+	double encoded_start = raspiCamCvGetCaptureProperty(capture, RPI_CAP_PROP_BYTES_ENCODED);
+	double still_start = raspiCamCvGetCaptureProperty(capture, RPI_CAP_PROP_STILL_FRAMES);
+	double wall_start = now_seconds(CLOCK_MONOTONIC);
+	double cpu_start = now_seconds(CLOCK_PROCESS_CPUTIME_ID);
+
+	for (i = 0; i < options.frames; i++)
+	{
+		if (options.async_threads > 0)
+			sem_wait(&options.completed);
+		else
+			consume(next_frame(capture, &options), &options);
+	}
+
+	double wall = now_seconds(CLOCK_MONOTONIC) - wall_start;
+	double cpu = now_seconds(CLOCK_PROCESS_CPUTIME_ID) - cpu_start;
+	raspiCamCvGetCaptureStats(capture, &stats);
+	double encoded = raspiCamCvGetCaptureProperty(capture, RPI_CAP_PROP_BYTES_ENCODED) - encoded_start;
+
+	unsigned int delivered = stats.frames_delivered - start.frames_delivered;
+	unsigned int dropped = stats.frames_dropped - start.frames_dropped;
+
+	printf("{\n");
+	printf("  \"source\": \"%s\",\n", source_name);
+	printf("  \"width\": %.0f,\n", raspiCamCvGetCaptureProperty(capture, RPI_CAP_PROP_FRAME_WIDTH));
+	printf("  \"height\": %.0f,\n", raspiCamCvGetCaptureProperty(capture, RPI_CAP_PROP_FRAME_HEIGHT));
+	printf("  \"framerate\": %.0f,\n", raspiCamCvGetCaptureProperty(capture, RPI_CAP_PROP_FPS));
+	if (config->roi_width > 0)
+		printf("  \"roi\": [%.0f, %.0f],\n", raspiCamCvGetCaptureProperty(capture, RPI_CAP_PROP_ROI_X),
+			raspiCamCvGetCaptureProperty(capture, RPI_CAP_PROP_ROI_Y));
+	if (options.async_threads > 0)
+	{
+		printf("  \"mode\": \"async\",\n");
+		printf("  \"threads\": %d,\n", options.async_threads);
+		printf("  \"backpressure\": \"%s\",\n", options.backpressure == RASPICAM_ASYNC_BLOCK ? "block" : "drop");
+	}
+	else
+	{
+		printf("  \"mode\": \"%s\",\n", options.grab ? "grab" : "blocking");
+	}
+	printf("  \"monochrome\": %d,\n", config->monochrome);
+	printf("  \"zero_copy\": %d,\n", config->zero_copy);
+	printf("  \"format\": \"%s\",\n", format_name);
+	printf("  \"convert\": \"%s\",\n", convert_name);
+	printf("  \"frame_policy\": \"%s\",\n", config->frame_policy == RASPICAM_FRAME_EVERY ? "every" : "latest");
+	printf("  \"encoder\": \"%s\",\n", encoder_name);
+	printf("  \"consumer_us\": %d,\n", options.consumer_us);
+	printf("  \"frames\": %d,\n", options.frames);
+	printf("  \"seconds\": %.3f,\n", wall);
+	printf("  \"fps\": %.2f,\n", options.frames / wall);
+	printf("  \"frames_delivered\": %u,\n", delivered);
+	printf("  \"frames_dropped\": %u,\n", dropped);
+	print_histogram("latency_us", &stats.latency);
+	print_histogram("copy_time_us", &stats.copy_time);
+	print_histogram("jitter_us", &stats.jitter);
+	if (strobe)
+	{
+		RASPICAM_STROBE_STATS strobe_stats;
+		raspiCamCvGetStrobeStats(capture, &strobe_stats);
+		printf("  \"strobe_switches\": %u,\n", strobe_stats.switches);
+		printf("  \"strobe_missed\": %u,\n", strobe_stats.missed);
+		print_histogram("strobe_offset_us", &strobe_stats.offset);
+	}
+	if (motion_threshold > 0)
+		printf("  \"still_frames\": %.0f,\n", raspiCamCvGetCaptureProperty(capture, RPI_CAP_PROP_STILL_FRAMES) - still_start);
+	RASPICAM_MEMORY_STATS memory;
+	raspiCamCvGetMemoryStats(capture, &memory);
+	printf("  \"ring_depth\": %d,\n", memory.ring_depth);
+	printf("  \"memory_arena\": %lld,\n", memory.arena_size);
+	printf("  \"memory_in_use\": %lld,\n", memory.in_use);
+	printf("  \"memory_peak\": %lld,\n", memory.peak);
+	printf("  \"memory_source\": %lld,\n", memory.source_bytes);
+	if (config->memory_flags)
+	{
+		printf("  \"memory_locked\": %d,\n", memory.locked);
+		printf("  \"memory_huge_pages\": %d,\n", memory.huge_pages);
+	}
+	printf("  \"cpu_seconds\": %.3f,\n", cpu);
+	printf("  \"cpu_percent\": %.1f,\n", 100.0 * cpu / wall);
+	printf("  \"encoded_bitrate\": %.0f,\n", encoded * 8 / wall);
+	printf("  \"bytes_copied_per_frame\": %.0f\n", delivered ? (double)(stats.bytes_copied - start.bytes_copied) / delivered : 0.0);
+	printf("}\n");
+
+	if (options.async_threads > 0)
+	{
+		raspiCamCvStopAsync(capture);
+		sem_destroy(&options.completed);
+	}
+	if (encoder != RASPICAM_ENCODER_NONE)
+	{
+		raspiCamCvStopEncoder(capture);
+		close(encoded_fd);
+	}
+	raspiCamCvReleaseCapture(&capture);
+	free(config);
+	return 0;
+}
@@ -30,87 +30,134 @@
 /////////////////////////////////////////////////////////////
 
 #include "RaspiCamCV.h"
+#include "RaspiCamSource.h"
+#include "RaspiCamRing.h"
+#include "RaspiCamStats.h"
+#include "RaspiCamConvert.h"
+#include "RaspiCamAsync.h"
+#include "RaspiCamClip.h"
+#include "RaspiCamMulti.h"
+#include "RaspiCamMotion.h"
+#include "RaspiCamArena.h"
 #include "flash.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <memory.h>
+#include <unistd.h>
+#include <errno.h>
 
 //new
 #include <cv.h>
 #include <highgui.h>
 #include "time.h"
 
-#include "bcm_host.h"
-#include "interface/vcos/vcos.h"
-
-#include "interface/mmal/mmal.h"
-#include "interface/mmal/mmal_logging.h"
-#include "interface/mmal/mmal_buffer.h"
-#include "interface/mmal/util/mmal_util.h"
-#include "interface/mmal/util/mmal_util_params.h"
-#include "interface/mmal/util/mmal_default_components.h"
-#include "interface/mmal/util/mmal_connection.h"
-
-#include "RaspiCamControl.h"
-
-#include <semaphore.h>
-
-/// Camera number to use - we only have one camera, indexed from 0.
-#define CAMERA_NUMBER 0
-
-// Standard port setting for the camera component
-#define MMAL_CAMERA_PREVIEW_PORT 0
-#define MMAL_CAMERA_VIDEO_PORT 1
-#define MMAL_CAMERA_CAPTURE_PORT 2
-
 // Video format information
 #define VIDEO_FRAME_RATE_NUM 30
-#define VIDEO_FRAME_RATE_DEN 1
 
-/// Video render needs at least 2 buffers.
-#define VIDEO_OUTPUT_BUFFERS_NUM 3
+#define RING_DEFAULT_DEPTH 3
+
+// Pre-trigger ring size relative to the bitrate, and index entries per frame
+#define CLIP_BITRATE_MARGIN 1.5
+#define CLIP_CHUNKS_PER_FRAME 4
+
+#define ALIGN_UP(x, n) (((x) + (n) - 1) & ~((n) - 1))
 
-// Max bitrate we allow for recording
-const int MAX_BITRATE = 30000000; // 30Mbits/s
+// Buffers a source keeps in rotation besides the ones the capture holds, for the max_memory estimate
+#define SOURCE_BUFFERS_NUM 3
 
-int mmal_status_to_int(MMAL_STATUS_T status);
+// Longest wait of a blocking capture for the first frame, after the source (re)started
+#define FIRST_FRAME_TIMEOUT_MS 2000
 
 /** Structure containing all state information for the current run
  */
 typedef struct _RASPIVID_STATE
 {
-	int finished;
+	atomic_int finished;		/// Set by raspiCamCvReleaseCapture, read by the source thread
 	int width;            	/// Requested width of image
 	int height;           	/// requested height of image
+	int frame_width;		/// Frame the images are cut from, width x height without a region of interest
+	int frame_height;
+	CvRect roi;				/// Region of interest in the frame, 0 width for none
 	int bitrate;          	/// Requested bitrate
 	int framerate;        	/// Requested frame rate (fps)
 	int monochrome;			/// Capture in gray only (2x faster)
-	int immutableInput;     /// Flag to specify whether encoder works in place or creates a new buffer. Result is preview can display either
-                            /// the camera output or the encoder output (with compression artifacts)
-	RASPICAM_CAMERA_PARAMETERS camera_parameters; /// Camera setup parameters
+	int format;				/// RASPICAM_FORMAT_*
+	int convert;			/// RASPICAM_CONVERT_*
+	int zero_copy;			/// Images wrap the source buffers instead of holding a copy
+	int padded;				/// Images keep the 32 pixel aligned row stride of the camera buffers
+	int non_blocking;		/// Don't wait for frames when (re)starting
+	int source_type;		/// RASPICAM_SOURCE_*
+	int camera_num;			/// Camera index, several cameras on a Compute Module
+	atomic_int cpu;			/// Core the frames are delivered on, -1 for any
+	pthread_t pinned_thread;	/// Source thread last pinned, source thread only
+	int pinned_cpu;			/// Core it is pinned to, -1 for none, source thread only
+
+	RASPICAM_FLASH flash;	/// Flash outputs stepped at each frame of this camera
+
+	RASPIVID_PROPERTIES properties;	/// Camera properties passed at creation
+	int has_properties;
+
+	RASPICAM_SOURCE source;	/// Where frames come from
+	atomic_int failed;		/// The source didn't start again or ended, no more frames come
+	int source_closed;		/// Closed by a reopen that failed, not stopped nor closed again
+
+	int ring_depth;			/// Frames buffered between the source and the consumer
+	int frame_policy;		/// RASPICAM_FRAME_*
+	RASPICAM_RING ring;
+	RASPICAM_RING_SLOT * current;	/// Frame handed out to the consumer
+
+	int second_width;		/// Second, downscaled stream, 0 for none
+	int second_height;
+	RASPICAM_RING second_ring;
+	RASPICAM_RING_SLOT * second_current;	/// Matched with current by raspiCamCvRetrievePair
+
+	RASPICAM_ASYNC * async;	/// Asynchronous mode, NULL otherwise
+
+	int encoder;			/// RASPICAM_ENCODER_* running on the source
+	int encoded_fd;			/// Where the encoder output goes, when there is no callback
+	RASPICAM_ENCODED_CALLBACK encoded_callback;
+	void * encoded_user;
+	atomic_ullong bytes_encoded;
+	atomic_int held_frames;			/// Frames taken with raspiCamCvHoldFrame
+	RASPICAM_CLIP_RING clip;		/// Pre-trigger ring of the encoder output
+
+	int motion_enabled;		/// Only frames with changed blocks reach the ring
+	RASPICAM_MOTION_CONFIG motion_config;
+	RASPICAM_MOTION motion;
+	unsigned char * motion_map;		/// Map of the frame being delivered, source thread only
+	atomic_uint still_frames;		/// Frames without enough changed blocks
+
+	pthread_mutex_t settings_lock;
+	RASPICAM_FRAME_METADATA settings;	/// Last sensor settings reported by the source
+
+	RASPICAM_ARENA arena;			/// Frame buffers
+	long long max_memory;			/// Size of the arena, 0 for malloc
+	int memory_flags;				/// RASPICAM_MEMORY_*
+
+	atomic_uint frames_delivered;
+	atomic_ullong bytes_copied;		/// Frame data copied into the ring
+	int64_t last_callback_us;		/// Callback entry of the previous frame, source thread only
+	RASPICAM_ROLLING_HISTOGRAM latency;
+	RASPICAM_ROLLING_HISTOGRAM copy_time;
+	RASPICAM_ROLLING_HISTOGRAM jitter;
+
+	int64_t reconfigure_us;			/// Duration of the last live reconfiguration
+	int64_t restart_us;				/// Duration of the last raspiCamCvRestart
 
-	MMAL_COMPONENT_T *camera_component;    /// Pointer to the camera component
-	MMAL_COMPONENT_T *encoder_component;   /// Pointer to the encoder component
-
-	MMAL_POOL_T *video_pool; /// Pointer to the pool of buffers used by encoder output port
-
-	IplImage * dstImages [2];
-	int dstImageIndex ;
+} RASPIVID_STATE;
 
-	VCOS_SEMAPHORE_T capture_sem;
-	VCOS_SEMAPHORE_T capture_done_sem;
+// Flash outputs of raspiCamCvFlashEnable, from before captures had their own
+static RASPICAM_FLASH default_flash;
+static pthread_once_t default_flash_once = PTHREAD_ONCE_INIT;
 
-} RASPIVID_STATE;
+static void open_default_flash(void)
+{
+	flash_open(&default_flash);
+}
 
 static void default_status(RASPIVID_STATE *state)
 {
-   if (!state)
-   {
-      vcos_assert(0);
-      return;
-   }
-
    // Default everything to zero
    memset(state, 0, sizeof(RASPIVID_STATE));
 
@@ -120,299 +167,407 @@ static void default_status(RASPIVID_STATE *state)
    state->height 			= 480;		// use a multiple of 240 (480, 960)
    state->bitrate 			= 17000000; // This is a decent default bitrate for 1080p
    state->framerate 		= VIDEO_FRAME_RATE_NUM;
-   state->immutableInput 	= 1;
    state->monochrome 		= 0;		// Gray (1) much faster than color (0)
+   state->source_type		= RASPICAM_SOURCE_CAMERA;
+   state->ring_depth		= RING_DEFAULT_DEPTH;
+   state->frame_policy		= RASPICAM_FRAME_LATEST;
+   state->cpu				= -1;
+   state->pinned_cpu		= -1;
+
+   // Same as raspicamcontrol_set_defaults, reported until changed
+   state->properties.brightness	= 50;
+   state->properties.awb		= 1;
+   state->properties.exposure	= AUTO;
+}
 
-   // Set up the camera_parameters to default
-   raspicamcontrol_set_defaults(&state->camera_parameters);
+static const RASPICAM_SOURCE_OPS * get_source_ops(int source_type)
+{
+	switch (source_type)
+	{
+		case RASPICAM_SOURCE_CAMERA:
+#ifndef RASPICAM_NO_MMAL
+			return &raspicam_mmal_source_ops;
+#else
+			fprintf(stderr, "Camera source not available, library built without MMAL\n");
+			return NULL;
+#endif
+		case RASPICAM_SOURCE_SYNTHETIC:
+			return &raspicam_synthetic_source_ops;
+		case RASPICAM_SOURCE_FILE:
+			return &raspicam_file_source_ops;
+	}
+	return NULL;
 }
 
 /**
- *  buffer header callback function for video
+ * Layout of the source buffers for an image format
+ *
+ * @param format RASPICAM_FORMAT_*
+ * @param monochrome Gray only
+ * @param convert RASPICAM_CONVERT_*
  *
- * @param port Pointer to port from which callback originated
- * @param buffer mmal buffer header pointer
+ * @return RASPICAM_ENCODING_*
  */
-static void video_buffer_callback(MMAL_PORT_T *port, MMAL_BUFFER_HEADER_T *buffer)
+static int source_encoding(int format, int monochrome, int convert)
 {
-	MMAL_BUFFER_HEADER_T *new_buffer;
-	RASPIVID_STATE * state = (RASPIVID_STATE *)port->userdata;
-
-	if (state)
-	{
-		if (state->finished) {
-			vcos_semaphore_post(&state->capture_done_sem);
-			return;
-		}
-		if (buffer->length)
-		{
-			mmal_buffer_header_mem_lock(buffer);
- 			flash_update();
-
-			int w=state->width;	// get image size
-			int h=state->height;
+	if (format == RASPICAM_FORMAT_NV12)
+		return RASPICAM_ENCODING_NV12;
+	if (format == RASPICAM_FORMAT_I420 || monochrome || convert == RASPICAM_CONVERT_I420_BGR)
+		return RASPICAM_ENCODING_I420;
+	return RASPICAM_ENCODING_RGB24;
+}
 
-			int copy_size = (state->dstImages[state->dstImageIndex]->height) * (state->dstImages[state->dstImageIndex]->widthStep);
+/**
+ * Point the plane images of a slot into a buffer in the source layout
+ *
+ * @param source Source of the frames
+ * @param slot Slot of a YUV format capture
+ * @param data Start of the buffer
+ */
+static void set_planes(RASPICAM_SOURCE * source, RASPICAM_RING_SLOT * slot, unsigned char * data)
+{
+	unsigned char * chroma = data + source->stride * source->buffer_height;
 
-			state->dstImageIndex = state->dstImageIndex ? 0 : 1 ;
-			memcpy(state->dstImages[state->dstImageIndex]->imageData,buffer->data, copy_size); //buffer is larger than actual image
+	cvSetData(slot->planes[0], data, source->stride);
+	if (source->encoding == RASPICAM_ENCODING_NV12)
+	{
+		cvSetData(slot->planes[1], chroma, source->stride);
+	}
+	else
+	{
+		cvSetData(slot->planes[1], chroma, source->stride / 2);
+		cvSetData(slot->planes[2], chroma + (source->stride / 2) * (source->buffer_height / 2), source->stride / 2);
+	}
+}
 
-			vcos_semaphore_post(&state->capture_done_sem);
-			vcos_semaphore_wait(&state->capture_sem);
+/**
+ * Copy a frame to a RASPICAM_FORMAT_PACKED image, converting it on the way
+ *
+ * @param state Pointer to state control struct
+ * @param data Frame in the source encoding
+ * @param stride Bytes per row of data
+ * @param buffer_height Rows of each plane of data
+ * @param image Destination, any widthStep
+ *
+ * @return Bytes written to the image, with the row padding when a padded image is copied in one go
+ */
+static size_t copy_frame(RASPIVID_STATE * state, const unsigned char * data, int stride, int buffer_height, IplImage * image)
+{
+	uint8_t * dst = (uint8_t *)image->imageData;
+	size_t row_bytes = (size_t)image->width * image->nChannels;
 
-			mmal_buffer_header_mem_unlock(buffer);
+	if (state->source.encoding == RASPICAM_ENCODING_RGB24)
+	{
+		if (state->convert == RASPICAM_CONVERT_BGR)
+		{
+			raspicam_rgb_to_bgr(data, stride, dst, image->widthStep, image->width, image->height);
 		}
 		else
 		{
-			vcos_log_error("buffer null");
+			raspicam_copy_plane(data, stride, dst, image->widthStep, image->width * 3, image->height);
+			// Same stride: one memcpy, padding included
+			if (stride == image->widthStep && image->height > 0)
+				return (size_t)stride * (image->height - 1) + row_bytes;
 		}
 	}
+	else if (image->nChannels == 3)
+	{
+		const unsigned char * u = data + stride * buffer_height;
+		const unsigned char * v = u + (stride / 2) * (buffer_height / 2);
+		raspicam_i420_to_bgr(data, stride, u, v, stride / 2, dst, image->widthStep, image->width, image->height);
+	}
 	else
 	{
-		vcos_log_error("Received a encoder buffer callback with no state");
+		raspicam_i420_to_gray(data, stride, dst, image->widthStep, image->width, image->height);
 	}
+	return row_bytes * image->height;
+}
 
-	// release buffer back to the pool
-	mmal_buffer_header_release(buffer);
+/**
+ * Ring callback: zero-copy frames give their buffer back to the source
+ *
+ * @param userdata Pointer to state control struct
+ * @param slot Slot being discarded
+ */
+static void drop_slot(void * userdata, RASPICAM_RING_SLOT * slot)
+{
+	RASPIVID_STATE * state = (RASPIVID_STATE *)userdata;
 
-	// and send one back to the port (if still open)
-	if (port->is_enabled)
+	if (slot->handle)
 	{
-		MMAL_STATUS_T status;
+		state->source.ops->release_buffer(&state->source, slot->handle);
+		slot->handle = NULL;
+	}
+}
 
-		new_buffer = mmal_queue_get(state->video_pool->queue);
+int raspicam_source_deliver(RASPICAM_SOURCE * source, unsigned char * data, int64_t pts, void * handle)
+{
+	RASPIVID_STATE * state = source->state;
+	int64_t callback_us = raspicam_now_us();
+	int kept = 0;
 
-		if (new_buffer)
-			status = mmal_port_send_buffer(port, new_buffer);
+	if (state->finished)
+		return 0;
 
-		if (!new_buffer || status != MMAL_SUCCESS)
-			vcos_log_error("Unable to return a buffer to the encoder port");
+	// Every frame gets its number, dropped ones and still ones too
+	unsigned int sequence = atomic_fetch_add(&state->frames_delivered, 1);
+	if (state->last_callback_us)
+	{
+		int64_t deviation = callback_us - state->last_callback_us - 1000000 / state->framerate;
+		raspicam_histogram_add(&state->jitter, deviation < 0 ? -deviation : deviation);
 	}
-}
-
+	state->last_callback_us = callback_us;
 
-/**
- * Create the camera component, set up its ports
- *
- * @param state Pointer to state control struct
- *
- * @return 0 if failed, pointer to component if successful
- *
- */
-static MMAL_COMPONENT_T *create_camera_component(RASPIVID_STATE *state)
-{
-	MMAL_COMPONENT_T *camera = 0;
-	MMAL_ES_FORMAT_T *format;
-	MMAL_PORT_T *preview_port = NULL, *video_port = NULL, *still_port = NULL;
-	MMAL_STATUS_T status;
+	// A restarted source may deliver from a new thread, and -1 lets the pinned one run anywhere again
+	int cpu = state->cpu;
+	int pinned = pthread_equal(state->pinned_thread, pthread_self()) ? state->pinned_cpu : -1;
+	if (cpu != pinned && (cpu >= 0 || pinned >= 0))
+	{
+		state->pinned_thread = pthread_self();
+		state->pinned_cpu = cpu;
+		if (raspicam_pin_thread(cpu) != 0)
+			fprintf(stderr, "%s: Can't pin camera %d to core %d\n", __func__, state->camera_num, cpu);
+	}
 
-	/* Create the component */
-	status = mmal_component_create(MMAL_COMPONENT_DEFAULT_CAMERA, &camera);
+	// The flash of raspiCamCvFlashEnable follows camera 0
+	if (state->camera_num == 0)
+		flash_frame(&default_flash, callback_us, pts, 1000000 / state->framerate);
+	flash_frame(&state->flash, callback_us, pts, 1000000 / state->framerate);
 
-	if (status != MMAL_SUCCESS)
+	// Still frames never reach the ring, the consumer sleeps through them
+	int changed = -1;
+	if (state->motion_enabled)
 	{
-	   vcos_log_error("Failed to create camera component");
-	   goto error;
+		if (state->motion_config.use_vectors && state->encoder == RASPICAM_ENCODER_H264)
+			changed = raspicam_motion_detect_vectors(&state->motion, pts, 3 * 1000000 / state->framerate, state->motion_map);
+		if (changed < 0)
+			changed = raspicam_motion_detect(&state->motion, data, source->stride, state->motion_map);
+		if (changed < state->motion.config.min_blocks)
+		{
+			atomic_fetch_add(&state->still_frames, 1);
+			return 0;
+		}
 	}
 
-	if (!camera->output_num)
+	// Never wait for the consumer, the ring drops a frame instead
+	RASPICAM_RING_SLOT * slot = raspicam_ring_begin_write(&state->ring);
+	if (!slot)
+		return 0;
+
+	// The next frames are compared with this one
+	slot->changed_blocks = changed;
+	if (state->motion_enabled)
 	{
-	   vcos_log_error("Camera doesn't have output ports");
-	   goto error;
+		memcpy(slot->motion, state->motion_map, state->motion.blocks_x * state->motion.blocks_y);
+		raspicam_motion_set_reference(&state->motion, data, source->stride);
 	}
 
-	video_port = camera->output[MMAL_CAMERA_VIDEO_PORT];
-	still_port = camera->output[MMAL_CAMERA_CAPTURE_PORT];
+	IplImage * image = slot->image;
+	slot->sequence = sequence;
+	slot->pts = pts;
+	slot->callback_us = callback_us;
 
-	//  set up the camera configuration
+	pthread_mutex_lock(&state->settings_lock);
+	slot->metadata = state->settings;
+	pthread_mutex_unlock(&state->settings_lock);
+
+	if (state->format != RASPICAM_FORMAT_PACKED)
 	{
-	   MMAL_PARAMETER_CAMERA_CONFIG_T cam_config =
-	   {
-	      { MMAL_PARAMETER_CAMERA_CONFIG, sizeof(cam_config) },
-	      .max_stills_w = state->width,
-	      .max_stills_h = state->height,
-	      .stills_yuv422 = 0,
-	      .one_shot_stills = 0,
-	      .max_preview_video_w = state->width,
-	      .max_preview_video_h = state->height,
-	      .num_preview_video_frames = 3,
-	      .stills_capture_circular_buffer_height = 0,
-	      .fast_preview_resume = 0,
-	      .use_stc_timestamp = MMAL_PARAM_TIMESTAMP_MODE_RESET_STC
-	   };
-	   mmal_port_parameter_set(camera->control, &cam_config.hdr);
+		// All planes are views of one buffer, the source's or our copy of it
+		if (state->zero_copy)
+		{
+			set_planes(source, slot, data);
+			slot->handle = handle;
+			kept = 1;
+		}
+		else
+		{
+			int copy_size = source->stride * source->buffer_height * 3 / 2;
+			memcpy(slot->data, data, copy_size);
+			atomic_fetch_add(&state->bytes_copied, copy_size);
+		}
 	}
-	// Set the encode format on the video  port
-	
-	format = video_port->format;
-	if (state->monochrome)
+	else if (state->zero_copy)
 	{
-		format->encoding_variant = MMAL_ENCODING_I420;
-		format->encoding = MMAL_ENCODING_I420;
+		cvSetData(image, data, source->stride);
+		image->height = state->height;
+		slot->handle = handle;
+		kept = 1;
 	}
 	else
 	{
-		format->encoding = MMAL_ENCODING_RGB24;
-		format->encoding_variant = MMAL_ENCODING_RGB24;
+		// Rows are repacked when the image stride isn't the camera's
+		atomic_fetch_add(&state->bytes_copied, copy_frame(state, data, source->stride, source->buffer_height, image));
 	}
 
-	format->es->video.width = VCOS_ALIGN_UP(state->width, 32);
-	format->es->video.height = VCOS_ALIGN_UP(state->height, 16);
-	format->es->video.crop.x = 0;
-	format->es->video.crop.y = 0;
-	format->es->video.crop.width = state->width;
-	format->es->video.crop.height = state->height;
-	format->es->video.frame_rate.num = state->framerate;
-	format->es->video.frame_rate.den = VIDEO_FRAME_RATE_DEN;
+	slot->copied_us = raspicam_now_us();
+	raspicam_histogram_add(&state->copy_time, slot->copied_us - callback_us);
 
-	status = mmal_port_format_commit(video_port);
-	if (status)
-	{
-	   vcos_log_error("camera video format couldn't be set");
-	   goto error;
-	}
+	raspicam_ring_end_write(&state->ring, slot);
+	return kept;
+}
 
-	// PR : plug the callback to the video port
-	status = mmal_port_enable(video_port, video_buffer_callback);
-	if (status)
-	{
-	   vcos_log_error("camera video callback2 error");
-	   goto error;
-	}
+void raspicam_source_deliver_end(RASPICAM_SOURCE * source)
+{
+	RASPIVID_STATE * state = source->state;
 
-   // Ensure there are enough buffers to avoid dropping frames
-   if (video_port->buffer_num < VIDEO_OUTPUT_BUFFERS_NUM)
-      video_port->buffer_num = VIDEO_OUTPUT_BUFFERS_NUM;
+	fprintf(stderr, "%s: The %s source stopped delivering frames\n", __func__, source->ops->name);
+	state->failed = 1;
+	raspicam_ring_close(&state->ring);
+}
 
+void raspicam_source_deliver_encoded(RASPICAM_SOURCE * source, const unsigned char * data, int length, int64_t pts, int flags)
+{
+	RASPIVID_STATE * state = source->state;
 
-   // Set the encode format on the still  port
-   format = still_port->format;
-   format->encoding = MMAL_ENCODING_OPAQUE;
-   format->encoding_variant = MMAL_ENCODING_I420;
-   format->es->video.width = VCOS_ALIGN_UP(state->width, 32);
-   format->es->video.height = VCOS_ALIGN_UP(state->height, 16);
-   format->es->video.crop.x = 0;
-   format->es->video.crop.y = 0;
-   format->es->video.crop.width = state->width;
-   format->es->video.crop.height = state->height;
-   format->es->video.frame_rate.num = 1;
-   format->es->video.frame_rate.den = 1;
+	if (state->finished)
+		return;
 
-   status = mmal_port_format_commit(still_port);
-   if (status)
-   {
-      vcos_log_error("camera still format couldn't be set");
-      goto error;
-   }
+	atomic_fetch_add(&state->bytes_encoded, length);
+	raspicam_clip_write(&state->clip, data, length, pts, flags);
 
+	if (state->encoded_callback)
+	{
+		state->encoded_callback(state->encoded_user, data, length, pts, flags);
+		return;
+	}
 
-	//PR : create pool of message on video port
-	MMAL_POOL_T *pool;
-	video_port->buffer_size = video_port->buffer_size_recommended;
-	video_port->buffer_num = video_port->buffer_num_recommended;
-	pool = mmal_port_pool_create(video_port, video_port->buffer_num, video_port->buffer_size);
-	if (!pool)
+	while (state->encoded_fd >= 0 && length > 0)
 	{
-	   vcos_log_error("Failed to create buffer header pool for video output port");
+		ssize_t written = write(state->encoded_fd, data, length);
+		if (written < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			fprintf(stderr, "%s: Failed to write the encoded data: %s\n", __func__, strerror(errno));
+			return;
+		}
+		data += written;
+		length -= written;
 	}
-	state->video_pool = pool;
+}
 
-	/* Ensure there are enough buffers to avoid dropping frames */
-	if (still_port->buffer_num < VIDEO_OUTPUT_BUFFERS_NUM)
-	   still_port->buffer_num = VIDEO_OUTPUT_BUFFERS_NUM;
+void raspicam_source_deliver_vectors(RASPICAM_SOURCE * source, const unsigned char * data, int length, int64_t pts)
+{
+	RASPIVID_STATE * state = source->state;
 
-	/* Enable component */
-	status = mmal_component_enable(camera);
+	if (!state->finished && state->motion_enabled)
+		raspicam_motion_add_vectors(&state->motion, data, length, pts);
+}
 
-	if (status)
-	{
-	   vcos_log_error("camera component couldn't be enabled");
-	   goto error;
-	}
+void * raspicam_source_alloc(RASPICAM_SOURCE * source, size_t size)
+{
+	return raspicam_arena_calloc(&source->state->arena, size);
+}
 
-	raspicamcontrol_set_all_parameters(camera, &state->camera_parameters);
+void raspicam_source_free(RASPICAM_SOURCE * source, void * buffer)
+{
+	raspicam_arena_free(&source->state->arena, buffer);
+}
 
-	state->camera_component = camera;
-	return camera;
+void raspicam_source_deliver_settings(RASPICAM_SOURCE * source, const RASPICAM_FRAME_METADATA * settings)
+{
+	RASPIVID_STATE * state = source->state;
 
-error:
+	pthread_mutex_lock(&state->settings_lock);
+	state->settings = *settings;
+	state->settings.valid = 1;
+	pthread_mutex_unlock(&state->settings_lock);
+}
+
+void raspicam_source_deliver_second(RASPICAM_SOURCE * source, unsigned char * data, int64_t pts)
+{
+	RASPIVID_STATE * state = source->state;
+
+	if (state->finished || state->second_width <= 0)
+		return;
 
-   if (camera)
-      mmal_component_destroy(camera);
+	RASPICAM_RING_SLOT * slot = raspicam_ring_begin_write(&state->second_ring);
+	if (!slot)
+		return;
 
-   return 0;
+	// The frames are small enough to always copy. The YUV formats only keep the Y plane.
+	IplImage * image = slot->image;
+	if (state->format == RASPICAM_FORMAT_PACKED)
+		copy_frame(state, data, source->second_stride, source->second_buffer_height, image);
+	else
+		raspicam_copy_plane(data, source->second_stride, (uint8_t *)image->imageData, image->widthStep, image->width, image->height);
+
+	slot->pts = pts;
+	raspicam_ring_end_write(&state->second_ring, slot);
 }
 
 /**
- * Destroy the camera component
+ * Make a slot acquired from the ring the consumer's current frame
  *
  * @param state Pointer to state control struct
- *
+ * @param slot Slot returned by raspicam_ring_acquire
  */
-static void destroy_camera_component(RASPIVID_STATE *state)
+static void set_current(RASPIVID_STATE * state, RASPICAM_RING_SLOT * slot)
 {
-   if (state->camera_component)
-   {
-      mmal_component_destroy(state->camera_component);
-      state->camera_component = NULL;
-   }
+	slot->pickup_us = raspicam_now_us();
+	raspicam_histogram_add(&state->latency, slot->pickup_us - slot->callback_us);
+	state->current = slot;
 }
 
-
 /**
- * Destroy the encoder component
+ * Check that the consumer holds no frame but the current one, before the ring is reset
  *
  * @param state Pointer to state control struct
+ * @param caller Function name for the message
  *
+ * @return 1 if the ring can be reset
  */
-static void destroy_encoder_component(RASPIVID_STATE *state)
+static int consumer_idle(RASPIVID_STATE * state, const char * caller)
 {
-   // Get rid of any port buffers first
-   if (state->video_pool)
-   {
-      mmal_port_pool_destroy(state->encoder_component->output[0], state->video_pool);
-   }
+	if (state->async)
+	{
+		fprintf(stderr, "%s: Stop the asynchronous mode first\n", caller);
+		return 0;
+	}
+	if (atomic_load(&state->held_frames) > 0)
+	{
+		fprintf(stderr, "%s: Release the held frames first\n", caller);
+		return 0;
+	}
+	return 1;
 }
 
 /**
- * Connect two specific ports together
+ * Check that the source runs, before it is changed
  *
- * @param output_port Pointer the output port
- * @param input_port Pointer the input port
- * @param Pointer to a mmal connection pointer, reassigned if function successful
- * @return Returns a MMAL_STATUS_T giving result of operation
+ * @param state Pointer to state control struct
+ * @param caller Function name for the message
  *
+ * @return 1 if it runs, 0 after a failed restart, until raspiCamCvRestart brings it back
  */
-static MMAL_STATUS_T connect_ports(MMAL_PORT_T *output_port, MMAL_PORT_T *input_port, MMAL_CONNECTION_T **connection)
+static int source_running(RASPIVID_STATE * state, const char * caller)
 {
-   MMAL_STATUS_T status;
-
-   status =  mmal_connection_create(connection, output_port, input_port, MMAL_CONNECTION_FLAG_TUNNELLING | MMAL_CONNECTION_FLAG_ALLOCATION_ON_INPUT);
-
-   if (status == MMAL_SUCCESS)
-   {
-      status =  mmal_connection_enable(*connection);
-      if (status != MMAL_SUCCESS)
-         mmal_connection_destroy(*connection);
-   }
-
-   return status;
+	if (state->failed)
+	{
+		fprintf(stderr, "%s: The capture failed to restart, call raspiCamCvRestart first\n", caller);
+		return 0;
+	}
+	return 1;
 }
 
 /**
- * Checks if specified port is valid and enabled, then disables it
- *
- * @param port  Pointer the port
- *
+ * Percentile of a rolling histogram, for raspiCamCvGetCaptureProperty
  */
-static void check_disable_port(MMAL_PORT_T *port)
+static double histogram_percentile(RASPICAM_ROLLING_HISTOGRAM * histogram, int p99)
 {
-   if (port && port->is_enabled)
-      mmal_port_disable(port);
+	RASPICAM_HISTOGRAM snapshot;
+	raspicam_histogram_snapshot(histogram, &snapshot);
+	return p99 ? snapshot.p99 : snapshot.p50;
 }
 
 double raspiCamCvGetCaptureProperty(RaspiCamCvCapture * capture, int property_id)
 {
+	// Sensor settings of the current frame, when the source reported some
+	const RASPICAM_FRAME_METADATA * metadata = NULL;
+	if (capture->pState->current && capture->pState->current->metadata.valid)
+		metadata = &capture->pState->current->metadata;
+
     switch(property_id)
     {
 		case RPI_CAP_PROP_FRAME_HEIGHT:
@@ -425,306 +580,1491 @@ double raspiCamCvGetCaptureProperty(RaspiCamCvCapture * capture, int property_id
 			return capture->pState->monochrome;
 		case RPI_CAP_PROP_BITRATE:
 			return capture->pState->bitrate;
+		case RPI_CAP_PROP_BRIGHTNESS:
+			return capture->pState->properties.brightness;
+		case RPI_CAP_PROP_CONTRAST:
+			return capture->pState->properties.contrast;
+		case RPI_CAP_PROP_SATURATION:
+			return capture->pState->properties.saturation;
+		case RPI_CAP_PROP_EXPOSURE:
+			if (metadata)
+				return metadata->exposure;
+			return capture->pState->properties.shutter_speed;
+		case RPI_CAP_PROP_GAIN:
+			return metadata ? metadata->analog_gain * metadata->digital_gain : 0;
+		case RPI_CAP_PROP_ANALOG_GAIN:
+			return metadata ? metadata->analog_gain : 0;
+		case RPI_CAP_PROP_DIGITAL_GAIN:
+			return metadata ? metadata->digital_gain : 0;
+		case RPI_CAP_PROP_AWB_RED_GAIN:
+			return metadata ? metadata->awb_red_gain : 0;
+		case RPI_CAP_PROP_AWB_BLUE_GAIN:
+			return metadata ? metadata->awb_blue_gain : 0;
+		case RPI_CAP_PROP_COLOUR_TEMPERATURE:
+			return metadata ? metadata->colour_temperature : 0;
+		case RPI_CAP_PROP_FRAME_SEQUENCE:
+			return capture->pState->current ? capture->pState->current->sequence : 0;
+		case RPI_CAP_PROP_MEMORY_IN_USE:
+		case RPI_CAP_PROP_MEMORY_PEAK:
+		{
+			RASPICAM_MEMORY_STATS stats;
+			raspiCamCvGetMemoryStats(capture, &stats);
+			return property_id == RPI_CAP_PROP_MEMORY_PEAK ? stats.peak : stats.in_use;
+		}
+		case RPI_CAP_PROP_DROPPED_FRAMES:
+			return atomic_load(&capture->pState->ring.dropped);
+		case RPI_CAP_PROP_FRAMES_DELIVERED:
+			return atomic_load(&capture->pState->frames_delivered);
+		case RPI_CAP_PROP_LATENCY_P50:
+		case RPI_CAP_PROP_LATENCY_P99:
+			return histogram_percentile(&capture->pState->latency, property_id == RPI_CAP_PROP_LATENCY_P99);
+		case RPI_CAP_PROP_COPY_TIME_P50:
+		case RPI_CAP_PROP_COPY_TIME_P99:
+			return histogram_percentile(&capture->pState->copy_time, property_id == RPI_CAP_PROP_COPY_TIME_P99);
+		case RPI_CAP_PROP_JITTER_P50:
+		case RPI_CAP_PROP_JITTER_P99:
+			return histogram_percentile(&capture->pState->jitter, property_id == RPI_CAP_PROP_JITTER_P99);
+		case RPI_CAP_PROP_FRAME_PTS:
+			return capture->pState->current ? capture->pState->current->pts : 0;
+		case RPI_CAP_PROP_RECONFIGURE_TIME:
+			return capture->pState->reconfigure_us;
+		case RPI_CAP_PROP_RESTART_TIME:
+			return capture->pState->restart_us;
+		case RPI_CAP_PROP_BYTES_COPIED:
+			return atomic_load(&capture->pState->bytes_copied);
+		case RPI_CAP_PROP_BYTES_ENCODED:
+			return atomic_load(&capture->pState->bytes_encoded);
+		case RPI_CAP_PROP_CLIP_DURATION:
+			return raspicam_clip_duration(&capture->pState->clip);
+		case RPI_CAP_PROP_CLIP_DROPPED:
+			return capture->pState->clip.dropped;
+		case RPI_CAP_PROP_ROI_X:
+			return capture->pState->roi.x;
+		case RPI_CAP_PROP_ROI_Y:
+			return capture->pState->roi.y;
+		case RPI_CAP_PROP_ROI_WIDTH:
+			return capture->pState->width;
+		case RPI_CAP_PROP_ROI_HEIGHT:
+			return capture->pState->height;
+		case RPI_CAP_PROP_MOTION_BLOCKS:
+			return capture->pState->current ? capture->pState->current->changed_blocks : -1;
+		case RPI_CAP_PROP_STILL_FRAMES:
+			return atomic_load(&capture->pState->still_frames);
     }
     return 0;
 }
 
-int raspiCamCvSetCaptureProperty(RaspiCamCvCapture * capture, int property_id, double value)
+/**
+ * Free what setup_motion allocated
+ *
+ * @param state Pointer to state control struct, the source is stopped
+ */
+static void release_motion(RASPIVID_STATE * state)
 {
-    int retval = 0; // indicate failure
+	int i;
 
-/* 
-	Naive implementation does not work.	Need to reset the camera and restart
-	switch(property_id)
+	for (i = 0; i < state->ring.depth; i++)
 	{
-		case RPI_CAP_PROP_FRAME_HEIGHT:
-			capture->pState->height = value;
-			break;
-		case RPI_CAP_PROP_FRAME_WIDTH:
-			capture->pState->width = value;
-			break;
-		case RPI_CAP_PROP_FPS:
-			capture->pState->framerate = value;
-			break;
-		default:
-			retval = 0;
-			break;
+		free(state->ring.slots[i].motion);
+		state->ring.slots[i].motion = NULL;
+		state->ring.slots[i].changed_blocks = -1;
 	}
-*/	
-	return retval;
+	free(state->motion_map);
+	state->motion_map = NULL;
+	raspicam_motion_configure(&state->motion, NULL, 0, 0, 0);
 }
 
-RaspiCamCvCapture * raspiCamCvCreateCameraCapture2(int index, RASPIVID_CONFIG* config)
+/**
+ * Set the motion detector up for the current size and encoding, or turn it off
+ *
+ * @param state Pointer to state control struct, the source is stopped
+ *
+ * @return 0 on success
+ */
+static int setup_motion(RASPIVID_STATE * state)
 {
-	RaspiCamCvCapture * capture = (RaspiCamCvCapture*)malloc(sizeof(RaspiCamCvCapture));
-	// Our main data storage vessel..
-	RASPIVID_STATE * state = (RASPIVID_STATE*)malloc(sizeof(RASPIVID_STATE));
-	capture->pState = state;
-	
-	MMAL_STATUS_T status = -1;
-	MMAL_PORT_T *camera_video_port = NULL;
-	MMAL_PORT_T *camera_still_port = NULL;
-
-	bcm_host_init();
-
-	default_status(state);
-	
-	if (config != NULL)	{
-		if (config->width != 0) 		state->width = config->width;
-		if (config->height != 0) 		state->height = config->height;
-		if (config->bitrate != 0) 		state->bitrate = config->bitrate;
-		if (config->framerate != 0) 	state->framerate = config->framerate;
-		if (config->monochrome != 0) 	state->monochrome = config->monochrome;
-	}
-
-	int w = state->width;
-	int h = state->height;
-	int pixelSize = state->monochrome ? 1 : 3;
-
-	//should use VCOS_ALIGN_UP to compute width and height and then set image ROI to inner w*h image
-	state->dstImages[0] = cvCreateImage(cvSize(VCOS_ALIGN_UP(w, 32),VCOS_ALIGN_UP(h, 16)), IPL_DEPTH_8U, pixelSize); //final picture to display
-	state->dstImages[1] = cvCreateImage(cvSize(VCOS_ALIGN_UP(w, 32),VCOS_ALIGN_UP(h, 16)), IPL_DEPTH_8U, pixelSize); // final picture to display
-	//re-setting image size to what user passed
-	state->dstImages[0]->width = w ;
-	state->dstImages[0]->height = h;
-	state->dstImages[0]->widthStep = VCOS_ALIGN_UP(w, 32) * pixelSize ;
-
-	state->dstImages[1]->width = w ;
-	state->dstImages[1]->height = h;
-	state->dstImages[1]->widthStep = VCOS_ALIGN_UP(w, 32) * pixelSize ;
-
-	state->dstImageIndex = 0 ;
-	vcos_semaphore_create(&state->capture_sem, "Capture-Sem", 0);
-	vcos_semaphore_create(&state->capture_done_sem, "Capture-Done-Sem", 0);
-
-	// create camera
-	if (!create_camera_component(state))
-	{
-	   vcos_log_error("%s: Failed to create camera component", __func__);
-	   raspiCamCvReleaseCapture(&capture);
-	   return NULL;
-	}
+	int i, blocks;
 
-	camera_video_port = state->camera_component->output[MMAL_CAMERA_VIDEO_PORT];
-	camera_still_port = state->camera_component->output[MMAL_CAMERA_CAPTURE_PORT];
+	if (!state->motion_enabled)
+		return 0;
 
-	// assign data to use for callback
-	camera_video_port->userdata = (struct MMAL_PORT_USERDATA_T *)state;
-
-	// start capture
-	if (mmal_port_parameter_set_boolean(camera_video_port, MMAL_PARAMETER_CAPTURE, 1) != MMAL_SUCCESS)
-	{
-	   vcos_log_error("%s: Failed to start capture", __func__);
-	   raspiCamCvReleaseCapture(&capture);
-	   return NULL;
-	}
+	// RGB frames are compared on all three bytes, YUV frames on the luma plane
+	if (raspicam_motion_configure(&state->motion, &state->motion_config, state->width, state->height,
+		state->source.encoding == RASPICAM_ENCODING_RGB24 ? 3 : 1) != 0)
+		goto error;
 
-	// Send all the buffers to the video port
-		
-	int num = mmal_queue_length(state->video_pool->queue);
-	int q;
-	for (q = 0; q < num; q++)
+	blocks = state->motion.blocks_x * state->motion.blocks_y;
+	state->motion_map = (unsigned char *)malloc(blocks);
+	if (!state->motion_map)
+		goto error;
+	for (i = 0; i < state->ring.depth; i++)
 	{
-		MMAL_BUFFER_HEADER_T *buffer = mmal_queue_get(state->video_pool->queue);
-		
-		if (!buffer)
-			vcos_log_error("Unable to get a required buffer %d from pool queue", q);
-		
-		if (mmal_port_send_buffer(camera_video_port, buffer)!= MMAL_SUCCESS)
-			vcos_log_error("Unable to send a buffer to encoder output port (%d)", q);
+		state->ring.slots[i].motion = (unsigned char *)calloc(blocks, 1);
+		if (!state->ring.slots[i].motion)
+			goto error;
 	}
+	return 0;
 
-	//mmal_status_to_int(status);	
-		
-	// Disable all our ports that are not handled by connections
-	//check_disable_port(camera_still_port);
-
-	//if (status != 0)
-	//	raspicamcontrol_check_configuration(128);
-
-	vcos_semaphore_wait(&state->capture_done_sem);
-	return capture;
+error:
+	fprintf(stderr, "%s: Failed to set up motion detection, turning it off\n", __func__);
+	release_motion(state);
+	state->motion_enabled = 0;
+	return -1;
 }
 
-
 /**
-*\brief Create a capture device for the camera
-*\param index camera index
-*\param config Configuration for the camera (framerate, resolution , ...)
-*\param properties Capture properties (exposure, brightness ...)
-*\param non_blocking Allow to setup the device for non-blocking capture (use cvGrab and cvRetrieve functions)
-*\return The created capture device, NULL if something went wrong
-*/
-RaspiCamCvCapture * raspiCamCvCreateCameraCapture3(int index, RASPIVID_CONFIG* config, RASPIVID_PROPERTIES* properties, int non_blocking)
+ * Image with its pixels in the capture memory
+ *
+ * @param state Pointer to state control struct
+ * @param width Image width
+ * @param height Image height
+ * @param channels Bytes per pixel
+ * @param step Bytes per row
+ *
+ * @return The image, NULL if it doesn't fit in the memory
+ */
+static IplImage * create_image(RASPIVID_STATE * state, int width, int height, int channels, int step)
 {
-	RaspiCamCvCapture * capture = (RaspiCamCvCapture*)malloc(sizeof(RaspiCamCvCapture));
-	// Our main data storage vessel..
-	RASPIVID_STATE * state = (RASPIVID_STATE*)malloc(sizeof(RASPIVID_STATE));
-	capture->pState = state;
-	
-	MMAL_STATUS_T status = -1;
-	MMAL_PORT_T *camera_video_port = NULL;
-	MMAL_PORT_T *camera_still_port = NULL;
-
-	bcm_host_init();
-
-	default_status(state);
-	
-	if (config != NULL)	{
-		if (config->width != 0) 		state->width = config->width;
-		if (config->height != 0) 		state->height = config->height;
-		if (config->bitrate != 0) 		state->bitrate = config->bitrate;
-		if (config->framerate != 0) 	state->framerate = config->framerate;
-		if (config->monochrome != 0) 	state->monochrome = config->monochrome;
-	}
+	unsigned char * data = (unsigned char *)raspicam_arena_alloc(&state->arena, (size_t)step * height);
+	IplImage * image;
+
+	if (!data)
+		return NULL;
+	image = cvCreateImageHeader(cvSize(width, height), IPL_DEPTH_8U, channels);
+	cvSetData(image, data, step);
+	return image;
+}
 
-	if(properties != NULL){
-			state->camera_parameters.brightness = properties->brightness;
-			state->camera_parameters.contrast = properties->contrast;
-			state->camera_parameters.sharpness = properties->sharpness;
-			state->camera_parameters.saturation = properties->saturation;
-			state->camera_parameters.hflip = properties->hflip;
-			state->camera_parameters.vflip = properties->vflip;
-			state->camera_parameters.exposureMode = properties->exposure;
-			state->camera_parameters.shutter_speed = properties->shutter_speed;
-			state->camera_parameters.awbMode = (properties->awb > 0) ? MMAL_PARAM_AWBMODE_AUTO : MMAL_PARAM_AWBMODE_OFF ;
-			state->camera_parameters.awb_gains_r = properties->awb_gr ;
-			state->camera_parameters.awb_gains_b = properties->awb_gb ;
-	}
+static void release_image(RASPIVID_STATE * state, IplImage ** image)
+{
+	raspicam_arena_free(&state->arena, (*image)->imageData);
+	cvReleaseImageHeader(image);
+}
 
+/**
+ * Create the images of the ring slots for the current size and color mode
+ *
+ * @param state Pointer to state control struct
+ *
+ * @return 0 on success, -1 if they don't fit in max_memory
+ */
+static int create_images(RASPIVID_STATE * state)
+{
 	int w = state->width;
 	int h = state->height;
 	int pixelSize = state->monochrome ? 1 : 3;
-	//printf("Adjusted size is : %u x %u \n", VCOS_ALIGN_UP(w, 32), VCOS_ALIGN_UP(h, 16));
-	//state->dstImages[0] = cvCreateImage(cvSize(VCOS_ALIGN_UP(w, 32),VCOS_ALIGN_UP(h, 16)), IPL_DEPTH_8U, pixelSize); //final picture to di$
-        //state->dstImages[1] = cvCreateImage(cvSize(VCOS_ALIGN_UP(w, 32),VCOS_ALIGN_UP(h, 16)), IPL_DEPTH_8U, pixelSize); // final picture to d$
-        state->dstImages[0] = cvCreateImage(cvSize(w,h), IPL_DEPTH_8U, pixelSize); //final picture to
-        state->dstImages[1] = cvCreateImage(cvSize(w,h), IPL_DEPTH_8U, pixelSize); // final picture to
-	//re-setting image size to what user passed
-        /*state->dstImages[0]->width = w ;
-        state->dstImages[0]->height = h;
-        state->dstImages[0]->widthStep = VCOS_ALIGN_UP(w, 32) * pixelSize ;
-
-        state->dstImages[1]->width = w ;
-        state->dstImages[1]->height = h;
-        state->dstImages[1]->widthStep = VCOS_ALIGN_UP(w, 32) * pixelSize ;
-	*/
-
-
-	state->dstImageIndex = 0 ;
-	vcos_semaphore_create(&state->capture_sem, "Capture-Sem", 0);
-	vcos_semaphore_create(&state->capture_done_sem, "Capture-Done-Sem", 0);
-
-	// create camera
-	if (!create_camera_component(state))
-	{
-	   vcos_log_error("%s: Failed to create camera component", __func__);
-	   raspiCamCvReleaseCapture(&capture);
-	   return NULL;
-	}
-	
-	camera_video_port = state->camera_component->output[MMAL_CAMERA_VIDEO_PORT];
-	camera_still_port = state->camera_component->output[MMAL_CAMERA_CAPTURE_PORT];
-
-	// assign data to use for callback
-	camera_video_port->userdata = (struct MMAL_PORT_USERDATA_T *)state;
 
-	// start capture
-	if (mmal_port_parameter_set_boolean(camera_video_port, MMAL_PARAMETER_CAPTURE, 1) != MMAL_SUCCESS)
+	int i;
+	for (i = 0; i < state->ring.depth; i++)
 	{
-	   vcos_log_error("%s: Failed to start capture", __func__);
-	   raspiCamCvReleaseCapture(&capture);
-	   return NULL;
+		IplImage * image;
+		if (state->format != RASPICAM_FORMAT_PACKED)
+		{
+			RASPICAM_RING_SLOT * slot = &state->ring.slots[i];
+			CvSize chroma = cvSize((w + 1) / 2, (h + 1) / 2);
+
+			image = cvCreateImageHeader(cvSize(w, h), IPL_DEPTH_8U, 1);
+			slot->image = slot->planes[0] = image;
+			if (state->format == RASPICAM_FORMAT_NV12)
+			{
+				slot->planes[1] = cvCreateImageHeader(chroma, IPL_DEPTH_8U, 2);
+			}
+			else
+			{
+				slot->planes[1] = cvCreateImageHeader(chroma, IPL_DEPTH_8U, 1);
+				slot->planes[2] = cvCreateImageHeader(chroma, IPL_DEPTH_8U, 1);
+			}
+
+			// Zero-copy sets the planes to the source buffer of each frame
+			if (!state->zero_copy)
+			{
+				slot->data = (unsigned char *)raspicam_arena_alloc(&state->arena, state->source.stride * state->source.buffer_height * 3 / 2);
+				if (!slot->data)
+					goto error;
+				set_planes(&state->source, slot, slot->data);
+			}
+		}
+		else if (state->zero_copy)
+		{
+			// Data and stride are set to the source buffer of each frame
+			image = cvCreateImageHeader(cvSize(w, h), IPL_DEPTH_8U, pixelSize);
+		}
+		else if (state->padded)
+		{
+			// Rows keep the 32 pixel aligned stride of the camera
+			image = create_image(state, w, h, pixelSize, ALIGN_UP(w, 32) * pixelSize);
+		}
+		else
+		{
+			// Rows aligned on 4 bytes, like cvCreateImage
+			image = create_image(state, w, h, pixelSize, ALIGN_UP(w * pixelSize, 4));
+		}
+		state->ring.slots[i].image = image;
+		if (!image)
+			goto error;
 	}
 
-	// Send all the buffers to the video port
-		
-	int num = mmal_queue_length(state->video_pool->queue);
-	int q;
-	for (q = 0; q < num; q++)
+	// The second stream holds gray images in the YUV formats: its Y plane
+	if (state->second_width > 0)
 	{
-		MMAL_BUFFER_HEADER_T *buffer = mmal_queue_get(state->video_pool->queue);
-		
-		if (!buffer)
-			vcos_log_error("Unable to get a required buffer %d from pool queue", q);
-		
-		if (mmal_port_send_buffer(camera_video_port, buffer)!= MMAL_SUCCESS)
-			vcos_log_error("Unable to send a buffer to encoder output port (%d)", q);
+		int channels = (state->format == RASPICAM_FORMAT_PACKED) ? pixelSize : 1;
+		for (i = 0; i < state->second_ring.depth; i++)
+		{
+			state->second_ring.slots[i].image = create_image(state, state->second_width, state->second_height, channels,
+				ALIGN_UP(state->second_width * channels, 4));
+			if (!state->second_ring.slots[i].image)
+				goto error;
+		}
 	}
 
-	//mmal_status_to_int(status);	
-		
-	// Disable all our ports that are not handled by connections
-	//check_disable_port(camera_still_port);
-
-	//if (status != 0)
-	//	raspicamcontrol_check_configuration(128);
-	if(non_blocking == 0) vcos_semaphore_wait(&state->capture_done_sem);
-	return capture;
-}
-
+	setup_motion(state);
+	return 0;
 
-
-RaspiCamCvCapture * raspiCamCvCreateCameraCapture(int index)
-{
-	return raspiCamCvCreateCameraCapture2(index, NULL);
+error:
+	fprintf(stderr, "%s: The images of %d %dx%d frames don't fit in %lld bytes\n", __func__,
+		state->ring.depth, w, h, state->max_memory);
+	return -1;
 }
 
-void raspiCamCvReleaseCapture(RaspiCamCvCapture ** capture)
+static void release_images(RASPIVID_STATE * state)
 {
-	RASPIVID_STATE * state = (*capture)->pState;
+	int i;
 
-	// Unblock the callback.
-	state->finished = 1;
-	vcos_semaphore_post(&state->capture_sem);
-	vcos_semaphore_wait(&state->capture_done_sem);
+	release_motion(state);
 
-	vcos_semaphore_delete(&state->capture_sem);
-	vcos_semaphore_delete(&state->capture_done_sem);
+	for (i = 0; i < state->ring.depth; i++)
+	{
+		RASPICAM_RING_SLOT * slot = &state->ring.slots[i];
 
-	if (state->camera_component)
-		mmal_component_disable(state->camera_component);
+		if (state->format != RASPICAM_FORMAT_PACKED)
+		{
+			// planes[0] is the image
+			if (slot->planes[1])
+				cvReleaseImageHeader(&slot->planes[1]);
+			if (slot->planes[2])
+				cvReleaseImageHeader(&slot->planes[2]);
+			slot->planes[0] = NULL;
+			raspicam_arena_free(&state->arena, slot->data);
+			slot->data = NULL;
+		}
 
-	destroy_camera_component(state);
+		if (!slot->image)
+			continue;
+		if (state->zero_copy || state->format != RASPICAM_FORMAT_PACKED)
+			cvReleaseImageHeader(&(slot->image));
+		else
+			release_image(state, &(slot->image));
+	}
 
-	cvReleaseImage(&(state->dstImages[0]));
-	cvReleaseImage(&(state->dstImages[1]));
+	if (state->second_width > 0)
+	{
+		for (i = 0; i < state->second_ring.depth; i++)
+		{
+			if (state->second_ring.slots[i].image)
+				release_image(state, &(state->second_ring.slots[i].image));
+		}
+	}
+}
+
+/**
+ * Clamp a region of interest to the frame, on even pixels for the chroma planes
+ *
+ * @param width Frame width
+ * @param height Frame height
+ * @param roi Requested region, NULL or 0 width for none
+ *
+ * @return The region, the full frame for none
+ */
+static CvRect clamp_roi(int width, int height, const CvRect * roi)
+{
+	CvRect region = cvRect(0, 0, width, height);
+
+	if (!roi || roi->width <= 0 || roi->height <= 0)
+		return region;
+
+	region.width = (roi->width < width ? roi->width : width) & ~1;
+	region.height = (roi->height < height ? roi->height : height) & ~1;
+	if (region.width < 2 || region.height < 2)
+		return cvRect(0, 0, width, height);
+
+	region.x = roi->x < width - region.width ? roi->x : width - region.width;
+	region.y = roi->y < height - region.height ? roi->y : height - region.height;
+	region.x = (region.x > 0 ? region.x : 0) & ~1;
+	region.y = (region.y > 0 ? region.y : 0) & ~1;
+	return region;
+}
+
+/**
+ * Tell the source which part of the frame to deliver
+ *
+ * @param source The source, stopped
+ * @param width Frame width
+ * @param height Frame height
+ * @param roi Region of interest, NULL or 0 width for none
+ */
+static void set_source_region(RASPICAM_SOURCE * source, int width, int height, const CvRect * roi)
+{
+	CvRect region = clamp_roi(width, height, roi);
+
+	source->full_width = width;
+	source->full_height = height;
+	source->roi_x = region.x;
+	source->roi_y = region.y;
+	source->width = region.width;
+	source->height = region.height;
+}
+
+/**
+ * Take the image size and region the source settled on
+ *
+ * @param state Pointer to state control struct
+ */
+static void take_source_region(RASPIVID_STATE * state)
+{
+	RASPICAM_SOURCE * source = &state->source;
+
+	// A source that doesn't know about regions changed the size on its own
+	if (source->full_width < source->width || source->full_height < source->height)
+	{
+		source->full_width = source->width;
+		source->full_height = source->height;
+		source->roi_x = source->roi_y = 0;
+	}
+
+	state->width = source->width;
+	state->height = source->height;
+	state->frame_width = source->full_width;
+	state->frame_height = source->full_height;
+	if (source->width == source->full_width && source->height == source->full_height)
+		state->roi = cvRect(0, 0, 0, 0);
+	else
+		state->roi = cvRect(source->roi_x, source->roi_y, source->width, source->height);
+}
+
+/**
+ * Apply a size, framerate and color mode to the stopped source, and create the images that go with it
+ *
+ * @param state Pointer to state control struct, without images
+ * @param width Frame width
+ * @param height Frame height
+ * @param roi Region of interest in the frame, NULL or 0 width for none
+ * @param framerate Framerate
+ * @param monochrome Color mode
+ *
+ * @return 0 on success, -1 if the source refused it or the images don't fit in max_memory
+ */
+static int apply_source_config(RASPIVID_STATE * state, int width, int height, const CvRect * roi, int framerate, int monochrome)
+{
+	RASPICAM_SOURCE * source = &state->source;
+
+	set_source_region(source, width, height, roi);
+	source->framerate = framerate;
+	source->monochrome = monochrome;
+	source->encoding = source_encoding(state->format, monochrome, state->convert);
+	if (source->ops->reconfigure(source) != 0)
+		return -1;
+
+	take_source_region(state);
+	state->framerate = source->framerate;
+	state->monochrome = source->monochrome;
+	if (create_images(state) != 0)
+	{
+		release_images(state);
+		return -1;
+	}
+	return 0;
+}
+
+/**
+ * Close the source and open it again with the same settings, after it failed to start
+ *
+ * @param state Pointer to state control struct, the source is stopped and has every buffer back
+ *
+ * @return 0 if the source is running again
+ */
+static int reopen_source(RASPIVID_STATE * state)
+{
+	RASPICAM_SOURCE * source = &state->source;
+	int stride = source->stride;
+	int buffer_height = source->buffer_height;
+	int second_stride = source->second_stride;
+
+	if (!state->source_closed)
+	{
+		if (state->encoder)
+			source->ops->stop_encoder(source);
+		source->ops->close(source);
+	}
+
+	if (source->ops->open(source) != 0)
+	{
+		fprintf(stderr, "%s: Failed to open the %s source again\n", __func__, source->ops->name);
+		state->encoder = RASPICAM_ENCODER_NONE;
+		state->source_closed = 1;
+		return -1;
+	}
+	state->source_closed = 0;
+
+	// The images are kept, unless the source came back with another buffer layout, or a failed reconfigure released them
+	if (source->width != state->width || source->height != state->height || source->stride != stride ||
+		source->buffer_height != buffer_height || source->second_stride != second_stride || !state->ring.slots[0].image)
+	{
+		release_images(state);
+		take_source_region(state);
+		if (create_images(state) != 0)
+		{
+			release_images(state);
+			return -1;
+		}
+	}
+
+	if (state->encoder && source->ops->start_encoder(source, state->encoder, state->bitrate) != 0)
+	{
+		fprintf(stderr, "%s: Failed to restart the encoder\n", __func__);
+		state->encoder = RASPICAM_ENCODER_NONE;
+	}
+
+	return source->ops->start(source);
+}
+
+/**
+ * Start the stopped source, or open it again if it doesn't start. When that
+ * fails too, the capture is marked failed: QueryFrame and Grab return nothing
+ * instead of waiting for frames that never come, until raspiCamCvRestart works.
+ *
+ * @param state Pointer to state control struct, the source has every buffer back
+ * @param caller Function name for the messages
+ *
+ * @return 0 if the source is running again
+ */
+static int restart_source(RASPIVID_STATE * state, const char * caller)
+{
+	RASPICAM_SOURCE * source = &state->source;
+
+	if (!state->failed && source->ops->start(source) == 0)
+		return 0;
+
+	if (!state->source_closed)
+	{
+		fprintf(stderr, "%s: The %s source didn't start, opening it again\n", caller, source->ops->name);
+		source->ops->stop(source);
+	}
+	if (reopen_source(state) != 0)
+	{
+		fprintf(stderr, "%s: Failed to restart capture\n", caller);
+		state->failed = 1;
+		return -1;
+	}
+	state->failed = 0;
+	return 0;
+}
+
+/**
+ * Wait for the first frame of a blocking capture, and leave it in the ring
+ *
+ * @param state Pointer to state control struct
+ * @param caller Function name for the message
+ *
+ * @return 0 if a frame came within FIRST_FRAME_TIMEOUT_MS
+ */
+static int wait_first_frame(RASPIVID_STATE * state, const char * caller)
+{
+	struct timespec deadline;
+	int ret;
+
+	clock_gettime(CLOCK_REALTIME, &deadline);
+	deadline.tv_sec += FIRST_FRAME_TIMEOUT_MS / 1000;
+	deadline.tv_nsec += (FIRST_FRAME_TIMEOUT_MS % 1000) * 1000000L;
+	if (deadline.tv_nsec >= 1000000000L)
+	{
+		deadline.tv_nsec -= 1000000000L;
+		deadline.tv_sec++;
+	}
+
+	while ((ret = sem_timedwait(&state->ring.ready_sem, &deadline)) != 0 && errno == EINTR);
+	if (ret == 0 && state->failed)
+		return -1;
+	if (ret != 0)
+	{
+		fprintf(stderr, "%s: No frame from the %s source after %d ms\n", caller, state->source.ops->name, FIRST_FRAME_TIMEOUT_MS);
+		return -1;
+	}
+	sem_post(&state->ring.ready_sem);
+	return 0;
+}
+
+/**
+ * Restart the source with a new size, framerate or color mode
+ *
+ * @param state Pointer to state control struct
+ * @param width New frame width
+ * @param height New frame height
+ * @param roi Region of interest in the new frame, NULL or 0 width for none
+ * @param framerate New framerate
+ * @param monochrome New color mode
+ *
+ * @return 1 if successful, 0 if the source refused the change and kept the previous one
+ */
+static int reconfigure(RASPIVID_STATE * state, int width, int height, const CvRect * roi, int framerate, int monochrome)
+{
+	RASPICAM_SOURCE * source = &state->source;
+	int64_t start_us = raspicam_now_us();
+	int retval = 1;
+
+	if (width <= 0 || height <= 0 || framerate <= 0)
+		return 0;
+	if (!source_running(state, __func__) || !consumer_idle(state, __func__))
+		return 0;
+	if (!source->ops->reconfigure)
+	{
+		fprintf(stderr, "%s: The %s source can't be reconfigured\n", __func__, source->ops->name);
+		return 0;
+	}
+
+	source->ops->stop(source);
+
+	// The encoder is set up again for the new format
+	if (state->encoder)
+		source->ops->stop_encoder(source);
+
+	// Every buffer goes back to the source, and the images go with the old size
+	state->current = NULL;
+	raspicam_ring_reset(&state->ring);
+	if (state->second_width > 0)
+	{
+		state->second_current = NULL;
+		raspicam_ring_reset(&state->second_ring);
+	}
+	release_images(state);
+
+	// The previous configuration is restored if the source refuses the new one, or it doesn't fit in memory
+	int old_width = state->width, old_height = state->height;
+	int old_frame_width = state->frame_width, old_frame_height = state->frame_height;
+	int old_framerate = state->framerate, old_monochrome = state->monochrome;
+	CvRect old_roi = state->roi;
+
+	if (apply_source_config(state, width, height, roi, framerate, monochrome) != 0)
+	{
+		fprintf(stderr, "%s: Failed to reconfigure the %s source, keeping %dx%d@%d\n", __func__,
+			source->ops->name, old_width, old_height, old_framerate);
+		retval = 0;
+		if (apply_source_config(state, old_frame_width, old_frame_height, &old_roi, old_framerate, old_monochrome) != 0)
+		{
+			fprintf(stderr, "%s: Failed to restore the %s source\n", __func__, source->ops->name);
+			state->failed = 1;
+			state->reconfigure_us = raspicam_now_us() - start_us;
+			return 0;
+		}
+	}
+
+	// The interval across the restart isn't jitter
+	state->last_callback_us = 0;
+
+	if (state->encoder && source->ops->start_encoder(source, state->encoder, state->bitrate) != 0)
+	{
+		fprintf(stderr, "%s: Failed to restart the encoder\n", __func__);
+		state->encoder = RASPICAM_ENCODER_NONE;
+	}
+
+	// A failed reconfiguration is timed too, RPI_CAP_PROP_RECONFIGURE_TIME is never the previous one
+	if (restart_source(state, __func__) != 0)
+	{
+		state->reconfigure_us = raspicam_now_us() - start_us;
+		return 0;
+	}
+
+	// Blocking captures measure until the first frame of the new configuration
+	if (!state->non_blocking && wait_first_frame(state, __func__) != 0)
+	{
+		state->failed = 1;
+		retval = 0;
+	}
+	state->reconfigure_us = raspicam_now_us() - start_us;
+	return retval;
+}
+
+/**
+ * Change an image setting on the running source
+ *
+ * @param state Pointer to state control struct
+ * @param property_id RPI_CAP_PROP_BRIGHTNESS, CONTRAST, SATURATION or EXPOSURE
+ * @param value New value
+ *
+ * @return 1 if successful, 0 if the source doesn't support it
+ */
+static int set_parameter(RASPIVID_STATE * state, int property_id, double value)
+{
+	RASPICAM_SOURCE * source = &state->source;
+
+	if (!source_running(state, __func__))
+		return 0;
+	if (!source->ops->set_parameter || source->ops->set_parameter(source, property_id, value) != 0)
+		return 0;
+
+	switch (property_id)
+	{
+		case RPI_CAP_PROP_BRIGHTNESS:
+			state->properties.brightness = (int)value;
+			break;
+		case RPI_CAP_PROP_CONTRAST:
+			state->properties.contrast = (int)value;
+			break;
+		case RPI_CAP_PROP_SATURATION:
+			state->properties.saturation = (int)value;
+			break;
+		case RPI_CAP_PROP_EXPOSURE:
+			state->properties.shutter_speed = (int)value;
+			break;
+	}
+	return 1;
+}
+
+int raspiCamCvSetCaptureProperty(RaspiCamCvCapture * capture, int property_id, double value)
+{
+	RASPIVID_STATE * state = capture->pState;
+	int retval = 0; // indicate failure
+
+	switch(property_id)
+	{
+		case RPI_CAP_PROP_FRAME_HEIGHT:
+			retval = reconfigure(state, state->frame_width, (int)value, NULL, state->framerate, state->monochrome);
+			break;
+		case RPI_CAP_PROP_FRAME_WIDTH:
+			retval = reconfigure(state, (int)value, state->frame_height, NULL, state->framerate, state->monochrome);
+			break;
+		case RPI_CAP_PROP_FPS:
+			retval = reconfigure(state, state->frame_width, state->frame_height, &state->roi, (int)value, state->monochrome);
+			break;
+		case RPI_CAP_PROP_MONOCHROME:
+			retval = reconfigure(state, state->frame_width, state->frame_height, &state->roi, state->framerate, value != 0);
+			break;
+		case RPI_CAP_PROP_ROI_X:
+			retval = raspiCamCvSetROI(capture, (int)value, state->roi.y, state->width, state->height);
+			break;
+		case RPI_CAP_PROP_ROI_Y:
+			retval = raspiCamCvSetROI(capture, state->roi.x, (int)value, state->width, state->height);
+			break;
+		case RPI_CAP_PROP_ROI_WIDTH:
+			retval = raspiCamCvSetROI(capture, state->roi.x, state->roi.y, (int)value, state->height);
+			break;
+		case RPI_CAP_PROP_ROI_HEIGHT:
+			retval = raspiCamCvSetROI(capture, state->roi.x, state->roi.y, state->width, (int)value);
+			break;
+		case RPI_CAP_PROP_BRIGHTNESS:
+		case RPI_CAP_PROP_CONTRAST:
+		case RPI_CAP_PROP_SATURATION:
+		case RPI_CAP_PROP_EXPOSURE:
+			// No restart, the camera applies these on the fly
+			retval = set_parameter(state, property_id, value);
+			break;
+		case RPI_CAP_PROP_BITRATE:
+			state->bitrate = (int)value;
+			// A running encoder takes it on the fly when the source can, at the next start otherwise
+			if (state->encoder && !state->failed && state->source.ops->set_parameter)
+				state->source.ops->set_parameter(&state->source, property_id, value);
+			retval = 1;
+			break;
+	}
+	return retval;
+}
+
+int raspiCamCvSetCaptureSize(RaspiCamCvCapture * capture, int width, int height)
+{
+	RASPIVID_STATE * state = capture->pState;
+
+	return reconfigure(state, width, height, NULL, state->framerate, state->monochrome);
+}
+
+int raspiCamCvSetROI(RaspiCamCvCapture * capture, int x, int y, int width, int height)
+{
+	RASPIVID_STATE * state = capture->pState;
+	RASPICAM_SOURCE * source = &state->source;
+	CvRect roi = cvRect(x, y, width, height);
+	CvRect region = clamp_roi(state->frame_width, state->frame_height, &roi);
+
+	if (!source_running(state, __func__))
+		return 0;
+
+	// Same size: the images stay, the source moves the crop on the fly
+	if (region.width == state->width && region.height == state->height && source->ops->set_roi)
+	{
+		int old_x = source->roi_x;
+		int old_y = source->roi_y;
+
+		source->roi_x = region.x;
+		source->roi_y = region.y;
+		if (source->ops->set_roi(source) == 0)
+		{
+			take_source_region(state);
+			return 1;
+		}
+		source->roi_x = old_x;
+		source->roi_y = old_y;
+	}
+
+	return reconfigure(state, state->frame_width, state->frame_height, &roi, state->framerate, state->monochrome);
+}
+
+/**
+ * Bytes of a frame in the camera layout, 32 pixel aligned rows and 16 row aligned planes
+ */
+static size_t frame_bytes(int width, int height, int encoding)
+{
+	size_t bytes = (size_t)ALIGN_UP(width, 32) * (encoding == RASPICAM_ENCODING_RGB24 ? 3 : 1) * ALIGN_UP(height, 16);
+
+	return encoding == RASPICAM_ENCODING_RGB24 ? bytes : bytes * 3 / 2;
+}
+
+/**
+ * Frame buffer memory of a capture with a ring of depth slots, before the source is open
+ *
+ * @param state Pointer to state control struct, configured
+ * @param depth Ring depth
+ *
+ * @return The estimate in bytes: the source buffers, kept ones included, the ring and the second stream
+ */
+static size_t capture_memory(RASPIVID_STATE * state, int depth)
+{
+	int encoding = source_encoding(state->format, state->monochrome, state->convert);
+	int width = state->roi.width > 0 ? state->roi.width : state->width;
+	int height = state->roi.width > 0 ? state->roi.height : state->height;
+	size_t frame = raspicam_arena_footprint(frame_bytes(width, height, encoding));
+	size_t total = (SOURCE_BUFFERS_NUM + (state->zero_copy ? depth : 0)) * frame;
+
+	if (!state->zero_copy)
+		total += depth * frame;
+	if (state->second_width > 0 && state->second_height > 0)
+		total += (depth + 1) * raspicam_arena_footprint(frame_bytes(state->second_width, state->second_height, encoding));
+	return total;
+}
+
+/**
+ * Common part of the raspiCamCvCreateCameraCapture* functions
+ *
+ * @param ops Frame source, NULL to pick it from config->source
+ * @param userdata Stored in RASPICAM_SOURCE.userdata
+ * @param config Configuration for the camera, NULL for defaults
+ * @param properties Capture properties, NULL for defaults
+ * @param non_blocking Do not wait for the first frame
+ * @param padded Images keep the 32 pixel aligned row stride of the camera buffers
+ *
+ * @return The created capture device, NULL if something went wrong
+ */
+static RaspiCamCvCapture * create_capture(const RASPICAM_SOURCE_OPS * ops, void * userdata, int index,
+	RASPIVID_CONFIG* config, RASPIVID_PROPERTIES* properties, int non_blocking, int padded)
+{
+	RaspiCamCvCapture * capture = (RaspiCamCvCapture*)malloc(sizeof(RaspiCamCvCapture));
+	// Our main data storage vessel..
+	RASPIVID_STATE * state = (RASPIVID_STATE*)malloc(sizeof(RASPIVID_STATE));
+	if (!capture || !state)
+	{
+		free(capture);
+		free(state);
+		return NULL;
+	}
+	capture->pState = state;
+
+	default_status(state);
+	state->camera_num = index;
+	flash_open(&state->flash);
+	pthread_once(&default_flash_once, open_default_flash);
+
+	if (config != NULL)	{
+		if (config->width != 0) 		state->width = config->width;
+		if (config->height != 0) 		state->height = config->height;
+		if (config->bitrate != 0) 		state->bitrate = config->bitrate;
+		if (config->framerate != 0) 	state->framerate = config->framerate;
+		if (config->monochrome != 0) 	state->monochrome = config->monochrome;
+		if (config->zero_copy != 0) 	state->zero_copy = config->zero_copy;
+		if (config->source != 0) 		state->source_type = config->source;
+		if (config->ring_depth != 0) 	state->ring_depth = config->ring_depth;
+		if (config->frame_policy != 0) 	state->frame_policy = config->frame_policy;
+		if (config->format != 0) 		state->format = config->format;
+		if (config->second_width != 0) 	state->second_width = config->second_width;
+		if (config->second_height != 0) state->second_height = config->second_height;
+		if (config->layout != 0) 		padded = (config->layout == RASPICAM_LAYOUT_PADDED);
+		if (config->convert != 0) 		state->convert = config->convert;
+		if (config->roi_width != 0) 	state->roi = cvRect(config->roi_x, config->roi_y, config->roi_width, config->roi_height);
+		if (config->max_memory != 0) 	state->max_memory = config->max_memory;
+		if (config->memory_flags != 0) 	state->memory_flags = config->memory_flags;
+	}
+
+	if (properties != NULL) {
+		state->properties = *properties;
+		state->has_properties = 1;
+	}
+	state->padded = padded;
+	state->non_blocking = non_blocking;
+
+	// A converted frame can't be the camera buffer
+	if (state->zero_copy && state->convert != RASPICAM_CONVERT_NONE && state->format == RASPICAM_FORMAT_PACKED)
+	{
+		fprintf(stderr, "%s: Color conversion needs a copy, zero-copy disabled\n", __func__);
+		state->zero_copy = 0;
+	}
+
+	// Cut the ring to what fits in max_memory, and reserve it
+	if (state->max_memory > 0)
+	{
+		int ring_depth = state->ring_depth;
+
+		while (state->ring_depth > 2 && capture_memory(state, state->ring_depth) > (size_t)state->max_memory)
+			state->ring_depth--;
+		if (capture_memory(state, state->ring_depth) > (size_t)state->max_memory)
+		{
+			fprintf(stderr, "%s: %d frames of %dx%d need %zu bytes, more than the max_memory of %lld\n", __func__,
+				state->ring_depth + SOURCE_BUFFERS_NUM, state->width, state->height,
+				capture_memory(state, state->ring_depth), state->max_memory);
+			flash_close(&state->flash);
+			free(state);
+			free(capture);
+			return NULL;
+		}
+		if (state->ring_depth < ring_depth)
+			fprintf(stderr, "%s: Ring depth cut from %d to %d to fit in %lld bytes\n", __func__,
+				ring_depth, state->ring_depth, state->max_memory);
+	}
+	if (raspicam_arena_init(&state->arena, state->max_memory > 0 ? state->max_memory : 0, state->memory_flags) != 0)
+	{
+		flash_close(&state->flash);
+		free(state);
+		free(capture);
+		return NULL;
+	}
+
+	atomic_init(&state->frames_delivered, 0);
+	atomic_init(&state->bytes_copied, 0);
+	raspicam_histogram_init(&state->latency);
+	raspicam_histogram_init(&state->copy_time);
+	raspicam_histogram_init(&state->jitter);
+	raspicam_clip_init(&state->clip);
+	raspicam_motion_init(&state->motion);
+	state->motion.arena = &state->arena;
+	atomic_init(&state->still_frames, 0);
+	atomic_init(&state->held_frames, 0);
+	pthread_mutex_init(&state->settings_lock, NULL);
+
+	if (raspicam_ring_init(&state->ring, state->ring_depth, state->frame_policy, drop_slot, state) != 0)
+	{
+		fprintf(stderr, "%s: Invalid ring depth %d\n", __func__, state->ring_depth);
+		raspicam_histogram_destroy(&state->latency);
+		raspicam_histogram_destroy(&state->copy_time);
+		raspicam_histogram_destroy(&state->jitter);
+		raspicam_clip_destroy(&state->clip);
+		raspicam_motion_destroy(&state->motion);
+		pthread_mutex_destroy(&state->settings_lock);
+		raspicam_arena_destroy(&state->arena);
+		flash_close(&state->flash);
+		free(state);
+		free(capture);
+		return NULL;
+	}
+
+	// The second stream ring always keeps the newest frames, the consumer picks its match
+	if (state->second_width > 0 && state->second_height > 0)
+		raspicam_ring_init(&state->second_ring, state->ring_depth, RASPICAM_FRAME_LATEST, NULL, NULL);
+	else
+		state->second_width = state->second_height = 0;
+
+	// open the frame source, it has the final say on the image size
+	RASPICAM_SOURCE * source = &state->source;
+	source->state = state;
+	set_source_region(source, state->width, state->height, &state->roi);
+	source->framerate = state->framerate;
+	source->monochrome = state->monochrome;
+	source->encoding = source_encoding(state->format, state->monochrome, state->convert);
+	source->camera_num = state->camera_num;
+	source->properties = state->has_properties ? &state->properties : NULL;
+	source->arg = config ? config->source_arg : NULL;
+	source->userdata = userdata;
+	source->held_buffers = state->zero_copy ? state->ring.depth : 0;
+	source->second_width = state->second_width;
+	source->second_height = state->second_height;
+
+	source->ops = ops ? ops : get_source_ops(state->source_type);
+	if (!source->ops || source->ops->open(source) != 0)
+	{
+	   fprintf(stderr, "%s: Failed to open frame source\n", __func__);
+	   source->ops = NULL;
+	   raspiCamCvReleaseCapture(&capture);
+	   return NULL;
+	}
+
+	take_source_region(state);
+	if (state->second_width > 0 && source->second_width <= 0)
+	{
+		fprintf(stderr, "%s: The %s source has no second stream\n", __func__, source->ops->name);
+		raspicam_ring_destroy(&state->second_ring);
+		state->second_width = state->second_height = 0;
+	}
+	if (create_images(state) != 0)
+	{
+	   raspiCamCvReleaseCapture(&capture);
+	   return NULL;
+	}
+
+	// start capture
+	if (source->ops->start(source) != 0)
+	{
+	   fprintf(stderr, "%s: Failed to start capture\n", __func__);
+	   raspiCamCvReleaseCapture(&capture);
+	   return NULL;
+	}
+
+	// A blocking capture without frames would hang the first QueryFrame
+	if (non_blocking == 0 && wait_first_frame(state, __func__) != 0)
+	{
+	   raspiCamCvReleaseCapture(&capture);
+	   return NULL;
+	}
+	return capture;
+}
+
+RaspiCamCvCapture * raspiCamCvCreateCameraCapture2(int index, RASPIVID_CONFIG* config)
+{
+	return create_capture(NULL, NULL, index, config, NULL, 0, 1);
+}
+
+
+/**
+*\brief Create a capture device for the camera
+*\param index camera index
+*\param config Configuration for the camera (framerate, resolution , ...)
+*\param properties Capture properties (exposure, brightness ...)
+*\param non_blocking Allow to setup the device for non-blocking capture (use cvGrab and cvRetrieve functions)
+*\return The created capture device, NULL if something went wrong or a blocking capture got no frame within 2 seconds
+*/
+RaspiCamCvCapture * raspiCamCvCreateCameraCapture3(int index, RASPIVID_CONFIG* config, RASPIVID_PROPERTIES* properties, int non_blocking)
+{
+	return create_capture(NULL, NULL, index, config, properties, non_blocking, 0);
+}
+
+RaspiCamCvCapture * raspiCamCvCreateCameraCaptureFromSource(const RASPICAM_SOURCE_OPS * ops, void * userdata,
+	RASPIVID_CONFIG * config, RASPIVID_PROPERTIES * properties, int non_blocking)
+{
+	return create_capture(ops, userdata, 0, config, properties, non_blocking, 0);
+}
+
+
+
+RaspiCamCvCapture * raspiCamCvCreateCameraCapture(int index)
+{
+	return raspiCamCvCreateCameraCapture2(index, NULL);
+}
+
+void raspiCamCvReleaseCapture(RaspiCamCvCapture ** capture)
+{
+	RASPIVID_STATE * state = (*capture)->pState;
+
+	state->finished = 1;
+
+	if (state->async)
+		raspiCamCvStopAsync(*capture);
+
+	if (state->source.ops && !state->source_closed)
+	{
+		state->source.ops->stop(&state->source);
+		if (state->encoder)
+			state->source.ops->stop_encoder(&state->source);
+
+		// Give back every buffer still held by a slot
+		raspicam_ring_destroy(&state->ring);
+
+		state->source.ops->close(&state->source);
+	}
+	else
+	{
+		raspicam_ring_destroy(&state->ring);
+	}
+
+	if (state->second_width > 0)
+		raspicam_ring_destroy(&state->second_ring);
+
+	raspicam_clip_destroy(&state->clip);
+	flash_close(&state->flash);
+	release_images(state);
+	raspicam_motion_destroy(&state->motion);
+	pthread_mutex_destroy(&state->settings_lock);
+	raspicam_arena_destroy(&state->arena);
+
+	raspicam_histogram_destroy(&state->latency);
+	raspicam_histogram_destroy(&state->copy_time);
+	raspicam_histogram_destroy(&state->jitter);
 
 	free(state);
 	free(*capture);
 	*capture = 0;
 }
 
+int raspiCamCvRestart(RaspiCamCvCapture * capture)
+{
+	RASPIVID_STATE * state = capture->pState;
+	RASPICAM_SOURCE * source = &state->source;
+	int64_t start_us = raspicam_now_us();
+
+	if (!consumer_idle(state, __func__))
+		return 0;
+
+	if (!state->source_closed)
+		source->ops->stop(source);
+
+	// Every buffer goes back to the source, the frames from before the restart are gone
+	state->current = NULL;
+	raspicam_ring_reset(&state->ring);
+	if (state->second_width > 0)
+	{
+		state->second_current = NULL;
+		raspicam_ring_reset(&state->second_ring);
+	}
+	state->last_callback_us = 0;
+
+	// Images, ring and source buffers are reused, a source that doesn't start is opened again
+	if (restart_source(state, __func__) != 0)
+		return 0;
+
+	if (!state->non_blocking && wait_first_frame(state, __func__) != 0)
+	{
+		state->failed = 1;
+		return 0;
+	}
+	state->restart_us = raspicam_now_us() - start_us;
+	return 1;
+}
+
 IplImage * raspiCamCvQueryFrame(RaspiCamCvCapture * capture)
 {
 	RASPIVID_STATE * state = capture->pState;
-	vcos_semaphore_post(&state->capture_sem);
-	vcos_semaphore_wait(&state->capture_done_sem);
-	return state->dstImages[state->dstImageIndex];
+
+	if (state->async || state->failed) return NULL;
+
+	// done with the previous frame
+	if (state->current)
+		raspicam_ring_release(&state->ring, state->current);
+
+	// NULL when the source ends while we wait
+	RASPICAM_RING_SLOT * slot = raspicam_ring_acquire(&state->ring, 1);
+	if (!slot)
+	{
+		state->current = NULL;
+		return NULL;
+	}
+	set_current(state, slot);
+	return state->current->image;
 }
 
 int raspiCamCvGrab(RaspiCamCvCapture * capture)
 {
-        VCOS_STATUS_T  status ;
-	RASPIVID_STATE * state = capture->pState;        
-	status = vcos_semaphore_trywait(&state->capture_done_sem);
-	if(status == VCOS_EAGAIN) return  0 ; //No frame available
-	vcos_semaphore_post(&state->capture_sem); // One frame is available, trigger capture of the next one
-        return 1 ;
+	RASPIVID_STATE * state = capture->pState;
+	if (state->async || state->failed) return 0;
+
+	RASPICAM_RING_SLOT * slot = raspicam_ring_acquire(&state->ring, 0);
+
+	if (!slot) return 0 ; //No frame available
+
+	if (state->current)
+		raspicam_ring_release(&state->ring, state->current);
+	set_current(state, slot);
+	return 1 ;
 }
 
 IplImage * raspiCamCvRetrieve(RaspiCamCvCapture * capture)
 {
 	RASPIVID_STATE * state = capture->pState;
-        return state->dstImages[state->dstImageIndex]; // retrieve last acquired frame
+	if (!state->current) return NULL;
+	return state->current->image; // retrieve last acquired frame
+}
+
+IplImage * raspiCamCvRetrievePlane(RaspiCamCvCapture * capture, int plane)
+{
+	RASPIVID_STATE * state = capture->pState;
+	if (!state->current || plane < 0 || plane > 2) return NULL;
+	return state->current->planes[plane];
+}
+
+int raspiCamCvRetrievePair(RaspiCamCvCapture * capture, IplImage ** full, IplImage ** small)
+{
+	RASPIVID_STATE * state = capture->pState;
+	RASPICAM_RING_SLOT * current = state->current;
+
+	if (!current || state->second_width <= 0) return 0;
+
+	if (!state->second_current || state->second_current->pts != current->pts)
+	{
+		if (state->second_current)
+			raspicam_ring_release(&state->second_ring, state->second_current);
+
+		// Both streams come from the same sensor frame, but not always in the same order
+		int64_t period = 1000000 / state->framerate;
+		state->second_current = raspicam_ring_acquire_match(&state->second_ring, current->pts, period / 2, 2 * period);
+		if (!state->second_current) return 0;
+	}
+
+	*full = current->image;
+	*small = state->second_current->image;
+	return 1;
+}
+
+void raspiCamCvReleaseFrame(RaspiCamCvCapture * capture, IplImage * image)
+{
+	RASPIVID_STATE * state = capture->pState;
+
+	if (!state->zero_copy || !state->current || state->current->image != image)
+		return;
+
+	raspicam_ring_release(&state->ring, state->current);
+	state->current = NULL;
+}
+
+RaspiCamCvFrame * raspiCamCvHoldFrame(RaspiCamCvCapture * capture)
+{
+	RASPIVID_STATE * state = capture->pState;
+	RASPICAM_RING_SLOT * slot = state->current;
+
+	if (!slot)
+		return NULL;
+	if (atomic_load(&state->held_frames) >= state->ring_depth - 1)
+	{
+		fprintf(stderr, "%s: A ring depth of %d can't hold more than %d frames\n", __func__,
+			state->ring_depth, state->ring_depth - 1);
+		return NULL;
+	}
+
+	// The slot stays with the consumer, out of the rotation, until it is given back
+	state->current = NULL;
+	atomic_fetch_add(&state->held_frames, 1);
+	return (RaspiCamCvFrame *)slot;
+}
+
+void raspiCamCvReleaseHeldFrame(RaspiCamCvCapture * capture, RaspiCamCvFrame * frame)
+{
+	RASPIVID_STATE * state = capture->pState;
+
+	if (!frame)
+		return;
+
+	raspicam_ring_release(&state->ring, (RASPICAM_RING_SLOT *)frame);
+	atomic_fetch_sub(&state->held_frames, 1);
+}
+
+void raspiCamCvGetCaptureStats(RaspiCamCvCapture * capture, RASPICAM_CAPTURE_STATS * stats)
+{
+	RASPIVID_STATE * state = capture->pState;
+
+	stats->frames_delivered = atomic_load(&state->frames_delivered);
+	stats->frames_dropped = atomic_load(&state->ring.dropped);
+	stats->bytes_copied = atomic_load(&state->bytes_copied);
+	raspicam_histogram_snapshot(&state->latency, &stats->latency);
+	raspicam_histogram_snapshot(&state->copy_time, &stats->copy_time);
+	raspicam_histogram_snapshot(&state->jitter, &stats->jitter);
 }
 
+void raspiCamCvResetCaptureStats(RaspiCamCvCapture * capture)
+{
+	RASPIVID_STATE * state = capture->pState;
+
+	raspicam_histogram_reset(&state->latency);
+	raspicam_histogram_reset(&state->copy_time);
+	raspicam_histogram_reset(&state->jitter);
+}
+
+void raspiCamCvGetMemoryStats(RaspiCamCvCapture * capture, RASPICAM_MEMORY_STATS * stats)
+{
+	RASPIVID_STATE * state = capture->pState;
+	RASPICAM_ARENA * arena = &state->arena;
+
+	pthread_mutex_lock(&arena->lock);
+	stats->arena_size = arena->size;
+	stats->in_use = arena->in_use;
+	stats->peak = arena->peak;
+	stats->buffers = arena->allocations;
+	pthread_mutex_unlock(&arena->lock);
+
+	stats->source_bytes = state->source.pool_bytes;
+	stats->ring_depth = state->ring.depth;
+	stats->locked = arena->locked;
+	stats->huge_pages = arena->huge_pages;
+}
+
+int raspiCamCvGetFrameTimes(RaspiCamCvCapture * capture, RASPICAM_FRAME_TIMES * times)
+{
+	RASPICAM_RING_SLOT * slot = capture->pState->current;
+
+	if (!slot)
+		return 0;
+
+	raspicam_ring_slot_times(slot, times);
+	return 1;
+}
+
+int raspiCamCvStartAsync(RaspiCamCvCapture * capture, RASPICAM_FRAME_CALLBACK callback, void * user, int nthreads)
+{
+	return raspiCamCvStartAsync2(capture, callback, NULL, user, nthreads, RASPICAM_ASYNC_DROP);
+}
+
+int raspiCamCvStartAsync2(RaspiCamCvCapture * capture, RASPICAM_FRAME_CALLBACK callback, RASPICAM_FRAME_CALLBACK complete,
+	void * user, int nthreads, int backpressure)
+{
+	RASPIVID_STATE * state = capture->pState;
+
+	if (state->async || state->failed)
+		return 0;
+	if (state->ring_depth - 1 < nthreads)
+		fprintf(stderr, "%s: A ring depth of %d keeps only %d of the %d workers busy\n", __func__,
+			state->ring_depth, state->ring_depth - 1, nthreads);
+
+	// The workers own every frame from now on
+	if (state->current)
+	{
+		raspicam_ring_release(&state->ring, state->current);
+		state->current = NULL;
+	}
+	if (state->second_current)
+	{
+		raspicam_ring_release(&state->second_ring, state->second_current);
+		state->second_current = NULL;
+	}
+
+	state->async = raspicam_async_start(&state->ring, &state->latency, callback, complete, user, nthreads, backpressure);
+	return state->async != NULL;
+}
+
+void raspiCamCvStopAsync(RaspiCamCvCapture * capture)
+{
+	RASPIVID_STATE * state = capture->pState;
+
+	if (!state->async)
+		return;
+
+	raspicam_async_stop(state->async);
+	state->async = NULL;
+}
+
+
+/**
+ * Add or remove the encoder. The source restarts, like for a size change.
+ *
+ * @param state Pointer to state control struct
+ * @param encoder RASPICAM_ENCODER_*, NONE to remove it
+ *
+ * @return 1 if successful
+ */
+static int set_encoder(RASPIVID_STATE * state, int encoder)
+{
+	RASPICAM_SOURCE * source = &state->source;
+	int retval = 1;
+
+	if (!source_running(state, __func__) || !consumer_idle(state, __func__))
+		return 0;
+	if (!source->ops->start_encoder || !source->ops->stop_encoder)
+	{
+		fprintf(stderr, "%s: The %s source has no encoder\n", __func__, source->ops->name);
+		return 0;
+	}
+
+	source->ops->stop(source);
+
+	// Every buffer goes back to the source, which may swap its pool
+	state->current = NULL;
+	raspicam_ring_reset(&state->ring);
+
+	if (state->encoder)
+		source->ops->stop_encoder(source);
+	state->encoder = RASPICAM_ENCODER_NONE;
+
+	if (encoder != RASPICAM_ENCODER_NONE)
+	{
+		source->motion_vectors = state->motion_enabled && state->motion_config.use_vectors;
+		if (source->ops->start_encoder(source, encoder, state->bitrate) == 0)
+		{
+			state->encoder = encoder;
+		}
+		else
+		{
+			fprintf(stderr, "%s: Failed to start the %s encoder of the %s source\n", __func__,
+				encoder == RASPICAM_ENCODER_H264 ? "H.264" : "MJPEG", source->ops->name);
+			retval = 0;
+		}
+	}
+
+	state->last_callback_us = 0;
+	if (restart_source(state, __func__) != 0)
+		return 0;
+	return retval;
+}
+
+int raspiCamCvStartEncoder(RaspiCamCvCapture * capture, int encoder, int fd)
+{
+	RASPIVID_STATE * state = capture->pState;
+
+	if (state->encoder || fd < 0 || (encoder != RASPICAM_ENCODER_H264 && encoder != RASPICAM_ENCODER_MJPEG))
+		return 0;
+
+	state->encoded_fd = fd;
+	state->encoded_callback = NULL;
+	state->encoded_user = NULL;
+	return set_encoder(state, encoder);
+}
+
+int raspiCamCvStartEncoder2(RaspiCamCvCapture * capture, int encoder, RASPICAM_ENCODED_CALLBACK callback, void * user)
+{
+	RASPIVID_STATE * state = capture->pState;
+
+	if (state->encoder || (encoder != RASPICAM_ENCODER_H264 && encoder != RASPICAM_ENCODER_MJPEG))
+		return 0;
+
+	state->encoded_fd = -1;
+	state->encoded_callback = callback;
+	state->encoded_user = user;
+	return set_encoder(state, encoder);
+}
+
+void raspiCamCvStopEncoder(RaspiCamCvCapture * capture)
+{
+	RASPIVID_STATE * state = capture->pState;
+
+	if (state->encoder)
+		set_encoder(state, RASPICAM_ENCODER_NONE);
+}
+
+int raspiCamCvSetMotionDetect(RaspiCamCvCapture * capture, const RASPICAM_MOTION_CONFIG * config)
+{
+	RASPIVID_STATE * state = capture->pState;
+	RASPICAM_SOURCE * source = &state->source;
+	int vectors = config && config->use_vectors;
+	int retval = 1;
+
+	if (!source_running(state, __func__) || !consumer_idle(state, __func__))
+		return 0;
+
+	source->ops->stop(source);
+
+	// The maps of the slots go with the frames in them
+	state->current = NULL;
+	raspicam_ring_reset(&state->ring);
+	release_motion(state);
+
+	state->motion_enabled = config != NULL;
+	if (config)
+	{
+		state->motion_config = *config;
+		retval = setup_motion(state) == 0;
+	}
+
+	// The encoder is set up again to add or remove its motion vectors
+	if (state->encoder == RASPICAM_ENCODER_H264 && source->motion_vectors != (state->motion_enabled && vectors))
+	{
+		source->ops->stop_encoder(source);
+		source->motion_vectors = state->motion_enabled && vectors;
+		if (source->ops->start_encoder(source, state->encoder, state->bitrate) != 0)
+		{
+			fprintf(stderr, "%s: Failed to restart the encoder\n", __func__);
+			state->encoder = RASPICAM_ENCODER_NONE;
+		}
+	}
+
+	state->last_callback_us = 0;
+	if (restart_source(state, __func__) != 0)
+		return 0;
+	return retval;
+}
+
+int raspiCamCvGetMotionMap(RaspiCamCvCapture * capture, const unsigned char ** map, int * blocks_x, int * blocks_y)
+{
+	RASPIVID_STATE * state = capture->pState;
+
+	if (!state->motion_enabled || !state->current || !state->current->motion)
+		return -1;
+
+	*map = state->current->motion;
+	*blocks_x = state->motion.blocks_x;
+	*blocks_y = state->motion.blocks_y;
+	return state->current->changed_blocks;
+}
+
+int raspiCamCvSetClipRing(RaspiCamCvCapture * capture, double seconds)
+{
+	RASPIVID_STATE * state = capture->pState;
+
+	if (seconds <= 0)
+		return raspicam_clip_configure(&state->clip, 0, 0) == 0;
+
+	// Keyframes and rate control overshoot take more than the average bitrate
+	size_t size = (size_t)(seconds * state->bitrate / 8 * CLIP_BITRATE_MARGIN);
+	// Headers, and frames the encoder outputs in several parts
+	unsigned int max_chunks = (unsigned int)(seconds * state->framerate * CLIP_CHUNKS_PER_FRAME);
+
+	return raspicam_clip_configure(&state->clip, size, max_chunks) == 0;
+}
+
+int raspiCamCvDumpRing(RaspiCamCvCapture * capture, double seconds_before, double seconds_after,
+	RASPICAM_ENCODED_CALLBACK sink, void * user)
+{
+	RASPIVID_STATE * state = capture->pState;
+
+	if (seconds_before < 0 || seconds_after < 0)
+		return 0;
+	return raspicam_clip_dump(&state->clip, (int64_t)(seconds_before * 1000000), (int64_t)(seconds_after * 1000000), sink, user);
+}
+
+
+int raspiCamCvPinCallback(RaspiCamCvCapture * capture, int cpu)
+{
+	RASPIVID_STATE * state = capture->pState;
+
+	if (cpu < -1 || cpu >= sysconf(_SC_NPROCESSORS_CONF))
+		return 0;
+
+	// Applied by the source thread at its next frame
+	state->cpu = cpu;
+	return 1;
+}
 
 void raspiCamCvSetFlashPattern(unsigned char * pattern, unsigned char pattern_length){
-         flash_set_pattern(pattern, pattern_length);
+         pthread_once(&default_flash_once, open_default_flash);
+         flash_set_pattern(&default_flash, pattern, pattern_length);
 }
 
 unsigned char raspiCamCvFlashEnable(unsigned char pin){
-        unsigned char index = flash_init(pin);
+        pthread_once(&default_flash_once, open_default_flash);
+        unsigned char index = flash_init(&default_flash, pin);
+	return index ;
+}
+
+void raspiCamCvSetFlashPattern2(RaspiCamCvCapture * capture, unsigned char * pattern, unsigned char pattern_length){
+         flash_set_pattern(&capture->pState->flash, pattern, pattern_length);
+}
+
+unsigned char raspiCamCvFlashEnable2(RaspiCamCvCapture * capture, unsigned char pin){
+        unsigned char index = flash_init(&capture->pState->flash, pin);
 	return index ;
 }
+
+/**
+ * The flash switched at the exposures of a capture: its own, or the one of camera 0
+ */
+static RASPICAM_FLASH * strobe_flash(RASPIVID_STATE * state)
+{
+	if (state->flash.nb_output == 0 && state->camera_num == 0)
+		return &default_flash;
+	return &state->flash;
+}
+
+void raspiCamCvSetStrobeTiming(RaspiCamCvCapture * capture, int lead_us, int pulse_us)
+{
+	flash_set_timing(strobe_flash(capture->pState), lead_us, pulse_us);
+}
+
+void raspiCamCvGetStrobeStats(RaspiCamCvCapture * capture, RASPICAM_STROBE_STATS * stats)
+{
+	flash_stats(strobe_flash(capture->pState), stats);
+}
+
+void raspiCamCvUseMockGpio(void)
+{
+	flash_use_mock_gpio();
+}
+
+int raspiCamCvGetMockGpioEvents(RASPICAM_GPIO_EVENT * events, int max)
+{
+	return flash_mock_events(events, max);
+}
@@ -7,6 +7,86 @@ extern "C" {
 
 typedef struct _RASPIVID_STATE RASPIVID_STATE;
 
+// Frame sources, see RASPIVID_CONFIG.source
+enum
+{
+	RASPICAM_SOURCE_CAMERA = 0,		// MMAL camera
+	RASPICAM_SOURCE_SYNTHETIC = 1,	// Software generated frames, no camera needed. source_arg: gradient, bars, checker or noise
+	RASPICAM_SOURCE_FILE = 2,		// Replay of a Y4M or raw file. source_arg: file name
+};
+
+// Consumer policies, see RASPIVID_CONFIG.frame_policy
+enum
+{
+	RASPICAM_FRAME_LATEST = 0,		// Always return the newest frame, older unread frames are dropped
+	RASPICAM_FRAME_EVERY = 1,		// Return frames in order, new frames are dropped while the ring is full
+};
+
+// Image formats, see RASPIVID_CONFIG.format
+enum
+{
+	RASPICAM_FORMAT_PACKED = 0,		// 3 channel pixels, or gray in monochrome mode
+	RASPICAM_FORMAT_I420 = 1,		// Y, U and V planes. Images are the Y plane, see raspiCamCvRetrievePlane
+	RASPICAM_FORMAT_NV12 = 2,		// Y plane and interleaved UV plane. Images are the Y plane
+};
+
+// Row layout of RASPICAM_FORMAT_PACKED images, see RASPIVID_CONFIG.layout
+enum
+{
+	RASPICAM_LAYOUT_DEFAULT = 0,	// Padded for raspiCamCvCreateCameraCapture/2, packed for raspiCamCvCreateCameraCapture3
+	RASPICAM_LAYOUT_PADDED = 1,		// Rows keep the 32 pixel aligned camera stride, the frame is copied in one block
+	RASPICAM_LAYOUT_PACKED = 2,		// widthStep is the image width, rows are repacked
+};
+
+// Color conversion of RASPICAM_FORMAT_PACKED color images, see RASPIVID_CONFIG.convert
+enum
+{
+	RASPICAM_CONVERT_NONE = 0,		// RGB24 as the camera delivers it
+	RASPICAM_CONVERT_BGR = 1,		// Swap red and blue on the CPU, for OpenCV's BGR order
+	RASPICAM_CONVERT_I420_BGR = 2,	// The camera delivers I420, half the bandwidth, and the CPU converts it to BGR
+};
+
+// Planes of the YUV formats, see raspiCamCvRetrievePlane
+enum
+{
+	RASPICAM_PLANE_Y = 0,
+	RASPICAM_PLANE_U = 1,
+	RASPICAM_PLANE_V = 2,
+	RASPICAM_PLANE_UV = 1,			// NV12: 2 channel image, U then V
+};
+
+// What happens to new frames while every in flight frame is still processed, see raspiCamCvStartAsync2
+enum
+{
+	RASPICAM_ASYNC_DROP = 0,		// Frames are dropped according to RASPIVID_CONFIG.frame_policy
+	RASPICAM_ASYNC_BLOCK = 1,		// The source waits for a free slot, every frame is processed
+};
+
+// Encoders of raspiCamCvStartEncoder
+enum
+{
+	RASPICAM_ENCODER_NONE = 0,
+	RASPICAM_ENCODER_H264 = 1,
+	RASPICAM_ENCODER_MJPEG = 2,
+};
+
+// Flags of the encoded data, see RASPICAM_ENCODED_CALLBACK
+enum
+{
+	RASPICAM_ENCODED_CONFIG = 1,	// Stream headers: H.264 SPS and PPS, repeated before each keyframe
+	RASPICAM_ENCODED_KEYFRAME = 2,	// Part of a frame decodable on its own
+	RASPICAM_ENCODED_FRAME_END = 4,	// Last part of a frame
+	RASPICAM_ENCODED_CLIP_END = 8,	// End of a raspiCamCvDumpRing clip, without data
+};
+
+// Backing of the frame buffers, see RASPIVID_CONFIG.memory_flags
+enum
+{
+	RASPICAM_MEMORY_LOCK = 1,		// Lock the arena in RAM, it is never swapped out
+	RASPICAM_MEMORY_HUGE_PAGES = 2,	// Back the arena with huge pages, or transparent huge pages when there are none
+};
+
+// Fields left to zero keep their default value.
 typedef struct
 {
 	int width;
@@ -14,6 +94,23 @@ typedef struct
 	int bitrate;
 	int framerate;
 	int monochrome;
+	int zero_copy;	// Return images wrapping the camera buffers instead of copies. See raspiCamCvReleaseFrame
+	int source;		// RASPICAM_SOURCE_*
+	int ring_depth;	// Frames buffered between the camera and the consumer, 2 to 16. Default 3
+	int frame_policy;	// RASPICAM_FRAME_*
+	const char * source_arg;	// Source specific, see RASPICAM_SOURCE_*
+	int format;		// RASPICAM_FORMAT_*
+	int second_width;	// Second, downscaled stream of the same frames, see raspiCamCvRetrievePair
+	int second_height;
+	int layout;		// RASPICAM_LAYOUT_*. Ignored in zero-copy mode, images keep the camera stride
+	int convert;	// RASPICAM_CONVERT_*. Disables zero-copy
+	int roi_x;		// Region of interest of the width x height frame: images are roi_width x roi_height, cut
+	int roi_y;		// by the camera so only its pixels are transferred and copied. roi_width 0 for the full
+	int roi_width;	// frame. Rounded down to even pixels. See raspiCamCvSetROI
+	int roi_height;
+	long long max_memory;	// Bytes of frame buffers at most, 0 for no limit. They then come from one arena of
+							// that size, and the ring depth is cut to fit. See raspiCamCvGetMemoryStats
+	int memory_flags;		// RASPICAM_MEMORY_*, with max_memory
 } RASPIVID_CONFIG;
 
 enum exposure_mode {
@@ -53,6 +150,75 @@ typedef struct {
 
 typedef struct _IplImage IplImage;
 
+// Capture instrumentation. Times are in microseconds, from CLOCK_MONOTONIC unless noted.
+#define RASPICAM_STATS_BINS 24
+
+typedef struct
+{
+	unsigned int count;		// Samples in the window (last 512 frames)
+	double mean;
+	double min;
+	double max;
+	double p50;
+	double p99;
+	unsigned int bins [RASPICAM_STATS_BINS];	// bins[0]: 0-1us, bins[k]: 2^k to 2^(k+1)-1 us, last bin: everything above
+} RASPICAM_HISTOGRAM;
+
+typedef struct
+{
+	unsigned int frames_delivered;	// Frames received from the source
+	unsigned int frames_dropped;	// Same as RPI_CAP_PROP_DROPPED_FRAMES
+	unsigned long long bytes_copied;	// Frame data copied into the ring, 0 in zero-copy mode
+	RASPICAM_HISTOGRAM latency;		// Source callback to consumer pickup
+	RASPICAM_HISTOGRAM copy_time;	// Callback entry to frame ready in the ring
+	RASPICAM_HISTOGRAM jitter;		// Deviation of the callback interval from 1/framerate
+} RASPICAM_CAPTURE_STATS;
+
+// Settings the sensor used for a frame, as the camera reports them
+typedef struct
+{
+	int valid;				// 0 until the source reported its settings
+	unsigned int exposure;	// Exposure time, microseconds
+	float analog_gain;
+	float digital_gain;
+	float awb_red_gain;		// White balance gains applied to red and blue
+	float awb_blue_gain;
+	unsigned int colour_temperature;	// Kelvin, 0 when the source doesn't report it
+	unsigned int focus_position;
+} RASPICAM_FRAME_METADATA;
+
+// Frame buffer memory, see raspiCamCvGetMemoryStats
+typedef struct
+{
+	long long arena_size;	// Bytes reserved for the buffers, 0 without max_memory
+	long long in_use;		// Buffers allocated now, the steady state while capturing
+	long long peak;			// Most allocated at once, during setup and size changes
+	long long source_bytes;	// Buffers the source keeps outside the arena, the MMAL pools in GPU memory
+	int buffers;			// Buffers allocated now
+	int ring_depth;			// Ring depth, after the max_memory cut
+	int locked;				// The arena is locked in RAM
+	int huge_pages;			// The arena is backed by huge pages
+} RASPICAM_MEMORY_STATS;
+
+typedef struct
+{
+	long long pts;			// Sensor presentation timestamp, camera clock
+	long long callback;		// Source callback entry
+	long long copied;		// Frame ready in the ring
+	long long pickup;		// Handed out to the consumer
+	unsigned int sequence;	// Frame sequence number, gaps are frames dropped or skipped by motion detection
+	int changed_blocks;		// Blocks the motion detector found changed, -1 when it is off
+	RASPICAM_FRAME_METADATA metadata;	// Sensor settings, the last ones reported when the frame came
+} RASPICAM_FRAME_TIMES;
+
+// Asynchronous mode callback. The image and times are valid until the callback of the frame returns,
+// or its completion callback when there is one.
+typedef void (*RASPICAM_FRAME_CALLBACK)(void * user, IplImage * image, const RASPICAM_FRAME_TIMES * times);
+
+// Encoder output callback, called from the source thread. A frame may come in several parts.
+// pts is the sensor timestamp of the frame in microseconds, -1 for stream headers.
+typedef void (*RASPICAM_ENCODED_CALLBACK)(void * user, const unsigned char * data, int length, long long pts, int flags);
+
 // Mirror of CV_CAP_PROP_* properties in opencv's highgui_c.h
 enum
 {
@@ -65,8 +231,39 @@ enum
     RPI_CAP_PROP_CONTRAST      =11,
     RPI_CAP_PROP_SATURATION    =12,
     RPI_CAP_PROP_HUE           =13,
-    RPI_CAP_PROP_GAIN          =14,
-    RPI_CAP_PROP_EXPOSURE      =15,
+    RPI_CAP_PROP_GAIN          =14,	// get: analog * digital gain of the current frame
+    RPI_CAP_PROP_EXPOSURE      =15,	// Shutter speed in microseconds, 0 for auto. get: exposure of the current frame if known
+
+    // RaspiCamCV specific
+    RPI_CAP_PROP_DROPPED_FRAMES =1000,	// Frames lost because the consumer was too slow
+    RPI_CAP_PROP_FRAMES_DELIVERED,		// Frames received from the source
+    RPI_CAP_PROP_LATENCY_P50,			// Source callback to consumer pickup, microseconds
+    RPI_CAP_PROP_LATENCY_P99,
+    RPI_CAP_PROP_COPY_TIME_P50,			// Callback entry to frame ready, microseconds
+    RPI_CAP_PROP_COPY_TIME_P99,
+    RPI_CAP_PROP_JITTER_P50,			// Callback interval deviation from 1/fps, microseconds
+    RPI_CAP_PROP_JITTER_P99,
+    RPI_CAP_PROP_FRAME_PTS,				// Sensor timestamp of the current frame, microseconds
+    RPI_CAP_PROP_RECONFIGURE_TIME,		// Duration of the last size, fps or color mode change, microseconds
+    RPI_CAP_PROP_BYTES_COPIED,			// Frame data copied into the ring so far
+    RPI_CAP_PROP_BYTES_ENCODED,			// Encoder output so far
+    RPI_CAP_PROP_CLIP_DURATION,			// Encoded video in the pre-trigger ring, microseconds
+    RPI_CAP_PROP_CLIP_DROPPED,			// Encoder output the pre-trigger ring couldn't keep during dumps
+    RPI_CAP_PROP_RESTART_TIME,			// Duration of the last raspiCamCvRestart, microseconds
+    RPI_CAP_PROP_ROI_X,					// Region of interest in the frame, see raspiCamCvSetROI.
+    RPI_CAP_PROP_ROI_Y,					// Setting X or Y moves it without a restart
+    RPI_CAP_PROP_ROI_WIDTH,
+    RPI_CAP_PROP_ROI_HEIGHT,
+    RPI_CAP_PROP_MOTION_BLOCKS,			// Changed blocks of the current frame, -1 without motion detection
+    RPI_CAP_PROP_STILL_FRAMES,			// Frames the motion detector kept from the consumer
+    RPI_CAP_PROP_ANALOG_GAIN,			// Sensor settings of the current frame, see RASPICAM_FRAME_METADATA
+    RPI_CAP_PROP_DIGITAL_GAIN,
+    RPI_CAP_PROP_AWB_RED_GAIN,
+    RPI_CAP_PROP_AWB_BLUE_GAIN,
+    RPI_CAP_PROP_COLOUR_TEMPERATURE,
+    RPI_CAP_PROP_FRAME_SEQUENCE,		// Sequence number of the current frame, counting the frames that were dropped
+    RPI_CAP_PROP_MEMORY_IN_USE,			// Frame buffer bytes, see raspiCamCvGetMemoryStats
+    RPI_CAP_PROP_MEMORY_PEAK,
 
 };
 
@@ -76,13 +273,157 @@ RaspiCamCvCapture * raspiCamCvCreateCameraCapture(int index);
 void raspiCamCvReleaseCapture(RaspiCamCvCapture ** capture);
 double raspiCamCvGetCaptureProperty(RaspiCamCvCapture * capture, int property_id);
 int raspiCamCvSetCaptureProperty(RaspiCamCvCapture * capture, int property_id, double value);
+// Change width and height with a single restart. Returns 1 on success
+// The size is the frame size: a region of interest is turned off, like with RPI_CAP_PROP_FRAME_WIDTH/HEIGHT.
+int raspiCamCvSetCaptureSize(RaspiCamCvCapture * capture, int width, int height);
+// Capture a region of the frame only, 0 width or height for the full frame. Images take the size of the
+// region. Moving it without a size change is applied on the fly, from the next frames on; a new size
+// restarts the capture like raspiCamCvSetCaptureSize. Returns 1 on success
+int raspiCamCvSetROI(RaspiCamCvCapture * capture, int x, int y, int width, int height);
+// Stop and start the capture again, for a watchdog. The images, ring and source buffers are reused;
+// a source that doesn't start is closed and opened again. Frames from before are gone. Returns 1 on
+// success. A blocking capture also fails when no frame comes within 2 seconds.
+// When the source can't be started again, here or by a size, encoder or motion detection change, the
+// capture fails: Query returns NULL and Grab 0, and changes are refused until a raspiCamCvRestart works.
+int raspiCamCvRestart(RaspiCamCvCapture * capture);
 IplImage * raspiCamCvQueryFrame(RaspiCamCvCapture * capture);
 
 int raspiCamCvGrab(RaspiCamCvCapture * capture);
 IplImage * raspiCamCvRetrieve(RaspiCamCvCapture * capture);
+// YUV formats: plane of the frame last returned by raspiCamCvQueryFrame/raspiCamCvRetrieve, a view
+// into the same buffer as the image. Rows keep the camera stride. NULL if there is no such plane.
+IplImage * raspiCamCvRetrievePlane(RaspiCamCvCapture * capture, int plane);
+// Second stream: the frame last returned by raspiCamCvQueryFrame/raspiCamCvGrab and its downscaled copy,
+// with the same timestamp. Waits up to two frame periods for it. Returns 0 if there is no match.
+int raspiCamCvRetrievePair(RaspiCamCvCapture * capture, IplImage ** full, IplImage ** small);
+
+// Zero-copy mode: give the buffer behind an image returned by raspiCamCvQueryFrame/raspiCamCvRetrieve
+// back to the camera. Optional, the previous frame is released when the next one is queried.
+void raspiCamCvReleaseFrame(RaspiCamCvCapture * capture, IplImage * image);
+
+// Keep the frame last returned by raspiCamCvQueryFrame/raspiCamCvRetrieve past the next one: the capture lets go of
+// it, and its image, planes and buffer stay valid until raspiCamCvReleaseHeldFrame, from any thread. The ring
+// has one slot less meanwhile, at most ring_depth - 1 frames can be held. Size changes, restarts, encoder
+// and motion detection changes fail while frames are held. NULL if there is no current frame, or too many are held.
+typedef struct _RaspiCamCvFrame RaspiCamCvFrame;
+RaspiCamCvFrame * raspiCamCvHoldFrame(RaspiCamCvCapture * capture);
+void raspiCamCvReleaseHeldFrame(RaspiCamCvCapture * capture, RaspiCamCvFrame * frame);
+
+// Capture instrumentation
+void raspiCamCvGetCaptureStats(RaspiCamCvCapture * capture, RASPICAM_CAPTURE_STATS * stats);
+void raspiCamCvResetCaptureStats(RaspiCamCvCapture * capture);
+void raspiCamCvGetMemoryStats(RaspiCamCvCapture * capture, RASPICAM_MEMORY_STATS * stats);
+// Timestamps of the frame last returned by raspiCamCvQueryFrame/raspiCamCvRetrieve. Returns 0 if there is none.
+int raspiCamCvGetFrameTimes(RaspiCamCvCapture * capture, RASPICAM_FRAME_TIMES * times);
+
+// Asynchronous mode: callback runs on one of nthreads workers for each frame, several frames at once.
+// At most ring_depth - 1 frames are in flight. Query, Grab and Retrieve return nothing until
+// raspiCamCvStopAsync. Returns 1 on success.
+int raspiCamCvStartAsync(RaspiCamCvCapture * capture, RASPICAM_FRAME_CALLBACK callback, void * user, int nthreads);
+// Same, with complete called after callback for each frame, in frame order and one at a time. May be NULL.
+// backpressure is RASPICAM_ASYNC_*
+int raspiCamCvStartAsync2(RaspiCamCvCapture * capture, RASPICAM_FRAME_CALLBACK callback, RASPICAM_FRAME_CALLBACK complete,
+	void * user, int nthreads, int backpressure);
+// Wait for the frames in flight and go back to Query/Grab/Retrieve
+void raspiCamCvStopAsync(RaspiCamCvCapture * capture);
 
+// Encoder: compress the frames at RPI_CAP_PROP_BITRATE next to the raw stream, RASPICAM_ENCODER_*.
+// The output is written to fd, which stays open. The capture restarts, like a size change. Returns 1 on success.
+int raspiCamCvStartEncoder(RaspiCamCvCapture * capture, int encoder, int fd);
+// Same, with the output passed to callback. NULL keeps it in the pre-trigger ring only.
+int raspiCamCvStartEncoder2(RaspiCamCvCapture * capture, int encoder, RASPICAM_ENCODED_CALLBACK callback, void * user);
+void raspiCamCvStopEncoder(RaspiCamCvCapture * capture);
+
+// Motion detection, see raspiCamCvSetMotionDetect. Fields left to zero keep their default value.
+typedef struct
+{
+	int block_size;		// Block side in pixels, rounded up to a multiple of 16, at most 128. Default 16
+	int threshold;		// Mean absolute difference per byte over a block that marks it changed. Default 8
+	int min_blocks;		// Changed blocks that make a frame worth handing out. Default 1
+	int use_vectors;	// While the H.264 encoder runs, use its motion vectors instead, one frame late
+} RASPICAM_MOTION_CONFIG;
+
+// Hand out only the frames that changed since the last one handed out, compared block by block on the
+// luma plane, or the RGB bytes in the packed color formats. The others never reach the ring, so the
+// consumer sleeps through still scenes. NULL turns it off. The capture restarts, like a size change.
+// Returns 1 on success.
+int raspiCamCvSetMotionDetect(RaspiCamCvCapture * capture, const RASPICAM_MOTION_CONFIG * config);
+// Changed block map of the frame last returned by raspiCamCvQueryFrame/raspiCamCvRetrieve: blocks_x * blocks_y
+// bytes row by row, 1 for a changed block. Valid until the next frame. Returns the number of changed blocks,
+// -1 without motion detection.
+int raspiCamCvGetMotionMap(RaspiCamCvCapture * capture, const unsigned char ** map, int * blocks_x, int * blocks_y);
+
+// Pre-trigger ring: keep the last seconds of encoder output in memory, sized from RPI_CAP_PROP_BITRATE
+// and RPI_CAP_PROP_FPS when called. 0 frees it. Returns 1 on success.
+int raspiCamCvSetClipRing(RaspiCamCvCapture * capture, double seconds);
+// Stream a clip from the pre-trigger ring: from the keyframe before seconds_before the newest frame, to
+// seconds_after it. sink is called from a library thread while the capture goes on, last with
+// RASPICAM_ENCODED_CLIP_END. Returns 0 if there is nothing to dump yet, or a dump is running.
+int raspiCamCvDumpRing(RaspiCamCvCapture * capture, double seconds_before, double seconds_after,
+	RASPICAM_ENCODED_CALLBACK sink, void * user);
+
+// Deliver the frames on one core, -1 for any. With the camera, the MMAL callback thread is pinned.
+// -1 after a core lets the pinned thread run on every core again.
+// Returns 1 on success.
+int raspiCamCvPinCallback(RaspiCamCvCapture * capture, int cpu);
+
+// Several cameras, on a Compute Module: one capture each, and frame sets matched on their timestamps
+typedef struct _RaspiCamCvMultiCapture RaspiCamCvMultiCapture;
+
+typedef struct
+{
+	unsigned int sets;			// Frame sets returned
+	unsigned int discarded;		// Frames skipped to match the other cameras
+	RASPICAM_HISTOGRAM skew;	// Spread of the timestamps in a set, microseconds
+} RASPICAM_FRAME_SET_STATS;
+
+// Open cameras 0 to count - 1 with the same config. Frames of camera i are delivered on core cpus[i],
+// -1 or NULL cpus for any. The frames of a set are at most skew_us apart, 0 for half a frame period.
+RaspiCamCvMultiCapture * raspiCamCvCreateMultiCapture(int count, RASPIVID_CONFIG * config, const int * cpus, int skew_us);
+void raspiCamCvReleaseMultiCapture(RaspiCamCvMultiCapture ** multi);
+// The capture of one camera, for its properties and settings
+RaspiCamCvCapture * raspiCamCvMultiCaptureCamera(RaspiCamCvMultiCapture * multi, int camera);
+// Next set of frames, one per camera in images, and their times if not NULL. Valid until the next call.
+// Returns 1 on success, 0 if the timestamps never come within the skew.
+int raspiCamCvQueryFrameSet(RaspiCamCvMultiCapture * multi, IplImage ** images, RASPICAM_FRAME_TIMES * times);
+void raspiCamCvGetFrameSetStats(RaspiCamCvMultiCapture * multi, RASPICAM_FRAME_SET_STATS * stats);
+
+// Flash outputs of camera 0: a strobe thread switches them to the next pattern entry at the predicted
+// start of each exposure. Bit i of an entry is output i. The pattern is copied, and replaces the current
+// one at the next frame.
 void raspiCamCvSetFlashPattern(unsigned char * pattern, unsigned char pattern_length);
 unsigned char raspiCamCvFlashEnable(unsigned char pin);
+// Same, for the exposures of one capture
+void raspiCamCvSetFlashPattern2(RaspiCamCvCapture * capture, unsigned char * pattern, unsigned char pattern_length);
+unsigned char raspiCamCvFlashEnable2(RaspiCamCvCapture * capture, unsigned char pin);
+
+typedef struct
+{
+	unsigned int switches;		// Pattern entries applied
+	unsigned int missed;		// Exposures that started before their switch could happen
+	long long period_us;		// Frame period measured from the timestamps
+	long long last_offset_us;	// Last switch minus the exposure start measured from its frame, positive when late
+	RASPICAM_HISTOGRAM offset;	// |switch - exposure start|, microseconds
+} RASPICAM_STROBE_STATS;
+
+// Exposure start to frame callback, 0 for one frame period. pulse_us turns the outputs off that long after
+// each switch, 0 holds them until the next one. Applies to the flash of the capture, or of camera 0.
+void raspiCamCvSetStrobeTiming(RaspiCamCvCapture * capture, int lead_us, int pulse_us);
+void raspiCamCvGetStrobeStats(RaspiCamCvCapture * capture, RASPICAM_STROBE_STATS * stats);
+
+// Pin write recorded by the mock GPIO backend
+typedef struct
+{
+	int pin;
+	int value;
+	long long time_us;			// CLOCK_MONOTONIC
+} RASPICAM_GPIO_EVENT;
+
+// Record the flash pin writes instead of using wiringPi, for tests. Call before the first FlashEnable.
+// Builds without wiringPi always record.
+void raspiCamCvUseMockGpio(void);
+// The last recorded writes, oldest first. Returns how many were copied to events.
+int raspiCamCvGetMockGpioEvents(RASPICAM_GPIO_EVENT * events, int max);
 
 #ifdef __cplusplus
 }
@@ -0,0 +1,255 @@
+/*
+
+ Copyright (c) by Emil Valkov,
+ All rights reserved.
+
+ License: http://www.opensource.org/licenses/bsd-license.php
+
+ C++ interface of RaspiCamCV: cv::Mat frames, cv::VideoCapture style calls.
+ Header only, link with libraspicamcv as for the C interface. Needs C++11.
+
+*/
+
+#ifndef __RaspiCamCV_hpp__
+#define __RaspiCamCV_hpp__
+
+#include <opencv2/core/core.hpp>
+#include <cv.h>
+#include "RaspiCamCV.h"
+
+namespace raspicamcv {
+
+class RaspiCam;
+
+/*
+ * A frame held out of the capture ring: mat() is a view of the ring slot, or
+ * of the camera buffer in zero-copy mode, never a copy. The buffer goes back
+ * to the capture when the Frame is destroyed or reset. Frames are moved, not
+ * copied, and must be released before their RaspiCam.
+ */
+class Frame {
+public:
+	Frame() : fCapture(0), fFrame(0) {}
+	~Frame() {reset();}
+
+	Frame(Frame && other) noexcept : fCapture(0), fFrame(0) {swap(other);}
+	Frame & operator=(Frame && other) noexcept {
+		if (this != &other) {
+			reset();
+			swap(other);
+		}
+		return *this;
+	}
+	Frame(const Frame &) = delete;
+	Frame & operator=(const Frame &) = delete;
+
+	/// Give the buffer back to the capture
+	void reset() {
+		if (fFrame)
+			raspiCamCvReleaseHeldFrame(fCapture, fFrame);
+		fCapture = 0;
+		fFrame = 0;
+		fMat.release();
+		for (int i = 0; i < 3; i++)
+			fPlanes[i].release();
+	}
+
+	bool empty() const {return fFrame == 0;}
+
+	/// The image, valid as long as the Frame holds it. A YUV format gives the Y plane.
+	const cv::Mat & mat() const {return fMat;}
+	operator const cv::Mat & () const {return fMat;}
+
+	/// YUV formats: RASPICAM_PLANE_*, empty if there is no such plane
+	const cv::Mat & plane(int plane) const {
+		static const cv::Mat none;
+		return plane >= 0 && plane < 3 ? fPlanes[plane] : none;
+	}
+
+	const RASPICAM_FRAME_TIMES & times() const {return fTimes;}
+	long long pts() const {return fTimes.pts;}
+	/// Sensor settings, check metadata().valid
+	const RASPICAM_FRAME_METADATA & metadata() const {return fTimes.metadata;}
+
+	void swap(Frame & other) noexcept {
+		std::swap(fCapture, other.fCapture);
+		std::swap(fFrame, other.fFrame);
+		std::swap(fTimes, other.fTimes);
+		fMat.swap(other.fMat);
+		for (int i = 0; i < 3; i++)
+			fPlanes[i].swap(other.fPlanes[i]);
+	}
+
+	/// Header over an image of the capture, no copy
+	static cv::Mat wrap(const IplImage * image) {
+		if (!image)
+			return cv::Mat();
+		return cv::Mat(image->height, image->width, CV_8UC(image->nChannels), image->imageData, image->widthStep);
+	}
+
+private:
+	friend class RaspiCam;
+
+	RaspiCamCvCapture * fCapture;
+	RaspiCamCvFrame * fFrame;
+	RASPICAM_FRAME_TIMES fTimes;
+	cv::Mat fMat;
+	cv::Mat fPlanes [3];
+};
+
+/*
+ * A capture, opened like cv::VideoCapture. grab, retrieve and read keep the
+ * VideoCapture semantics: retrieve copies into the destination, which is only
+ * allocated when its size or type changes. read(Frame &) and frame() hand the
+ * frame out without a copy instead.
+ */
+class RaspiCam {
+public:
+	RaspiCam() : fCapture(0), fGrabbed(false) {}
+	explicit RaspiCam(int index, RASPIVID_CONFIG * config = 0, RASPIVID_PROPERTIES * properties = 0)
+		: fCapture(0), fGrabbed(false) {
+		open(index, config, properties);
+	}
+	~RaspiCam() {release();}
+
+	RaspiCam(RaspiCam && other) noexcept : fCapture(other.fCapture), fGrabbed(other.fGrabbed) {
+		other.fCapture = 0;
+		other.fGrabbed = false;
+	}
+	RaspiCam & operator=(RaspiCam && other) noexcept {
+		if (this != &other) {
+			release();
+			std::swap(fCapture, other.fCapture);
+			std::swap(fGrabbed, other.fGrabbed);
+		}
+		return *this;
+	}
+	RaspiCam(const RaspiCam &) = delete;
+	RaspiCam & operator=(const RaspiCam &) = delete;
+
+	/**
+	 * Open a camera, or another source picked by config->source
+	 *
+	 * @param index Camera index
+	 * @param config Configuration, NULL for defaults
+	 * @param properties Camera properties, NULL for defaults
+	 *
+	 * @return true on success
+	 */
+	bool open(int index = 0, RASPIVID_CONFIG * config = 0, RASPIVID_PROPERTIES * properties = 0) {
+		release();
+		fCapture = raspiCamCvCreateCameraCapture3(index, config, properties, 0);
+		return fCapture != 0;
+	}
+
+	bool isOpened() const {return fCapture != 0;}
+
+	/// Close the capture. Held Frames must be gone.
+	void release() {
+		if (fCapture)
+			raspiCamCvReleaseCapture(&fCapture);
+		fGrabbed = false;
+	}
+
+	/// Wait for the next frame
+	bool grab() {
+		fGrabbed = fCapture && raspiCamCvQueryFrame(fCapture) != 0;
+		return fGrabbed;
+	}
+
+	/// Take the next frame if there is one already, without waiting
+	bool tryGrab() {
+		fGrabbed = fCapture && raspiCamCvGrab(fCapture);
+		return fGrabbed;
+	}
+
+	/// Copy the grabbed frame into image, reusing its buffer. channel is a RASPICAM_PLANE_* in the YUV formats.
+	bool retrieve(cv::OutputArray image, int channel = 0) {
+		IplImage * frame = 0;
+
+		if (fGrabbed)
+			frame = channel ? raspiCamCvRetrievePlane(fCapture, channel) : raspiCamCvRetrieve(fCapture);
+		if (!frame) {
+			image.release();
+			return false;
+		}
+		Frame::wrap(frame).copyTo(image);
+		return true;
+	}
+
+	/// Hand the grabbed frame out without a copy. The capture lets go of it.
+	bool retrieve(Frame & frame) {
+		frame.reset();
+		if (!fGrabbed)
+			return false;
+
+		IplImage * image = raspiCamCvRetrieve(fCapture);
+		if (!image)
+			return false;
+
+		RASPICAM_FRAME_TIMES times;
+		if (!raspiCamCvGetFrameTimes(fCapture, &times))
+			return false;
+
+		cv::Mat planes [3];
+		for (int i = 0; i < 3; i++)
+			planes[i] = Frame::wrap(raspiCamCvRetrievePlane(fCapture, i));
+
+		frame.fFrame = raspiCamCvHoldFrame(fCapture);
+		if (!frame.fFrame)
+			return false;
+		frame.fCapture = fCapture;
+		frame.fTimes = times;
+		frame.fMat = Frame::wrap(image);
+		for (int i = 0; i < 3; i++)
+			frame.fPlanes[i] = planes[i];
+
+		// The next retrieve needs another grab
+		fGrabbed = false;
+		return true;
+	}
+
+	bool read(cv::OutputArray image) {
+		if (grab())
+			return retrieve(image);
+		image.release();
+		return false;
+	}
+
+	bool read(Frame & frame) {
+		frame.reset();
+		return grab() && retrieve(frame);
+	}
+
+	/// Next frame, empty if there is none
+	Frame frame() {
+		Frame next;
+		read(next);
+		return next;
+	}
+
+	RaspiCam & operator>>(cv::Mat & image) {
+		read(image);
+		return *this;
+	}
+
+	RaspiCam & operator>>(Frame & frame) {
+		read(frame);
+		return *this;
+	}
+
+	/// RPI_CAP_PROP_*
+	double get(int property_id) const {return fCapture ? raspiCamCvGetCaptureProperty(fCapture, property_id) : 0;}
+	bool set(int property_id, double value) {return fCapture && raspiCamCvSetCaptureProperty(fCapture, property_id, value);}
+
+	/// For the rest of the C interface
+	RaspiCamCvCapture * capture() const {return fCapture;}
+
+private:
+	RaspiCamCvCapture * fCapture;
+	bool fGrabbed;
+};
+
+} // namespace raspicamcv
+
+#endif
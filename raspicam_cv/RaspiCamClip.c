@@ -0,0 +1,352 @@
+/*
+
+ Copyright (c) by Emil Valkov,
+ All rights reserved.
+
+ License: http://www.opensource.org/licenses/bsd-license.php
+
+ Pre-trigger ring of encoded data, see RaspiCamClip.h
+
+*/
+
+#include "RaspiCamClip.h"
+#include "RaspiCamStats.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+// A dump ends this long after its last frame was due, even if it never came
+#define CLIP_DEADLINE_MARGIN_US 1000000
+
+#define CHUNK(clip, seq) (&(clip)->chunks[(seq) % (clip)->max_chunks])
+
+/**
+ * Can a clip start at this chunk: stream headers, or the first part of a keyframe without headers
+ */
+static int is_entry(RASPICAM_CLIP_RING * clip, unsigned int seq)
+{
+	RASPICAM_CLIP_CHUNK * chunk = CHUNK(clip, seq);
+	RASPICAM_CLIP_CHUNK * prev = seq != clip->first ? CHUNK(clip, seq - 1) : NULL;
+
+	if (chunk->flags & RASPICAM_ENCODED_CONFIG)
+		return !prev || !(prev->flags & RASPICAM_ENCODED_CONFIG);
+	if (chunk->flags & RASPICAM_ENCODED_KEYFRAME)
+		return !prev || (prev->flags & RASPICAM_ENCODED_FRAME_END);
+	return 0;
+}
+
+/**
+ * Forget the oldest chunk, unless the dump is reading it
+ */
+static int evict_oldest(RASPICAM_CLIP_RING * clip)
+{
+	if (clip->reading && clip->dump_next == clip->first)
+		return 0;
+	clip->first++;
+	return 1;
+}
+
+/**
+ * Find contiguous room for a chunk, evicting the oldest ones as needed
+ *
+ * @return 1 with offset set, 0 if the dump holds the room
+ */
+static int find_space(RASPICAM_CLIP_RING * clip, int length, size_t * offset)
+{
+	for (;;)
+	{
+		if (clip->first == clip->next)
+		{
+			clip->head = 0;
+			*offset = 0;
+			return 1;
+		}
+
+		size_t tail = CHUNK(clip, clip->first)->offset;
+		if (clip->head > tail)
+		{
+			// Used from tail to head, free after head and before tail
+			if (length <= clip->size - clip->head)
+			{
+				*offset = clip->head;
+				return 1;
+			}
+			if (length <= tail)
+			{
+				*offset = 0;
+				return 1;
+			}
+		}
+		else if (length <= tail - clip->head)
+		{
+			// Wrapped, free from head to tail
+			*offset = clip->head;
+			return 1;
+		}
+
+		if (!evict_oldest(clip))
+			return 0;
+	}
+}
+
+static void * dump_thread(void * arg)
+{
+	RASPICAM_CLIP_RING * clip = (RASPICAM_CLIP_RING *)arg;
+
+	pthread_mutex_lock(&clip->lock);
+	while (clip->running || clip->dumping)
+	{
+		if (!clip->dumping)
+		{
+			pthread_cond_wait(&clip->cond, &clip->lock);
+			continue;
+		}
+
+		int end = !clip->running || raspicam_now_us() >= clip->dump_deadline_us;
+
+		if (!end && (int)(clip->dump_next - clip->first) < 0)
+		{
+			// Overwritten before it was streamed, go on at the next keyframe
+			clip->dump_next = clip->first;
+			while (clip->dump_next != clip->next && !is_entry(clip, clip->dump_next))
+				clip->dump_next++;
+		}
+
+		if (!end && clip->dump_next == clip->next)
+		{
+			// Caught up with the capture, wait for the next frames
+			struct timespec deadline;
+			deadline.tv_sec = clip->dump_deadline_us / 1000000;
+			deadline.tv_nsec = (clip->dump_deadline_us % 1000000) * 1000;
+			pthread_cond_timedwait(&clip->cond, &clip->lock, &deadline);
+			continue;
+		}
+
+		if (!end)
+		{
+			RASPICAM_CLIP_CHUNK chunk = *CHUNK(clip, clip->dump_next);
+
+			if (chunk.pts < 0 || chunk.pts <= clip->dump_end_pts)
+			{
+				// The writer leaves this chunk alone until reading is cleared
+				clip->reading = 1;
+				pthread_mutex_unlock(&clip->lock);
+				clip->sink(clip->user, clip->data + chunk.offset, chunk.length, chunk.pts, chunk.flags);
+				pthread_mutex_lock(&clip->lock);
+				clip->reading = 0;
+				clip->dump_next++;
+				continue;
+			}
+		}
+
+		// Past the end of the clip
+		RASPICAM_ENCODED_CALLBACK sink = clip->sink;
+		void * user = clip->user;
+		clip->dumping = 0;
+		pthread_mutex_unlock(&clip->lock);
+		sink(user, NULL, 0, -1, RASPICAM_ENCODED_CLIP_END);
+		pthread_mutex_lock(&clip->lock);
+	}
+	pthread_mutex_unlock(&clip->lock);
+	return NULL;
+}
+
+void raspicam_clip_init(RASPICAM_CLIP_RING * clip)
+{
+	pthread_condattr_t attr;
+
+	memset(clip, 0, sizeof(RASPICAM_CLIP_RING));
+	pthread_mutex_init(&clip->lock, NULL);
+
+	// Deadlines are on the raspicam_now_us clock
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&clip->cond, &attr);
+	pthread_condattr_destroy(&attr);
+}
+
+void raspicam_clip_destroy(RASPICAM_CLIP_RING * clip)
+{
+	raspicam_clip_configure(clip, 0, 0);
+	pthread_cond_destroy(&clip->cond);
+	pthread_mutex_destroy(&clip->lock);
+}
+
+int raspicam_clip_configure(RASPICAM_CLIP_RING * clip, size_t size, unsigned int max_chunks)
+{
+	// A dump in progress ends here
+	if (clip->running)
+	{
+		pthread_mutex_lock(&clip->lock);
+		clip->running = 0;
+		pthread_cond_broadcast(&clip->cond);
+		pthread_mutex_unlock(&clip->lock);
+		pthread_join(clip->thread, NULL);
+	}
+
+	pthread_mutex_lock(&clip->lock);
+	free(clip->data);
+	free(clip->chunks);
+	clip->data = NULL;
+	clip->chunks = NULL;
+	clip->size = 0;
+	clip->head = 0;
+	clip->first = clip->next = 0;
+	clip->skip_to_keyframe = 0;
+
+	if (size > 0)
+	{
+		// A power of 2, so chunk indexes stay continuous when sequence numbers wrap
+		clip->max_chunks = 16;
+		while (clip->max_chunks < max_chunks)
+			clip->max_chunks *= 2;
+
+		clip->data = (unsigned char *)malloc(size);
+		clip->chunks = (RASPICAM_CLIP_CHUNK *)calloc(clip->max_chunks, sizeof(RASPICAM_CLIP_CHUNK));
+		if (!clip->data || !clip->chunks)
+		{
+			free(clip->data);
+			free(clip->chunks);
+			clip->data = NULL;
+			clip->chunks = NULL;
+			pthread_mutex_unlock(&clip->lock);
+			fprintf(stderr, "%s: Failed to allocate %lu bytes\n", __func__, (unsigned long)size);
+			return -1;
+		}
+		clip->size = size;
+	}
+	pthread_mutex_unlock(&clip->lock);
+
+	if (size > 0)
+	{
+		clip->running = 1;
+		if (pthread_create(&clip->thread, NULL, dump_thread, clip) != 0)
+		{
+			fprintf(stderr, "%s: Failed to start the dump thread\n", __func__);
+			clip->running = 0;
+			raspicam_clip_configure(clip, 0, 0);
+			return -1;
+		}
+	}
+	return 0;
+}
+
+void raspicam_clip_write(RASPICAM_CLIP_RING * clip, const unsigned char * data, int length, int64_t pts, int flags)
+{
+	size_t offset;
+
+	pthread_mutex_lock(&clip->lock);
+
+	if (!clip->data || length <= 0 || (size_t)length > clip->size)
+		goto done;
+
+	// After a gap, frames can't be decoded until the next keyframe
+	if (clip->skip_to_keyframe && !(flags & (RASPICAM_ENCODED_CONFIG | RASPICAM_ENCODED_KEYFRAME)))
+	{
+		clip->dropped++;
+		goto done;
+	}
+
+	if ((clip->next - clip->first == clip->max_chunks && !evict_oldest(clip)) || !find_space(clip, length, &offset))
+	{
+		clip->dropped++;
+		clip->skip_to_keyframe = 1;
+		goto done;
+	}
+	clip->skip_to_keyframe = 0;
+
+	memcpy(clip->data + offset, data, length);
+
+	RASPICAM_CLIP_CHUNK * chunk = CHUNK(clip, clip->next);
+	chunk->pts = pts;
+	chunk->offset = offset;
+	chunk->length = length;
+	chunk->flags = flags;
+	clip->head = offset + length;
+	clip->next++;
+
+	if (clip->dumping)
+		pthread_cond_signal(&clip->cond);
+
+done:
+	pthread_mutex_unlock(&clip->lock);
+}
+
+int raspicam_clip_dump(RASPICAM_CLIP_RING * clip, int64_t before_us, int64_t after_us, RASPICAM_ENCODED_CALLBACK sink, void * user)
+{
+	int64_t newest = -1;
+	unsigned int seq, start = 0;
+	int found = 0;
+
+	pthread_mutex_lock(&clip->lock);
+
+	if (!clip->data || clip->dumping || !sink)
+	{
+		pthread_mutex_unlock(&clip->lock);
+		return 0;
+	}
+
+	// The trigger is the newest frame
+	for (seq = clip->next; seq != clip->first; )
+	{
+		seq--;
+		if (CHUNK(clip, seq)->pts >= 0)
+		{
+			newest = CHUNK(clip, seq)->pts;
+			break;
+		}
+	}
+
+	// Start at the last keyframe before the clip start, or the oldest one when the ring is shorter
+	for (seq = clip->first; newest >= 0 && seq != clip->next; seq++)
+	{
+		unsigned int frame = seq;
+
+		if (!is_entry(clip, seq))
+			continue;
+
+		// Stream headers take the timestamp of the frame after them
+		while (frame != clip->next && CHUNK(clip, frame)->pts < 0)
+			frame++;
+		if (frame == clip->next)
+			break;
+
+		if (found && CHUNK(clip, frame)->pts > newest - before_us)
+			break;
+		start = seq;
+		found = 1;
+	}
+
+	if (!found)
+	{
+		pthread_mutex_unlock(&clip->lock);
+		return 0;
+	}
+
+	clip->dumping = 1;
+	clip->dump_next = start;
+	clip->dump_end_pts = newest + after_us;
+	clip->dump_deadline_us = raspicam_now_us() + after_us + CLIP_DEADLINE_MARGIN_US;
+	clip->sink = sink;
+	clip->user = user;
+	pthread_cond_signal(&clip->cond);
+
+	pthread_mutex_unlock(&clip->lock);
+	return 1;
+}
+
+int64_t raspicam_clip_duration(RASPICAM_CLIP_RING * clip)
+{
+	int64_t oldest = -1, newest = -1;
+	unsigned int seq;
+
+	pthread_mutex_lock(&clip->lock);
+	for (seq = clip->first; seq != clip->next && oldest < 0; seq++)
+		oldest = CHUNK(clip, seq)->pts;
+	for (seq = clip->next; seq != clip->first && newest < 0; )
+		newest = CHUNK(clip, --seq)->pts;
+	pthread_mutex_unlock(&clip->lock);
+
+	return oldest >= 0 && newest >= oldest ? newest - oldest : 0;
+}
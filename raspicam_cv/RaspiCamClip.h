@@ -0,0 +1,99 @@
+#ifndef __RaspiCamClip__
+#define __RaspiCamClip__
+
+#include <stdint.h>
+#include <stddef.h>
+#include <pthread.h>
+#include "RaspiCamCV.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Pre-trigger ring of encoded data. The encoder output is copied into one
+ * buffer allocated up front, each piece contiguous, with an index of the
+ * pieces; the oldest ones are overwritten. A dump thread streams a clip out
+ * of it, the buffered seconds before the trigger then the live data after
+ * it, reading the pieces in place.
+ *
+ * The piece being read by the dump is never overwritten: when the writer
+ * would need its room, it drops the new data until the next keyframe, so
+ * the buffered stream stays decodable.
+ */
+
+typedef struct
+{
+	int64_t pts;			/// Frame timestamp in microseconds, -1 for stream headers
+	size_t offset;			/// In the data buffer
+	int length;
+	int flags;				/// RASPICAM_ENCODED_*
+} RASPICAM_CLIP_CHUNK;
+
+typedef struct
+{
+	pthread_mutex_t lock;
+	pthread_cond_t cond;	/// Signaled for new data and dump requests
+
+	unsigned char * data;	/// NULL when the ring is off
+	size_t size;
+	size_t head;			/// Where the next chunk goes, unless it wraps
+
+	RASPICAM_CLIP_CHUNK * chunks;
+	unsigned int max_chunks;
+	unsigned int first;		/// Sequence number of the oldest chunk, chunks[seq % max_chunks]
+	unsigned int next;		/// Sequence number of the next chunk
+	int skip_to_keyframe;	/// Data is dropped until the next keyframe
+	unsigned int dropped;	/// Chunks dropped because the dump was reading the room they needed
+
+	// Dump in progress
+	int dumping;
+	unsigned int dump_next;	/// Next chunk to stream
+	int reading;			/// The dump reads chunk dump_next without the lock
+	int64_t dump_end_pts;
+	int64_t dump_deadline_us;	/// Ends the dump even if the timestamps restart with the capture
+	RASPICAM_ENCODED_CALLBACK sink;
+	void * user;
+
+	pthread_t thread;
+	int running;			/// The dump thread is there
+} RASPICAM_CLIP_RING;
+
+void raspicam_clip_init(RASPICAM_CLIP_RING * clip);
+void raspicam_clip_destroy(RASPICAM_CLIP_RING * clip);
+
+/**
+ * Allocate the ring, or free it
+ *
+ * @param clip The ring
+ * @param size Bytes of encoded data to keep, 0 to turn the ring off
+ * @param max_chunks Pieces of data to keep
+ *
+ * @return 0 on success
+ */
+int raspicam_clip_configure(RASPICAM_CLIP_RING * clip, size_t size, unsigned int max_chunks);
+
+/// Producer: keep a piece of encoder output, overwriting the oldest ones
+void raspicam_clip_write(RASPICAM_CLIP_RING * clip, const unsigned char * data, int length, int64_t pts, int flags);
+
+/**
+ * Start streaming a clip to sink, from the dump thread
+ *
+ * @param clip The ring
+ * @param before_us Clip start before the newest frame. It starts at the keyframe before, or the oldest one.
+ * @param after_us Clip end after the newest frame
+ * @param sink Called for each piece, then with RASPICAM_ENCODED_CLIP_END
+ * @param user Passed to sink
+ *
+ * @return 1 if the dump started, 0 if the ring is off, has no keyframe yet or is already dumping
+ */
+int raspicam_clip_dump(RASPICAM_CLIP_RING * clip, int64_t before_us, int64_t after_us, RASPICAM_ENCODED_CALLBACK sink, void * user);
+
+/// Span of the buffered frames in microseconds
+int64_t raspicam_clip_duration(RASPICAM_CLIP_RING * clip);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,227 @@
+/*
+
+ Copyright (c) by Emil Valkov,
+ All rights reserved.
+
+ License: http://www.opensource.org/licenses/bsd-license.php
+
+ Pixel format conversion kernels, see RaspiCamConvert.h
+
+*/
+
+#include "RaspiCamConvert.h"
+#include <string.h>
+
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#define CONVERT_NEON
+#include <arm_neon.h>
+#elif defined(__SSE2__)
+#define CONVERT_SSE2
+#include <emmintrin.h>
+#ifdef __SSSE3__
+#define CONVERT_SSSE3
+#include <tmmintrin.h>
+#endif
+#endif
+
+// BT.601 video range, 6 bit fixed point. The partial sums fit in 16 bits
+// except when the result saturates anyway, so all paths agree.
+#define YUV_Y	74
+#define YUV_BU	129
+#define YUV_GU	25
+#define YUV_GV	52
+#define YUV_RV	102
+
+static inline uint8_t clamp(int value)
+{
+	return value < 0 ? 0 : (value > 255 ? 255 : value);
+}
+
+static inline void yuv_to_bgr_pixel(int y, int u, int v, uint8_t * bgr)
+{
+	int c = YUV_Y * (y - 16);
+	int d = u - 128;
+	int e = v - 128;
+
+	bgr[0] = clamp((c + YUV_BU * d + 32) >> 6);
+	bgr[1] = clamp((c - YUV_GU * d - YUV_GV * e + 32) >> 6);
+	bgr[2] = clamp((c + YUV_RV * e + 32) >> 6);
+}
+
+const char * raspicam_convert_isa(void)
+{
+#if defined(CONVERT_NEON)
+	return "neon";
+#elif defined(CONVERT_SSSE3)
+	return "ssse3";
+#elif defined(CONVERT_SSE2)
+	return "sse2";
+#else
+	return "c";
+#endif
+}
+
+void raspicam_copy_plane(const uint8_t * src, int src_stride, uint8_t * dst, int dst_stride, int row_bytes, int height)
+{
+	int y;
+
+	if (height <= 0)
+		return;
+
+	// memcpy is already vectorized, the only win is one call for the whole plane
+	if (src_stride == dst_stride)
+	{
+		memcpy(dst, src, (size_t)src_stride * (height - 1) + row_bytes);
+		return;
+	}
+
+	for (y = 0; y < height; y++)
+		memcpy(dst + y * dst_stride, src + y * src_stride, row_bytes);
+}
+
+void raspicam_rgb_to_bgr(const uint8_t * src, int src_stride, uint8_t * dst, int dst_stride, int width, int height)
+{
+	int x, y;
+
+	for (y = 0; y < height; y++)
+	{
+		const uint8_t * s = src + y * src_stride;
+		uint8_t * d = dst + y * dst_stride;
+		x = 0;
+
+#if defined(CONVERT_NEON)
+		for (; x + 16 <= width; x += 16)
+		{
+			uint8x16x3_t pixels = vld3q_u8(s + 3 * x);
+			uint8x16_t red = pixels.val[0];
+			pixels.val[0] = pixels.val[2];
+			pixels.val[2] = red;
+			vst3q_u8(d + 3 * x, pixels);
+		}
+#elif defined(CONVERT_SSSE3)
+		// 5 pixels per 16 byte load. The 16th byte is rewritten by the next step.
+		const __m128i mask = _mm_setr_epi8(2, 1, 0, 5, 4, 3, 8, 7, 6, 11, 10, 9, 14, 13, 12, 15);
+		for (; x + 6 <= width; x += 5)
+		{
+			__m128i pixels = _mm_loadu_si128((const __m128i *)(s + 3 * x));
+			_mm_storeu_si128((__m128i *)(d + 3 * x), _mm_shuffle_epi8(pixels, mask));
+		}
+#endif
+
+		for (; x < width; x++)
+		{
+			uint8_t red = s[3 * x];
+			d[3 * x + 1] = s[3 * x + 1];
+			d[3 * x] = s[3 * x + 2];
+			d[3 * x + 2] = red;
+		}
+	}
+}
+
+void raspicam_i420_to_gray(const uint8_t * y, int y_stride, uint8_t * dst, int dst_stride, int width, int height)
+{
+	raspicam_copy_plane(y, y_stride, dst, dst_stride, width, height);
+}
+
+#if defined(CONVERT_SSE2)
+/**
+ * Store 8 BGR pixels from 3 planes of 8 bytes
+ */
+static inline void store_bgr8(uint8_t * dst, __m128i b, __m128i g, __m128i r)
+{
+#if defined(CONVERT_SSSE3)
+	__m128i bg = _mm_unpacklo_epi8(b, g);	// b0 g0 b1 g1 ... b7 g7
+	__m128i low = _mm_or_si128(
+		_mm_shuffle_epi8(bg, _mm_setr_epi8(0, 1, -1, 2, 3, -1, 4, 5, -1, 6, 7, -1, 8, 9, -1, 10)),
+		_mm_shuffle_epi8(r, _mm_setr_epi8(-1, -1, 0, -1, -1, 1, -1, -1, 2, -1, -1, 3, -1, -1, 4, -1)));
+	__m128i high = _mm_or_si128(
+		_mm_shuffle_epi8(bg, _mm_setr_epi8(11, -1, 12, 13, -1, 14, 15, -1, -1, -1, -1, -1, -1, -1, -1, -1)),
+		_mm_shuffle_epi8(r, _mm_setr_epi8(-1, 5, -1, -1, 6, -1, -1, 7, -1, -1, -1, -1, -1, -1, -1, -1)));
+	_mm_storeu_si128((__m128i *)dst, low);
+	_mm_storel_epi64((__m128i *)(dst + 16), high);
+#else
+	uint8_t planes [3][8];
+	int i;
+
+	_mm_storel_epi64((__m128i *)planes[0], b);
+	_mm_storel_epi64((__m128i *)planes[1], g);
+	_mm_storel_epi64((__m128i *)planes[2], r);
+	for (i = 0; i < 8; i++)
+	{
+		dst[3 * i] = planes[0][i];
+		dst[3 * i + 1] = planes[1][i];
+		dst[3 * i + 2] = planes[2][i];
+	}
+#endif
+}
+#endif
+
+void raspicam_i420_to_bgr(const uint8_t * y, int y_stride, const uint8_t * u, const uint8_t * v, int uv_stride,
+	uint8_t * dst, int dst_stride, int width, int height)
+{
+	int row, x;
+
+	for (row = 0; row < height; row++)
+	{
+		const uint8_t * luma = y + row * y_stride;
+		const uint8_t * cb = u + (row / 2) * uv_stride;
+		const uint8_t * cr = v + (row / 2) * uv_stride;
+		uint8_t * d = dst + row * dst_stride;
+		x = 0;
+
+#if defined(CONVERT_NEON)
+		for (; x + 16 <= width; x += 16)
+		{
+			uint8x16_t yv = vld1q_u8(luma + x);
+			int16x8_t du = vreinterpretq_s16_u16(vsubl_u8(vld1_u8(cb + x / 2), vdup_n_u8(128)));
+			int16x8_t dv = vreinterpretq_s16_u16(vsubl_u8(vld1_u8(cr + x / 2), vdup_n_u8(128)));
+
+			// Chroma terms, each shared by 2 pixels
+			int16x8x2_t b_uv = vzipq_s16(vmulq_n_s16(du, YUV_BU), vmulq_n_s16(du, YUV_BU));
+			int16x8_t g_term = vaddq_s16(vmulq_n_s16(du, -YUV_GU), vmulq_n_s16(dv, -YUV_GV));
+			int16x8x2_t g_uv = vzipq_s16(g_term, g_term);
+			int16x8x2_t r_uv = vzipq_s16(vmulq_n_s16(dv, YUV_RV), vmulq_n_s16(dv, YUV_RV));
+
+			int16x8_t c_low = vmulq_n_s16(vsubq_s16(vreinterpretq_s16_u16(vmovl_u8(vget_low_u8(yv))), vdupq_n_s16(16)), YUV_Y);
+			int16x8_t c_high = vmulq_n_s16(vsubq_s16(vreinterpretq_s16_u16(vmovl_u8(vget_high_u8(yv))), vdupq_n_s16(16)), YUV_Y);
+
+			uint8x16x3_t bgr;
+			bgr.val[0] = vcombine_u8(vqrshrun_n_s16(vqaddq_s16(c_low, b_uv.val[0]), 6), vqrshrun_n_s16(vqaddq_s16(c_high, b_uv.val[1]), 6));
+			bgr.val[1] = vcombine_u8(vqrshrun_n_s16(vqaddq_s16(c_low, g_uv.val[0]), 6), vqrshrun_n_s16(vqaddq_s16(c_high, g_uv.val[1]), 6));
+			bgr.val[2] = vcombine_u8(vqrshrun_n_s16(vqaddq_s16(c_low, r_uv.val[0]), 6), vqrshrun_n_s16(vqaddq_s16(c_high, r_uv.val[1]), 6));
+			vst3q_u8(d + 3 * x, bgr);
+		}
+#elif defined(CONVERT_SSE2)
+		const __m128i zero = _mm_setzero_si128();
+		const __m128i offset_y = _mm_set1_epi16(16);
+		const __m128i offset_uv = _mm_set1_epi16(128);
+		const __m128i round = _mm_set1_epi16(32);
+		for (; x + 8 <= width; x += 8)
+		{
+			int32_t cb4, cr4;
+			memcpy(&cb4, cb + x / 2, 4);
+			memcpy(&cr4, cr + x / 2, 4);
+
+			// Each chroma sample is shared by 2 pixels
+			__m128i cb8 = _mm_cvtsi32_si128(cb4);
+			__m128i cr8 = _mm_cvtsi32_si128(cr4);
+			__m128i du = _mm_sub_epi16(_mm_unpacklo_epi8(_mm_unpacklo_epi8(cb8, cb8), zero), offset_uv);
+			__m128i dv = _mm_sub_epi16(_mm_unpacklo_epi8(_mm_unpacklo_epi8(cr8, cr8), zero), offset_uv);
+			__m128i yv = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i *)(luma + x)), zero);
+			__m128i c = _mm_mullo_epi16(_mm_sub_epi16(yv, offset_y), _mm_set1_epi16(YUV_Y));
+
+			__m128i b = _mm_adds_epi16(c, _mm_mullo_epi16(du, _mm_set1_epi16(YUV_BU)));
+			__m128i g = _mm_adds_epi16(c, _mm_add_epi16(_mm_mullo_epi16(du, _mm_set1_epi16(-YUV_GU)), _mm_mullo_epi16(dv, _mm_set1_epi16(-YUV_GV))));
+			__m128i r = _mm_adds_epi16(c, _mm_mullo_epi16(dv, _mm_set1_epi16(YUV_RV)));
+
+			b = _mm_packus_epi16(_mm_srai_epi16(_mm_adds_epi16(b, round), 6), zero);
+			g = _mm_packus_epi16(_mm_srai_epi16(_mm_adds_epi16(g, round), 6), zero);
+			r = _mm_packus_epi16(_mm_srai_epi16(_mm_adds_epi16(r, round), 6), zero);
+			store_bgr8(d + 3 * x, b, g, r);
+		}
+#endif
+
+		for (; x < width; x++)
+			yuv_to_bgr_pixel(luma[x], cb[x / 2], cr[x / 2], d + 3 * x);
+	}
+}
@@ -0,0 +1,39 @@
+#ifndef __RaspiCamConvert__
+#define __RaspiCamConvert__
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Pixel format conversion and stride repacking kernels of the capture path.
+ * Each kernel has a NEON and an SSE implementation, picked at compile time
+ * from the target flags (-mfpu=neon, -msse2, -mssse3), and a C fallback that
+ * gives the same results. Strides are in bytes, sizes in pixels.
+ *
+ * YUV to BGR uses BT.601 video range coefficients in 6 bit fixed point.
+ */
+
+/// Instruction set the kernels were built for: "neon", "ssse3", "sse2" or "c"
+const char * raspicam_convert_isa(void);
+
+/// Copy row_bytes of each row between different strides, one memcpy when they are the same
+void raspicam_copy_plane(const uint8_t * src, int src_stride, uint8_t * dst, int dst_stride, int row_bytes, int height);
+
+/// Swap the first and third byte of each 3 byte pixel: RGB24 to BGR24 or back
+void raspicam_rgb_to_bgr(const uint8_t * src, int src_stride, uint8_t * dst, int dst_stride, int width, int height);
+
+/// Gray image from the Y plane of an I420 frame
+void raspicam_i420_to_gray(const uint8_t * y, int y_stride, uint8_t * dst, int dst_stride, int width, int height);
+
+/// BGR24 image from I420 planes. u and v have uv_stride bytes per row, for every two rows of y
+void raspicam_i420_to_bgr(const uint8_t * y, int y_stride, const uint8_t * u, const uint8_t * v, int uv_stride,
+	uint8_t * dst, int dst_stride, int width, int height);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
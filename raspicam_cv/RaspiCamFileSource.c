@@ -0,0 +1,360 @@
+/*
+
+ Copyright (c) by Emil Valkov,
+ All rights reserved.
+
+ License: http://www.opensource.org/licenses/bsd-license.php
+
+ File frame source: replays a raw or Y4M file at the requested framerate,
+ looping at the end of the file. source_arg is the file name.
+
+ - Y4M (YUV4MPEG2, 4:2:0 or mono): the image size comes from the file header.
+ - Anything else is raw frames with no padding: RGB24, or I420 when the
+   capture asks for a YUV format or monochrome. The image size comes from the
+   configuration.
+
+*/
+
+#include "RaspiCamSource.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define Y4M_MAGIC "YUV4MPEG2"
+
+typedef struct
+{
+	FILE * file;
+	int y4m;
+	int y4m_mono;		/// Y4M without chroma planes
+	long data_start;	/// Offset of the first frame
+	int frame_size;		/// Bytes per frame in the file, without Y4M frame headers
+	int width;			/// Y4M: image size in the file
+	int height;
+	unsigned char * frame;
+} FILE_SOURCE_STATE;
+
+static inline unsigned char clamp(int value)
+{
+	return value < 0 ? 0 : (value > 255 ? 255 : value);
+}
+
+/**
+ * Parse the stream header of a Y4M file
+ *
+ * @param source Source being opened, width and height are set from the header
+ * @param state File source state
+ *
+ * @return 0 if successful, -1 on an unsupported file
+ */
+static int parse_y4m_header(RASPICAM_SOURCE * source, FILE_SOURCE_STATE * state)
+{
+	char line [256];
+	char * token;
+
+	if (!fgets(line, sizeof(line), state->file) || strchr(line, '\n') == NULL)
+		return -1;
+
+	for (token = strtok(line, " \n"); token; token = strtok(NULL, " \n"))
+	{
+		switch (token[0])
+		{
+			case 'W':
+				source->width = atoi(token + 1);
+				break;
+			case 'H':
+				source->height = atoi(token + 1);
+				break;
+			case 'C':
+				if (strcmp(token + 1, "mono") == 0)
+					state->y4m_mono = 1;
+				else if (strncmp(token + 1, "420", 3) != 0)
+				{
+					fprintf(stderr, "Unsupported Y4M colorspace %s\n", token + 1);
+					return -1;
+				}
+				break;
+			case 'I':
+				if (token[1] != 'p' && token[1] != '?')
+				{
+					fprintf(stderr, "Interlaced Y4M is not supported\n");
+					return -1;
+				}
+				break;
+		}
+	}
+
+	if (source->width <= 0 || source->height <= 0)
+		return -1;
+
+	state->frame_size = source->width * source->height;
+	if (!state->y4m_mono)
+		state->frame_size += 2 * ((source->width + 1) / 2) * ((source->height + 1) / 2);
+	return 0;
+}
+
+/**
+ * Read the next frame of the file into state->frame, going back to the start at the end
+ */
+static int read_frame(FILE_SOURCE_STATE * state)
+{
+	int attempt;
+
+	for (attempt = 0; attempt < 2; attempt++)
+	{
+		if (state->y4m)
+		{
+			char header [128];
+			if (fgets(header, sizeof(header), state->file) && strncmp(header, "FRAME", 5) == 0 &&
+				fread(state->frame, 1, state->frame_size, state->file) == (size_t)state->frame_size)
+				return 0;
+		}
+		else if (fread(state->frame, 1, state->frame_size, state->file) == (size_t)state->frame_size)
+		{
+			return 0;
+		}
+
+		fseek(state->file, state->data_start, SEEK_SET);
+	}
+
+	fprintf(stderr, "%s: No complete frame in file\n", __func__);
+	return -1;
+}
+
+/**
+ * Copy an unpadded I420 frame to the camera I420 or NV12 layout
+ */
+static void copy_yuv(RASPICAM_SOURCE * source, unsigned char * data, const unsigned char * frame, int has_chroma)
+{
+	int w = source->width, h = source->height;
+	int cw = (w + 1) / 2, ch = (h + 1) / 2;
+	int nv12 = (source->encoding == RASPICAM_ENCODING_NV12);
+	int cstride = nv12 ? source->stride : source->stride / 2;
+	unsigned char * u = data + source->stride * source->buffer_height;
+	unsigned char * v = u + cstride * (source->buffer_height / 2);
+	int x, y;
+
+	for (y = 0; y < h; y++)
+		memcpy(data + y * source->stride, frame + y * w, w);
+
+	if (!has_chroma || source->monochrome)
+	{
+		memset(u, 128, source->stride * source->buffer_height / 2);
+		return;
+	}
+
+	frame += w * h;
+	for (y = 0; y < ch; y++)
+	{
+		const unsigned char * u_row = frame + y * cw;
+		const unsigned char * v_row = frame + cw * ch + y * cw;
+		if (nv12)
+		{
+			unsigned char * uv = u + y * cstride;
+			for (x = 0; x < cw; x++)
+			{
+				uv[2 * x] = u_row[x];
+				uv[2 * x + 1] = v_row[x];
+			}
+		}
+		else
+		{
+			memcpy(u + y * cstride, u_row, cw);
+			memcpy(v + y * cstride, v_row, cw);
+		}
+	}
+}
+
+/**
+ * Convert an unpadded I420 (or mono) frame to padded RGB24
+ */
+static void convert_i420_rgb(RASPICAM_SOURCE * source, unsigned char * data, const unsigned char * frame, int has_chroma)
+{
+	int w = source->width, h = source->height;
+	int cw = (w + 1) / 2, ch = (h + 1) / 2;
+	const unsigned char * u_plane = frame + w * h;
+	const unsigned char * v_plane = u_plane + cw * ch;
+	int x, y;
+
+	for (y = 0; y < h; y++)
+	{
+		const unsigned char * luma = frame + y * w;
+		unsigned char * rgb = data + y * source->stride;
+		for (x = 0; x < w; x++)
+		{
+			int c = 298 * (luma[x] - 16);
+			int d = has_chroma ? u_plane[(y / 2) * cw + x / 2] - 128 : 0;
+			int e = has_chroma ? v_plane[(y / 2) * cw + x / 2] - 128 : 0;
+			rgb[3 * x] = clamp((c + 409 * e + 128) >> 8);
+			rgb[3 * x + 1] = clamp((c - 100 * d - 208 * e + 128) >> 8);
+			rgb[3 * x + 2] = clamp((c + 516 * d + 128) >> 8);
+		}
+	}
+}
+
+static int file_fill(RASPICAM_SOURCE * source, unsigned char * data, unsigned int frame)
+{
+	FILE_SOURCE_STATE * state = (FILE_SOURCE_STATE *)raspicam_soft_source_generator(source);
+	int y;
+
+	if (read_frame(state) != 0)
+		return -1;
+
+	if (state->y4m)
+	{
+		if (source->encoding != RASPICAM_ENCODING_RGB24)
+			copy_yuv(source, data, state->frame, !state->y4m_mono);
+		else
+			convert_i420_rgb(source, data, state->frame, !state->y4m_mono);
+	}
+	else if (source->encoding != RASPICAM_ENCODING_RGB24)
+	{
+		copy_yuv(source, data, state->frame, 1);
+	}
+	else
+	{
+		for (y = 0; y < source->height; y++)
+			memcpy(data + y * source->stride, state->frame + y * 3 * source->width, 3 * source->width);
+	}
+	return 0;
+}
+
+static void free_state(FILE_SOURCE_STATE * state)
+{
+	if (state->file)
+		fclose(state->file);
+	free(state->frame);
+	free(state);
+}
+
+/**
+ * Size of a raw frame in the file for the source size and color mode
+ */
+static int raw_frame_size(RASPICAM_SOURCE * source)
+{
+	int size = source->width * source->height;
+
+	return size + (source->encoding != RASPICAM_ENCODING_RGB24 ? 2 * ((source->width + 1) / 2) * ((source->height + 1) / 2) : 2 * size);
+}
+
+/**
+ * Frames are replayed whole, a region of interest falls back to the full frame
+ */
+static void reset_region(RASPICAM_SOURCE * source)
+{
+	if (source->full_width > 0 && source->full_height > 0 &&
+		(source->width != source->full_width || source->height != source->full_height))
+	{
+		fprintf(stderr, "%s: No region of interest on files, using the full frame\n", __func__);
+		source->width = source->full_width;
+		source->height = source->full_height;
+	}
+	source->roi_x = 0;
+	source->roi_y = 0;
+}
+
+static int file_open(RASPICAM_SOURCE * source)
+{
+	FILE_SOURCE_STATE * state;
+	char magic [sizeof(Y4M_MAGIC)];
+
+	if (source->arg == NULL)
+	{
+		fprintf(stderr, "%s: No file to replay\n", __func__);
+		return -1;
+	}
+
+	state = (FILE_SOURCE_STATE *)calloc(1, sizeof(FILE_SOURCE_STATE));
+	if (!state)
+		return -1;
+	reset_region(source);
+
+	state->file = fopen(source->arg, "rb");
+	if (!state->file)
+	{
+		fprintf(stderr, "%s: Can't open %s\n", __func__, source->arg);
+		free_state(state);
+		return -1;
+	}
+
+	if (fread(magic, 1, sizeof(magic) - 1, state->file) == sizeof(magic) - 1 && memcmp(magic, Y4M_MAGIC, sizeof(magic) - 1) == 0)
+	{
+		state->y4m = 1;
+		if (parse_y4m_header(source, state) != 0)
+		{
+			fprintf(stderr, "%s: Invalid Y4M header in %s\n", __func__, source->arg);
+			free_state(state);
+			return -1;
+		}
+	}
+	else
+	{
+		rewind(state->file);
+		state->frame_size = raw_frame_size(source);
+	}
+	state->data_start = ftell(state->file);
+	state->width = source->width;
+	state->height = source->height;
+	source->full_width = source->width;
+	source->full_height = source->height;
+
+	state->frame = (unsigned char *)malloc(state->frame_size);
+	if (!state->frame || raspicam_soft_source_open(source, file_fill, state) != 0)
+	{
+		free_state(state);
+		return -1;
+	}
+	return 0;
+}
+
+static void file_close(RASPICAM_SOURCE * source)
+{
+	FILE_SOURCE_STATE * state = (FILE_SOURCE_STATE *)raspicam_soft_source_generator(source);
+
+	if (state)
+		free_state(state);
+	raspicam_soft_source_close(source);
+}
+
+static int file_reconfigure(RASPICAM_SOURCE * source)
+{
+	FILE_SOURCE_STATE * state = (FILE_SOURCE_STATE *)raspicam_soft_source_generator(source);
+	unsigned char * frame;
+	int frame_size;
+
+	reset_region(source);
+	if (state->y4m)
+	{
+		// The file decides the size, the color mode is converted on the fly
+		if (source->width != state->width || source->height != state->height)
+		{
+			fprintf(stderr, "%s: The size of a Y4M file can't be changed\n", __func__);
+			return -1;
+		}
+		return raspicam_soft_source_reconfigure(source);
+	}
+
+	// Raw frames are read as they are, the new size and mode tell how
+	frame_size = raw_frame_size(source);
+	frame = (unsigned char *)realloc(state->frame, frame_size);
+	if (!frame)
+		return -1;
+	state->frame = frame;
+	state->frame_size = frame_size;
+	fseek(state->file, state->data_start, SEEK_SET);
+	return raspicam_soft_source_reconfigure(source);
+}
+
+const RASPICAM_SOURCE_OPS raspicam_file_source_ops =
+{
+	"file",
+	file_open,
+	raspicam_soft_source_start,
+	raspicam_soft_source_stop,
+	file_close,
+	raspicam_soft_source_release_buffer,
+	file_reconfigure,
+	NULL,
+	raspicam_soft_source_start_encoder,
+	raspicam_soft_source_stop_encoder,
+};
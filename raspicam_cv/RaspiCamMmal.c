@@ -0,0 +1,1194 @@
+/////////////////////////////////////////////////////////////
+//
+// Many source code lines are copied from RaspiVid.c
+// Copyright (c) 2012, Broadcom Europe Ltd
+//
+// MMAL camera frame source for RaspiCamCV.c
+//
+/////////////////////////////////////////////////////////////
+
+#include "RaspiCamSource.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "bcm_host.h"
+#include "interface/vcos/vcos.h"
+
+#include "interface/mmal/mmal.h"
+#include "interface/mmal/mmal_logging.h"
+#include "interface/mmal/mmal_buffer.h"
+#include "interface/mmal/util/mmal_util.h"
+#include "interface/mmal/util/mmal_util_params.h"
+#include "interface/mmal/util/mmal_default_components.h"
+#include "interface/mmal/util/mmal_connection.h"
+
+#include "RaspiCamControl.h"
+
+// Standard port setting for the camera component
+#define MMAL_CAMERA_PREVIEW_PORT 0
+#define MMAL_CAMERA_VIDEO_PORT 1
+#define MMAL_CAMERA_CAPTURE_PORT 2
+
+// Video format information
+#define VIDEO_FRAME_RATE_DEN 1
+
+/// Video render needs at least 2 buffers.
+#define VIDEO_OUTPUT_BUFFERS_NUM 3
+
+// Splitter ports when encoding
+#define SPLITTER_RAW_PORT 0
+#define SPLITTER_ENCODER_PORT 1
+
+int mmal_status_to_int(MMAL_STATUS_T status);
+
+/** Structure containing the MMAL side of a capture
+ */
+typedef struct
+{
+	RASPICAM_CAMERA_PARAMETERS camera_parameters; /// Camera setup parameters
+
+	MMAL_COMPONENT_T *camera_component;    /// Pointer to the camera component
+	MMAL_COMPONENT_T *encoder_component;   /// Pointer to the encoder component
+	MMAL_COMPONENT_T *splitter_component;  /// Feeds the raw frames and the encoder when encoding
+
+	MMAL_CONNECTION_T *splitter_connection; /// Camera video port to splitter
+	MMAL_CONNECTION_T *encoder_connection;  /// Splitter to encoder
+
+	MMAL_POOL_T *video_pool; /// Pointer to the pool of buffers used by the camera video port, or the splitter raw port
+	MMAL_POOL_T *preview_pool; /// Pool of the preview port, which feeds the second stream
+	MMAL_POOL_T *encoder_pool; /// Pool of the encoder output port
+
+	int max_width;           /// Video size allowed by the current camera configuration
+	int max_height;
+} MMAL_SOURCE_STATE;
+
+static void set_camera_parameters(RASPICAM_CAMERA_PARAMETERS * params, const RASPIVID_PROPERTIES * properties)
+{
+	raspicamcontrol_set_defaults(params);
+
+	if (properties != NULL) {
+		params->brightness = properties->brightness;
+		params->contrast = properties->contrast;
+		params->sharpness = properties->sharpness;
+		params->saturation = properties->saturation;
+		params->hflip = properties->hflip;
+		params->vflip = properties->vflip;
+		params->exposureMode = properties->exposure;
+		params->shutter_speed = properties->shutter_speed;
+		params->awbMode = (properties->awb > 0) ? MMAL_PARAM_AWBMODE_AUTO : MMAL_PARAM_AWBMODE_OFF ;
+		params->awb_gains_r = properties->awb_gr ;
+		params->awb_gains_b = properties->awb_gb ;
+	}
+}
+
+/**
+ * Port delivering the raw frames: the camera video port, or the splitter when encoding
+ */
+static MMAL_PORT_T *raw_port(MMAL_SOURCE_STATE * mmal)
+{
+	if (mmal->splitter_component)
+		return mmal->splitter_component->output[SPLITTER_RAW_PORT];
+	return mmal->camera_component->output[MMAL_CAMERA_VIDEO_PORT];
+}
+
+/**
+ * Release a buffer to the pool, and send one back to the video port
+ *
+ * @param mmal Pointer to the MMAL source state
+ * @param buffer mmal buffer header pointer
+ */
+static void recycle_buffer(MMAL_SOURCE_STATE * mmal, MMAL_BUFFER_HEADER_T *buffer)
+{
+	MMAL_PORT_T * port = raw_port(mmal);
+	MMAL_BUFFER_HEADER_T *new_buffer;
+
+	// release buffer back to the pool
+	mmal_buffer_header_release(buffer);
+
+	// and send one back to the port (if still open)
+	if (port->is_enabled)
+	{
+		MMAL_STATUS_T status;
+
+		new_buffer = mmal_queue_get(mmal->video_pool->queue);
+
+		if (new_buffer)
+			status = mmal_port_send_buffer(port, new_buffer);
+
+		if (!new_buffer || status != MMAL_SUCCESS)
+			vcos_log_error("Unable to return a buffer to the encoder port");
+	}
+}
+
+/**
+ *  buffer header callback function for video
+ *
+ * @param port Pointer to port from which callback originated
+ * @param buffer mmal buffer header pointer
+ */
+static void video_buffer_callback(MMAL_PORT_T *port, MMAL_BUFFER_HEADER_T *buffer)
+{
+	RASPICAM_SOURCE * source = (RASPICAM_SOURCE *)port->userdata;
+
+	if (!source)
+	{
+		vcos_log_error("Received a encoder buffer callback with no state");
+		mmal_buffer_header_release(buffer);
+		return;
+	}
+
+	if (buffer->length)
+	{
+		mmal_buffer_header_mem_lock(buffer);
+
+		// The capture keeps the buffer in zero-copy mode, it comes back through mmal_release_buffer
+		if (raspicam_source_deliver(source, buffer->data, buffer->pts, buffer))
+			return;
+
+		mmal_buffer_header_mem_unlock(buffer);
+	}
+	else
+	{
+		vcos_log_error("buffer null");
+	}
+
+	recycle_buffer((MMAL_SOURCE_STATE *)source->priv, buffer);
+}
+
+/**
+ *  buffer header callback function for the preview port, delivering the second stream
+ *
+ * @param port Pointer to port from which callback originated
+ * @param buffer mmal buffer header pointer
+ */
+static void preview_buffer_callback(MMAL_PORT_T *port, MMAL_BUFFER_HEADER_T *buffer)
+{
+	RASPICAM_SOURCE * source = (RASPICAM_SOURCE *)port->userdata;
+	MMAL_SOURCE_STATE * state = (MMAL_SOURCE_STATE *)source->priv;
+
+	if (buffer->length)
+	{
+		mmal_buffer_header_mem_lock(buffer);
+		raspicam_source_deliver_second(source, buffer->data, buffer->pts);
+		mmal_buffer_header_mem_unlock(buffer);
+	}
+
+	mmal_buffer_header_release(buffer);
+
+	if (port->is_enabled)
+	{
+		MMAL_BUFFER_HEADER_T *new_buffer = mmal_queue_get(state->preview_pool->queue);
+
+		if (!new_buffer || mmal_port_send_buffer(port, new_buffer) != MMAL_SUCCESS)
+			vcos_log_error("Unable to return a buffer to the preview port");
+	}
+}
+
+/**
+ *  buffer header callback function for the encoder output
+ *
+ * @param port Pointer to port from which callback originated
+ * @param buffer mmal buffer header pointer
+ */
+static void encoder_buffer_callback(MMAL_PORT_T *port, MMAL_BUFFER_HEADER_T *buffer)
+{
+	RASPICAM_SOURCE * source = (RASPICAM_SOURCE *)port->userdata;
+	MMAL_SOURCE_STATE * state = (MMAL_SOURCE_STATE *)source->priv;
+
+	if (buffer->length && (buffer->flags & MMAL_BUFFER_HEADER_FLAG_CODECSIDEINFO))
+	{
+		// Inline motion vectors, after the frame they belong to
+		mmal_buffer_header_mem_lock(buffer);
+		raspicam_source_deliver_vectors(source, buffer->data, buffer->length, buffer->pts);
+		mmal_buffer_header_mem_unlock(buffer);
+	}
+	else if (buffer->length)
+	{
+		int flags = 0;
+
+		if (buffer->flags & MMAL_BUFFER_HEADER_FLAG_CONFIG)
+			flags |= RASPICAM_ENCODED_CONFIG;
+		if (buffer->flags & MMAL_BUFFER_HEADER_FLAG_KEYFRAME)
+			flags |= RASPICAM_ENCODED_KEYFRAME;
+		if (buffer->flags & MMAL_BUFFER_HEADER_FLAG_FRAME_END)
+			flags |= RASPICAM_ENCODED_FRAME_END;
+
+		mmal_buffer_header_mem_lock(buffer);
+		raspicam_source_deliver_encoded(source, buffer->data, buffer->length,
+			buffer->pts == MMAL_TIME_UNKNOWN ? -1 : buffer->pts, flags);
+		mmal_buffer_header_mem_unlock(buffer);
+	}
+
+	mmal_buffer_header_release(buffer);
+
+	if (port->is_enabled)
+	{
+		MMAL_BUFFER_HEADER_T *new_buffer = mmal_queue_get(state->encoder_pool->queue);
+
+		if (!new_buffer || mmal_port_send_buffer(port, new_buffer) != MMAL_SUCCESS)
+			vcos_log_error("Unable to return a buffer to the encoder port");
+	}
+}
+
+static float rational_value(MMAL_RATIONAL_T value)
+{
+	return value.den ? (float)value.num / value.den : 0;
+}
+
+/**
+ *  callback function for the camera control port, which reports the sensor settings
+ *
+ * @param port Pointer to port from which callback originated
+ * @param buffer mmal buffer header pointer
+ */
+static void camera_control_callback(MMAL_PORT_T *port, MMAL_BUFFER_HEADER_T *buffer)
+{
+	RASPICAM_SOURCE * source = (RASPICAM_SOURCE *)port->userdata;
+
+	if (buffer->cmd == MMAL_EVENT_PARAMETER_CHANGED)
+	{
+		MMAL_EVENT_PARAMETER_CHANGED_T *param = (MMAL_EVENT_PARAMETER_CHANGED_T *)buffer->data;
+
+		if (param->hdr.id == MMAL_PARAMETER_CAMERA_SETTINGS)
+		{
+			MMAL_PARAMETER_CAMERA_SETTINGS_T *camera_settings = (MMAL_PARAMETER_CAMERA_SETTINGS_T *)param;
+			RASPICAM_FRAME_METADATA settings;
+
+			// The camera doesn't report the colour temperature it settled on
+			memset(&settings, 0, sizeof(settings));
+			settings.exposure = camera_settings->exposure;
+			settings.analog_gain = rational_value(camera_settings->analog_gain);
+			settings.digital_gain = rational_value(camera_settings->digital_gain);
+			settings.awb_red_gain = rational_value(camera_settings->awb_red_gain);
+			settings.awb_blue_gain = rational_value(camera_settings->awb_blue_gain);
+			settings.focus_position = camera_settings->focus_position;
+			raspicam_source_deliver_settings(source, &settings);
+		}
+	}
+	else if (buffer->cmd == MMAL_EVENT_ERROR)
+		vcos_log_error("Camera control callback got an error");
+
+	mmal_buffer_header_release(buffer);
+}
+
+/**
+ * Set the camera configuration, which caps the video size
+ *
+ * @param camera Pointer to the camera component, disabled
+ * @param width Maximum width
+ * @param height Maximum height
+ */
+static void set_camera_config(MMAL_COMPONENT_T *camera, int width, int height)
+{
+	MMAL_PARAMETER_CAMERA_CONFIG_T cam_config =
+	{
+	   { MMAL_PARAMETER_CAMERA_CONFIG, sizeof(cam_config) },
+	   .max_stills_w = width,
+	   .max_stills_h = height,
+	   .stills_yuv422 = 0,
+	   .one_shot_stills = 0,
+	   .max_preview_video_w = width,
+	   .max_preview_video_h = height,
+	   .num_preview_video_frames = 3,
+	   .stills_capture_circular_buffer_height = 0,
+	   .fast_preview_resume = 0,
+	   .use_stc_timestamp = MMAL_PARAM_TIMESTAMP_MODE_RESET_STC
+	};
+	mmal_port_parameter_set(camera->control, &cam_config.hdr);
+}
+
+/**
+ * Crop the sensor image to the region of interest, the ports get its pixels only
+ *
+ * Works on the running camera. The crop is relative to the field of view of
+ * the sensor mode the camera picked, in 1/65536 of it.
+ *
+ * @param source Pointer to the source, giving the region in its full frame
+ * @param camera Pointer to the camera component
+ *
+ * @return MMAL_SUCCESS if successful
+ */
+static MMAL_STATUS_T set_input_crop(RASPICAM_SOURCE *source, MMAL_COMPONENT_T *camera)
+{
+	MMAL_PARAMETER_INPUT_CROP_T crop = {{MMAL_PARAMETER_INPUT_CROP, sizeof(MMAL_PARAMETER_INPUT_CROP_T)}};
+
+	crop.rect.x = (int32_t)((int64_t)source->roi_x * 65536 / source->full_width);
+	crop.rect.y = (int32_t)((int64_t)source->roi_y * 65536 / source->full_height);
+	crop.rect.width = (int32_t)((int64_t)source->width * 65536 / source->full_width);
+	crop.rect.height = (int32_t)((int64_t)source->height * 65536 / source->full_height);
+
+	MMAL_STATUS_T status = mmal_port_parameter_set(camera->control, &crop.hdr);
+	if (status != MMAL_SUCCESS)
+		vcos_log_error("Could not set the region of interest");
+	return status;
+}
+
+/**
+ * Set a raw video format
+ *
+ * @param format Format to set
+ * @param source Pointer to the source, giving the size and framerate
+ * @param encoding RASPICAM_ENCODING_*
+ */
+static void set_video_format(MMAL_ES_FORMAT_T *format, RASPICAM_SOURCE *source, int encoding)
+{
+	switch (encoding)
+	{
+		case RASPICAM_ENCODING_I420:
+			format->encoding_variant = MMAL_ENCODING_I420;
+			format->encoding = MMAL_ENCODING_I420;
+			break;
+		case RASPICAM_ENCODING_NV12:
+			format->encoding_variant = MMAL_ENCODING_NV12;
+			format->encoding = MMAL_ENCODING_NV12;
+			break;
+		default:
+			format->encoding = MMAL_ENCODING_RGB24;
+			format->encoding_variant = MMAL_ENCODING_RGB24;
+			break;
+	}
+
+	format->es->video.width = VCOS_ALIGN_UP(source->width, 32);
+	format->es->video.height = VCOS_ALIGN_UP(source->height, 16);
+	format->es->video.crop.x = 0;
+	format->es->video.crop.y = 0;
+	format->es->video.crop.width = source->width;
+	format->es->video.crop.height = source->height;
+	format->es->video.frame_rate.num = source->framerate;
+	format->es->video.frame_rate.den = VIDEO_FRAME_RATE_DEN;
+}
+
+/**
+ * Commit the video and still port formats for the source size, framerate and color mode
+ *
+ * @param source Pointer to the source
+ * @param camera Pointer to the camera component, with both ports disabled
+ *
+ * @return MMAL_SUCCESS if successful
+ */
+static MMAL_STATUS_T set_port_formats(RASPICAM_SOURCE *source, MMAL_COMPONENT_T *camera)
+{
+	MMAL_PORT_T *video_port = camera->output[MMAL_CAMERA_VIDEO_PORT];
+	MMAL_PORT_T *still_port = camera->output[MMAL_CAMERA_CAPTURE_PORT];
+	MMAL_ES_FORMAT_T *format;
+	MMAL_STATUS_T status;
+
+	// Set the encode format on the video  port
+	set_video_format(video_port->format, source, source->encoding);
+
+	status = mmal_port_format_commit(video_port);
+	if (status)
+	{
+	   vcos_log_error("camera video format couldn't be set");
+	   return status;
+	}
+
+   // Set the encode format on the still  port
+   format = still_port->format;
+   format->encoding = MMAL_ENCODING_OPAQUE;
+   format->encoding_variant = MMAL_ENCODING_I420;
+   format->es->video.width = VCOS_ALIGN_UP(source->width, 32);
+   format->es->video.height = VCOS_ALIGN_UP(source->height, 16);
+   format->es->video.crop.x = 0;
+   format->es->video.crop.y = 0;
+   format->es->video.crop.width = source->width;
+   format->es->video.crop.height = source->height;
+   format->es->video.frame_rate.num = 1;
+   format->es->video.frame_rate.den = 1;
+
+   status = mmal_port_format_commit(still_port);
+   if (status)
+   {
+      vcos_log_error("camera still format couldn't be set");
+      return status;
+   }
+
+	/* Ensure there are enough buffers to avoid dropping frames */
+	if (still_port->buffer_num < VIDEO_OUTPUT_BUFFERS_NUM)
+	   still_port->buffer_num = VIDEO_OUTPUT_BUFFERS_NUM;
+
+	// The video port delivers rows padded to 32 pixels, and 16 rows of padding
+	source->stride = VCOS_ALIGN_UP(source->width, 32) * (source->encoding == RASPICAM_ENCODING_RGB24 ? 3 : 1);
+	source->buffer_height = VCOS_ALIGN_UP(source->height, 16);
+
+	if (source->second_width > 0)
+	{
+		// The preview port scales the same sensor frames to the second stream size
+		MMAL_PORT_T *preview_port = camera->output[MMAL_CAMERA_PREVIEW_PORT];
+
+		mmal_format_copy(preview_port->format, video_port->format);
+		format = preview_port->format;
+		format->es->video.width = VCOS_ALIGN_UP(source->second_width, 32);
+		format->es->video.height = VCOS_ALIGN_UP(source->second_height, 16);
+		format->es->video.crop.width = source->second_width;
+		format->es->video.crop.height = source->second_height;
+
+		status = mmal_port_format_commit(preview_port);
+		if (status)
+		{
+		   vcos_log_error("camera preview format couldn't be set");
+		   return status;
+		}
+
+		source->second_stride = VCOS_ALIGN_UP(source->second_width, 32) * (source->encoding == RASPICAM_ENCODING_RGB24 ? 3 : 1);
+		source->second_buffer_height = VCOS_ALIGN_UP(source->second_height, 16);
+	}
+
+	return MMAL_SUCCESS;
+}
+
+/**
+ * Payload memory of a pool
+ */
+static long long pool_payload_bytes(MMAL_POOL_T *pool)
+{
+	if (!pool || !pool->headers_num)
+		return 0;
+	return (long long)pool->headers_num * pool->header[0]->alloc_size;
+}
+
+/**
+ * Report the memory of the frame pools, which VideoCore allocates outside the capture arena
+ */
+static void update_pool_bytes(RASPICAM_SOURCE *source)
+{
+	MMAL_SOURCE_STATE *state = (MMAL_SOURCE_STATE *)source->priv;
+
+	source->pool_bytes = pool_payload_bytes(state->video_pool) + pool_payload_bytes(state->preview_pool);
+}
+
+/**
+ * Enable the video port and create its buffer pool
+ *
+ * @param source Pointer to the source
+ * @param video_port Pointer to the camera video port, format committed
+ *
+ * @return MMAL_SUCCESS if successful
+ */
+static MMAL_STATUS_T enable_video_port(RASPICAM_SOURCE *source, MMAL_PORT_T *video_port)
+{
+	MMAL_SOURCE_STATE *state = (MMAL_SOURCE_STATE *)source->priv;
+	MMAL_STATUS_T status;
+
+	// PR : plug the callback to the video port
+	status = mmal_port_enable(video_port, video_buffer_callback);
+	if (status)
+	{
+	   vcos_log_error("camera video callback2 error");
+	   return status;
+	}
+
+	//PR : create pool of message on video port
+	MMAL_POOL_T *pool;
+	video_port->buffer_size = video_port->buffer_size_recommended;
+	video_port->buffer_num = video_port->buffer_num_recommended;
+	// Buffers kept by the capture are out of the port's rotation until they are released
+	if (source->held_buffers > 0)
+	{
+		if (video_port->buffer_num < VIDEO_OUTPUT_BUFFERS_NUM)
+			video_port->buffer_num = VIDEO_OUTPUT_BUFFERS_NUM;
+		video_port->buffer_num += source->held_buffers;
+	}
+	pool = mmal_port_pool_create(video_port, video_port->buffer_num, video_port->buffer_size);
+	if (!pool)
+	{
+	   vcos_log_error("Failed to create buffer header pool for video output port");
+	   mmal_port_disable(video_port);
+	   return MMAL_ENOMEM;
+	}
+	state->video_pool = pool;
+	update_pool_bytes(source);
+
+	return MMAL_SUCCESS;
+}
+
+/**
+ * Enable the preview port for the second stream, and create its buffer pool
+ *
+ * @param source Pointer to the source
+ * @param preview_port Pointer to the camera preview port, format committed
+ *
+ * @return MMAL_SUCCESS if successful, or if there is no second stream
+ */
+static MMAL_STATUS_T enable_preview_port(RASPICAM_SOURCE *source, MMAL_PORT_T *preview_port)
+{
+	MMAL_SOURCE_STATE *state = (MMAL_SOURCE_STATE *)source->priv;
+	MMAL_STATUS_T status;
+
+	if (source->second_width <= 0)
+		return MMAL_SUCCESS;
+
+	preview_port->userdata = (struct MMAL_PORT_USERDATA_T *)source;
+	status = mmal_port_enable(preview_port, preview_buffer_callback);
+	if (status)
+	{
+	   vcos_log_error("camera preview callback error");
+	   return status;
+	}
+
+	// Frames are copied in the callback, the recommended number of buffers is enough
+	preview_port->buffer_size = preview_port->buffer_size_recommended;
+	preview_port->buffer_num = preview_port->buffer_num_recommended;
+	if (preview_port->buffer_num < VIDEO_OUTPUT_BUFFERS_NUM)
+		preview_port->buffer_num = VIDEO_OUTPUT_BUFFERS_NUM;
+	state->preview_pool = mmal_port_pool_create(preview_port, preview_port->buffer_num, preview_port->buffer_size);
+	if (!state->preview_pool)
+	{
+	   vcos_log_error("Failed to create buffer header pool for preview port");
+	   return MMAL_ENOMEM;
+	}
+	update_pool_bytes(source);
+
+	return MMAL_SUCCESS;
+}
+
+/**
+ * Send every buffer of a pool to a port
+ */
+static void send_pool_buffers(MMAL_POOL_T *pool, MMAL_PORT_T *port)
+{
+	int num = mmal_queue_length(pool->queue);
+	int q;
+	for (q = 0; q < num; q++)
+	{
+		MMAL_BUFFER_HEADER_T *buffer = mmal_queue_get(pool->queue);
+
+		if (!buffer)
+			vcos_log_error("Unable to get a required buffer %d from pool queue", q);
+
+		if (mmal_port_send_buffer(port, buffer)!= MMAL_SUCCESS)
+			vcos_log_error("Unable to send a buffer to encoder output port (%d)", q);
+	}
+}
+
+/**
+ * Checks if specified port is valid and enabled, then disables it
+ *
+ * @param port  Pointer the port
+ *
+ */
+static void check_disable_port(MMAL_PORT_T *port)
+{
+   if (port && port->is_enabled)
+      mmal_port_disable(port);
+}
+
+/**
+ * Disable the camera output ports and destroy their pools
+ *
+ * @param state Pointer to state control struct
+ * @param camera The camera component
+ *
+ */
+static void destroy_camera_pools(MMAL_SOURCE_STATE *state, MMAL_COMPONENT_T *camera)
+{
+   MMAL_PORT_T *video_port = camera->output[MMAL_CAMERA_VIDEO_PORT];
+   MMAL_PORT_T *preview_port = camera->output[MMAL_CAMERA_PREVIEW_PORT];
+
+   // A pool is destroyed once every buffer is back, which disabling the port makes sure of
+   check_disable_port(video_port);
+   check_disable_port(preview_port);
+
+   // When encoding, the raw frames pool belongs to the splitter
+   if (state->video_pool && !state->splitter_component)
+   {
+      mmal_port_pool_destroy(video_port, state->video_pool);
+      state->video_pool = NULL;
+   }
+   if (state->preview_pool)
+   {
+      mmal_port_pool_destroy(preview_port, state->preview_pool);
+      state->preview_pool = NULL;
+   }
+}
+
+/**
+ * Create the camera component, set up its ports
+ *
+ * @param source Pointer to the source being opened
+ *
+ * @return 0 if failed, pointer to component if successful
+ *
+ */
+static MMAL_COMPONENT_T *create_camera_component(RASPICAM_SOURCE *source)
+{
+	MMAL_SOURCE_STATE *state = (MMAL_SOURCE_STATE *)source->priv;
+	MMAL_COMPONENT_T *camera = 0;
+	MMAL_PORT_T *video_port = NULL;
+	MMAL_STATUS_T status;
+
+	/* Create the component */
+	status = mmal_component_create(MMAL_COMPONENT_DEFAULT_CAMERA, &camera);
+
+	if (status != MMAL_SUCCESS)
+	{
+	   vcos_log_error("Failed to create camera component");
+	   goto error;
+	}
+
+	if (!camera->output_num)
+	{
+	   vcos_log_error("Camera doesn't have output ports");
+	   goto error;
+	}
+
+	video_port = camera->output[MMAL_CAMERA_VIDEO_PORT];
+
+	// Compute Module boards have a second camera
+	MMAL_PARAMETER_INT32_T camera_num = {{MMAL_PARAMETER_CAMERA_NUM, sizeof(camera_num)}, source->camera_num};
+	status = mmal_port_parameter_set(camera->control, &camera_num.hdr);
+	if (status != MMAL_SUCCESS)
+	{
+	   vcos_log_error("Could not select camera %d", source->camera_num);
+	   goto error;
+	}
+
+	// Sensor settings of every frame, for the frame metadata
+	MMAL_PARAMETER_CHANGE_EVENT_REQUEST_T change_event_request =
+		{{MMAL_PARAMETER_CHANGE_EVENT_REQUEST, sizeof(change_event_request)}, MMAL_PARAMETER_CAMERA_SETTINGS, 1};
+	if (mmal_port_parameter_set(camera->control, &change_event_request.hdr) != MMAL_SUCCESS)
+	   vcos_log_error("No camera settings events, the frames have no metadata");
+
+	camera->control->userdata = (struct MMAL_PORT_USERDATA_T *)source;
+	status = mmal_port_enable(camera->control, camera_control_callback);
+	if (status != MMAL_SUCCESS)
+	{
+	   vcos_log_error("Unable to enable the camera control port");
+	   goto error;
+	}
+
+	//  set up the camera configuration, for the full frame so the region can grow back
+	set_camera_config(camera, source->full_width, source->full_height);
+	state->max_width = source->full_width;
+	state->max_height = source->full_height;
+
+	if (set_port_formats(source, camera) != MMAL_SUCCESS)
+	   goto error;
+
+	// the callback gets the source from the port
+	video_port->userdata = (struct MMAL_PORT_USERDATA_T *)source;
+
+	if (enable_video_port(source, video_port) != MMAL_SUCCESS)
+	   goto error;
+
+	if (enable_preview_port(source, camera->output[MMAL_CAMERA_PREVIEW_PORT]) != MMAL_SUCCESS)
+	   goto error;
+
+	/* Enable component */
+	status = mmal_component_enable(camera);
+
+	if (status)
+	{
+	   vcos_log_error("camera component couldn't be enabled");
+	   goto error;
+	}
+
+	raspicamcontrol_set_all_parameters(camera, &state->camera_parameters);
+	if (set_input_crop(source, camera) != MMAL_SUCCESS)
+	   goto error;
+
+	state->camera_component = camera;
+	return camera;
+
+error:
+
+   if (camera)
+   {
+      destroy_camera_pools(state, camera);
+      mmal_component_destroy(camera);
+   }
+
+   return 0;
+}
+
+/**
+ * Destroy the camera component
+ *
+ * @param state Pointer to state control struct
+ *
+ */
+static void destroy_camera_component(MMAL_SOURCE_STATE *state)
+{
+   if (state->camera_component)
+   {
+      mmal_component_destroy(state->camera_component);
+      state->camera_component = NULL;
+   }
+}
+
+
+/**
+ * Destroy the encoder and splitter components, and their connections
+ *
+ * @param state Pointer to state control struct
+ *
+ */
+static void destroy_encoder_component(MMAL_SOURCE_STATE *state)
+{
+   if (state->encoder_connection)
+   {
+      mmal_connection_destroy(state->encoder_connection);
+      state->encoder_connection = NULL;
+   }
+   if (state->splitter_connection)
+   {
+      mmal_connection_destroy(state->splitter_connection);
+      state->splitter_connection = NULL;
+   }
+
+   if (state->encoder_component)
+   {
+      MMAL_PORT_T *encoder_output = state->encoder_component->output[0];
+
+      // Get rid of any port buffers first
+      check_disable_port(encoder_output);
+      if (state->encoder_pool)
+      {
+         mmal_port_pool_destroy(encoder_output, state->encoder_pool);
+         state->encoder_pool = NULL;
+      }
+      mmal_component_destroy(state->encoder_component);
+      state->encoder_component = NULL;
+   }
+
+   if (state->splitter_component)
+   {
+      // The raw frames came from the splitter, and so did their pool
+      MMAL_PORT_T *splitter_output = state->splitter_component->output[SPLITTER_RAW_PORT];
+
+      check_disable_port(splitter_output);
+      if (state->video_pool)
+      {
+         mmal_port_pool_destroy(splitter_output, state->video_pool);
+         state->video_pool = NULL;
+      }
+      mmal_component_destroy(state->splitter_component);
+      state->splitter_component = NULL;
+   }
+}
+
+/**
+ * Connect two specific ports together
+ *
+ * @param output_port Pointer the output port
+ * @param input_port Pointer the input port
+ * @param Pointer to a mmal connection pointer, reassigned if function successful
+ * @return Returns a MMAL_STATUS_T giving result of operation
+ *
+ */
+static MMAL_STATUS_T connect_ports(MMAL_PORT_T *output_port, MMAL_PORT_T *input_port, MMAL_CONNECTION_T **connection)
+{
+   MMAL_STATUS_T status;
+
+   status =  mmal_connection_create(connection, output_port, input_port, MMAL_CONNECTION_FLAG_TUNNELLING | MMAL_CONNECTION_FLAG_ALLOCATION_ON_INPUT);
+
+   if (status == MMAL_SUCCESS)
+   {
+      status =  mmal_connection_enable(*connection);
+      if (status != MMAL_SUCCESS)
+         mmal_connection_destroy(*connection);
+   }
+
+   return status;
+}
+
+/**
+ * Create the encoder component, and the splitter feeding it and the raw frames
+ *
+ * @param source Pointer to the source, stopped
+ * @param encoder RASPICAM_ENCODER_*
+ * @param bitrate Bits per second
+ *
+ * @return MMAL_SUCCESS if successful
+ */
+static MMAL_STATUS_T create_encoder_component(RASPICAM_SOURCE *source, int encoder, int bitrate)
+{
+	MMAL_SOURCE_STATE *state = (MMAL_SOURCE_STATE *)source->priv;
+	MMAL_PORT_T *video_port = state->camera_component->output[MMAL_CAMERA_VIDEO_PORT];
+	MMAL_COMPONENT_T *splitter;
+	MMAL_COMPONENT_T *encoder_component;
+	MMAL_PORT_T *encoder_output;
+	MMAL_STATUS_T status;
+
+	// The camera feeds I420 to the splitter, which converts the raw frames to the capture's encoding
+	set_video_format(video_port->format, source, RASPICAM_ENCODING_I420);
+	status = mmal_port_format_commit(video_port);
+	if (status)
+	{
+	   vcos_log_error("camera video format couldn't be set");
+	   return status;
+	}
+
+	status = mmal_component_create(MMAL_COMPONENT_DEFAULT_VIDEO_SPLITTER, &state->splitter_component);
+	if (status)
+	{
+	   vcos_log_error("Failed to create splitter component");
+	   return status;
+	}
+	splitter = state->splitter_component;
+
+	mmal_format_copy(splitter->input[0]->format, video_port->format);
+	if (splitter->input[0]->buffer_num < VIDEO_OUTPUT_BUFFERS_NUM)
+	   splitter->input[0]->buffer_num = VIDEO_OUTPUT_BUFFERS_NUM;
+	status = mmal_port_format_commit(splitter->input[0]);
+	if (status)
+	{
+	   vcos_log_error("splitter input format couldn't be set");
+	   return status;
+	}
+
+	mmal_format_copy(splitter->output[SPLITTER_RAW_PORT]->format, splitter->input[0]->format);
+	set_video_format(splitter->output[SPLITTER_RAW_PORT]->format, source, source->encoding);
+	mmal_format_copy(splitter->output[SPLITTER_ENCODER_PORT]->format, splitter->input[0]->format);
+	status = mmal_port_format_commit(splitter->output[SPLITTER_RAW_PORT]);
+	if (status == MMAL_SUCCESS)
+	   status = mmal_port_format_commit(splitter->output[SPLITTER_ENCODER_PORT]);
+	if (status)
+	{
+	   vcos_log_error("splitter output formats couldn't be set");
+	   return status;
+	}
+
+	status = mmal_component_create(MMAL_COMPONENT_DEFAULT_VIDEO_ENCODER, &state->encoder_component);
+	if (status)
+	{
+	   vcos_log_error("Unable to create video encoder component");
+	   return status;
+	}
+	encoder_component = state->encoder_component;
+	encoder_output = encoder_component->output[0];
+
+	// Only need to set the format of the output port, the input gets the splitter's when connected
+	mmal_format_copy(encoder_output->format, encoder_component->input[0]->format);
+	encoder_output->format->encoding = encoder == RASPICAM_ENCODER_MJPEG ? MMAL_ENCODING_MJPEG : MMAL_ENCODING_H264;
+	encoder_output->format->bitrate = bitrate;
+	encoder_output->buffer_size = encoder_output->buffer_size_recommended;
+	if (encoder_output->buffer_size < encoder_output->buffer_size_min)
+	   encoder_output->buffer_size = encoder_output->buffer_size_min;
+	encoder_output->buffer_num = encoder_output->buffer_num_recommended;
+	if (encoder_output->buffer_num < encoder_output->buffer_num_min)
+	   encoder_output->buffer_num = encoder_output->buffer_num_min;
+	// We need to set the frame rate on output to 0, to ensure it gets
+	// updated correctly from the input framerate when port connected
+	encoder_output->format->es->video.frame_rate.num = 0;
+	encoder_output->format->es->video.frame_rate.den = 1;
+
+	status = mmal_port_format_commit(encoder_output);
+	if (status)
+	{
+	   vcos_log_error("Unable to set format on video encoder output port");
+	   return status;
+	}
+
+	if (encoder == RASPICAM_ENCODER_H264)
+	{
+	   // A keyframe per second, each with its SPS and PPS, so a recording can start at any of them
+	   MMAL_PARAMETER_UINT32_T intra_period = {{ MMAL_PARAMETER_INTRAPERIOD, sizeof(intra_period)}, source->framerate};
+	   MMAL_PARAMETER_VIDEO_PROFILE_T profile;
+
+	   if (mmal_port_parameter_set(encoder_output, &intra_period.hdr) != MMAL_SUCCESS)
+	      vcos_log_error("Unable to set intraperiod");
+
+	   profile.hdr.id = MMAL_PARAMETER_PROFILE;
+	   profile.hdr.size = sizeof(profile);
+	   profile.profile[0].profile = MMAL_VIDEO_PROFILE_H264_HIGH;
+	   profile.profile[0].level = MMAL_VIDEO_LEVEL_H264_4;
+	   if (mmal_port_parameter_set(encoder_output, &profile.hdr) != MMAL_SUCCESS)
+	      vcos_log_error("Unable to set H264 profile");
+
+	   if (mmal_port_parameter_set_boolean(encoder_output, MMAL_PARAMETER_VIDEO_ENCODE_INLINE_HEADER, 1) != MMAL_SUCCESS)
+	      vcos_log_error("failed to set INLINE HEADER FLAG parameters");
+
+	   if (source->motion_vectors &&
+	       mmal_port_parameter_set_boolean(encoder_output, MMAL_PARAMETER_VIDEO_ENCODE_INLINE_VECTORS, 1) != MMAL_SUCCESS)
+	      vcos_log_error("failed to set INLINE VECTORS parameters");
+	}
+
+	status = mmal_component_enable(encoder_component);
+	if (status == MMAL_SUCCESS)
+	   status = mmal_component_enable(splitter);
+	if (status)
+	{
+	   vcos_log_error("Unable to enable video encoder or splitter component");
+	   return status;
+	}
+
+	state->encoder_pool = mmal_port_pool_create(encoder_output, encoder_output->buffer_num, encoder_output->buffer_size);
+	if (!state->encoder_pool)
+	{
+	   vcos_log_error("Failed to create buffer header pool for encoder output port");
+	   return MMAL_ENOMEM;
+	}
+
+	status = connect_ports(video_port, splitter->input[0], &state->splitter_connection);
+	if (status)
+	{
+	   state->splitter_connection = NULL;
+	   vcos_log_error("Failed to connect camera video port to splitter input");
+	   return status;
+	}
+	status = connect_ports(splitter->output[SPLITTER_ENCODER_PORT], encoder_component->input[0], &state->encoder_connection);
+	if (status)
+	{
+	   state->encoder_connection = NULL;
+	   vcos_log_error("Failed to connect splitter to video encoder input");
+	   return status;
+	}
+
+	encoder_output->userdata = (struct MMAL_PORT_USERDATA_T *)source;
+	status = mmal_port_enable(encoder_output, encoder_buffer_callback);
+	if (status)
+	{
+	   vcos_log_error("Failed to setup encoder output");
+	   return status;
+	}
+
+	// The raw frames come from the splitter now
+	splitter->output[SPLITTER_RAW_PORT]->userdata = (struct MMAL_PORT_USERDATA_T *)source;
+	return enable_video_port(source, splitter->output[SPLITTER_RAW_PORT]);
+}
+
+static void mmal_close(RASPICAM_SOURCE * source);
+
+static int mmal_open(RASPICAM_SOURCE * source)
+{
+	MMAL_SOURCE_STATE * state = (MMAL_SOURCE_STATE *)calloc(1, sizeof(MMAL_SOURCE_STATE));
+	if (!state)
+		return -1;
+	source->priv = state;
+
+	bcm_host_init();
+
+	set_camera_parameters(&state->camera_parameters, source->properties);
+
+	// create camera
+	if (!create_camera_component(source))
+	{
+	   vcos_log_error("%s: Failed to create camera component", __func__);
+	   mmal_close(source);
+	   return -1;
+	}
+
+	return 0;
+}
+
+static int mmal_start(RASPICAM_SOURCE * source)
+{
+	MMAL_SOURCE_STATE * state = (MMAL_SOURCE_STATE *)source->priv;
+	MMAL_PORT_T *camera_video_port = state->camera_component->output[MMAL_CAMERA_VIDEO_PORT];
+	MMAL_PORT_T *preview_port = state->camera_component->output[MMAL_CAMERA_PREVIEW_PORT];
+	MMAL_PORT_T *video_port = raw_port(state);
+
+	// mmal_stop disabled the ports, a restart without a new format enables them again
+	if (!video_port->is_enabled && mmal_port_enable(video_port, video_buffer_callback) != MMAL_SUCCESS)
+	{
+	   vcos_log_error("%s: Failed to enable the video port", __func__);
+	   return -1;
+	}
+	if (state->preview_pool && !preview_port->is_enabled)
+		mmal_port_enable(preview_port, preview_buffer_callback);
+	if (state->encoder_pool && !state->encoder_component->output[0]->is_enabled)
+		mmal_port_enable(state->encoder_component->output[0], encoder_buffer_callback);
+
+	// start capture
+	if (mmal_port_parameter_set_boolean(camera_video_port, MMAL_PARAMETER_CAPTURE, 1) != MMAL_SUCCESS)
+	{
+	   vcos_log_error("%s: Failed to start capture", __func__);
+	   return -1;
+	}
+
+	// Send all the buffers to the video port, the preview port for the second stream, and the encoder
+	send_pool_buffers(state->video_pool, video_port);
+	if (state->preview_pool)
+		send_pool_buffers(state->preview_pool, preview_port);
+	if (state->encoder_pool)
+		send_pool_buffers(state->encoder_pool, state->encoder_component->output[0]);
+
+	return 0;
+}
+
+static void mmal_stop(RASPICAM_SOURCE * source)
+{
+	MMAL_SOURCE_STATE * state = (MMAL_SOURCE_STATE *)source->priv;
+
+	if (state && state->camera_component)
+	{
+		MMAL_PORT_T *camera_video_port = state->camera_component->output[MMAL_CAMERA_VIDEO_PORT];
+		mmal_port_parameter_set_boolean(camera_video_port, MMAL_PARAMETER_CAPTURE, 0);
+		// When encoding, the camera video port stays connected to the splitter
+		check_disable_port(raw_port(state));
+		check_disable_port(state->camera_component->output[MMAL_CAMERA_PREVIEW_PORT]);
+		if (state->encoder_component)
+			check_disable_port(state->encoder_component->output[0]);
+	}
+}
+
+static void mmal_close(RASPICAM_SOURCE * source)
+{
+	MMAL_SOURCE_STATE * state = (MMAL_SOURCE_STATE *)source->priv;
+
+	if (!state)
+		return;
+
+	// The encoder first, it holds the raw frames pool and a connection to the camera
+	destroy_encoder_component(state);
+
+	if (state->camera_component)
+	{
+		destroy_camera_pools(state, state->camera_component);
+		mmal_component_disable(state->camera_component);
+	}
+
+	destroy_camera_component(state);
+
+	free(state);
+	source->priv = NULL;
+}
+
+static void mmal_release_buffer(RASPICAM_SOURCE * source, void * handle)
+{
+	MMAL_BUFFER_HEADER_T * buffer = (MMAL_BUFFER_HEADER_T *)handle;
+
+	mmal_buffer_header_mem_unlock(buffer);
+	recycle_buffer((MMAL_SOURCE_STATE *)source->priv, buffer);
+}
+
+static int mmal_reconfigure(RASPICAM_SOURCE * source)
+{
+	MMAL_SOURCE_STATE * state = (MMAL_SOURCE_STATE *)source->priv;
+	MMAL_COMPONENT_T * camera = state->camera_component;
+	MMAL_PORT_T * video_port = camera->output[MMAL_CAMERA_VIDEO_PORT];
+	int disabled = 0;
+
+	// mmal_stop disabled the video port, its buffers are all back in the pool
+	if (state->video_pool)
+	{
+		mmal_port_pool_destroy(video_port, state->video_pool);
+		state->video_pool = NULL;
+	}
+	if (state->preview_pool)
+	{
+		mmal_port_pool_destroy(camera->output[MMAL_CAMERA_PREVIEW_PORT], state->preview_pool);
+		state->preview_pool = NULL;
+	}
+
+	// A larger size needs a new camera configuration, which only applies to a disabled component
+	if (source->full_width > state->max_width || source->full_height > state->max_height)
+	{
+		mmal_component_disable(camera);
+		disabled = 1;
+		set_camera_config(camera, source->full_width, source->full_height);
+		state->max_width = source->full_width;
+		state->max_height = source->full_height;
+	}
+
+	if (set_port_formats(source, camera) != MMAL_SUCCESS)
+		return -1;
+
+	if (enable_video_port(source, video_port) != MMAL_SUCCESS ||
+		enable_preview_port(source, camera->output[MMAL_CAMERA_PREVIEW_PORT]) != MMAL_SUCCESS)
+		return -1;
+
+	if (disabled)
+	{
+		if (mmal_component_enable(camera) != MMAL_SUCCESS)
+		{
+			vcos_log_error("camera component couldn't be enabled");
+			return -1;
+		}
+		raspicamcontrol_set_all_parameters(camera, &state->camera_parameters);
+	}
+
+	// The region may have changed with the size
+	return set_input_crop(source, camera) == MMAL_SUCCESS ? 0 : -1;
+}
+
+static int mmal_set_parameter(RASPICAM_SOURCE * source, int property_id, double value)
+{
+	MMAL_SOURCE_STATE * state = (MMAL_SOURCE_STATE *)source->priv;
+	RASPICAM_CAMERA_PARAMETERS * params = &state->camera_parameters;
+	MMAL_COMPONENT_T * camera = state->camera_component;
+
+	switch (property_id)
+	{
+		case RPI_CAP_PROP_BRIGHTNESS:
+			params->brightness = (int)value;
+			return raspicamcontrol_set_brightness(camera, params->brightness);
+		case RPI_CAP_PROP_CONTRAST:
+			params->contrast = (int)value;
+			return raspicamcontrol_set_contrast(camera, params->contrast);
+		case RPI_CAP_PROP_SATURATION:
+			params->saturation = (int)value;
+			return raspicamcontrol_set_saturation(camera, params->saturation);
+		case RPI_CAP_PROP_EXPOSURE:
+			params->shutter_speed = (int)value;
+			return raspicamcontrol_set_shutter_speed(camera, params->shutter_speed);
+		case RPI_CAP_PROP_BITRATE:
+			if (!state->encoder_component)
+				return -1;
+			return mmal_port_parameter_set_uint32(state->encoder_component->output[0], MMAL_PARAMETER_VIDEO_BIT_RATE, (uint32_t)value) == MMAL_SUCCESS ? 0 : -1;
+	}
+	return -1;
+}
+
+static void mmal_stop_encoder(RASPICAM_SOURCE * source)
+{
+	MMAL_SOURCE_STATE * state = (MMAL_SOURCE_STATE *)source->priv;
+	MMAL_PORT_T * video_port = state->camera_component->output[MMAL_CAMERA_VIDEO_PORT];
+
+	destroy_encoder_component(state);
+
+	// The camera video port delivers the raw frames again, in the capture's encoding
+	set_video_format(video_port->format, source, source->encoding);
+	if (mmal_port_format_commit(video_port) != MMAL_SUCCESS)
+		vcos_log_error("camera video format couldn't be set");
+	video_port->userdata = (struct MMAL_PORT_USERDATA_T *)source;
+	enable_video_port(source, video_port);
+
+	// Stopped like after mmal_stop, mmal_start enables it again
+	check_disable_port(video_port);
+}
+
+static int mmal_start_encoder(RASPICAM_SOURCE * source, int encoder, int bitrate)
+{
+	MMAL_SOURCE_STATE * state = (MMAL_SOURCE_STATE *)source->priv;
+	MMAL_PORT_T * video_port = state->camera_component->output[MMAL_CAMERA_VIDEO_PORT];
+
+	// mmal_stop disabled the video port, its buffers are all back in the pool
+	if (state->video_pool)
+	{
+		mmal_port_pool_destroy(video_port, state->video_pool);
+		state->video_pool = NULL;
+	}
+
+	if (create_encoder_component(source, encoder, bitrate) != MMAL_SUCCESS)
+	{
+		// Back to the raw frames alone
+		mmal_stop_encoder(source);
+		return -1;
+	}
+	return 0;
+}
+
+static int mmal_set_roi(RASPICAM_SOURCE * source)
+{
+	MMAL_SOURCE_STATE * state = (MMAL_SOURCE_STATE *)source->priv;
+
+	return set_input_crop(source, state->camera_component) == MMAL_SUCCESS ? 0 : -1;
+}
+
+const RASPICAM_SOURCE_OPS raspicam_mmal_source_ops =
+{
+	"mmal",
+	mmal_open,
+	mmal_start,
+	mmal_stop,
+	mmal_close,
+	mmal_release_buffer,
+	mmal_reconfigure,
+	mmal_set_parameter,
+	mmal_start_encoder,
+	mmal_stop_encoder,
+	mmal_set_roi,
+};
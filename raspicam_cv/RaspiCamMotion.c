@@ -0,0 +1,227 @@
+/*
+
+ Copyright (c) by Emil Valkov,
+ All rights reserved.
+
+ License: http://www.opensource.org/licenses/bsd-license.php
+
+ Block change detector, see RaspiCamMotion.h
+
+*/
+
+#include "RaspiCamMotion.h"
+#include "RaspiCamSource.h"
+#include "RaspiCamConvert.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#define MOTION_NEON
+#include <arm_neon.h>
+#elif defined(__SSE2__)
+#define MOTION_SSE2
+#include <emmintrin.h>
+#endif
+
+#define MOTION_DEFAULT_BLOCK 16
+#define MOTION_DEFAULT_THRESHOLD 8
+#define MACROBLOCK 16
+
+/**
+ * Sum of absolute differences of n bytes
+ */
+static inline uint32_t sad_segment(const uint8_t * a, const uint8_t * b, int n)
+{
+	uint32_t sum = 0;
+	int i = 0;
+
+#if defined(MOTION_NEON)
+	// 16 bit lanes hold 128 chunks, more than RASPICAM_MOTION_MAX_BLOCK RGB pixels
+	uint16x8_t acc = vdupq_n_u16(0);
+	for (; i + 16 <= n; i += 16)
+		acc = vpadalq_u8(acc, vabdq_u8(vld1q_u8(a + i), vld1q_u8(b + i)));
+	uint64x2_t total = vpaddlq_u32(vpaddlq_u16(acc));
+	sum = (uint32_t)(vgetq_lane_u64(total, 0) + vgetq_lane_u64(total, 1));
+#elif defined(MOTION_SSE2)
+	__m128i acc = _mm_setzero_si128();
+	for (; i + 16 <= n; i += 16)
+		acc = _mm_add_epi64(acc, _mm_sad_epu8(_mm_loadu_si128((const __m128i *)(a + i)), _mm_loadu_si128((const __m128i *)(b + i))));
+	sum = _mm_cvtsi128_si32(acc) + _mm_cvtsi128_si32(_mm_srli_si128(acc, 8));
+#endif
+
+	for (; i < n; i++)
+		sum += a[i] > b[i] ? a[i] - b[i] : b[i] - a[i];
+	return sum;
+}
+
+void raspicam_sad_row(const uint8_t * a, const uint8_t * b, int row_bytes, int block_bytes, uint32_t * sums)
+{
+	int x;
+
+	for (x = 0; x + block_bytes <= row_bytes; x += block_bytes)
+		*sums++ += sad_segment(a + x, b + x, block_bytes);
+	if (x < row_bytes)
+		*sums += sad_segment(a + x, b + x, row_bytes - x);
+}
+
+void raspicam_motion_init(RASPICAM_MOTION * motion)
+{
+	memset(motion, 0, sizeof(RASPICAM_MOTION));
+	pthread_mutex_init(&motion->lock, NULL);
+	motion->vector_pts = -1;
+}
+
+void raspicam_motion_destroy(RASPICAM_MOTION * motion)
+{
+	raspicam_motion_configure(motion, NULL, 0, 0, 0);
+	pthread_mutex_destroy(&motion->lock);
+}
+
+int raspicam_motion_configure(RASPICAM_MOTION * motion, const RASPICAM_MOTION_CONFIG * config,
+	int width, int height, int bytes_per_pixel)
+{
+	pthread_mutex_lock(&motion->lock);
+	raspicam_arena_free(motion->arena, motion->reference);
+	free(motion->sums);
+	free(motion->vector_map);
+	motion->reference = NULL;
+	motion->sums = NULL;
+	motion->vector_map = NULL;
+	motion->vector_pts = -1;
+	motion->has_reference = 0;
+	motion->blocks_x = motion->blocks_y = 0;
+
+	if (!config)
+	{
+		pthread_mutex_unlock(&motion->lock);
+		return 0;
+	}
+
+	motion->config = *config;
+	if (motion->config.block_size <= 0)
+		motion->config.block_size = MOTION_DEFAULT_BLOCK;
+	if (motion->config.threshold <= 0)
+		motion->config.threshold = MOTION_DEFAULT_THRESHOLD;
+	if (motion->config.min_blocks <= 0)
+		motion->config.min_blocks = 1;
+
+	// Whole SIMD chunks per block, and macroblocks for the encoder vectors
+	motion->config.block_size = (motion->config.block_size + MACROBLOCK - 1) & ~(MACROBLOCK - 1);
+	if (motion->config.block_size > RASPICAM_MOTION_MAX_BLOCK)
+		motion->config.block_size = RASPICAM_MOTION_MAX_BLOCK;
+
+	motion->width = width;
+	motion->height = height;
+	motion->bytes_per_pixel = bytes_per_pixel;
+	motion->blocks_x = (width + motion->config.block_size - 1) / motion->config.block_size;
+	motion->blocks_y = (height + motion->config.block_size - 1) / motion->config.block_size;
+
+	motion->reference = (uint8_t *)raspicam_arena_alloc(motion->arena, (size_t)width * bytes_per_pixel * height);
+	motion->sums = (uint32_t *)malloc(motion->blocks_x * sizeof(uint32_t));
+	motion->vector_map = (unsigned char *)calloc(motion->blocks_x * motion->blocks_y, 1);
+	pthread_mutex_unlock(&motion->lock);
+
+	if (!motion->reference || !motion->sums || !motion->vector_map)
+	{
+		fprintf(stderr, "%s: Failed to allocate the detector of a %dx%d frame\n", __func__, width, height);
+		raspicam_motion_configure(motion, NULL, 0, 0, 0);
+		return -1;
+	}
+	return 0;
+}
+
+int raspicam_motion_detect(RASPICAM_MOTION * motion, const uint8_t * data, int stride, unsigned char * map)
+{
+	int block_size = motion->config.block_size;
+	int row_bytes = motion->width * motion->bytes_per_pixel;
+	int block_bytes = block_size * motion->bytes_per_pixel;
+	int changed = 0;
+	int bx, by, y;
+
+	if (!motion->has_reference)
+	{
+		memset(map, 1, motion->blocks_x * motion->blocks_y);
+		return motion->blocks_x * motion->blocks_y;
+	}
+
+	for (by = 0; by < motion->blocks_y; by++)
+	{
+		int y0 = by * block_size;
+		int rows = motion->height - y0 < block_size ? motion->height - y0 : block_size;
+
+		memset(motion->sums, 0, motion->blocks_x * sizeof(uint32_t));
+		for (y = y0; y < y0 + rows; y++)
+			raspicam_sad_row(data + (size_t)y * stride, motion->reference + (size_t)y * row_bytes, row_bytes, block_bytes, motion->sums);
+
+		// Mean difference per byte over the block, the last ones may be smaller
+		for (bx = 0; bx < motion->blocks_x; bx++)
+		{
+			int x0 = bx * block_bytes;
+			int bytes = (row_bytes - x0 < block_bytes ? row_bytes - x0 : block_bytes) * rows;
+			int hit = motion->sums[bx] > (uint32_t)motion->config.threshold * bytes;
+
+			map[by * motion->blocks_x + bx] = hit;
+			changed += hit;
+		}
+	}
+	return changed;
+}
+
+int raspicam_motion_detect_vectors(RASPICAM_MOTION * motion, int64_t pts, int64_t max_age_us, unsigned char * map)
+{
+	int changed = -1;
+
+	pthread_mutex_lock(&motion->lock);
+	if (motion->vector_map && motion->vector_pts >= 0 && motion->vector_pts >= pts - max_age_us && motion->vector_pts <= pts)
+	{
+		memcpy(map, motion->vector_map, motion->blocks_x * motion->blocks_y);
+		changed = motion->vector_changed;
+	}
+	pthread_mutex_unlock(&motion->lock);
+	return changed;
+}
+
+void raspicam_motion_set_reference(RASPICAM_MOTION * motion, const uint8_t * data, int stride)
+{
+	int row_bytes = motion->width * motion->bytes_per_pixel;
+
+	raspicam_copy_plane(data, stride, motion->reference, row_bytes, row_bytes, motion->height);
+	motion->has_reference = 1;
+}
+
+void raspicam_motion_add_vectors(RASPICAM_MOTION * motion, const unsigned char * data, int length, int64_t pts)
+{
+	const RASPICAM_MOTION_VECTOR * vectors = (const RASPICAM_MOTION_VECTOR *)data;
+	int mb_x = (motion->width + MACROBLOCK - 1) / MACROBLOCK;
+	int mb_y = (motion->height + MACROBLOCK - 1) / MACROBLOCK;
+	int per_block = motion->config.block_size / MACROBLOCK;
+	int x, y;
+
+	pthread_mutex_lock(&motion->lock);
+	if (!motion->vector_map || length < (int)sizeof(RASPICAM_MOTION_VECTOR) * (mb_x + 1) * mb_y)
+	{
+		pthread_mutex_unlock(&motion->lock);
+		return;
+	}
+
+	// A macroblock changed when it moved, or its prediction error is over the threshold per pixel
+	memset(motion->vector_map, 0, motion->blocks_x * motion->blocks_y);
+	motion->vector_changed = 0;
+	for (y = 0; y < mb_y; y++)
+	{
+		for (x = 0; x < mb_x; x++)
+		{
+			const RASPICAM_MOTION_VECTOR * v = &vectors[y * (mb_x + 1) + x];
+			unsigned char * block = &motion->vector_map[(y / per_block) * motion->blocks_x + x / per_block];
+
+			if ((v->x || v->y || v->sad > motion->config.threshold * MACROBLOCK * MACROBLOCK) && !*block)
+			{
+				*block = 1;
+				motion->vector_changed++;
+			}
+		}
+	}
+	motion->vector_pts = pts;
+	pthread_mutex_unlock(&motion->lock);
+}
@@ -0,0 +1,92 @@
+#ifndef __RaspiCamMotion__
+#define __RaspiCamMotion__
+
+#include <stdint.h>
+#include <pthread.h>
+#include "RaspiCamCV.h"
+#include "RaspiCamArena.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Block change detector of the capture callback. Each frame is compared with
+ * the last frame handed to the consumer: the sum of absolute differences of
+ * each block of the luma plane, or of the RGB bytes, against a threshold.
+ * Frames with too few changed blocks are not written to the ring at all.
+ *
+ * When the H.264 encoder runs with motion vectors, the macroblocks it saw
+ * move or change give the map instead. They come after the raw frame, so
+ * the map of a frame is the one of the previous encoded frame.
+ */
+
+#define RASPICAM_MOTION_MAX_BLOCK 128
+
+typedef struct
+{
+	RASPICAM_MOTION_CONFIG config;
+	int width;				/// Frame size in pixels
+	int height;
+	int bytes_per_pixel;	/// 1 for the luma plane, 3 for RGB
+	int blocks_x;
+	int blocks_y;
+
+	RASPICAM_ARENA * arena;	/// Where the reference frame goes, NULL for malloc
+	uint8_t * reference;	/// Last frame kept, row_bytes per row
+	int has_reference;
+	uint32_t * sums;		/// Per block sums of one band of rows
+
+	// Encoder motion vectors
+	pthread_mutex_t lock;
+	unsigned char * vector_map;	/// Changed blocks of the last encoded frame
+	int vector_changed;
+	int64_t vector_pts;			/// -1 when there is none
+} RASPICAM_MOTION;
+
+void raspicam_motion_init(RASPICAM_MOTION * motion);
+void raspicam_motion_destroy(RASPICAM_MOTION * motion);
+
+/**
+ * Set up for a frame size, or free everything
+ *
+ * @param motion The detector
+ * @param config Settings, NULL to turn the detector off
+ * @param width Frame width in pixels
+ * @param height Frame height in pixels
+ * @param bytes_per_pixel 1 for a luma plane, 3 for RGB
+ *
+ * @return 0 on success
+ */
+int raspicam_motion_configure(RASPICAM_MOTION * motion, const RASPICAM_MOTION_CONFIG * config,
+	int width, int height, int bytes_per_pixel);
+
+/**
+ * Compare a frame with the reference
+ *
+ * @param motion The detector
+ * @param data First plane of the frame
+ * @param stride Bytes per row of data
+ * @param map blocks_x * blocks_y bytes, set to 1 for the changed blocks
+ *
+ * @return Changed blocks, every block when there is no reference yet
+ */
+int raspicam_motion_detect(RASPICAM_MOTION * motion, const uint8_t * data, int stride, unsigned char * map);
+
+/// Map of the encoder motion vectors, if there is one from max_age_us before pts. Returns changed blocks, -1 for none.
+int raspicam_motion_detect_vectors(RASPICAM_MOTION * motion, int64_t pts, int64_t max_age_us, unsigned char * map);
+
+/// Keep a frame as the reference of the next ones
+void raspicam_motion_set_reference(RASPICAM_MOTION * motion, const uint8_t * data, int stride);
+
+/// Encoder side information: RASPICAM_MOTION_VECTOR entries of 16x16 macroblocks, one more per row than fit the width
+void raspicam_motion_add_vectors(RASPICAM_MOTION * motion, const unsigned char * data, int length, int64_t pts);
+
+/// Add the sum of absolute differences of each block_bytes wide segment of a row to sums, the last one may be narrower
+void raspicam_sad_row(const uint8_t * a, const uint8_t * b, int row_bytes, int block_bytes, uint32_t * sums);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,194 @@
+/*
+
+ Copyright (c) by Emil Valkov,
+ All rights reserved.
+
+ License: http://www.opensource.org/licenses/bsd-license.php
+
+ Multi-camera capture manager, see RaspiCamMulti.h
+
+*/
+
+#define _GNU_SOURCE
+#include "RaspiCamMulti.h"
+#include "RaspiCamStats.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+
+// Frames skipped on one set before deciding the timestamps can't match
+#define MULTI_MAX_DISCARDED 64
+
+struct _RaspiCamCvMultiCapture
+{
+	int count;
+	RaspiCamCvCapture ** captures;
+	IplImage ** images;			/// Newest frame of each camera
+	RASPICAM_FRAME_TIMES * times;
+	int64_t skew_us;
+
+	unsigned int sets;
+	unsigned int discarded;
+	RASPICAM_ROLLING_HISTOGRAM skew;
+};
+
+int raspicam_pin_thread(int cpu)
+{
+	cpu_set_t set;
+	int i;
+
+	CPU_ZERO(&set);
+	if (cpu >= 0)
+	{
+		CPU_SET(cpu, &set);
+	}
+	else
+	{
+		for (i = 0; i < sysconf(_SC_NPROCESSORS_CONF) && i < CPU_SETSIZE; i++)
+			CPU_SET(i, &set);
+	}
+	return pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+}
+
+RaspiCamCvMultiCapture * raspiCamCvCreateMultiCapture(int count, RASPIVID_CONFIG * config, const int * cpus, int skew_us)
+{
+	RaspiCamCvMultiCapture * multi;
+	int i;
+
+	if (count <= 0)
+		return NULL;
+
+	multi = (RaspiCamCvMultiCapture *)calloc(1, sizeof(RaspiCamCvMultiCapture));
+	if (!multi)
+		return NULL;
+	multi->captures = (RaspiCamCvCapture **)calloc(count, sizeof(RaspiCamCvCapture *));
+	multi->images = (IplImage **)calloc(count, sizeof(IplImage *));
+	multi->times = (RASPICAM_FRAME_TIMES *)calloc(count, sizeof(RASPICAM_FRAME_TIMES));
+	raspicam_histogram_init(&multi->skew);
+	multi->count = count;
+
+	if (!multi->captures || !multi->images || !multi->times)
+	{
+		raspiCamCvReleaseMultiCapture(&multi);
+		return NULL;
+	}
+
+	for (i = 0; i < count; i++)
+	{
+		multi->captures[i] = raspiCamCvCreateCameraCapture3(i, config, NULL, 0);
+		if (!multi->captures[i])
+		{
+			fprintf(stderr, "%s: Failed to open camera %d\n", __func__, i);
+			raspiCamCvReleaseMultiCapture(&multi);
+			return NULL;
+		}
+		if (cpus && cpus[i] >= 0 && !raspiCamCvPinCallback(multi->captures[i], cpus[i]))
+			fprintf(stderr, "%s: No core %d for camera %d\n", __func__, cpus[i], i);
+	}
+
+	if (skew_us > 0)
+		multi->skew_us = skew_us;
+	else
+		multi->skew_us = 500000 / (int)raspiCamCvGetCaptureProperty(multi->captures[0], RPI_CAP_PROP_FPS);
+
+	return multi;
+}
+
+void raspiCamCvReleaseMultiCapture(RaspiCamCvMultiCapture ** multi)
+{
+	int i;
+
+	for (i = 0; (*multi)->captures && i < (*multi)->count; i++)
+	{
+		if ((*multi)->captures[i])
+			raspiCamCvReleaseCapture(&(*multi)->captures[i]);
+	}
+
+	raspicam_histogram_destroy(&(*multi)->skew);
+	free((*multi)->captures);
+	free((*multi)->images);
+	free((*multi)->times);
+	free(*multi);
+	*multi = NULL;
+}
+
+RaspiCamCvCapture * raspiCamCvMultiCaptureCamera(RaspiCamCvMultiCapture * multi, int camera)
+{
+	if (camera < 0 || camera >= multi->count)
+		return NULL;
+	return multi->captures[camera];
+}
+
+/**
+ * Replace the frame of one camera with its next one
+ *
+ * @return 1 on success
+ */
+static int query_camera(RaspiCamCvMultiCapture * multi, int camera)
+{
+	multi->images[camera] = raspiCamCvQueryFrame(multi->captures[camera]);
+	return multi->images[camera] && raspiCamCvGetFrameTimes(multi->captures[camera], &multi->times[camera]);
+}
+
+int raspiCamCvQueryFrameSet(RaspiCamCvMultiCapture * multi, IplImage ** images, RASPICAM_FRAME_TIMES * times)
+{
+	int i, behind, discarded = 0;
+	int64_t newest, oldest;
+
+	for (i = 0; i < multi->count; i++)
+	{
+		if (!query_camera(multi, i))
+			return 0;
+	}
+
+	// Cameras behind the newest frame catch up, until they are all within the skew
+	do
+	{
+		newest = multi->times[0].pts;
+		for (i = 1; i < multi->count; i++)
+		{
+			if (multi->times[i].pts > newest)
+				newest = multi->times[i].pts;
+		}
+
+		behind = 0;
+		for (i = 0; i < multi->count; i++)
+		{
+			if (multi->times[i].pts >= newest - multi->skew_us)
+				continue;
+			if (++discarded > MULTI_MAX_DISCARDED || !query_camera(multi, i))
+			{
+				fprintf(stderr, "%s: The cameras never came within %lld us, are they on the same clock?\n",
+					__func__, (long long)multi->skew_us);
+				multi->discarded += discarded;
+				return 0;
+			}
+			behind = 1;
+		}
+	} while (behind);
+
+	oldest = newest;
+	for (i = 0; i < multi->count; i++)
+	{
+		if (multi->times[i].pts < oldest)
+			oldest = multi->times[i].pts;
+	}
+	raspicam_histogram_add(&multi->skew, newest - oldest);
+	multi->discarded += discarded;
+	multi->sets++;
+
+	memcpy(images, multi->images, multi->count * sizeof(IplImage *));
+	if (times)
+		memcpy(times, multi->times, multi->count * sizeof(RASPICAM_FRAME_TIMES));
+	return 1;
+}
+
+void raspiCamCvGetFrameSetStats(RaspiCamCvMultiCapture * multi, RASPICAM_FRAME_SET_STATS * stats)
+{
+	stats->sets = multi->sets;
+	stats->discarded = multi->discarded;
+	raspicam_histogram_snapshot(&multi->skew, &stats->skew);
+}
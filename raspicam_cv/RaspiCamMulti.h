@@ -0,0 +1,24 @@
+#ifndef __RaspiCamMulti__
+#define __RaspiCamMulti__
+
+#include "RaspiCamCV.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Several cameras: one capture each, queried together until their newest
+ * frames are within the skew tolerance of each other. The cameras must
+ * timestamp their frames on the same clock, which the camera and the soft
+ * sources do.
+ */
+
+/// Run the calling thread on one core, -1 for any. Returns 0 on success.
+int raspicam_pin_thread(int cpu);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
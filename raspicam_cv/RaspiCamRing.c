@@ -0,0 +1,292 @@
+/*
+
+ Copyright (c) by Emil Valkov,
+ All rights reserved.
+
+ License: http://www.opensource.org/licenses/bsd-license.php
+
+ Lock-free frame ring between the frame source thread and the capture consumer.
+
+*/
+
+#include "RaspiCamRing.h"
+#include <string.h>
+#include <time.h>
+#include <errno.h>
+
+// Sequence numbers wrap, compare them through the signed difference
+#define SEQ_BEFORE(a, b) ((int)((a) - (b)) < 0)
+
+static int claim(RASPICAM_RING_SLOT * slot, int from, int to)
+{
+	int expected = from;
+	return atomic_compare_exchange_strong(&slot->state, &expected, to);
+}
+
+int raspicam_ring_init(RASPICAM_RING * ring, int depth, int policy, RASPICAM_RING_DROP_CB drop, void * userdata)
+{
+	int i;
+
+	if (depth < 2 || depth > RASPICAM_RING_MAX_DEPTH)
+		return -1;
+
+	memset(ring, 0, sizeof(RASPICAM_RING));
+	ring->depth = depth;
+	ring->policy = policy;
+	ring->drop = drop;
+	ring->userdata = userdata;
+
+	for (i = 0; i < RASPICAM_RING_MAX_DEPTH; i++)
+	{
+		atomic_init(&ring->slots[i].state, RING_SLOT_FREE);
+		atomic_init(&ring->slots[i].seq, 0);
+	}
+	atomic_init(&ring->next_seq, 0);
+	atomic_init(&ring->dropped, 0);
+	atomic_init(&ring->blocking, 0);
+	atomic_init(&ring->closed, 0);
+
+	if (sem_init(&ring->free_sem, 0, 0) != 0)
+		return -1;
+	return sem_init(&ring->ready_sem, 0, 0);
+}
+
+void raspicam_ring_reset(RASPICAM_RING * ring)
+{
+	int i;
+
+	for (i = 0; i < ring->depth; i++)
+	{
+		if (ring->drop)
+			ring->drop(ring->userdata, &ring->slots[i]);
+		atomic_store(&ring->slots[i].state, RING_SLOT_FREE);
+	}
+	while (sem_trywait(&ring->ready_sem) == 0);
+	while (sem_trywait(&ring->free_sem) == 0);
+	atomic_store(&ring->closed, 0);
+}
+
+void raspicam_ring_destroy(RASPICAM_RING * ring)
+{
+	raspicam_ring_reset(ring);
+	sem_destroy(&ring->ready_sem);
+	sem_destroy(&ring->free_sem);
+}
+
+void raspicam_ring_set_blocking(RASPICAM_RING * ring, int blocking)
+{
+	atomic_store(&ring->blocking, blocking);
+	if (!blocking)
+		sem_post(&ring->free_sem);
+}
+
+void raspicam_ring_close(RASPICAM_RING * ring)
+{
+	atomic_store(&ring->closed, 1);
+	sem_post(&ring->ready_sem);
+}
+
+/**
+ * Find the READY slot with the lowest or highest sequence number
+ *
+ * @param ring Pointer to the ring
+ * @param newest Look for the highest sequence number
+ *
+ * @return The slot, NULL if no slot is READY
+ */
+static RASPICAM_RING_SLOT * find_ready(RASPICAM_RING * ring, int newest)
+{
+	RASPICAM_RING_SLOT * best = NULL;
+	unsigned int best_seq = 0;
+	int i;
+
+	for (i = 0; i < ring->depth; i++)
+	{
+		RASPICAM_RING_SLOT * slot = &ring->slots[i];
+		if (atomic_load(&slot->state) != RING_SLOT_READY)
+			continue;
+
+		unsigned int seq = atomic_load(&slot->seq);
+		if (!best || (newest ? SEQ_BEFORE(best_seq, seq) : SEQ_BEFORE(seq, best_seq)))
+		{
+			best = slot;
+			best_seq = seq;
+		}
+	}
+	return best;
+}
+
+RASPICAM_RING_SLOT * raspicam_ring_begin_write(RASPICAM_RING * ring)
+{
+	int i;
+
+	for (;;)
+	{
+		for (i = 0; i < ring->depth; i++)
+		{
+			if (claim(&ring->slots[i], RING_SLOT_FREE, RING_SLOT_WRITING))
+				return &ring->slots[i];
+		}
+
+		// Every release posts, try again after each
+		if (!atomic_load(&ring->blocking))
+			break;
+		sem_wait(&ring->free_sem);
+	}
+
+	if (ring->policy == RASPICAM_FRAME_LATEST)
+	{
+		// Overwrite the oldest frame the consumer hasn't picked up. It may
+		// take it while we look, so try again on the next oldest.
+		RASPICAM_RING_SLOT * slot;
+		while ((slot = find_ready(ring, 0)) != NULL)
+		{
+			if (claim(slot, RING_SLOT_READY, RING_SLOT_WRITING))
+			{
+				if (ring->drop)
+					ring->drop(ring->userdata, slot);
+				atomic_fetch_add(&ring->dropped, 1);
+				return slot;
+			}
+		}
+	}
+
+	atomic_fetch_add(&ring->dropped, 1);
+	return NULL;
+}
+
+void raspicam_ring_end_write(RASPICAM_RING * ring, RASPICAM_RING_SLOT * slot)
+{
+	atomic_store(&slot->seq, atomic_fetch_add(&ring->next_seq, 1));
+	atomic_store(&slot->state, RING_SLOT_READY);
+	sem_post(&ring->ready_sem);
+}
+
+RASPICAM_RING_SLOT * raspicam_ring_acquire(RASPICAM_RING * ring, int wait)
+{
+	int newest = (ring->policy == RASPICAM_FRAME_LATEST) && !atomic_load(&ring->blocking);
+
+	for (;;)
+	{
+		// The semaphore only wakes us up, the slot states tell what is there
+		if (wait)
+			while (sem_trywait(&ring->ready_sem) == 0);
+
+		RASPICAM_RING_SLOT * slot = find_ready(ring, newest);
+		if (slot)
+		{
+			if (!claim(slot, RING_SLOT_READY, RING_SLOT_READING))
+				continue;
+
+			if (newest)
+			{
+				// Older frames will never be handed out
+				RASPICAM_RING_SLOT * old;
+				unsigned int seq = atomic_load(&slot->seq);
+				while ((old = find_ready(ring, 0)) != NULL && SEQ_BEFORE(atomic_load(&old->seq), seq))
+				{
+					if (claim(old, RING_SLOT_READY, RING_SLOT_READING))
+					{
+						raspicam_ring_release(ring, old);
+						atomic_fetch_add(&ring->dropped, 1);
+					}
+				}
+			}
+			return slot;
+		}
+
+		if (!wait || atomic_load(&ring->closed))
+			return NULL;
+
+		sem_wait(&ring->ready_sem);
+	}
+}
+
+/**
+ * Look for the READY frame matching a pts, dropping the older ones
+ *
+ * @param ring Pointer to the ring
+ * @param pts Presentation timestamp to match
+ * @param tolerance Largest pts difference of a match
+ * @param newer Set if a READY frame is past the match
+ *
+ * @return The claimed slot, NULL if there is no match
+ */
+static RASPICAM_RING_SLOT * claim_match(RASPICAM_RING * ring, int64_t pts, int64_t tolerance, int * newer)
+{
+	int i;
+
+	for (i = 0; i < ring->depth; i++)
+	{
+		RASPICAM_RING_SLOT * slot = &ring->slots[i];
+		if (!claim(slot, RING_SLOT_READY, RING_SLOT_READING))
+			continue;
+
+		// The slot is ours, its pts is stable
+		int64_t delta = slot->pts - pts;
+		if (delta >= -tolerance && delta <= tolerance)
+			return slot;
+
+		if (delta < 0)
+		{
+			// Too old to ever match
+			raspicam_ring_release(ring, slot);
+			atomic_fetch_add(&ring->dropped, 1);
+		}
+		else
+		{
+			*newer = 1;
+			atomic_store(&slot->state, RING_SLOT_READY);
+		}
+	}
+	return NULL;
+}
+
+RASPICAM_RING_SLOT * raspicam_ring_acquire_match(RASPICAM_RING * ring, int64_t pts, int64_t tolerance, int64_t timeout_us)
+{
+	struct timespec deadline;
+
+	clock_gettime(CLOCK_REALTIME, &deadline);
+	deadline.tv_sec += timeout_us / 1000000;
+	deadline.tv_nsec += (timeout_us % 1000000) * 1000;
+	if (deadline.tv_nsec >= 1000000000L)
+	{
+		deadline.tv_nsec -= 1000000000L;
+		deadline.tv_sec++;
+	}
+
+	for (;;)
+	{
+		int newer = 0;
+
+		// The semaphore only wakes us up, the slot states tell what is there
+		while (sem_trywait(&ring->ready_sem) == 0);
+
+		RASPICAM_RING_SLOT * slot = claim_match(ring, pts, tolerance, &newer);
+		if (slot || newer)
+			return slot;
+
+		if (sem_timedwait(&ring->ready_sem, &deadline) != 0 && errno == ETIMEDOUT)
+			return NULL;
+	}
+}
+
+void raspicam_ring_release(RASPICAM_RING * ring, RASPICAM_RING_SLOT * slot)
+{
+	if (ring->drop)
+		ring->drop(ring->userdata, slot);
+	atomic_store(&slot->state, RING_SLOT_FREE);
+	if (atomic_load(&ring->blocking))
+		sem_post(&ring->free_sem);
+}
+
+void raspicam_ring_slot_times(RASPICAM_RING_SLOT * slot, RASPICAM_FRAME_TIMES * times)
+{
+	times->pts = slot->pts;
+	times->callback = slot->callback_us;
+	times->copied = slot->copied_us;
+	times->pickup = slot->pickup_us;
+	times->sequence = slot->sequence;
+	times->changed_blocks = slot->changed_blocks;
+	times->metadata = slot->metadata;
+}
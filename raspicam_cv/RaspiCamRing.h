@@ -0,0 +1,101 @@
+#ifndef __RaspiCamRing__
+#define __RaspiCamRing__
+
+#include <stdint.h>
+#include <stdatomic.h>
+#include <semaphore.h>
+#include "RaspiCamCV.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Single producer / single consumer ring of frame slots. The producer (the
+ * source thread) doesn't block: when no slot is free it either drops the
+ * incoming frame (RASPICAM_FRAME_EVERY) or overwrites the oldest unread one
+ * (RASPICAM_FRAME_LATEST). Slot ownership moves through atomic states, and
+ * each written frame gets an increasing sequence number.
+ *
+ * In blocking mode the producer waits for a free slot instead, and the
+ * consumer takes every frame in order whatever the policy.
+ */
+
+#define RASPICAM_RING_MAX_DEPTH 16
+
+enum
+{
+	RING_SLOT_FREE = 0,
+	RING_SLOT_WRITING,	/// Owned by the producer
+	RING_SLOT_READY,	/// Written, not handed out yet
+	RING_SLOT_READING,	/// Owned by the consumer
+};
+
+typedef struct
+{
+	atomic_int state;		/// RING_SLOT_*
+	atomic_uint seq;		/// Order the frame was written to the ring in
+	unsigned int sequence;	/// Frame number from the source, with gaps for the frames that never reached the ring
+	int64_t pts;			/// Presentation timestamp in microseconds
+	int64_t callback_us;	/// Source callback entry
+	int64_t copied_us;		/// Frame ready in the slot
+	int64_t pickup_us;		/// Handed out to the consumer
+	void * handle;			/// Zero-copy: source buffer behind image
+	IplImage * image;
+	IplImage * planes [3];	/// YUV formats: views of the Y (same as image), U and V or UV planes
+	unsigned char * data;	/// YUV formats without zero-copy: frame copy behind the planes
+	unsigned char * motion;	/// Changed block map, with motion detection
+	int changed_blocks;		/// -1 without motion detection
+	RASPICAM_FRAME_METADATA metadata;	/// Sensor settings
+} RASPICAM_RING_SLOT;
+
+/// Called when the content of a slot is discarded, to free what the frame holds
+typedef void (*RASPICAM_RING_DROP_CB)(void * userdata, RASPICAM_RING_SLOT * slot);
+
+typedef struct
+{
+	RASPICAM_RING_SLOT slots [RASPICAM_RING_MAX_DEPTH];
+	int depth;
+	int policy;				/// RASPICAM_FRAME_*
+
+	atomic_uint next_seq;
+	atomic_uint dropped;	/// Frames lost to a full ring, or skipped by the consumer
+	sem_t ready_sem;		/// Posted for every written frame
+	atomic_int blocking;	/// The producer waits for a free slot
+	atomic_int closed;		/// No more frames come, a waiting consumer gets NULL
+	sem_t free_sem;			/// Posted for every released slot in blocking mode
+
+	RASPICAM_RING_DROP_CB drop;
+	void * userdata;
+} RASPICAM_RING;
+
+int  raspicam_ring_init(RASPICAM_RING * ring, int depth, int policy, RASPICAM_RING_DROP_CB drop, void * userdata);
+void raspicam_ring_destroy(RASPICAM_RING * ring);
+/// Discard every frame, with the producer stopped and no slot handed out
+void raspicam_ring_reset(RASPICAM_RING * ring);
+/// Switch blocking mode on or off. Turning it off wakes up a waiting producer.
+void raspicam_ring_set_blocking(RASPICAM_RING * ring, int blocking);
+/// Producer: no more frames come until the next reset. Wakes up a waiting consumer.
+void raspicam_ring_close(RASPICAM_RING * ring);
+
+/// Producer: get a slot to write the next frame into. NULL if the frame must be dropped.
+RASPICAM_RING_SLOT * raspicam_ring_begin_write(RASPICAM_RING * ring);
+/// Producer: publish a slot returned by raspicam_ring_begin_write
+void raspicam_ring_end_write(RASPICAM_RING * ring, RASPICAM_RING_SLOT * slot);
+
+/// Consumer: take the next frame according to the policy. With wait == 0, NULL if there is none,
+/// otherwise NULL once the ring is closed and empty.
+RASPICAM_RING_SLOT * raspicam_ring_acquire(RASPICAM_RING * ring, int wait);
+/// Consumer: take the frame with a pts within tolerance of pts, dropping older frames. Waits up to
+/// timeout_us for it to arrive, NULL if it doesn't or a newer frame shows it never will.
+RASPICAM_RING_SLOT * raspicam_ring_acquire_match(RASPICAM_RING * ring, int64_t pts, int64_t tolerance, int64_t timeout_us);
+/// Timestamps of the frame in a slot
+void raspicam_ring_slot_times(RASPICAM_RING_SLOT * slot, RASPICAM_FRAME_TIMES * times);
+/// Consumer: give back a slot returned by raspicam_ring_acquire
+void raspicam_ring_release(RASPICAM_RING * ring, RASPICAM_RING_SLOT * slot);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
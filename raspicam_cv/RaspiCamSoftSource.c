@@ -0,0 +1,533 @@
+/*
+
+ Copyright (c) by Emil Valkov,
+ All rights reserved.
+
+ License: http://www.opensource.org/licenses/bsd-license.php
+
+ Common part of the sources generating frames in software: a pool of buffers
+ laid out like the camera video port output, and a thread filling them at the
+ requested framerate.
+
+*/
+
+#include "RaspiCamSource.h"
+#include "RaspiCamMotion.h"
+#include "RaspiCamConvert.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <time.h>
+#include <errno.h>
+
+#define SOFT_BUFFERS_NUM 3
+
+#define ALIGN_UP(x, n) (((x) + (n) - 1) & ~((n) - 1))
+
+// Start codes and markers around the stand-in encoder payload
+#define SOFT_ENCODED_OVERHEAD 16
+// Share of the bitrate of a H.264 keyframe, relative to the other frames
+#define SOFT_KEYFRAME_WEIGHT 4
+#define MACROBLOCK 16
+
+typedef struct
+{
+	RASPICAM_SOFT_FILL_CB fill;
+	void * generator;		/// State of the source using the helpers
+
+	unsigned char ** buffers;
+	int * busy;				/// Kept by the capture
+	int buffer_num;
+	int buffer_size;
+	unsigned char * second;	/// Second stream frame, copied by the capture
+
+	int encoder;			/// RASPICAM_ENCODER_* of the stand-in encoder
+	int bitrate;
+	unsigned int encoded_frames;	/// Since the encoder started, keyframes come every framerate frames
+	unsigned char * encoded;		/// Output buffer, sized for a keyframe
+	RASPICAM_MOTION_VECTOR * vectors;	/// H.264 side information, when source->motion_vectors
+	unsigned char * previous;		/// Frame the vectors are measured against, packed rows
+	uint32_t * mb_sums;
+
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t wake;	/// CLOCK_MONOTONIC, signalled by stop to cut the wait for the next frame short
+	atomic_int running;		/// Written by stop, read by the frame thread
+} SOFT_SOURCE_STATE;
+
+static int get_free_buffer(SOFT_SOURCE_STATE * state)
+{
+	int i, index = -1;
+
+	pthread_mutex_lock(&state->lock);
+	for (i = 0; i < state->buffer_num; i++)
+	{
+		if (!state->busy[i])
+		{
+			state->busy[i] = 1;
+			index = i;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&state->lock);
+	return index;
+}
+
+static void put_buffer(SOFT_SOURCE_STATE * state, int index)
+{
+	pthread_mutex_lock(&state->lock);
+	state->busy[index] = 0;
+	pthread_mutex_unlock(&state->lock);
+}
+
+/**
+ * Nearest neighbour scaling of one plane
+ *
+ * @param src Source plane
+ * @param src_stride Bytes per source row
+ * @param src_w Source width in pixels
+ * @param src_h Source height
+ * @param dst Destination plane
+ * @param dst_stride Bytes per destination row
+ * @param dst_w Destination width in pixels
+ * @param dst_h Destination height
+ * @param bpp Bytes per pixel
+ */
+static void scale_plane(const unsigned char * src, int src_stride, int src_w, int src_h,
+	unsigned char * dst, int dst_stride, int dst_w, int dst_h, int bpp)
+{
+	int x, y, c;
+
+	for (y = 0; y < dst_h; y++)
+	{
+		const unsigned char * src_row = src + (y * src_h / dst_h) * src_stride;
+		unsigned char * dst_row = dst + y * dst_stride;
+		for (x = 0; x < dst_w; x++)
+		{
+			const unsigned char * p = src_row + (x * src_w / dst_w) * bpp;
+			for (c = 0; c < bpp; c++)
+				dst_row[x * bpp + c] = p[c];
+		}
+	}
+}
+
+/**
+ * Downscale a frame to the second stream layout
+ */
+static void scale_frame(RASPICAM_SOURCE * source, const unsigned char * src, unsigned char * dst)
+{
+	int w = source->width, h = source->height;
+	int sw = source->second_width, sh = source->second_height;
+
+	if (source->encoding == RASPICAM_ENCODING_RGB24)
+	{
+		scale_plane(src, source->stride, w, h, dst, source->second_stride, sw, sh, 3);
+		return;
+	}
+
+	scale_plane(src, source->stride, w, h, dst, source->second_stride, sw, sh, 1);
+	src += source->stride * source->buffer_height;
+	dst += source->second_stride * source->second_buffer_height;
+	if (source->encoding == RASPICAM_ENCODING_NV12)
+	{
+		scale_plane(src, source->stride, (w + 1) / 2, (h + 1) / 2,
+			dst, source->second_stride, (sw + 1) / 2, (sh + 1) / 2, 2);
+	}
+	else
+	{
+		int i;
+		for (i = 0; i < 2; i++)
+		{
+			scale_plane(src, source->stride / 2, (w + 1) / 2, (h + 1) / 2,
+				dst, source->second_stride / 2, (sw + 1) / 2, (sh + 1) / 2, 1);
+			src += (source->stride / 2) * (source->buffer_height / 2);
+			dst += (source->second_stride / 2) * (source->second_buffer_height / 2);
+		}
+	}
+}
+
+/**
+ * Payload bytes of the next stand-in encoder frame, so that the stream averages the bitrate
+ */
+static int encoded_payload(RASPICAM_SOURCE * source, SOFT_SOURCE_STATE * state, int keyframe)
+{
+	long long frame_bytes = (long long)state->bitrate / 8 / source->framerate;
+	int period = source->framerate;
+
+	if (state->encoder == RASPICAM_ENCODER_MJPEG || period <= 1)
+		return frame_bytes;
+
+	// One keyframe per second, weighted against the period - 1 predicted frames
+	frame_bytes = frame_bytes * period / (period - 1 + SOFT_KEYFRAME_WEIGHT);
+	return keyframe ? frame_bytes * SOFT_KEYFRAME_WEIGHT : frame_bytes;
+}
+
+/**
+ * Stand-in motion vectors: no motion search, each macroblock gets the difference with the previous frame
+ */
+static void soft_vectors(RASPICAM_SOURCE * source, SOFT_SOURCE_STATE * state, const unsigned char * frame, int64_t pts)
+{
+	int bytes_per_pixel = source->encoding == RASPICAM_ENCODING_RGB24 ? 3 : 1;
+	int row_bytes = source->width * bytes_per_pixel;
+	int mb_x = (source->width + MACROBLOCK - 1) / MACROBLOCK;
+	int mb_y = (source->height + MACROBLOCK - 1) / MACROBLOCK;
+	int x, y;
+
+	for (y = 0; y < mb_y; y++)
+	{
+		int rows = source->height - y * MACROBLOCK < MACROBLOCK ? source->height - y * MACROBLOCK : MACROBLOCK;
+		int row;
+
+		memset(state->mb_sums, 0, mb_x * sizeof(uint32_t));
+		for (row = y * MACROBLOCK; row < y * MACROBLOCK + rows; row++)
+			raspicam_sad_row(frame + (size_t)row * source->stride, state->previous + (size_t)row * row_bytes,
+				row_bytes, MACROBLOCK * bytes_per_pixel, state->mb_sums);
+
+		for (x = 0; x < mb_x; x++)
+		{
+			uint32_t sad = state->mb_sums[x] / bytes_per_pixel;
+			RASPICAM_MOTION_VECTOR * v = &state->vectors[y * (mb_x + 1) + x];
+			v->x = v->y = 0;
+			v->sad = sad > 0xffff ? 0xffff : sad;
+		}
+	}
+
+	raspicam_copy_plane(frame, source->stride, state->previous, row_bytes, row_bytes, source->height);
+	raspicam_source_deliver_vectors(source, (const unsigned char *)state->vectors,
+		(mb_x + 1) * mb_y * sizeof(RASPICAM_MOTION_VECTOR), pts);
+}
+
+/**
+ * Stand-in encoder: frame the payload like the hardware does, H.264 NAL units or JPEG markers
+ */
+static void soft_encode(RASPICAM_SOURCE * source, SOFT_SOURCE_STATE * state, const unsigned char * frame, int64_t pts)
+{
+	// High profile level 4 SPS and a PPS, the VideoCore encoder repeats them before each keyframe
+	static const unsigned char headers[] = { 0, 0, 0, 1, 0x67, 0x64, 0x00, 0x28, 0, 0, 0, 1, 0x68, 0xee, 0x3c, 0x80 };
+	int h264 = state->encoder == RASPICAM_ENCODER_H264;
+	int keyframe = !h264 || state->encoded_frames % source->framerate == 0;
+	int payload = encoded_payload(source, state, keyframe);
+	size_t frame_size = (size_t)source->stride * source->buffer_height;
+	size_t step = frame_size / (payload > 0 ? payload : 1);
+	unsigned char * out = state->encoded;
+	int i, n = 0;
+
+	if (step == 0)
+		step = 1;
+
+	if (h264)
+	{
+		if (keyframe)
+			raspicam_source_deliver_encoded(source, headers, sizeof(headers), -1, RASPICAM_ENCODED_CONFIG);
+		out[n++] = 0; out[n++] = 0; out[n++] = 0; out[n++] = 1;
+		out[n++] = keyframe ? 0x65 : 0x41;	// IDR or non IDR slice
+	}
+	else
+	{
+		out[n++] = 0xff; out[n++] = 0xd8;	// SOI
+	}
+
+	// Sampled from the frame, without start code or marker emulation
+	for (i = 0; i < payload; i++)
+	{
+		unsigned char b = frame[(i * step) % frame_size];
+		if (h264)
+			out[n++] = b ? b : 1;
+		else
+			out[n++] = b != 0xff ? b : 0xfe;
+	}
+
+	if (!h264)
+	{
+		out[n++] = 0xff; out[n++] = 0xd9;	// EOI
+	}
+
+	raspicam_source_deliver_encoded(source, out, n, pts,
+		RASPICAM_ENCODED_FRAME_END | (keyframe ? RASPICAM_ENCODED_KEYFRAME : 0));
+	state->encoded_frames++;
+
+	if (state->vectors)
+		soft_vectors(source, state, frame, pts);
+}
+
+/**
+ * Sleep until an absolute CLOCK_MONOTONIC time, or until the source is stopped
+ *
+ * @return 1 if the source still runs
+ */
+static int wait_frame_time(SOFT_SOURCE_STATE * state, const struct timespec * next)
+{
+	pthread_mutex_lock(&state->lock);
+	while (state->running && pthread_cond_timedwait(&state->wake, &state->lock, next) != ETIMEDOUT);
+	pthread_mutex_unlock(&state->lock);
+	return state->running;
+}
+
+static void * soft_source_thread(void * arg)
+{
+	RASPICAM_SOURCE * source = (RASPICAM_SOURCE *)arg;
+	SOFT_SOURCE_STATE * state = (SOFT_SOURCE_STATE *)source->priv;
+	long period_ns = 1000000000L / source->framerate;
+	unsigned int frame = 0;
+	struct timespec next;
+
+	// The first frame is due right away, a restart doesn't wait a frame period for it
+	clock_gettime(CLOCK_MONOTONIC, &next);
+	next.tv_nsec -= period_ns;
+	while (next.tv_nsec < 0)
+	{
+		next.tv_nsec += 1000000000L;
+		next.tv_sec--;
+	}
+
+	while (state->running)
+	{
+		next.tv_nsec += period_ns;
+		while (next.tv_nsec >= 1000000000L)
+		{
+			next.tv_nsec -= 1000000000L;
+			next.tv_sec++;
+		}
+		if (!wait_frame_time(state, &next))
+			break;
+
+		// Like the camera, drop the frame when the capture holds every buffer
+		int index = get_free_buffer(state);
+		if (index >= 0)
+		{
+			// Like the camera clock, shared by the sources of a process
+			int64_t pts = (int64_t)next.tv_sec * 1000000 + next.tv_nsec / 1000;
+			if (state->fill(source, state->buffers[index], frame) != 0)
+			{
+				put_buffer(state, index);
+				raspicam_source_deliver_end(source);
+				break;
+			}
+			// The second stream goes first, its match is there when the main frame is picked up
+			if (state->second)
+			{
+				scale_frame(source, state->buffers[index], state->second);
+				raspicam_source_deliver_second(source, state->second, pts);
+			}
+			int kept = raspicam_source_deliver(source, state->buffers[index], pts, &state->busy[index]);
+
+			// Kept buffers are only read by the capture, the encoder can read them too
+			if (state->encoder)
+				soft_encode(source, state, state->buffers[index], pts);
+			if (!kept)
+				put_buffer(state, index);
+		}
+		frame++;
+	}
+
+	return NULL;
+}
+
+/**
+ * Allocate the buffers for the current source size and color mode
+ */
+static int alloc_buffers(RASPICAM_SOURCE * source, SOFT_SOURCE_STATE * state)
+{
+	int i;
+
+	source->stride = ALIGN_UP(source->width, 32) * (source->encoding == RASPICAM_ENCODING_RGB24 ? 3 : 1);
+	source->buffer_height = ALIGN_UP(source->height, 16);
+
+	// Buffers kept by the capture are out of the rotation until they are released
+	state->buffer_num = SOFT_BUFFERS_NUM + source->held_buffers;
+	state->buffer_size = source->stride * source->buffer_height;
+	if (source->encoding != RASPICAM_ENCODING_RGB24)
+		state->buffer_size += state->buffer_size / 2;	// chroma planes
+
+	state->buffers = (unsigned char **)calloc(state->buffer_num, sizeof(unsigned char *));
+	state->busy = (int *)calloc(state->buffer_num, sizeof(int));
+	if (!state->buffers || !state->busy)
+		return -1;
+
+	if (source->second_width > 0 && source->second_height > 0)
+	{
+		int second_size;
+
+		source->second_stride = ALIGN_UP(source->second_width, 32) * (source->encoding == RASPICAM_ENCODING_RGB24 ? 3 : 1);
+		source->second_buffer_height = ALIGN_UP(source->second_height, 16);
+		second_size = source->second_stride * source->second_buffer_height;
+		if (source->encoding != RASPICAM_ENCODING_RGB24)
+			second_size += second_size / 2;
+		state->second = (unsigned char *)raspicam_source_alloc(source, second_size);
+		if (!state->second)
+			return -1;
+	}
+	for (i = 0; i < state->buffer_num; i++)
+	{
+		state->buffers[i] = (unsigned char *)raspicam_source_alloc(source, state->buffer_size);
+		if (!state->buffers[i])
+			return -1;
+	}
+	return 0;
+}
+
+static void free_buffers(RASPICAM_SOURCE * source, SOFT_SOURCE_STATE * state)
+{
+	int i;
+
+	if (state->buffers)
+	{
+		for (i = 0; i < state->buffer_num; i++)
+			raspicam_source_free(source, state->buffers[i]);
+	}
+	free(state->buffers);
+	free(state->busy);
+	raspicam_source_free(source, state->second);
+	state->buffers = NULL;
+	state->busy = NULL;
+	state->second = NULL;
+}
+
+int raspicam_soft_source_open(RASPICAM_SOURCE * source, RASPICAM_SOFT_FILL_CB fill, void * generator)
+{
+	SOFT_SOURCE_STATE * state = (SOFT_SOURCE_STATE *)calloc(1, sizeof(SOFT_SOURCE_STATE));
+
+	if (!state)
+		return -1;
+	source->priv = state;
+	state->fill = fill;
+	state->generator = generator;
+
+	pthread_condattr_t attr;
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&state->wake, &attr);
+	pthread_condattr_destroy(&attr);
+
+	pthread_mutex_init(&state->lock, NULL);
+	atomic_init(&state->running, 0);
+	if (alloc_buffers(source, state) != 0)
+	{
+		// The capture doesn't close a source that failed to open
+		raspicam_soft_source_close(source);
+		return -1;
+	}
+	return 0;
+}
+
+int raspicam_soft_source_reconfigure(RASPICAM_SOURCE * source)
+{
+	SOFT_SOURCE_STATE * state = (SOFT_SOURCE_STATE *)source->priv;
+
+	// Stopped, and the capture has given back every buffer
+	free_buffers(source, state);
+	return alloc_buffers(source, state);
+}
+
+int raspicam_soft_source_start_encoder(RASPICAM_SOURCE * source, int encoder, int bitrate)
+{
+	SOFT_SOURCE_STATE * state = (SOFT_SOURCE_STATE *)source->priv;
+
+	if (bitrate <= 0)
+		return -1;
+
+	// Stopped, the frame thread doesn't use the encoder
+	free(state->encoded);
+	state->encoder = encoder;
+	state->bitrate = bitrate;
+	state->encoded_frames = 0;
+	state->encoded = (unsigned char *)malloc(encoded_payload(source, state, 1) + SOFT_ENCODED_OVERHEAD);
+	if (!state->encoded)
+	{
+		state->encoder = RASPICAM_ENCODER_NONE;
+		return -1;
+	}
+
+	if (encoder == RASPICAM_ENCODER_H264 && source->motion_vectors)
+	{
+		int mb_x = (source->width + MACROBLOCK - 1) / MACROBLOCK;
+		int mb_y = (source->height + MACROBLOCK - 1) / MACROBLOCK;
+		int row_bytes = source->width * (source->encoding == RASPICAM_ENCODING_RGB24 ? 3 : 1);
+
+		state->vectors = (RASPICAM_MOTION_VECTOR *)calloc((mb_x + 1) * mb_y, sizeof(RASPICAM_MOTION_VECTOR));
+		state->previous = (unsigned char *)calloc(row_bytes, source->height);
+		state->mb_sums = (uint32_t *)malloc(mb_x * sizeof(uint32_t));
+		if (!state->vectors || !state->previous || !state->mb_sums)
+		{
+			raspicam_soft_source_stop_encoder(source);
+			return -1;
+		}
+	}
+	return 0;
+}
+
+void raspicam_soft_source_stop_encoder(RASPICAM_SOURCE * source)
+{
+	SOFT_SOURCE_STATE * state = (SOFT_SOURCE_STATE *)source->priv;
+
+	state->encoder = RASPICAM_ENCODER_NONE;
+	free(state->encoded);
+	free(state->vectors);
+	free(state->previous);
+	free(state->mb_sums);
+	state->encoded = NULL;
+	state->vectors = NULL;
+	state->previous = NULL;
+	state->mb_sums = NULL;
+}
+
+void * raspicam_soft_source_generator(RASPICAM_SOURCE * source)
+{
+	SOFT_SOURCE_STATE * state = (SOFT_SOURCE_STATE *)source->priv;
+
+	return state ? state->generator : NULL;
+}
+
+int raspicam_soft_source_start(RASPICAM_SOURCE * source)
+{
+	SOFT_SOURCE_STATE * state = (SOFT_SOURCE_STATE *)source->priv;
+
+	state->running = 1;
+	if (pthread_create(&state->thread, NULL, soft_source_thread, source) != 0)
+	{
+		state->running = 0;
+		fprintf(stderr, "%s: Failed to start the frame thread\n", __func__);
+		return -1;
+	}
+	return 0;
+}
+
+void raspicam_soft_source_stop(RASPICAM_SOURCE * source)
+{
+	SOFT_SOURCE_STATE * state = (SOFT_SOURCE_STATE *)source->priv;
+
+	if (state && state->running)
+	{
+		// Under the lock, the frame thread can't miss the signal between its check and its wait
+		pthread_mutex_lock(&state->lock);
+		state->running = 0;
+		pthread_cond_signal(&state->wake);
+		pthread_mutex_unlock(&state->lock);
+		pthread_join(state->thread, NULL);
+	}
+}
+
+void raspicam_soft_source_close(RASPICAM_SOURCE * source)
+{
+	SOFT_SOURCE_STATE * state = (SOFT_SOURCE_STATE *)source->priv;
+
+	if (!state)
+		return;
+
+	free_buffers(source, state);
+	raspicam_soft_source_stop_encoder(source);
+	pthread_mutex_destroy(&state->lock);
+	pthread_cond_destroy(&state->wake);
+
+	free(state);
+	source->priv = NULL;
+}
+
+void raspicam_soft_source_release_buffer(RASPICAM_SOURCE * source, void * handle)
+{
+	SOFT_SOURCE_STATE * state = (SOFT_SOURCE_STATE *)source->priv;
+
+	put_buffer(state, (int *)handle - state->busy);
+}
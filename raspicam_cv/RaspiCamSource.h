@@ -0,0 +1,219 @@
+#ifndef __RaspiCamSource__
+#define __RaspiCamSource__
+
+#include <stdint.h>
+#include <stddef.h>
+#include "RaspiCamCV.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * A frame source produces raw frames for a RaspiCamCvCapture. The library
+ * comes with the MMAL camera, a synthetic pattern generator and a file
+ * replay source, and raspiCamCvCreateCameraCaptureFromSource takes your own.
+ * Sources hand each frame to raspicam_source_deliver() from their own thread,
+ * in the camera video port layout given by source->encoding: rows padded to
+ * source->stride bytes, and planes of source->buffer_height rows.
+ */
+
+typedef struct _RASPICAM_SOURCE RASPICAM_SOURCE;
+
+// H.264 encoder side information, one per 16x16 macroblock, see raspicam_source_deliver_vectors
+typedef struct
+{
+	signed char x;				// Motion vector in pixels
+	signed char y;
+	unsigned short sad;			// Prediction error of the macroblock
+} RASPICAM_MOTION_VECTOR;
+
+// Layout of the delivered buffers
+enum
+{
+	RASPICAM_ENCODING_RGB24 = 0,	// One plane of packed pixels
+	RASPICAM_ENCODING_I420,			// Y plane, then U and V planes of half the size, stride and rows
+	RASPICAM_ENCODING_NV12,			// Y plane, then interleaved UV of half the rows, same stride
+};
+
+typedef struct
+{
+	const char * name;
+
+	/// Allocate resources and negotiate the frame format. Returns 0 on success.
+	/// May change width and height, must set stride and buffer_height. On failure,
+	/// frees what it allocated: neither stop nor close is called then.
+	int  (*open)(RASPICAM_SOURCE * source);
+	/// Start delivering frames. Returns 0 on success.
+	int  (*start)(RASPICAM_SOURCE * source);
+	/// Stop delivering frames. raspicam_source_deliver is not called once this returns.
+	void (*stop)(RASPICAM_SOURCE * source);
+	/// Free everything allocated by open.
+	void (*close)(RASPICAM_SOURCE * source);
+	/// Give back a buffer the capture kept from raspicam_source_deliver.
+	void (*release_buffer)(RASPICAM_SOURCE * source, void * handle);
+	/// Optional. Apply new width, height, framerate, monochrome or encoding while stopped, with
+	/// every buffer given back. Must set stride and buffer_height. Returns 0 on success.
+	int  (*reconfigure)(RASPICAM_SOURCE * source);
+	/// Optional. Change a RPI_CAP_PROP_* image setting while running. Returns 0 on success.
+	int  (*set_parameter)(RASPICAM_SOURCE * source, int property_id, double value);
+	/// Optional. Encode the frames with RASPICAM_ENCODER_* at bitrate bits per second, next to the raw
+	/// frames, and hand the output to raspicam_source_deliver_encoded. Called while stopped. Returns 0 on success.
+	int  (*start_encoder)(RASPICAM_SOURCE * source, int encoder, int bitrate);
+	/// Optional. Remove the encoder, while stopped.
+	void (*stop_encoder)(RASPICAM_SOURCE * source);
+	/// Optional. Move the region of interest to roi_x, roi_y while running, same size. Returns 0 on success.
+	/// Called from the capture's thread: a frame thread gets the new position from here, not from roi_x, roi_y.
+	int  (*set_roi)(RASPICAM_SOURCE * source);
+} RASPICAM_SOURCE_OPS;
+
+struct _RASPICAM_SOURCE
+{
+	const RASPICAM_SOURCE_OPS * ops;
+	RASPIVID_STATE * state;     /// Capture fed by this source
+	void * priv;                /// Source private data
+
+	int width;                  /// Image size requested by the capture
+	int height;
+	int full_width;             /// Frame the image is cut from at roi_x, roi_y, the image size without a
+	int full_height;            /// region of interest. Sources that can't crop reset them in open
+	int roi_x;
+	int roi_y;
+	int framerate;
+	int monochrome;             /// Gray only, chroma planes are neutral
+	int encoding;               /// RASPICAM_ENCODING_*, I420 or NV12 in monochrome mode
+	int camera_num;             /// Camera index passed to raspiCamCvCreateCameraCapture*
+	const RASPIVID_PROPERTIES * properties; /// Camera properties, NULL for defaults
+	const char * arg;           /// RASPIVID_CONFIG.source_arg
+	void * userdata;            /// Passed to raspiCamCvCreateCameraCaptureFromSource
+	int held_buffers;           /// Buffers the capture may keep at once, on top of what the source needs
+	int motion_vectors;         /// The H.264 encoder also hands motion vectors to raspicam_source_deliver_vectors
+
+	int stride;                 /// Bytes per row of the delivered buffers, set by open
+	int buffer_height;          /// Rows allocated per delivered buffer, set by open
+
+	int second_width;           /// Second, downscaled stream, 0 for none. Sources without one reset it in open
+	int second_height;
+	int second_stride;          /// Layout of the second stream buffers, set by open
+	int second_buffer_height;
+
+	long long pool_bytes;       /// Buffers not from raspicam_source_alloc, for the memory stats. Set by open and reconfigure
+};
+
+/**
+ * Hand a frame over to the capture.
+ *
+ * @param source Source delivering the frame
+ * @param data Pixel data, source->stride bytes per row
+ * @param pts Presentation timestamp in microseconds, on a clock shared by the cameras
+ * @param handle Source specific buffer handle passed back to release_buffer
+ *
+ * @return 1 if the capture kept the buffer and will call release_buffer later,
+ *         0 if the source may reuse it as soon as this returns
+ */
+int raspicam_source_deliver(RASPICAM_SOURCE * source, unsigned char * data, int64_t pts, void * handle);
+
+/**
+ * Hand a frame of the second stream over to the capture, which copies it.
+ *
+ * @param source Source delivering the frame
+ * @param data Pixel data in source->encoding, source->second_stride bytes per row
+ * @param pts Presentation timestamp in microseconds, the same as the matching main frame
+ */
+void raspicam_source_deliver_second(RASPICAM_SOURCE * source, unsigned char * data, int64_t pts);
+
+/**
+ * Tell the capture no more frames come, after the end of the stream or a failure. The capture
+ * fails like after a restart that didn't work: a waiting raspiCamCvQueryFrame returns NULL.
+ *
+ * @param source Source that stopped delivering, from its own thread
+ */
+void raspicam_source_deliver_end(RASPICAM_SOURCE * source);
+
+/**
+ * Hand encoder output over to the capture, which passes it on as it is.
+ *
+ * @param source Source delivering the data
+ * @param data Encoded data
+ * @param length Bytes of data
+ * @param pts Presentation timestamp of the frame in microseconds, -1 for stream headers
+ * @param flags RASPICAM_ENCODED_*
+ */
+void raspicam_source_deliver_encoded(RASPICAM_SOURCE * source, const unsigned char * data, int length, int64_t pts, int flags);
+
+/**
+ * Hand the motion vectors of an encoded frame over to the capture
+ *
+ * @param source Source delivering the vectors
+ * @param data RASPICAM_MOTION_VECTOR array, (width + 15) / 16 + 1 per row, (height + 15) / 16 rows
+ * @param length Bytes of data
+ * @param pts Presentation timestamp of the frame in microseconds
+ */
+void raspicam_source_deliver_vectors(RASPICAM_SOURCE * source, const unsigned char * data, int length, int64_t pts);
+
+/**
+ * Report the sensor settings, which go with the frames delivered from now on
+ *
+ * @param source Source reporting the settings, from any thread
+ * @param settings Settings of the last exposure
+ */
+void raspicam_source_deliver_settings(RASPICAM_SOURCE * source, const RASPICAM_FRAME_METADATA * settings);
+
+/**
+ * Allocate a frame buffer from the memory of the capture, the arena when it has a max_memory
+ *
+ * @param source Source needing the buffer
+ * @param size Bytes
+ *
+ * @return Zeroed buffer, 64 byte aligned, NULL if it doesn't fit
+ */
+void * raspicam_source_alloc(RASPICAM_SOURCE * source, size_t size);
+void raspicam_source_free(RASPICAM_SOURCE * source, void * buffer);
+
+/**
+ * Create a capture fed by a custom source
+ *
+ * @param ops Source implementation, must stay valid until the capture is released
+ * @param userdata Stored in RASPICAM_SOURCE.userdata
+ * @param config Configuration, NULL for defaults. config->source is ignored
+ * @param properties Camera properties, NULL for defaults
+ * @param non_blocking Do not wait for the first frame
+ *
+ * @return The created capture device, NULL if something went wrong
+ */
+RaspiCamCvCapture * raspiCamCvCreateCameraCaptureFromSource(const RASPICAM_SOURCE_OPS * ops, void * userdata,
+	RASPIVID_CONFIG * config, RASPIVID_PROPERTIES * properties, int non_blocking);
+
+extern const RASPICAM_SOURCE_OPS raspicam_mmal_source_ops;
+extern const RASPICAM_SOURCE_OPS raspicam_synthetic_source_ops;
+extern const RASPICAM_SOURCE_OPS raspicam_file_source_ops;
+
+/*
+ * Helpers for sources generating frames in software: a pool of buffers in
+ * the camera layout, and a thread calling fill at source->framerate. The
+ * ops of such a source call the raspicam_soft_source_* functions, with its
+ * own state passed as generator.
+ *
+ * Their encoder is a stand-in for the VideoCore one, to test the encoded
+ * path off target: it produces the same framing, flags, keyframe interval
+ * and bitrate, with payload sampled from the frames, but isn't decodable.
+ */
+
+/// Fill data with the given frame. A non zero return stops the source.
+typedef int (*RASPICAM_SOFT_FILL_CB)(RASPICAM_SOURCE * source, unsigned char * data, unsigned int frame);
+
+int  raspicam_soft_source_open(RASPICAM_SOURCE * source, RASPICAM_SOFT_FILL_CB fill, void * generator);
+int  raspicam_soft_source_start(RASPICAM_SOURCE * source);
+void raspicam_soft_source_stop(RASPICAM_SOURCE * source);
+void raspicam_soft_source_close(RASPICAM_SOURCE * source);
+void raspicam_soft_source_release_buffer(RASPICAM_SOURCE * source, void * handle);
+int  raspicam_soft_source_reconfigure(RASPICAM_SOURCE * source);
+int  raspicam_soft_source_start_encoder(RASPICAM_SOURCE * source, int encoder, int bitrate);
+void raspicam_soft_source_stop_encoder(RASPICAM_SOURCE * source);
+void * raspicam_soft_source_generator(RASPICAM_SOURCE * source);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
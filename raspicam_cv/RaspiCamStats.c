@@ -0,0 +1,109 @@
+/*
+
+ Copyright (c) by Emil Valkov,
+ All rights reserved.
+
+ License: http://www.opensource.org/licenses/bsd-license.php
+
+ Rolling histograms for the capture instrumentation.
+
+*/
+
+#include "RaspiCamStats.h"
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+int64_t raspicam_now_us(void)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (int64_t)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+/**
+ * Histogram bin of a value: bin 0 holds 0 and 1us, bin k holds [2^k, 2^(k+1)) us,
+ * the last bin everything above.
+ */
+static int bin_of(uint32_t value)
+{
+	int bin = 0;
+	while (value > 1 && bin < RASPICAM_STATS_BINS - 1)
+	{
+		value >>= 1;
+		bin++;
+	}
+	return bin;
+}
+
+static int compare_samples(const void * a, const void * b)
+{
+	uint32_t va = *(const uint32_t *)a, vb = *(const uint32_t *)b;
+	return (va > vb) - (va < vb);
+}
+
+void raspicam_histogram_init(RASPICAM_ROLLING_HISTOGRAM * histogram)
+{
+	memset(histogram, 0, sizeof(RASPICAM_ROLLING_HISTOGRAM));
+	pthread_mutex_init(&histogram->lock, NULL);
+}
+
+void raspicam_histogram_destroy(RASPICAM_ROLLING_HISTOGRAM * histogram)
+{
+	pthread_mutex_destroy(&histogram->lock);
+}
+
+void raspicam_histogram_reset(RASPICAM_ROLLING_HISTOGRAM * histogram)
+{
+	pthread_mutex_lock(&histogram->lock);
+	histogram->next = 0;
+	histogram->count = 0;
+	memset(histogram->bins, 0, sizeof(histogram->bins));
+	pthread_mutex_unlock(&histogram->lock);
+}
+
+void raspicam_histogram_add(RASPICAM_ROLLING_HISTOGRAM * histogram, int64_t value)
+{
+	uint32_t sample = value < 0 ? 0 : (value > UINT32_MAX ? UINT32_MAX : (uint32_t)value);
+
+	pthread_mutex_lock(&histogram->lock);
+	if (histogram->count == STATS_WINDOW)
+		histogram->bins[bin_of(histogram->samples[histogram->next])]--;	// oldest sample leaves the window
+	else
+		histogram->count++;
+
+	histogram->samples[histogram->next] = sample;
+	histogram->bins[bin_of(sample)]++;
+	histogram->next = (histogram->next + 1) % STATS_WINDOW;
+	pthread_mutex_unlock(&histogram->lock);
+}
+
+void raspicam_histogram_snapshot(RASPICAM_ROLLING_HISTOGRAM * histogram, RASPICAM_HISTOGRAM * snapshot)
+{
+	uint32_t sorted [STATS_WINDOW];
+	unsigned int i, count;
+	double sum = 0;
+
+	pthread_mutex_lock(&histogram->lock);
+	count = histogram->count;
+	memcpy(sorted, histogram->samples, count * sizeof(uint32_t));
+	memcpy(snapshot->bins, histogram->bins, sizeof(snapshot->bins));
+	pthread_mutex_unlock(&histogram->lock);
+
+	snapshot->count = count;
+	if (count == 0)
+	{
+		snapshot->mean = snapshot->min = snapshot->max = snapshot->p50 = snapshot->p99 = 0;
+		return;
+	}
+
+	qsort(sorted, count, sizeof(uint32_t), compare_samples);
+	for (i = 0; i < count; i++)
+		sum += sorted[i];
+
+	snapshot->mean = sum / count;
+	snapshot->min = sorted[0];
+	snapshot->max = sorted[count - 1];
+	snapshot->p50 = sorted[(count - 1) / 2];
+	snapshot->p99 = sorted[(count - 1) * 99 / 100];
+}
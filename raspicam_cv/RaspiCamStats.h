@@ -0,0 +1,42 @@
+#ifndef __RaspiCamStats__
+#define __RaspiCamStats__
+
+#include <stdint.h>
+#include <pthread.h>
+#include "RaspiCamCV.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Rolling histogram of the last STATS_WINDOW samples, in microseconds.
+ * Samples come from one thread and snapshots from another, so each
+ * histogram has its own short lock.
+ */
+
+#define STATS_WINDOW 512
+
+typedef struct
+{
+	pthread_mutex_t lock;
+	uint32_t samples [STATS_WINDOW];
+	unsigned int next;		/// Where the next sample goes in samples
+	unsigned int count;		/// Samples in the window
+	unsigned int bins [RASPICAM_STATS_BINS];
+} RASPICAM_ROLLING_HISTOGRAM;
+
+void raspicam_histogram_init(RASPICAM_ROLLING_HISTOGRAM * histogram);
+void raspicam_histogram_destroy(RASPICAM_ROLLING_HISTOGRAM * histogram);
+void raspicam_histogram_reset(RASPICAM_ROLLING_HISTOGRAM * histogram);
+void raspicam_histogram_add(RASPICAM_ROLLING_HISTOGRAM * histogram, int64_t value);
+void raspicam_histogram_snapshot(RASPICAM_ROLLING_HISTOGRAM * histogram, RASPICAM_HISTOGRAM * snapshot);
+
+/// CLOCK_MONOTONIC in microseconds
+int64_t raspicam_now_us(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,313 @@
+/*
+
+ Copyright (c) by Emil Valkov,
+ All rights reserved.
+
+ License: http://www.opensource.org/licenses/bsd-license.php
+
+ Synthetic frame source: generates a moving test pattern at the requested
+ framerate. Lets the capture code run on any Linux box, without the camera
+ or the userland libraries.
+
+ source_arg picks the pattern:
+   gradient	moving diagonal gradient (default)
+   bars		color bars with a moving white line
+   checker	checkerboard scrolling diagonally
+   noise	random pixels, every frame different
+
+ The pattern of each camera index is shifted to the left, like a stereo pair.
+ A region of interest is cut out of the pattern of the full frame.
+ The frames report the settings of a camera exposing for the whole frame
+ period at unity gain, or for the shutter speed and with the white balance
+ gains of the properties, under daylight.
+
+*/
+
+#include "RaspiCamSource.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdatomic.h>
+
+// Pattern shift between consecutive camera indexes, in pixels
+#define SYNTHETIC_DISPARITY 8
+// Colour temperature the frames report, D65
+#define SYNTHETIC_COLOUR_TEMPERATURE 6500
+
+enum
+{
+	PATTERN_GRADIENT,
+	PATTERN_BARS,
+	PATTERN_CHECKER,
+	PATTERN_NOISE,
+};
+
+typedef struct
+{
+	int pattern;
+	int shift;					/// Horizontal offset of the pattern, a disparity between cameras
+	unsigned int noise_state;
+	unsigned char * rgb_row;	/// Monochrome: pattern row before luma conversion
+	volatile int shutter_speed;	/// Exposure the frames report, 0 for the frame period
+	atomic_uint origin;			/// Region of interest position, x << 16 | y, one word so a frame never gets x and y of two moves
+} SYNTHETIC_STATE;
+
+#define ORIGIN_X(origin) ((int)((origin) >> 16))
+#define ORIGIN_Y(origin) ((int)((origin) & 0xffff))
+
+/**
+ * Publish the region of interest position to the frame thread
+ */
+static void set_origin(SYNTHETIC_STATE * synthetic, RASPICAM_SOURCE * source)
+{
+	atomic_store(&synthetic->origin, ((unsigned int)source->roi_x << 16) | (unsigned int)source->roi_y);
+}
+
+static const unsigned char kBars [8][3] =
+{
+	{255, 255, 255}, {255, 255, 0}, {0, 255, 255}, {0, 255, 0},
+	{255, 0, 255}, {255, 0, 0}, {0, 0, 255}, {0, 0, 0},
+};
+
+static inline unsigned int xorshift(unsigned int * state)
+{
+	unsigned int x = *state;
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+	*state = x;
+	return x;
+}
+
+/**
+ * Compute one row of the pattern as RGB
+ *
+ * @param synthetic Pattern state
+ * @param row Output, 3 bytes per pixel
+ * @param x0 Column of the first pixel in the frame, the region of interest
+ * @param width Row width in pixels
+ * @param full_width Frame width the pattern is laid out on
+ * @param y Row number in the frame
+ * @param frame Frame number
+ */
+static void pattern_row(SYNTHETIC_STATE * synthetic, unsigned char * row, int x0, int width, int full_width, int y, unsigned int frame)
+{
+	int offset = frame * 4 + synthetic->shift;
+	int x;
+
+	switch (synthetic->pattern)
+	{
+		case PATTERN_GRADIENT:
+			for (x = 0; x < width; x++)
+			{
+				row[3 * x] = (unsigned char)(x0 + x + offset);
+				row[3 * x + 1] = (unsigned char)y;
+				row[3 * x + 2] = (unsigned char)offset;
+			}
+			break;
+		case PATTERN_BARS:
+		{
+			int line = (frame + synthetic->shift) % full_width;
+			for (x = 0; x < width; x++)
+			{
+				const unsigned char * color = (x0 + x == line) ? kBars[0] : kBars[(x0 + x) * 8 / full_width];
+				row[3 * x] = color[0];
+				row[3 * x + 1] = color[1];
+				row[3 * x + 2] = color[2];
+			}
+		} break;
+		case PATTERN_CHECKER:
+			for (x = 0; x < width; x++)
+			{
+				unsigned char value = (((x0 + x + frame + synthetic->shift) >> 5) ^ ((y + frame) >> 5)) & 1 ? 255 : 0;
+				row[3 * x] = row[3 * x + 1] = row[3 * x + 2] = value;
+			}
+			break;
+		case PATTERN_NOISE:
+			for (x = 0; x < width; x++)
+			{
+				unsigned int value = xorshift(&synthetic->noise_state);
+				row[3 * x] = (unsigned char)value;
+				row[3 * x + 1] = (unsigned char)(value >> 8);
+				row[3 * x + 2] = (unsigned char)(value >> 16);
+			}
+			break;
+	}
+}
+
+/**
+ * Report the settings of the frame about to be delivered
+ */
+static void synthetic_settings(RASPICAM_SOURCE * source, SYNTHETIC_STATE * synthetic)
+{
+	const RASPIVID_PROPERTIES * properties = source->properties;
+	int shutter_speed = synthetic->shutter_speed;
+	RASPICAM_FRAME_METADATA settings;
+
+	memset(&settings, 0, sizeof(settings));
+	settings.exposure = 1000000 / source->framerate;
+	settings.analog_gain = 1;
+	settings.digital_gain = 1;
+	settings.awb_red_gain = 1;
+	settings.awb_blue_gain = 1;
+	settings.colour_temperature = SYNTHETIC_COLOUR_TEMPERATURE;
+
+	if (shutter_speed > 0 && shutter_speed < (int)settings.exposure)
+		settings.exposure = shutter_speed;
+	if (properties && properties->awb <= 0 && properties->awb_gr > 0 && properties->awb_gb > 0)
+	{
+		settings.awb_red_gain = properties->awb_gr;
+		settings.awb_blue_gain = properties->awb_gb;
+	}
+	raspicam_source_deliver_settings(source, &settings);
+}
+
+static int synthetic_fill(RASPICAM_SOURCE * source, unsigned char * data, unsigned int frame)
+{
+	SYNTHETIC_STATE * synthetic = (SYNTHETIC_STATE *)raspicam_soft_source_generator(source);
+	// Read once, the region may move while the frame is generated
+	unsigned int origin = atomic_load(&synthetic->origin);
+	int x0 = ORIGIN_X(origin);
+	int y0 = ORIGIN_Y(origin);
+	int x, y;
+
+	if (source->encoding != RASPICAM_ENCODING_RGB24)
+	{
+		unsigned char * rgb = synthetic->rgb_row;
+		unsigned char * chroma = data + source->stride * source->buffer_height;
+		int nv12 = (source->encoding == RASPICAM_ENCODING_NV12);
+		int cstride = nv12 ? source->stride : source->stride / 2;
+		unsigned char * u_plane = chroma;
+		unsigned char * v_plane = nv12 ? chroma + 1 : chroma + cstride * (source->buffer_height / 2);
+		int step = nv12 ? 2 : 1;
+
+		for (y = 0; y < source->height; y++)
+		{
+			unsigned char * row = data + y * source->stride;
+
+			pattern_row(synthetic, rgb, x0, source->width, source->full_width, y0 + y, frame);
+			for (x = 0; x < source->width; x++)
+				row[x] = (unsigned char)((77 * rgb[3 * x] + 150 * rgb[3 * x + 1] + 29 * rgb[3 * x + 2]) >> 8);
+
+			// Chroma of the top left pixel of each 2x2 block
+			if (!source->monochrome && (y & 1) == 0)
+			{
+				unsigned char * u = u_plane + (y / 2) * cstride;
+				unsigned char * v = v_plane + (y / 2) * cstride;
+				for (x = 0; x < source->width; x += 2)
+				{
+					const unsigned char * p = rgb + 3 * x;
+					u[(x / 2) * step] = (unsigned char)(((-43 * p[0] - 85 * p[1] + 128 * p[2] + 128) >> 8) + 128);
+					v[(x / 2) * step] = (unsigned char)(((128 * p[0] - 107 * p[1] - 21 * p[2] + 128) >> 8) + 128);
+				}
+			}
+		}
+		// Monochrome: neutral gray
+		if (source->monochrome)
+			memset(chroma, 128, source->stride * source->buffer_height / 2);
+	}
+	else
+	{
+		for (y = 0; y < source->height; y++)
+			pattern_row(synthetic, data + y * source->stride, x0, source->width, source->full_width, y0 + y, frame);
+	}
+
+	synthetic_settings(source, synthetic);
+	return 0;
+}
+
+static int synthetic_open(RASPICAM_SOURCE * source)
+{
+	SYNTHETIC_STATE * synthetic = (SYNTHETIC_STATE *)calloc(1, sizeof(SYNTHETIC_STATE));
+
+	if (!synthetic)
+		return -1;
+
+	synthetic->pattern = PATTERN_GRADIENT;
+	synthetic->shift = source->camera_num * SYNTHETIC_DISPARITY;
+	synthetic->noise_state = 2463534242u;
+	set_origin(synthetic, source);
+	if (source->properties)
+		synthetic->shutter_speed = source->properties->shutter_speed;
+	if (source->arg != NULL)
+	{
+		if (strcmp(source->arg, "bars") == 0)
+			synthetic->pattern = PATTERN_BARS;
+		else if (strcmp(source->arg, "checker") == 0)
+			synthetic->pattern = PATTERN_CHECKER;
+		else if (strcmp(source->arg, "noise") == 0)
+			synthetic->pattern = PATTERN_NOISE;
+		else if (strcmp(source->arg, "gradient") != 0)
+			fprintf(stderr, "%s: Unknown pattern %s, using gradient\n", __func__, source->arg);
+	}
+
+	synthetic->rgb_row = (unsigned char *)malloc(3 * source->width);
+	if (!synthetic->rgb_row || raspicam_soft_source_open(source, synthetic_fill, synthetic) != 0)
+	{
+		free(synthetic->rgb_row);
+		free(synthetic);
+		return -1;
+	}
+	return 0;
+}
+
+static void synthetic_close(RASPICAM_SOURCE * source)
+{
+	SYNTHETIC_STATE * synthetic = (SYNTHETIC_STATE *)raspicam_soft_source_generator(source);
+
+	if (synthetic)
+	{
+		free(synthetic->rgb_row);
+		free(synthetic);
+	}
+	raspicam_soft_source_close(source);
+}
+
+static int synthetic_reconfigure(RASPICAM_SOURCE * source)
+{
+	SYNTHETIC_STATE * synthetic = (SYNTHETIC_STATE *)raspicam_soft_source_generator(source);
+	unsigned char * rgb_row = (unsigned char *)realloc(synthetic->rgb_row, 3 * source->width);
+
+	if (!rgb_row)
+		return -1;
+	synthetic->rgb_row = rgb_row;
+	set_origin(synthetic, source);
+	return raspicam_soft_source_reconfigure(source);
+}
+
+/**
+ * Only the exposure can be set, the next frames report it
+ */
+static int synthetic_set_parameter(RASPICAM_SOURCE * source, int property_id, double value)
+{
+	SYNTHETIC_STATE * synthetic = (SYNTHETIC_STATE *)raspicam_soft_source_generator(source);
+
+	if (property_id != RPI_CAP_PROP_EXPOSURE)
+		return -1;
+	synthetic->shutter_speed = (int)value;
+	return 0;
+}
+
+/**
+ * The next frames are generated at the new position
+ */
+static int synthetic_set_roi(RASPICAM_SOURCE * source)
+{
+	set_origin((SYNTHETIC_STATE *)raspicam_soft_source_generator(source), source);
+	return 0;
+}
+
+const RASPICAM_SOURCE_OPS raspicam_synthetic_source_ops =
+{
+	"synthetic",
+	synthetic_open,
+	raspicam_soft_source_start,
+	raspicam_soft_source_stop,
+	synthetic_close,
+	raspicam_soft_source_release_buffer,
+	synthetic_reconfigure,
+	synthetic_set_parameter,
+	raspicam_soft_source_start_encoder,
+	raspicam_soft_source_stop_encoder,
+	synthetic_set_roi,
+};
@@ -15,7 +15,7 @@
 
 int main(int argc, char *argv[ ]){
 
-	RASPIVID_CONFIG * config = (RASPIVID_CONFIG*)malloc(sizeof(RASPIVID_CONFIG));
+	RASPIVID_CONFIG * config = (RASPIVID_CONFIG*)calloc(1, sizeof(RASPIVID_CONFIG));
 	
 	config->width=320;
 	config->height=240;
@@ -25,7 +25,7 @@ int main(int argc, char *argv[ ]){
 
 	int opt;
 
-	while ((opt = getopt(argc, argv, "lxm")) != -1)
+	while ((opt = getopt(argc, argv, "lxmzs")) != -1)
 	{
 		switch (opt)
 		{
@@ -40,11 +40,19 @@ int main(int argc, char *argv[ ]){
 			case 'm':					// monochrome
 				config->monochrome = 1;
 				break;
+			case 'z':					// zero-copy
+				config->zero_copy = 1;
+				break;
+			case 's':					// synthetic source
+				config->source = RASPICAM_SOURCE_SYNTHETIC;
+				break;
 			default:
-				fprintf(stderr, "Usage: %s [-x] [-l] [-m] \n", argv[0], opt);
+				fprintf(stderr, "Usage: %s [-x] [-l] [-m] [-z] [-s] \n", argv[0], opt);
 				fprintf(stderr, "-l: Large mode\n");
 				fprintf(stderr, "-x: Extra large mode\n");
 				fprintf(stderr, "-l: Monochrome mode\n");
+				fprintf(stderr, "-z: Zero-copy mode\n");
+				fprintf(stderr, "-s: Synthetic frames, no camera\n");
 				exit(EXIT_FAILURE);
 		}
 	}
@@ -92,10 +100,10 @@ int main(int argc, char *argv[ ]){
 				exit = 1;
 				break;
 			case 60:		// < (less than)
-				raspiCamCvSetCaptureProperty(capture, RPI_CAP_PROP_FPS, 25);	// Currently NOOP
+				raspiCamCvSetCaptureProperty(capture, RPI_CAP_PROP_FPS, 25);	// Restarts the camera
 				break;
 			case 62:		// > (greater than)
-				raspiCamCvSetCaptureProperty(capture, RPI_CAP_PROP_FPS, 30);	// Currently NOOP
+				raspiCamCvSetCaptureProperty(capture, RPI_CAP_PROP_FPS, 30);
 				break;
 		}
 		
@@ -1,32 +1,370 @@
+/*
+
+ Copyright (c) by Emil Valkov,
+ All rights reserved.
+
+ License: http://www.opensource.org/licenses/bsd-license.php
+
+ Strobe scheduler for the flash outputs, see flash.h
+
+*/
+
 #include "flash.h"
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <sched.h>
+
+#ifndef RASPICAM_NO_WIRINGPI
+#include <wiringPi.h>
+#endif
+
+// Frames before the first switch, for the period and phase to settle
+#define FLASH_LOCK_FRAMES 3
+// Missing frames after which the prediction starts over
+#define FLASH_STALL_PERIODS 4
+// The scheduler sleeps until this long before a switch, then spins: sleep wake up is late by up to a few 100us
+#define FLASH_SPIN_US 300
+// Callbacks later than the phase only move it by this fraction, it follows the earliest ones
+#define FLASH_PHASE_SMOOTHING 16
+#define FLASH_PERIOD_SMOOTHING 8
+
+#define MOCK_EVENTS 4096
+
+/*
+ * GPIO backends
+ */
+
+#ifndef RASPICAM_NO_WIRINGPI
+static void wiringpi_setup(void)
+{
+	wiringPiSetup();
+}
+
+static void wiringpi_pin_mode(int pin)
+{
+	pinMode(pin, OUTPUT);
+}
+
+static void wiringpi_write(int pin, int value)
+{
+	digitalWrite(pin, value);
+}
+
+static const RASPICAM_GPIO_OPS wiringpi_gpio_ops = { wiringpi_setup, wiringpi_pin_mode, wiringpi_write };
+#endif
+
+static pthread_mutex_t mock_lock = PTHREAD_MUTEX_INITIALIZER;
+static RASPICAM_GPIO_EVENT mock_events [MOCK_EVENTS];
+static unsigned int mock_count;
+
+static void mock_setup(void)
+{
+}
+
+static void mock_pin_mode(int pin)
+{
+}
+
+static void mock_write(int pin, int value)
+{
+	pthread_mutex_lock(&mock_lock);
+	RASPICAM_GPIO_EVENT * event = &mock_events[mock_count++ % MOCK_EVENTS];
+	event->pin = pin;
+	event->value = value;
+	event->time_us = raspicam_now_us();
+	pthread_mutex_unlock(&mock_lock);
+}
+
+static const RASPICAM_GPIO_OPS mock_gpio_ops = { mock_setup, mock_pin_mode, mock_write };
+
+// Host builds without wiringPi record the writes
+#ifndef RASPICAM_NO_WIRINGPI
+static const RASPICAM_GPIO_OPS * gpio = &wiringpi_gpio_ops;
+#else
+static const RASPICAM_GPIO_OPS * gpio = &mock_gpio_ops;
+#endif
+static pthread_mutex_t gpio_lock = PTHREAD_MUTEX_INITIALIZER;
+static int gpio_ready = 0;
+
+void flash_use_mock_gpio(void)
+{
+	pthread_mutex_lock(&gpio_lock);
+	if (gpio_ready)
+		fprintf(stderr, "%s: The GPIO backend is already in use\n", __func__);
+	else
+		gpio = &mock_gpio_ops;
+	pthread_mutex_unlock(&gpio_lock);
+}
+
+int flash_mock_events(RASPICAM_GPIO_EVENT * events, int max)
+{
+	unsigned int first, i;
+	int n = 0;
+
+	pthread_mutex_lock(&mock_lock);
+	first = mock_count > MOCK_EVENTS ? mock_count - MOCK_EVENTS : 0;
+	for (i = first; i < mock_count && n < max; i++)
+		events[n++] = mock_events[i % MOCK_EVENTS];
+	pthread_mutex_unlock(&mock_lock);
+	return n;
+}
+
+/*
+ * Scheduler
+ */
+
+static void sleep_until(int64_t time_us)
+{
+	struct timespec t;
+
+	t.tv_sec = time_us / 1000000;
+	t.tv_nsec = (time_us % 1000000) * 1000;
+	while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &t, NULL) != 0);
+}
+
+/**
+ * Set every output from a pattern entry. Called with the lock held.
+ */
+static void write_outputs(RASPICAM_FLASH * flash, unsigned char bits)
+{
+	unsigned int i;
+
+	for (i = 0; i < flash->nb_output; i++)
+		gpio->write(flash->pins[i], (bits >> i) & 0x01);
+}
+
+static int64_t frame_time(RASPICAM_FLASH * flash, int64_t frame)
+{
+	return flash->phase_us + (frame - flash->base_frame) * flash->period_us;
+}
+
+static void * scheduler_thread(void * arg)
+{
+	RASPICAM_FLASH * flash = (RASPICAM_FLASH *)arg;
+	struct sched_param param;
+
+	// Best effort, it needs the privileges
+	param.sched_priority = sched_get_priority_min(SCHED_FIFO) + 1;
+	pthread_setschedparam(pthread_self(), SCHED_FIFO, &param);
+
+	pthread_mutex_lock(&flash->lock);
+	while (flash->running)
+	{
+		int64_t now = raspicam_now_us();
+
+		// Nothing to predict from until the frames come, or after they stop
+		if (flash->locked < FLASH_LOCK_FRAMES || (!flash->pattern_length && !flash->pattern_pending) ||
+			now > flash->last_callback_us + FLASH_STALL_PERIODS * flash->period_us)
+		{
+			pthread_cond_wait(&flash->cond, &flash->lock);
+			continue;
+		}
+
+		int64_t lead = flash->lead_us > 0 ? flash->lead_us : flash->period_us;
+
+		// The first exposure that hasn't started, the ones before are missed
+		int64_t first = flash->base_frame + (now + lead - flash->phase_us + flash->period_us - 1) / flash->period_us;
+		if (flash->next_frame < first)
+		{
+			if (flash->next_frame >= 0)
+				flash->missed += first - flash->next_frame;
+			flash->next_frame = first;
+		}
+		int64_t frame = flash->next_frame;
+		int64_t at = frame_time(flash, frame) - lead;
+
+		pthread_mutex_unlock(&flash->lock);
+		sleep_until(at - FLASH_SPIN_US);
+		while (raspicam_now_us() < at);
+		pthread_mutex_lock(&flash->lock);
+
+		// A new lock on the frames renumbers them
+		if (!flash->running || flash->next_frame != frame)
+			continue;
+
+		// Pattern changes take effect at a frame boundary
+		if (flash->pattern_pending)
+		{
+			memcpy(flash->pattern, flash->next_pattern, flash->next_pattern_length);
+			flash->pattern_length = flash->next_pattern_length;
+			flash->pattern_pending = 0;
+			flash->period_counter = 0;
+		}
+		if (!flash->pattern_length)
+			continue;
+
+		write_outputs(flash, flash->pattern[flash->period_counter]);
+		int64_t done = raspicam_now_us();
+
+		flash->switch_us[frame % FLASH_HISTORY] = done;
+		flash->switch_frame[frame % FLASH_HISTORY] = frame;
+		flash->switches++;
+		flash->next_frame = frame + 1;
+		if (++flash->period_counter >= flash->pattern_length)
+			flash->period_counter = 0;
+
+		if (flash->pulse_us > 0 && flash->pulse_us < flash->period_us)
+		{
+			pthread_mutex_unlock(&flash->lock);
+			sleep_until(done + flash->pulse_us);
+			pthread_mutex_lock(&flash->lock);
+			write_outputs(flash, 0);
+		}
+	}
+	pthread_mutex_unlock(&flash->lock);
+	return NULL;
+}
+
+void flash_open(RASPICAM_FLASH * flash)
+{
+	pthread_condattr_t attr;
+
+	memset(flash, 0, sizeof(RASPICAM_FLASH));
+	pthread_mutex_init(&flash->lock, NULL);
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&flash->cond, &attr);
+	pthread_condattr_destroy(&attr);
+	raspicam_histogram_init(&flash->offset);
+	flash->open = 1;
+}
+
+void flash_close(RASPICAM_FLASH * flash)
+{
+	if (!flash->open)
+		return;
 
+	if (flash->running)
+	{
+		pthread_mutex_lock(&flash->lock);
+		flash->running = 0;
+		pthread_cond_signal(&flash->cond);
+		pthread_mutex_unlock(&flash->lock);
+		pthread_join(flash->thread, NULL);
+		write_outputs(flash, 0);
+	}
+
+	raspicam_histogram_destroy(&flash->offset);
+	pthread_cond_destroy(&flash->cond);
+	pthread_mutex_destroy(&flash->lock);
+	flash->open = 0;
+}
+
+unsigned char flash_init(RASPICAM_FLASH * flash, unsigned char pin)
+{
+	unsigned char index;
+
+	pthread_mutex_lock(&gpio_lock);
+	if (!gpio_ready)
+	{
+		gpio->setup();
+		gpio_ready = 1;
+	}
+	pthread_mutex_unlock(&gpio_lock);
+
+	pthread_mutex_lock(&flash->lock);
+	if (flash->nb_output >= FLASH_MAX_OUTPUTS)
+	{
+		pthread_mutex_unlock(&flash->lock);
+		return 0xff;
+	}
+	gpio->pin_mode(pin);
+	flash->pins[flash->nb_output] = pin;
+	index = flash->nb_output++;
+	flash->period_counter = 0;
 
-unsigned char flash_pins [8] ;
-unsigned char * flash_pattern ;
-unsigned char flash_pattern_length = 0;
-unsigned int nb_output = 0;
-unsigned int period_counter ;
+	if (!flash->running)
+	{
+		flash->running = 1;
+		if (pthread_create(&flash->thread, NULL, scheduler_thread, flash) != 0)
+		{
+			fprintf(stderr, "%s: Failed to start the strobe scheduler\n", __func__);
+			flash->running = 0;
+		}
+	}
+	pthread_mutex_unlock(&flash->lock);
+	return index;
+}
 
-unsigned char flash_init(unsigned char pin){
-  if(nb_output == 0) wiringPiSetup() ;
-  flash_pins[nb_output]= pin ;
-  pinMode (flash_pins[nb_output], OUTPUT) ;
-  nb_output += 1 ;
-  period_counter = 0 ;
-  return (nb_output - 1);
+void flash_set_pattern(RASPICAM_FLASH * flash, const unsigned char * pattern, unsigned char pattern_length)
+{
+	pthread_mutex_lock(&flash->lock);
+	memcpy(flash->next_pattern, pattern, pattern_length);
+	flash->next_pattern_length = pattern_length;
+	flash->pattern_pending = 1;
+	pthread_cond_signal(&flash->cond);
+	pthread_mutex_unlock(&flash->lock);
 }
 
-void flash_set_pattern(unsigned char * pattern, unsigned char pattern_length){
-	flash_pattern = pattern ;
-	flash_pattern_length = pattern_length ;
+void flash_set_timing(RASPICAM_FLASH * flash, int64_t lead_us, int64_t pulse_us)
+{
+	pthread_mutex_lock(&flash->lock);
+	flash->lead_us = lead_us;
+	flash->pulse_us = pulse_us;
+	pthread_mutex_unlock(&flash->lock);
 }
 
-void flash_update(){
-	int i;
-	for(i = 0 ; i < nb_output ; i ++){
-		unsigned char on_off = (flash_pattern[period_counter]  >> i) & 0x01 ;
-		digitalWrite (flash_pins[i], on_off);
+void flash_frame(RASPICAM_FLASH * flash, int64_t callback_us, int64_t pts, int64_t period_us)
+{
+	pthread_mutex_lock(&flash->lock);
+	if (!flash->running)
+	{
+		pthread_mutex_unlock(&flash->lock);
+		return;
 	}
-	period_counter ++ ;
-	if(period_counter >=  flash_pattern_length) period_counter = 0 ;
+
+	if (!flash->locked || callback_us - flash->last_callback_us > FLASH_STALL_PERIODS * flash->period_us)
+	{
+		// First frame, or the capture restarted: frame 0 is this one
+		flash->period_us = period_us;
+		flash->phase_us = callback_us;
+		flash->base_frame = 0;
+		flash->next_frame = -1;
+		flash->locked = 1;
+		memset(flash->switch_frame, 0xff, sizeof(flash->switch_frame));
+	}
+	else
+	{
+		// The camera timestamps give the period, free of the callback latency. Dropped frames count as several.
+		int64_t delta = pts - flash->last_pts;
+		int64_t periods = (delta + flash->period_us / 2) / flash->period_us;
+		if (periods > 0 && periods < FLASH_STALL_PERIODS)
+			flash->period_us += (delta / periods - flash->period_us) / FLASH_PERIOD_SMOOTHING;
+
+		// Frame number of this callback, and how far from the prediction it is
+		int64_t frame = flash->base_frame + (callback_us - flash->phase_us + flash->period_us / 2) / flash->period_us;
+		int64_t error = callback_us - frame_time(flash, frame);
+
+		// The callback latency only adds up, the earliest callbacks give the phase
+		flash->phase_us = frame_time(flash, frame) + (error < 0 ? error : error / FLASH_PHASE_SMOOTHING);
+		flash->base_frame = frame;
+
+		// Measured offset of the switch for this frame
+		if (flash->switch_frame[frame % FLASH_HISTORY] == frame)
+		{
+			int64_t lead = flash->lead_us > 0 ? flash->lead_us : flash->period_us;
+			int64_t offset = flash->switch_us[frame % FLASH_HISTORY] - (callback_us - lead);
+			raspicam_histogram_add(&flash->offset, offset < 0 ? -offset : offset);
+			flash->last_offset_us = offset;
+		}
+		if (flash->locked < FLASH_LOCK_FRAMES)
+			flash->locked++;
+	}
+	flash->last_pts = pts;
+	flash->last_callback_us = callback_us;
+
+	pthread_cond_signal(&flash->cond);
+	pthread_mutex_unlock(&flash->lock);
+}
+
+void flash_stats(RASPICAM_FLASH * flash, RASPICAM_STROBE_STATS * stats)
+{
+	pthread_mutex_lock(&flash->lock);
+	stats->switches = flash->switches;
+	stats->missed = flash->missed;
+	stats->period_us = flash->period_us;
+	stats->last_offset_us = flash->last_offset_us;
+	pthread_mutex_unlock(&flash->lock);
+	raspicam_histogram_snapshot(&flash->offset, &stats->offset);
 }
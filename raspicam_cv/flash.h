@@ -1,7 +1,101 @@
-#include <wiringPi.h>
+#ifndef __flash__
+#define __flash__
 
+#include <stdint.h>
+#include <pthread.h>
+#include "RaspiCamStats.h"
 
+#ifdef __cplusplus
+extern "C" {
+#endif
 
-unsigned char flash_init(unsigned char pin);
-void flash_update();
-void flash_set_pattern(unsigned char * pattern, unsigned char pattern_length);
+/*
+ * Strobe scheduler. The frames of a capture give the frame period and the
+ * phase of the exposures; a thread switches the flash outputs to the next
+ * pattern entry at the predicted start of each exposure, lead_us before the
+ * frame reaches the callback. It sleeps until just before the switch and
+ * spins the rest of the way. When the frame comes, the switch time is
+ * compared with its exposure start, that is the measured offset.
+ */
+
+#define FLASH_MAX_OUTPUTS 8
+#define FLASH_MAX_PATTERN 255
+#define FLASH_HISTORY 16			/// Switch times kept until their frame comes
+
+// Where the pin writes go
+typedef struct
+{
+	void (*setup)(void);
+	void (*pin_mode)(int pin);		/// Make it an output
+	void (*write)(int pin, int value);
+} RASPICAM_GPIO_OPS;
+
+typedef struct
+{
+	pthread_mutex_t lock;
+	pthread_cond_t cond;			/// Signaled for frames, pattern changes and close
+	pthread_t thread;
+	int open;
+	int running;					/// The scheduler thread is there
+
+	unsigned char pins [FLASH_MAX_OUTPUTS];
+	unsigned int nb_output;
+
+	unsigned char pattern [FLASH_MAX_PATTERN];	/// Bit i of each entry is output i
+	unsigned char pattern_length;
+	unsigned char next_pattern [FLASH_MAX_PATTERN];	/// Applied at the next switch
+	unsigned char next_pattern_length;
+	int pattern_pending;
+	unsigned int period_counter;	/// Entry of the next switch
+
+	// Exposure prediction
+	int64_t period_us;				/// Frame period, from the timestamps
+	int64_t phase_us;				/// Predicted callback of frame base_frame, from the earliest callbacks
+	int64_t base_frame;				/// Frame of the last callback, counted from the start of the prediction
+	int64_t last_pts;
+	int64_t last_callback_us;
+	int locked;						/// Frames in a row the prediction is built on
+	int64_t lead_us;				/// Exposure start to frame callback, 0 for one frame period
+	int64_t pulse_us;				/// Outputs go off this long after a switch, 0 to hold until the next one
+	int64_t next_frame;				/// Frame of the next switch, -1 for the next exposure to come
+
+	int64_t switch_us [FLASH_HISTORY];	/// When the switch of frame n happened, at n % FLASH_HISTORY
+	int64_t switch_frame [FLASH_HISTORY];
+	unsigned int switches;
+	unsigned int missed;			/// Switches too late for their exposure, skipped
+	RASPICAM_ROLLING_HISTOGRAM offset;	/// |switch - measured exposure start|
+	int64_t last_offset_us;			/// Signed, positive when the switch came late
+} RASPICAM_FLASH;
+
+void flash_open(RASPICAM_FLASH * flash);
+/// Stop the scheduler and turn the outputs off
+void flash_close(RASPICAM_FLASH * flash);
+
+/// Add an output, which starts the scheduler. Returns its bit in the pattern, 0xff if there are too many.
+unsigned char flash_init(RASPICAM_FLASH * flash, unsigned char pin);
+/// The pattern is copied, and replaces the current one at the next switch
+void flash_set_pattern(RASPICAM_FLASH * flash, const unsigned char * pattern, unsigned char pattern_length);
+void flash_set_timing(RASPICAM_FLASH * flash, int64_t lead_us, int64_t pulse_us);
+
+/**
+ * A frame came, from the source thread
+ *
+ * @param flash The flash
+ * @param callback_us raspicam_now_us at the callback entry
+ * @param pts Frame timestamp in microseconds, camera clock
+ * @param period_us Frame period of the configured framerate
+ */
+void flash_frame(RASPICAM_FLASH * flash, int64_t callback_us, int64_t pts, int64_t period_us);
+
+void flash_stats(RASPICAM_FLASH * flash, RASPICAM_STROBE_STATS * stats);
+
+/// Send the pin writes of every flash to a recorder instead of the GPIO, before the first flash_init
+void flash_use_mock_gpio(void);
+/// Recorded writes, oldest first. Returns how many were copied to events.
+int flash_mock_events(RASPICAM_GPIO_EVENT * events, int max);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif